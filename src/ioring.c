@@ -0,0 +1,251 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2007 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+
+ * This file contains the io_uring wrapper that is shared by the server
+ * and the library.
+ */
+
+#include <common.h>
+#include <ioring.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* The kernel reads the tails that we write and writes the heads that
+ * we read so these need the barriers */
+#define _load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define _store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+/* Sets up the rings with room for 'entries' submissions.  We need a
+ * kernel that maps both rings together and that can take a timeout
+ * with io_uring_enter(), which is 5.11 or newer.  Returns 0 on success
+ * or a negative errno if io_uring can't be used. */
+int
+ioring_init(ioring *r, unsigned entries)
+{
+    struct io_uring_params p;
+    size_t len;
+    unsigned n, *array;
+    int result;
+
+    bzero(r, sizeof(ioring));
+    bzero(&p, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if(r->fd < 0) {
+        result = -errno;
+        r->fd = -1;
+        return result;
+    }
+    if(!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+        close(r->fd);
+        r->fd = -1;
+        return -ENOSYS;
+    }
+    r->ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(len > r->ring_len) r->ring_len = len;
+    r->ring = mmap(NULL, r->ring_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if(r->ring == MAP_FAILED) {
+        result = -errno;
+        close(r->fd);
+        r->fd = -1;
+        return result;
+    }
+    r->sqe_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqe_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if(r->sqes == MAP_FAILED) {
+        result = -errno;
+        munmap(r->ring, r->ring_len);
+        close(r->fd);
+        r->fd = -1;
+        return result;
+    }
+    r->sq_head = (unsigned *)((char *)r->ring + p.sq_off.head);
+    r->sq_tail = (unsigned *)((char *)r->ring + p.sq_off.tail);
+    r->sq_mask = *(unsigned *)((char *)r->ring + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->cq_head = (unsigned *)((char *)r->ring + p.cq_off.head);
+    r->cq_tail = (unsigned *)((char *)r->ring + p.cq_off.tail);
+    r->cq_mask = *(unsigned *)((char *)r->ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((char *)r->ring + p.cq_off.cqes);
+    /* The submission entries are always used in order so the index
+     * array never has to change */
+    array = (unsigned *)((char *)r->ring + p.sq_off.array);
+    for(n = 0; n < p.sq_entries; n++) array[n] = n;
+    r->tail = *r->sq_tail;
+    return 0;
+}
+
+void
+ioring_free(ioring *r)
+{
+    if(r->fd < 0) return;
+    munmap(r->sqes, r->sqe_len);
+    munmap(r->ring, r->ring_len);
+    close(r->fd);
+    r->fd = -1;
+}
+
+/* Returns the next submission entry cleared out or NULL if the ring is
+ * full.  It isn't seen by the kernel until ioring_submit() is called. */
+struct io_uring_sqe *
+ioring_get_sqe(ioring *r)
+{
+    struct io_uring_sqe *sqe;
+
+    if(r->tail - _load_acquire(r->sq_head) >= r->sq_entries) return NULL;
+    sqe = &r->sqes[r->tail & r->sq_mask];
+    bzero(sqe, sizeof(struct io_uring_sqe));
+    r->tail++;
+    r->queued++;
+    return sqe;
+}
+
+/* Submits everything that has been queued and waits for at least 'wait'
+ * completions.  If 'msec' is zero or more we wait at most that long and
+ * return -ETIME if nothing was submitted and nothing completed.  Returns
+ * the number of entries submitted or a negative errno. */
+int
+ioring_submit(ioring *r, unsigned wait, int msec)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned flags = 0;
+    void *argp = NULL;
+    size_t argsz = 0;
+    int result;
+
+    if(wait) {
+        flags |= IORING_ENTER_GETEVENTS;
+        if(msec >= 0) {
+            ts.tv_sec = msec / 1000;
+            ts.tv_nsec = (msec % 1000) * 1000000;
+            bzero(&arg, sizeof(arg));
+            arg.ts = (u_int64_t)(unsigned long)&ts;
+            argp = &arg;
+            argsz = sizeof(arg);
+            flags |= IORING_ENTER_EXT_ARG;
+        }
+    }
+    _store_release(r->sq_tail, r->tail);
+    do {
+        result = syscall(__NR_io_uring_enter, r->fd, r->queued, wait, flags, argp, argsz);
+    } while(result < 0 && errno == EINTR);
+    if(result < 0) return -errno;
+    r->queued -= result;
+    return result;
+}
+
+/* Returns the oldest completion that hasn't been handled or NULL if
+ * there aren't any.  ioring_advance() has to be called when the caller
+ * is through with it. */
+struct io_uring_cqe *
+ioring_peek(ioring *r)
+{
+    unsigned head;
+
+    head = *r->cq_head;
+    if(head == _load_acquire(r->cq_tail)) return NULL;
+    return &r->cqes[head & r->cq_mask];
+}
+
+void
+ioring_advance(ioring *r)
+{
+    _store_release(r->cq_head, *r->cq_head + 1);
+}
+
+/* Allocates 'count' buffers of 'size' bytes each and hands them all to
+ * the kernel as buffer group 'group'.  This needs kernel 5.19 or newer.
+ * Returns 0 or a negative errno. */
+int
+ioring_bufs_init(ioring *r, ioring_bufs *b, u_int16_t group, unsigned count, unsigned size)
+{
+    struct io_uring_buf_reg reg;
+    void *br;
+    unsigned n;
+    int result;
+
+    bzero(b, sizeof(ioring_bufs));
+    if(count == 0 || (count & (count - 1)) || count > 32768) return -EINVAL;
+    if(posix_memalign(&br, sysconf(_SC_PAGESIZE), count * sizeof(struct io_uring_buf))) {
+        return -ENOMEM;
+    }
+    b->mem = malloc(count * size);
+    if(b->mem == NULL) {
+        free(br);
+        return -ENOMEM;
+    }
+    bzero(br, count * sizeof(struct io_uring_buf));
+    b->br = br;
+    b->count = count;
+    b->size = size;
+    b->group = group;
+
+    bzero(&reg, sizeof(reg));
+    reg.ring_addr = (u_int64_t)(unsigned long)br;
+    reg.ring_entries = count;
+    reg.bgid = group;
+    result = syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING, &reg, 1);
+    if(result < 0) {
+        result = -errno;
+        free(b->mem);
+        free(b->br);
+        bzero(b, sizeof(ioring_bufs));
+        return result;
+    }
+    for(n = 0; n < count; n++) {
+        ioring_bufs_put(b, n);
+    }
+    return 0;
+}
+
+void
+ioring_bufs_free(ioring *r, ioring_bufs *b)
+{
+    struct io_uring_buf_reg reg;
+
+    if(b->br == NULL) return;
+    bzero(&reg, sizeof(reg));
+    reg.bgid = b->group;
+    syscall(__NR_io_uring_register, r->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    free(b->mem);
+    free(b->br);
+    bzero(b, sizeof(ioring_bufs));
+}
+
+/* Gives buffer 'bid' back to the kernel after its data has been used */
+void
+ioring_bufs_put(ioring_bufs *b, unsigned bid)
+{
+    struct io_uring_buf *buf;
+    u_int16_t tail;
+
+    tail = b->br->tail;
+    buf = &b->br->bufs[tail & (b->count - 1)];
+    buf->addr = (u_int64_t)(unsigned long)ioring_buf_addr(b, bid);
+    buf->len = b->size;
+    buf->bid = bid;
+    _store_release(&b->br->tail, tail + 1);
+}
+
+#endif /* HAVE_LINUX_IO_URING_H */
@@ -0,0 +1,79 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2007 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+ * This header contains the definitions for the small io_uring wrapper
+ * that is used by both the server and the library.  It talks to the
+ * kernel with the raw system calls so that we don't need liburing.  The
+ * submission and completion rings are only ever used by one thread at a
+ * time.  If the system doesn't have io_uring ioring_init() fails and the
+ * callers go back to using the plain socket calls.
+ */
+
+#ifndef __IORING_H
+#define __IORING_H
+
+#include <sys/types.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+#include <linux/io_uring.h>
+
+typedef struct ioring {
+    int fd;
+    void *ring;             /* Submission and completion rings */
+    size_t ring_len;
+    struct io_uring_sqe *sqes;
+    size_t sqe_len;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned tail;          /* Our copy of the tail that isn't published yet */
+    unsigned queued;        /* Entries that haven't been submitted yet */
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+} ioring;
+
+/* A ring of buffers that the kernel picks from for receive operations
+ * that have IOSQE_BUFFER_SELECT set.  The buffer id that comes back in
+ * the completion is the index of the buffer. */
+typedef struct ioring_bufs {
+    struct io_uring_buf_ring *br;
+    u_int8_t *mem;
+    unsigned count;         /* Must be a power of two */
+    unsigned size;
+    u_int16_t group;
+} ioring_bufs;
+
+int ioring_init(ioring *r, unsigned entries);
+void ioring_free(ioring *r);
+struct io_uring_sqe *ioring_get_sqe(ioring *r);
+int ioring_submit(ioring *r, unsigned wait, int msec);
+struct io_uring_cqe *ioring_peek(ioring *r);
+void ioring_advance(ioring *r);
+
+int ioring_bufs_init(ioring *r, ioring_bufs *b, u_int16_t group, unsigned count, unsigned size);
+void ioring_bufs_free(ioring *r, ioring_bufs *b);
+void ioring_bufs_put(ioring_bufs *b, unsigned bid);
+
+#define ioring_buf_addr(b, bid) (&(b)->mem[(bid) * (b)->size])
+
+#endif /* HAVE_LINUX_IO_URING_H */
+
+#endif /* !__IORING_H */
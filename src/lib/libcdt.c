@@ -33,16 +33,16 @@
 # define DAX_DATATYPE_SIZE 8
 #endif
 
-/* Inserts the given datatype into the array */
+/* Names the datatype that is being built */
 static int
-_insert_type(dax_state *ds, int index, char *typename) {
+_insert_type(datatype *dt, char *typename) {
     /* Right now all we are doing is checking that the name isn't
      * too big.  We are assuming that the server hasn't sent us a
      * name that is malformed. */
     if(strlen(typename) <= DAX_TAGNAME_SIZE) {
-        ds->datatypes[index].name = strdup(typename);
+        dt->name = strdup(typename);
     }
-    if(ds->datatypes[index].name == NULL) {
+    if(dt->name == NULL) {
         return ERR_ALLOC;
     }
     return 0;
@@ -50,9 +50,9 @@ _insert_type(dax_state *ds, int index, char *typename) {
     
 /* Adds the member that is described by the string desc.  This string
  * would look like the one generated by the serialize_datatype() function
- * in the server.  The index is the array index in _datatypes[] */
+ * in the server. */
 static int
-_add_member_to_cache(dax_state *ds, int index, char *desc) {
+_add_member_to_cache(dax_state *ds, datatype *dt, char *desc) {
     char *str, *last;
     char *name, *type;
     int count;
@@ -86,9 +86,9 @@ _add_member_to_cache(dax_state *ds, int index, char *desc) {
         new->next = NULL;
         //--printf("_add_member() - name = %s type = 0x%X count = %ld\n", new->name, new->type, new->count);
         /* Add the new member to the end of the linked list */
-        this = ds->datatypes[index].members;
+        this = dt->members;
         if(this == NULL) {
-            ds->datatypes[index].members = new;
+            dt->members = new;
         } else {
             while(this->next != NULL) this = this->next;
             this->next = new;
@@ -173,66 +173,128 @@ get_cdt_pointer(dax_state *ds, tag_type type, int *error)
     }
 }
 
+/* Frees everything that hangs off of a single datatype */
+static void
+_free_datatype(datatype *dt)
+{
+    cdt_member *this, *next;
+
+    this = dt->members;
+    while(this != NULL) {
+        next = this->next;
+        free(this->name);
+        free(this);
+        this = next;
+    }
+    free(dt->name);
+    free(dt->ops);
+}
+
+/* Makes sure that the datatype array has room for 'index'.  The old
+ * array is not freed because other threads may be reading it without
+ * the lock.  Must be called with ds->lock held. */
+static int
+_grow_datatypes(dax_state *ds, int index)
+{
+    datatype *new_datatype;
+    struct dt_retired *old;
+    unsigned int size, n;
+
+    if(index < ds->datatype_size) return 0;
+    size = ds->datatype_size;
+    while(index >= size) size += DAX_DATATYPE_SIZE;
+    
+    new_datatype = malloc(size * sizeof(datatype));
+    if(new_datatype == NULL) return ERR_ALLOC;
+    if(ds->datatypes != NULL) {
+        old = malloc(sizeof(struct dt_retired));
+        if(old == NULL) {
+            free(new_datatype);
+            return ERR_ALLOC;
+        }
+        memcpy(new_datatype, ds->datatypes, ds->datatype_size * sizeof(datatype));
+        old->datatypes = ds->datatypes;
+        old->next = ds->retired;
+        ds->retired = old;
+    }
+    /* Set all the pointers to NULL */
+    for(n = ds->datatype_size; n < size; n++) {
+        new_datatype[n].name = NULL;
+        new_datatype[n].members = NULL;
+        new_datatype[n].ops = NULL;
+        new_datatype[n].op_count = 0;
+    }
+    ds->datatypes = new_datatype;
+    ds->datatype_size = size;
+    return 0;
+}
+
 /* Adds the given type to the array cache.  'type' is the type id
  * and typedesc is the type description string that would be generated
- * by a call to serialize_datatype() in the server. */
+ * by a call to serialize_datatype() in the server.  The datatype is
+ * built without the lock because figuring out the member types may
+ * have to ask the server about other datatypes.  It is only put into
+ * the array once it's complete. */
 int
 add_cdt_to_cache(dax_state *ds, tag_type type, char *typedesc)
 {
-    int index, result, n;
+    int index, result;
     char *str, *last;
+    datatype dt;
     
     index = CDT_TO_INDEX(type);
+    dt.name = NULL;
+    dt.members = NULL;
+    dt.ops = NULL;
+    dt.op_count = 0;
     
-    if(ds->datatype_size == 0) { /* Make sure we have an array */
-        /* Allocate the datatype array and set the initial counters */
-        ds->datatypes = malloc(sizeof(datatype) * DAX_DATATYPE_SIZE);
-        if(ds->datatypes == NULL) {
-            return ERR_ALLOC;
-        }
-        /* Set both pointers to NULL */
-        for(n = 0; n < DAX_DATATYPE_SIZE; n++) {
-            ds->datatypes[n].name = NULL;
-            ds->datatypes[n].members = NULL;
-        }
-        ds->datatype_size = DAX_DATATYPE_SIZE;
-    }
-    
-    /* Do we need to grow the array */
-    while(index >= ds->datatype_size) { 
-        /* Allocate more space for the array */
-        datatype *new_datatype;
-        
-        new_datatype = realloc(ds->datatypes, (ds->datatype_size + DAX_DATATYPE_SIZE) * sizeof(datatype));
-
-        if(new_datatype != NULL) {
-            ds->datatypes = new_datatype;
-            /* Set both pointers to NULL */
-            for(n = ds->datatype_size; n < ds->datatype_size + DAX_DATATYPE_SIZE; n++) {
-                ds->datatypes[n].name = NULL;
-                ds->datatypes[n].members = NULL;
-            }
-            ds->datatype_size += DAX_DATATYPE_SIZE;
-        } else {
-            return ERR_ALLOC;
-        }
-    }
-    
-    /* At this point we should have the spot for the datatype */
     str = strtok_r(typedesc, ":", &last);
     if(str == NULL) {
         dax_error(ds, "add_cdt_to_cache(): Something is seriously wrong with the string");
         return ERR_ARG;
     }
-    //--printf("typename = '%s'\n", str);
-    result = _insert_type(ds, index, str);
+    result = _insert_type(&dt, str);
+    if(result) return result;
     
     while( (str = strtok_r(NULL, ":", &last)) ) {
-        result = _add_member_to_cache(ds, index, str);
-        if(result) return result;
+        result = _add_member_to_cache(ds, &dt, str);
+        if(result) {
+            _free_datatype(&dt);
+            return result;
+        }
+    }
+    
+    libdax_lock(ds->lock);
+    result = _grow_datatypes(ds, index);
+    if(result == 0 && ds->datatypes[index].name == NULL) {
+        ds->datatypes[index] = dt;
+    } else {
+        /* Another thread beat us to it */
+        _free_datatype(&dt);
+    }
+    libdax_unlock(ds->lock);
+    return result;
+}
+
+/* Frees the datatype cache.  Only called from dax_free() */
+void
+free_datatypes(dax_state *ds)
+{
+    unsigned int n;
+    struct dt_retired *old;
+
+    for(n = 0; n < ds->datatype_size; n++) {
+        _free_datatype(&ds->datatypes[n]);
+    }
+    free(ds->datatypes);
+    ds->datatypes = NULL;
+    ds->datatype_size = 0;
+    while(ds->retired != NULL) {
+        old = ds->retired;
+        ds->retired = old->next;
+        free(old->datatypes);
+        free(old);
     }
-    //--printf("add_cdt_to_cache() type = 0x%X, name = %s\n", type, typedesc);
-    return 0;
 }
 
 /* Creates an empty Custom Datatype with 'name' if
@@ -250,11 +312,13 @@ dax_cdt_new(char *name, int *error)
     if(strlen(name) > DAX_TAGNAME_SIZE) {
         result = ERR_2BIG;
     } else {
-        new = malloc(sizeof(dax_cdt *));
+        new = malloc(sizeof(dax_cdt));
         if(new == NULL) {
             result = ERR_ALLOC;
         } else {
             new->members = NULL;
+            new->ops = NULL;
+            new->op_count = 0;
             new->name = strdup(name);
             if(new->name == NULL) {
                 free(new);
@@ -319,6 +383,7 @@ void
 dax_cdt_free(dax_cdt *cdt) {
     if(cdt->members != NULL) _cdt_member_free(cdt->members);
     if(cdt->name != NULL ) free(cdt->name);
+    if(cdt->ops != NULL) free(cdt->ops);
     free(cdt);
 }
 
@@ -663,6 +728,307 @@ dax_tag_handle(dax_state *ds, Handle *h, char *str, int count)
 }
 
 
+/* Growable list of ops that is used while a plan is being built */
+struct op_list {
+    dax_cdt_op *ops;
+    int count;
+    int size;
+};
+
+static dax_cdt_op *
+_op_append(struct op_list *list)
+{
+    dax_cdt_op *new;
+
+    if(list->count == list->size) {
+        new = realloc(list->ops, (list->size + 16) * sizeof(dax_cdt_op));
+        if(new == NULL) return NULL;
+        list->ops = new;
+        list->size += 16;
+    }
+    new = &list->ops[list->count++];
+    bzero(new, sizeof(dax_cdt_op));
+    return new;
+}
+
+/* Adds the CDT_OP_LEAVE that matches the CDT_OP_ENTER at position 'enter' */
+static int
+_op_leave(struct op_list *list, int enter)
+{
+    dax_cdt_op *op;
+
+    op = _op_append(list);
+    if(op == NULL) return ERR_ALLOC;
+    *op = list->ops[enter];
+    op->op = CDT_OP_LEAVE;
+    op->skip = 0;
+    list->ops[enter].skip = list->count - 1;
+    return 0;
+}
+
+/* Copies the plan of a nested datatype into the list shifting
+ * the offsets by 'byte' */
+static int
+_op_copy(struct op_list *list, dax_cdt_op *sub, int count, u_int32_t byte)
+{
+    int n, base;
+    dax_cdt_op *op;
+
+    base = list->count;
+    for(n = 0; n < count; n++) {
+        op = _op_append(list);
+        if(op == NULL) return ERR_ALLOC;
+        *op = sub[n];
+        op->byte += byte;
+        if(op->op == CDT_OP_ENTER) op->skip += base;
+    }
+    return 0;
+}
+
+/* Builds the conversion plan for one datatype.  The plans for any
+ * datatypes that are nested inside are built first and copied in. */
+static int
+_cdt_compile(dax_state *ds, tag_type type, struct op_list *list)
+{
+    datatype *dt;
+    cdt_member *this;
+    dax_cdt_op *op, *sub;
+    int result, subcount, enter, n, size;
+    u_int32_t byte = 0;
+    u_int8_t bit = 0;
+
+    dt = get_cdt_pointer(ds, type, &result);
+    if(dt == NULL) return result;
+    this = dt->members;
+    /* The member list is not moved when the datatype array grows
+     * so it's safe to keep walking it after the nested calls below */
+    while(this != NULL) {
+        if(IS_CUSTOM(this->type)) {
+            result = dax_cdt_ops(ds, this->type, &sub, &subcount);
+            if(result) return result;
+            size = dax_get_typesize(ds, this->type);
+            enter = list->count;
+            if((op = _op_append(list)) == NULL) return ERR_ALLOC;
+            op->op = CDT_OP_ENTER;
+            op->type = this->type;
+            op->byte = byte;
+            op->count = this->count;
+            op->name = this->name;
+            if(this->count > 1) {
+                for(n = 0; n < this->count; n++) {
+                    if((op = _op_append(list)) == NULL) return ERR_ALLOC;
+                    op->op = CDT_OP_ENTER;
+                    op->type = this->type;
+                    op->byte = byte + n * size;
+                    op->count = 1;
+                    op->index = n;
+                    if(_op_copy(list, sub, subcount, byte + n * size)) return ERR_ALLOC;
+                    if(_op_leave(list, list->count - subcount - 1)) return ERR_ALLOC;
+                }
+            } else {
+                if(_op_copy(list, sub, subcount, byte)) return ERR_ALLOC;
+            }
+            if(_op_leave(list, enter)) return ERR_ALLOC;
+        } else {
+            if((op = _op_append(list)) == NULL) return ERR_ALLOC;
+            op->op = CDT_OP_VALUE;
+            op->type = this->type;
+            op->byte = byte;
+            op->bit = bit;
+            op->count = this->count;
+            op->name = this->name;
+        }
+        /* Same offset arithmetic as dax_cdt_iter() */
+        if(this->next != NULL) {
+            if(this->type == DAX_BOOL) {
+                bit += this->count % 8;
+                byte += this->count / 8;
+                if(bit > 7) {
+                    bit %= 8;
+                    byte++;
+                }
+                if(this->next->type != DAX_BOOL && bit != 0) {
+                    bit = 0;
+                    byte++;
+                }
+            } else {
+                bit = 0;
+                byte += dax_get_typesize(ds, this->type) * this->count;
+            }
+        }
+        this = this->next;
+    }
+    return 0;
+}
+
+/* Returns the flattened conversion plan for the custom datatype 'type'
+ * in *ops and the number of ops in *count.  The plan is built the
+ * first time it's asked for and kept with the datatype.  The caller
+ * should not free it. */
+int
+dax_cdt_ops(dax_state *ds, tag_type type, dax_cdt_op **ops, int *count)
+{
+    int result;
+    datatype *dt;
+    struct op_list list;
+
+    dt = get_cdt_pointer(ds, type, &result);
+    if(dt == NULL) return result ? result : ERR_ARG;
+    if(dt->ops == NULL) {
+        list.ops = NULL;
+        list.count = list.size = 0;
+        result = _cdt_compile(ds, type, &list);
+        if(result) {
+            free(list.ops);
+            return result;
+        }
+        /* Building nested plans can grow the datatype array */
+        libdax_lock(ds->lock);
+        dt = get_cdt_pointer(ds, type, &result);
+        if(dt->ops == NULL) {
+            dt->ops = list.ops;
+            dt->op_count = list.count;
+        } else {
+            /* Another thread built it while we were */
+            free(list.ops);
+        }
+        libdax_unlock(ds->lock);
+    }
+    *ops = dt->ops;
+    *count = dt->op_count;
+    return 0;
+}
+
+/* Figures the handle for the prepared tag and makes sure that the
+ * data buffers are big enough for it. */
+static int
+_prepared_resolve(dax_state *ds, dax_prepared *p)
+{
+    int result;
+    Handle h;
+    void *data, *mask;
+
+    result = dax_tag_handle(ds, &h, p->name, p->count);
+    if(result) return result;
+    if(p->data == NULL || h.size > p->h.size) {
+        data = realloc(p->data, h.size);
+        if(data == NULL) return ERR_ALLOC;
+        p->data = data;
+        mask = realloc(p->mask, h.size);
+        if(mask == NULL) return ERR_ALLOC;
+        p->mask = mask;
+    }
+    p->h = h;
+    p->generation = ds->generation;
+    return 0;
+}
+
+/* Returns zero if the prepared tag's handle is still good, otherwise
+ * it tries to figure the handle again. */
+static inline int
+_prepared_check(dax_state *ds, dax_prepared *p)
+{
+    if(p->generation == ds->generation) return 0;
+    return _prepared_resolve(ds, p);
+}
+
+/* Parses 'str' and sets up a prepared tag for it in *p.  'count' is the
+ * same as for dax_tag_handle().  The prepared tag should be freed with
+ * dax_prepared_free() */
+int
+dax_tag_prepare(dax_state *ds, dax_prepared **p, char *str, int count)
+{
+    int result;
+    dax_prepared *new;
+
+    new = malloc(sizeof(dax_prepared));
+    if(new == NULL) return ERR_ALLOC;
+    bzero(new, sizeof(dax_prepared));
+    new->name = strdup(str);
+    if(new->name == NULL) {
+        free(new);
+        return ERR_ALLOC;
+    }
+    new->count = count;
+    result = _prepared_resolve(ds, new);
+    if(result) {
+        dax_prepared_free(new);
+        return result;
+    }
+    *p = new;
+    return 0;
+}
+
+/* Copies the current handle of the prepared tag into *h */
+int
+dax_prepared_handle(dax_state *ds, dax_prepared *p, Handle *h)
+{
+    int result;
+
+    result = _prepared_check(ds, p);
+    if(result) return result;
+    *h = p->h;
+    return 0;
+}
+
+/* These return the data and mask buffers.  The pointers can change
+ * when the handle is figured again so they should be retrieved after
+ * any call that can do that. */
+void *
+dax_prepared_data(dax_prepared *p)
+{
+    return p->data;
+}
+
+void *
+dax_prepared_mask(dax_prepared *p)
+{
+    return p->mask;
+}
+
+/* Reads the tag into the data buffer */
+int
+dax_prepared_read(dax_state *ds, dax_prepared *p)
+{
+    int result;
+
+    result = _prepared_check(ds, p);
+    if(result) return result;
+    return dax_read_tag(ds, p->h, p->data);
+}
+
+/* Writes the data buffer to the tag */
+int
+dax_prepared_write(dax_state *ds, dax_prepared *p)
+{
+    int result;
+
+    result = _prepared_check(ds, p);
+    if(result) return result;
+    return dax_write_tag(ds, p->h, p->data);
+}
+
+/* Writes the data buffer to the tag through the mask buffer */
+int
+dax_prepared_mask_write(dax_state *ds, dax_prepared *p)
+{
+    int result;
+
+    result = _prepared_check(ds, p);
+    if(result) return result;
+    return dax_mask_tag(ds, p->h, p->data, p->mask);
+}
+
+void
+dax_prepared_free(dax_prepared *p)
+{
+    if(p == NULL) return;
+    free(p->name);
+    free(p->data);
+    free(p->mask);
+    free(p);
+}
+
 /* This is the compound datatype iterator.  If type is a datatype then this
  * function iterates over each member of the datatype and calls 'callback'
  * with the cdt_iter structure and passes back the udata pointer as well.
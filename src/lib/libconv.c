@@ -20,110 +20,175 @@
  * the required conversions of data to be sent and received from the server.
  */
 
+
 #include <libdax.h>
 #include <libcommon.h>
 
-/* TODO: All of these functions need to be written.  Right now we just
-   assume that all is good and that we don't need any of this. */
-/* TODO: Might also be nice to have some that will handle a whole buffer
-   of data instead of just a single point */
+/* The byte order of the server is found when the module registers
+ * (see _mod_connect() in libmsg.c) and ds->reformat is set to show
+ * which kinds of numbers have to be swapped on the way through.  When
+ * both ends agree ds->reformat is zero and every function in here
+ * returns without touching the data. */
+
+#if defined(__GNUC__) && ((__GNUC__ > 4) || (__GNUC__ == 4 && __GNUC_MINOR__ >= 8))
+#  define _bswap16(x) __builtin_bswap16(x)
+#  define _bswap32(x) __builtin_bswap32(x)
+#  define _bswap64(x) __builtin_bswap64(x)
+#else
+static inline u_int16_t
+_bswap16(u_int16_t x)
+{
+    return (x >> 8) | (x << 8);
+}
+
+static inline u_int32_t
+_bswap32(u_int32_t x)
+{
+    return ((x >> 24) & 0x000000FF) | ((x >> 8) & 0x0000FF00) |
+           ((x << 8) & 0x00FF0000)  | ((x << 24) & 0xFF000000);
+}
+
+static inline u_int64_t
+_bswap64(u_int64_t x)
+{
+    return ((u_int64_t)_bswap32((u_int32_t)x) << 32) | _bswap32((u_int32_t)(x >> 32));
+}
+#endif
+
+/* Returns the reformat flag that governs the given base datatype.
+ * Byte sized types never need anything done to them. */
+static inline unsigned int
+_swap_flag(tag_type type)
+{
+    switch(type) {
+        case DAX_REAL:
+        case DAX_LREAL:
+            return REF_FLT_SWAP;
+        case DAX_BOOL:
+        case DAX_BYTE:
+        case DAX_SINT:
+            return 0;
+        default:
+            return REF_INT_SWAP;
+    }
+}
 
 /* 16 Bit Conversion Functions */
 int16_t
-mtos_int(int16_t x)
+mtos_int(dax_state *ds, int16_t x)
 {
+    if(ds->reformat & REF_INT_SWAP) return (int16_t)_bswap16((u_int16_t)x);
     return x;
 }
 
 u_int16_t
-mtos_uint(u_int16_t x)
+mtos_uint(dax_state *ds, u_int16_t x)
 {
+    if(ds->reformat & REF_INT_SWAP) return _bswap16(x);
     return x;
 }
 
 int16_t
-stom_int(int16_t x)
+stom_int(dax_state *ds, int16_t x)
 {
-    return x;
+    return mtos_int(ds, x);
 }
 
 u_int16_t
-stom_uint(u_int16_t x)
+stom_uint(dax_state *ds, u_int16_t x)
 {
-    return x;
+    return mtos_uint(ds, x);
 }
 
 /* 32 Bit conversion Functions */
 int32_t
-mtos_dint(int32_t x)
+mtos_dint(dax_state *ds, int32_t x)
 {
+    if(ds->reformat & REF_INT_SWAP) return (int32_t)_bswap32((u_int32_t)x);
     return x;
 }
 
 u_int32_t
-mtos_udint(u_int32_t x)
+mtos_udint(dax_state *ds, u_int32_t x)
 {
+    if(ds->reformat & REF_INT_SWAP) return _bswap32(x);
     return x;
 }
 
 float
-mtos_real(float x)
+mtos_real(dax_state *ds, float x)
 {
+    u_int32_t temp;
+
+    if(ds->reformat & REF_FLT_SWAP) {
+        memcpy(&temp, &x, 4);
+        temp = _bswap32(temp);
+        memcpy(&x, &temp, 4);
+    }
     return x;
 }
 
 int32_t
-stom_dint(int32_t x)
+stom_dint(dax_state *ds, int32_t x)
 {
-    return x;
+    return mtos_dint(ds, x);
 }
 
 u_int32_t
-stom_udint(u_int32_t x)
+stom_udint(dax_state *ds, u_int32_t x)
 {
-    return x;
+    return mtos_udint(ds, x);
 }
 
 float
-stom_real(float x)
+stom_real(dax_state *ds, float x)
 {
-    return x;
+    return mtos_real(ds, x);
 }
 
 dax_lint
-mtos_lint(dax_lint x)
+mtos_lint(dax_state *ds, dax_lint x)
 {
+    if(ds->reformat & REF_INT_SWAP) return (dax_lint)_bswap64((u_int64_t)x);
     return x;
 }
 
 dax_ulint
-mtos_ulint(dax_ulint x)
+mtos_ulint(dax_state *ds, dax_ulint x)
 {
+    if(ds->reformat & REF_INT_SWAP) return _bswap64(x);
     return x;
 }
 
 dax_lreal
-mtos_lreal(dax_lreal x)
+mtos_lreal(dax_state *ds, dax_lreal x)
 {
+    u_int64_t temp;
+
+    if(ds->reformat & REF_FLT_SWAP) {
+        memcpy(&temp, &x, 8);
+        temp = _bswap64(temp);
+        memcpy(&x, &temp, 8);
+    }
     return x;
 }
 
 dax_lint
-stom_lint(dax_lint x)
+stom_lint(dax_state *ds, dax_lint x)
 {
-    return x;
+    return mtos_lint(ds, x);
 }
 
 dax_ulint
-stom_ulint(dax_ulint x)
+stom_ulint(dax_state *ds, dax_ulint x)
 {
-    return x;
+    return mtos_ulint(ds, x);
 }
 
 dax_lreal
-stom_lreal(dax_lreal x)
+stom_lreal(dax_state *ds, dax_lreal x)
 {
-    return x;
+    return mtos_lreal(ds, x);
 }
 
 /* This is a generic module to server function.  It looks at the
@@ -131,105 +196,150 @@ stom_lreal(dax_lreal x)
  * and places it in *dst. If successful it returns 0 and a negative
  * error otherwise. */
 int
-mtos_generic(tag_type type, void *dst, void *src) {
-    switch (type) {
-        case DAX_BOOL:
-        case DAX_BYTE:
-        case DAX_SINT:
-            *(dax_byte *)dst = *(dax_byte *)src;
-            break;
-        case DAX_WORD:
-            *(dax_word *)dst = mtos_word(*(dax_word *)src);
-            break;
-        case DAX_INT:
-            *(dax_int *)dst = mtos_int(*(dax_int *)src);
-            break;
-        case DAX_UINT:
-            *(dax_uint *)dst = mtos_uint(*(dax_uint *)src);
-            break;
-        case DAX_DWORD:
-            *(dax_dword *)dst = mtos_dword(*(dax_dword *)src);
-            break;
-        case DAX_DINT:
-            *(dax_dint *)dst = mtos_dint(*(dax_dint *)src);
-            break;
-        case DAX_UDINT:
-            *(dax_udint *)dst = mtos_udint(*(dax_udint *)src);
-            break;
-        case DAX_TIME:
-            *(dax_time *)dst = mtos_time(*(dax_time *)src);
-            break;
-        case DAX_REAL:
-            *(dax_real *)dst = mtos_real(*(dax_real *)src);
-            break;
-        case DAX_LWORD:
-            *(dax_lword *)dst = mtos_lword(*(dax_lword *)src);
-            break;
-        case DAX_LINT:
-            *(dax_lint *)dst = mtos_lint(*(dax_lint *)src);
+mtos_generic(dax_state *ds, tag_type type, void *dst, void *src) {
+    int size;
+
+    if(IS_CUSTOM(type)) return ERR_ARG;
+    /* BOOLs are carried in a single byte */
+    size = type == DAX_BOOL ? 1 : TYPESIZE(type) / 8;
+    if(dst != src) memcpy(dst, src, size);
+    return mtos_buffer(ds, type, 1, dst);
+}
+
+/* This is a generic server to module function.  Swapping the bytes
+ * is the same operation in both directions. */
+int
+stom_generic(dax_state *ds, tag_type type, void *dst, void *src) {
+    return mtos_generic(ds, type, dst, src);
+}
+
+/* These are the bulk kernels.  The values are moved through a local
+ * with memcpy() so that unaligned buffers are safe.  The contiguous
+ * loops have a constant stride so the compiler can turn them into
+ * vector byte shuffles. */
+static void
+_swap16_buffer(u_int8_t *data, size_t count, size_t stride)
+{
+    size_t n;
+    u_int16_t x;
+
+    if(stride == 2) {
+        for(n = 0; n < count; n++) {
+            memcpy(&x, data + n * 2, 2);
+            x = _bswap16(x);
+            memcpy(data + n * 2, &x, 2);
+        }
+    } else {
+        for(n = 0; n < count; n++) {
+            memcpy(&x, data + n * stride, 2);
+            x = _bswap16(x);
+            memcpy(data + n * stride, &x, 2);
+        }
+    }
+}
+
+static void
+_swap32_buffer(u_int8_t *data, size_t count, size_t stride)
+{
+    size_t n;
+    u_int32_t x;
+
+    if(stride == 4) {
+        for(n = 0; n < count; n++) {
+            memcpy(&x, data + n * 4, 4);
+            x = _bswap32(x);
+            memcpy(data + n * 4, &x, 4);
+        }
+    } else {
+        for(n = 0; n < count; n++) {
+            memcpy(&x, data + n * stride, 4);
+            x = _bswap32(x);
+            memcpy(data + n * stride, &x, 4);
+        }
+    }
+}
+
+static void
+_swap64_buffer(u_int8_t *data, size_t count, size_t stride)
+{
+    size_t n;
+    u_int64_t x;
+
+    if(stride == 8) {
+        for(n = 0; n < count; n++) {
+            memcpy(&x, data + n * 8, 8);
+            x = _bswap64(x);
+            memcpy(data + n * 8, &x, 8);
+        }
+    } else {
+        for(n = 0; n < count; n++) {
+            memcpy(&x, data + n * stride, 8);
+            x = _bswap64(x);
+            memcpy(data + n * stride, &x, 8);
+        }
+    }
+}
+
+/* Swaps 'count' values of the base datatype 'type' that are 'stride'
+ * bytes apart starting at *data. */
+static void
+_swap_values(dax_state *ds, tag_type type, u_int8_t *data, size_t count, size_t stride)
+{
+    if(! (ds->reformat & _swap_flag(type))) return;
+    switch(TYPESIZE(type)) {
+        case 16:
+            _swap16_buffer(data, count, stride);
             break;
-        case DAX_ULINT:
-            *(dax_ulint *)dst = mtos_ulint(*(dax_ulint *)src);
+        case 32:
+            _swap32_buffer(data, count, stride);
             break;
-        case DAX_LREAL:
-            *(dax_lreal *)dst = mtos_lreal(*(dax_lreal *)src);
+        case 64:
+            _swap64_buffer(data, count, stride);
             break;
-        default:
-            return ERR_ARG;
     }
-    return 0;
 }
 
-/* This is a generic server to module function.  It looks at the
- * datatype that is passed to it and converts the data found at src
- * and places it in *dst. If successful it returns 0 and a negative
- * error otherwise. */
+/* Converts 'count' items of 'type' in the buffer *data in place.  Base
+ * datatypes are swapped as one contiguous run.  Custom datatypes use
+ * the flattened member list from dax_cdt_ops() so the offsets of the
+ * members are never figured more than once, and each member is swapped
+ * as a run instead of walking the datatype once per item. */
 int
-stom_generic(tag_type type, void *dst, void *src) {
-    switch (type) {
-        case DAX_BOOL:
-        case DAX_BYTE:
-        case DAX_SINT:
-            *(dax_byte *)dst = *(dax_byte *)src;
-            break;
-        case DAX_WORD:
-            *(dax_word *)dst = stom_word(*(dax_word *)src);
-            break;
-        case DAX_INT:
-            *(dax_int *)dst = stom_int(*(dax_int *)src);
-            break;
-        case DAX_UINT:
-            *(dax_uint *)dst = stom_uint(*(dax_uint *)src);
-            break;
-        case DAX_DWORD:
-            *(dax_dword *)dst = stom_dword(*(dax_dword *)src);
-            break;
-        case DAX_DINT:
-            *(dax_dint *)dst = stom_dint(*(dax_dint *)src);
-            break;
-        case DAX_UDINT:
-            *(dax_udint *)dst = stom_udint(*(dax_udint *)src);
-            break;
-        case DAX_TIME:
-            *(dax_time *)dst = stom_time(*(dax_time *)src);
-            break;
-        case DAX_REAL:
-            *(dax_real *)dst = stom_real(*(dax_real *)src);
-            break;
-        case DAX_LWORD:
-            *(dax_lword *)dst = stom_lword(*(dax_lword *)src);
-            break;
-        case DAX_LINT:
-            *(dax_lint *)dst = stom_lint(*(dax_lint *)src);
-            break;
-        case DAX_ULINT:
-            *(dax_ulint *)dst = stom_ulint(*(dax_ulint *)src);
-            break;
-        case DAX_LREAL:
-            *(dax_lreal *)dst = stom_lreal(*(dax_lreal *)src);
-            break;
-        default:
-            return ERR_ARG;
+mtos_buffer(dax_state *ds, tag_type type, int count, void *data)
+{
+    int n, i, result, opcount, size, width;
+    dax_cdt_op *ops;
+    u_int8_t *base;
+
+    if(ds->reformat == 0 || count <= 0) return 0;
+    if(! IS_CUSTOM(type)) {
+        _swap_values(ds, type, data, count, TYPESIZE(type) / 8);
+        return 0;
+    }
+    result = dax_cdt_ops(ds, type, &ops, &opcount);
+    if(result) return result;
+    size = dax_get_typesize(ds, type);
+    for(n = 0; n < opcount; n++) {
+        if(ops[n].op != CDT_OP_VALUE || TYPESIZE(ops[n].type) <= 8) continue;
+        width = TYPESIZE(ops[n].type) / 8;
+        base = (u_int8_t *)data + ops[n].byte;
+        /* Run the loop the long way through the data, either along
+         * the member array in each item or across the items */
+        if(ops[n].count >= count) {
+            for(i = 0; i < count; i++) {
+                _swap_values(ds, ops[n].type, base + i * size, ops[n].count, width);
+            }
+        } else {
+            for(i = 0; i < ops[n].count; i++) {
+                _swap_values(ds, ops[n].type, base + i * width, count, size);
+            }
+        }
     }
     return 0;
 }
+
+int
+stom_buffer(dax_state *ds, tag_type type, int count, void *data)
+{
+    return mtos_buffer(ds, type, count, data);
+}
@@ -23,486 +23,776 @@
 #include <libcommon.h>
 
 /* Tag Cache Handling Code
- * The tag cache is a doubly linked circular list
- * the head pointer is fixed at the top of the list
- * tag searched for will bubble up one item in the list
- * each time it's found.  This will make the top of the list
- * the most searched for tags and the bottom the lesser used tags.
+ * The tag cache is an array of cache_limit nodes.  Each node that holds
+ * a tag is chained into two hash tables, one keyed on the tag name and
+ * one on the tag index, so that a lookup only has to look at the nodes
+ * in one bucket.  When the cache is full the node to reuse is picked
+ * with the CLOCK algorithm.  Each hit sets the node's reference bit and
+ * the clock hand sweeps the array clearing reference bits until it finds
+ * a node that hasn't been used since the last sweep.
+ *
+ * Entries are removed when the server tells us that the tag has been
+ * deleted or redefined.  These notifications are delivered like any other
+ * event so the module has to be dispatching events for them to be seen.
  */
 
-/* TODO: I need a way to invalidate the tag cache so that changes
-   to the tag can be put into the tag cache */
+/* Returns the bucket for the given tag name.  This is the FNV-1a hash */
+static inline unsigned int
+_cache_name_hash(dax_state *ds, char *name)
+{
+    u_int32_t hash = 2166136261u;
+
+    while(*name) {
+        hash ^= (u_int8_t)*name++;
+        hash *= 16777619u;
+    }
+    return hash & ds->cache_mask;
+}
+
+/* Tag indexes are handed out sequentially by the server so they are
+ * already well distributed. */
+static inline unsigned int
+_cache_idx_hash(dax_state *ds, tag_index idx)
+{
+    return (u_int32_t)idx & ds->cache_mask;
+}
+
+/* Frees the cache arrays.  Safe to call on a cache that was never
+ * initialized. */
+void
+free_tag_cache(dax_state *ds)
+{
+    free(ds->cache);
+    free(ds->cache_name);
+    free(ds->cache_idx);
+    ds->cache = NULL;
+    ds->cache_name = NULL;
+    ds->cache_idx = NULL;
+    ds->cache_mask = 0;
+    ds->cache_limit = 0;
+    ds->cache_count = 0;
+    ds->cache_fill = 0;
+    ds->cache_hand = 0;
+}
 
+/* Allocates the cache.  The size is read from the 'cachesize'
+ * attribute.  A size of zero disables the cache. */
 int
 init_tag_cache(dax_state *ds)
 {
-    ds->cache_head = NULL;
-    ds->cache_limit = strtol(dax_get_attr(ds, "cachesize"), NULL, 0);
-    ds->cache_count = 0;
+    int limit;
+    unsigned int buckets = 1;
+
+    free_tag_cache(ds);
+    limit = strtol(dax_get_attr(ds, "cachesize"), NULL, 0);
+    if(limit <= 0) return 0;
+
+    /* Keep the number of buckets a power of two that is at least
+     * as big as the cache so that the chains stay short */
+    while(buckets < limit) buckets <<= 1;
+
+    ds->cache = calloc(limit, sizeof(tag_cnode));
+    ds->cache_name = calloc(buckets, sizeof(tag_cnode *));
+    ds->cache_idx = calloc(buckets, sizeof(tag_cnode *));
+    if(ds->cache == NULL || ds->cache_name == NULL || ds->cache_idx == NULL) {
+        free_tag_cache(ds);
+        return ERR_ALLOC;
+    }
+    ds->cache_mask = buckets - 1;
+    ds->cache_limit = limit;
     return 0;
 }
 
-/****** FOR TESTING ONLY ********
-static void
-print_cache(void)
+static tag_cnode *
+_cache_find_index(dax_state *ds, tag_index idx)
 {
-    int n;
     tag_cnode *this;
-    this = _cache_head;
-    printf("_cache_head->handle = {%d}\n", _cache_head->handle);
-    for(n=0; n<_cache_count; n++) {
-        printf("{%d} - %s\t\t", this->handle, this->name);
-        printf("this->prev = {%d}", this->prev->handle);
-        printf(" : this->next = {%d}\n", this->next->handle);
-        this = this->next;
+
+    if(ds->cache_count == 0) return NULL;
+    this = ds->cache_idx[_cache_idx_hash(ds, idx)];
+    while(this != NULL && this->idx != idx) {
+        this = this->idx_next;
     }
-    printf("\n{ count = %d, head = %p }\n", _cache_count, _cache_head);
-    //printf("{ head->handle = %d, tail->handle = %d head->prev = %p, tail->next = %p}\n", 
-    //       _cache_head->handle, _cache_tail->handle, _cache_head->prev, _cache_tail->next);
+    return this;
 }
-*/
- 
-/* This function assigns the data to *tag and bubbles
-   this up one node in the list */
+
+static tag_cnode *
+_cache_find_name(dax_state *ds, char *name)
+{
+    tag_cnode *this;
+
+    if(ds->cache_count == 0) return NULL;
+    this = ds->cache_name[_cache_name_hash(ds, name)];
+    while(this != NULL && strcmp(this->name, name)) {
+        this = this->name_next;
+    }
+    return this;
+}
+
+/* Removes the node from both hash chains and marks it free */
+static void
+_cache_unlink(dax_state *ds, tag_cnode *node)
+{
+    tag_cnode **last;
+
+    last = &ds->cache_name[_cache_name_hash(ds, node->name)];
+    while(*last != node) last = &(*last)->name_next;
+    *last = node->name_next;
+
+    last = &ds->cache_idx[_cache_idx_hash(ds, node->idx)];
+    while(*last != node) last = &(*last)->idx_next;
+    *last = node->idx_next;
+
+    node->used = 0;
+    node->ref = 0;
+    ds->cache_count--;
+}
+
+/* Returns a free node to put a new tag in.  Nodes that have never been
+ * used are handed out first, after that the clock hand goes looking for
+ * a node that is either free or hasn't been referenced since the hand
+ * last passed it. */
+static tag_cnode *
+_cache_victim(dax_state *ds)
+{
+    tag_cnode *node;
+
+    if(ds->cache_fill < ds->cache_limit) {
+        return &ds->cache[ds->cache_fill++];
+    }
+    while(1) {
+        node = &ds->cache[ds->cache_hand];
+        ds->cache_hand = (ds->cache_hand + 1) % ds->cache_limit;
+        if(!node->used) return node;
+        if(node->ref) {
+            node->ref = 0;
+        } else {
+            _cache_unlink(ds, node);
+            return node;
+        }
+    }
+}
+
+/* Copies the cached tag to *tag and marks the node as referenced */
 static inline void
-_cache_hit(dax_state *ds, tag_cnode *this, dax_tag *tag)
+_cache_hit(tag_cnode *this, dax_tag *tag)
 {
-    tag_cnode *before, *after;
-    
-    /* Store the return values in tag */
     strcpy(tag->name, this->name);
     tag->idx = this->idx;
     tag->type = this->type;
     tag->count = this->count;
-    
-    /* Bubble up:
-     'after' is set to the node that we swap with
-     'before' is set to the node that will be before
-     us after the swap.  The special case is when our
-     node will become the first one, then we move the head. */
-    if(this != ds->cache_head) { /* Do nothing if we are already at the top */
-        /* If there are only two then we do it the easy way */
-        if(ds->cache_count == 2) {
-            ds->cache_head = ds->cache_head->next;
-        } else {
-            if(this == ds->cache_head->next) ds->cache_head = this;
-            after = this->prev;
-            before = after->prev;
-            before->next = this;
-            after->prev = this;
-            after->next = this->next;
-            this->next->prev = after;
-            this->next = after;
-            this->prev = before;
-        }
-    }
-    //--print_cache();
+    this->ref = 1;
 }
 
 /* Used to check if a tag with the given handle is in the 
- * cache.  Returns a pointer to the tag if found and
+ * cache.  Returns 0 and fills in *tag if found and
  * returns ERR_NOTFOUND otherwise */
 int
 check_cache_index(dax_state *ds, tag_index idx, dax_tag *tag)
 {
     tag_cnode *this;
-    
-    if(ds->cache_head != NULL) {
-        this = ds->cache_head;
-    } else {
-        return ERR_NOTFOUND;
-    }
-    if(ds->cache_head->idx != idx) {
-        this = this->next;
-        
-        while(this != ds->cache_head && this->idx != idx) {
-            this = this->next;
-        }
-        if(this == ds->cache_head) {
-            return ERR_NOTFOUND;
-        }
-    }
-    
-    _cache_hit(ds, this, tag);
-    
+
+    this = _cache_find_index(ds, idx);
+    if(this == NULL) return ERR_NOTFOUND;
+    _cache_hit(this, tag);
     return 0;
 }
 
 /* Used to check if a tag with the given name is in the cache
- * If it is found then a pointer to the tag is returned and
+ * Returns 0 and fills in *tag if it is found and
  * ERR_NOTFOUND otherwise */
 int
 check_cache_name(dax_state *ds, char *name, dax_tag *tag)
 {
     tag_cnode *this;
-    
-    if(ds->cache_head != NULL) {
-        this = ds->cache_head;
-    } else {
-        return ERR_NOTFOUND;
-    }
-    if( strcmp(ds->cache_head->name, name) ) {
-        this = this->next;
-        
-        while(this != ds->cache_head && strcmp(this->name, name)) {
-            this = this->next;
-        }
-        if(this == ds->cache_head) {
-            return ERR_NOTFOUND;
-        }
-    }
-    
-    _cache_hit(ds, this, tag);
-    
+
+    this = _cache_find_name(ds, name);
+    if(this == NULL) return ERR_NOTFOUND;
+    _cache_hit(this, tag);
     return 0;
 }
 
-
-/* Adds a tag to the cache */
+/* Adds a tag to the cache.  If the tag is already in the cache
+ * the entry is replaced. */
 int
 cache_tag_add(dax_state *ds, dax_tag *tag)
 {
-    tag_cnode *new;
-    
-    if(ds->cache_head == NULL) { /* First one */
-        //--printf("adding {%d} to the beginning\n", tag->handle);
-        new = malloc(sizeof(tag_cnode));
-        if(new) {
-            new->next = new;
-            new->prev = new;
-            ds->cache_head = new;
-            ds->cache_count++;
-        } else {
-            return ERR_ALLOC;
-        }
-    } else if(ds->cache_count < ds->cache_limit) { /* Add to end */
-        //--printf("adding {%d} to the end\n", tag->handle);
-        new = malloc(sizeof(tag_cnode));
-        if(new) {
-            new->next = ds->cache_head;
-            new->prev = ds->cache_head->prev;
-            ds->cache_head->prev->next = new;
-            ds->cache_head->prev = new;
-            ds->cache_count++;
-        } else {
-            return ERR_ALLOC;
-        }
-    } else {
-        //--printf("Just putting {%d}  last\n", tag->handle);
-        new = ds->cache_head->prev;
+    tag_cnode *new, *old;
+    unsigned int bucket;
+
+    if(ds->cache_limit == 0) return 0;
+
+    /* Get rid of any entries that match either key */
+    if((new = _cache_find_index(ds, tag->idx)) != NULL) {
+        _cache_unlink(ds, new);
+    }
+    if((old = _cache_find_name(ds, tag->name)) != NULL) {
+        _cache_unlink(ds, old);
+        if(new == NULL) new = old;
+    }
+    if(new == NULL) {
+        new = _cache_victim(ds);
     }
     strcpy(new->name, tag->name);
     new->idx = tag->idx;
     new->type = tag->type;
     new->count = tag->count;
-    //--print_cache();
-    
+    new->used = 1;
+    new->ref = 1;
+
+    bucket = _cache_name_hash(ds, new->name);
+    new->name_next = ds->cache_name[bucket];
+    ds->cache_name[bucket] = new;
+    bucket = _cache_idx_hash(ds, new->idx);
+    new->idx_next = ds->cache_idx[bucket];
+    ds->cache_idx[bucket] = new;
+    ds->cache_count++;
+
     return 0;
 }
 
 /* This function deletes the tag in the cache given by 'tagname'
  * It returns 0 on success and ERR_NOTFOUND if the tag is not in the cache */
 int
-cache_tag_del(dax_state *ds, char *tagname) {
-    tag_cnode *this, *head;
-    
-    /* Search for the tag */
-    if(ds->cache_head != NULL) {
-        head = ds->cache_head;
-        this = head;
-    } else {
-        return ERR_NOTFOUND;
+cache_tag_del(dax_state *ds, char *tagname)
+{
+    tag_cnode *this;
+
+    this = _cache_find_name(ds, tagname);
+    if(this == NULL) return ERR_NOTFOUND;
+    _cache_unlink(ds, this);
+    return 0;
+}
+
+/* Same as cache_tag_del() but by tag index */
+int
+cache_tag_invalidate(dax_state *ds, tag_index idx)
+{
+    tag_cnode *this;
+
+    this = _cache_find_index(ds, idx);
+    if(this == NULL) return ERR_NOTFOUND;
+    _cache_unlink(ds, this);
+    return 0;
+}
+
+/* Pattern event callback for tags that have been deleted or redefined
+ * in the server.  Bumping the generation makes prepared tags figure
+ * their handles again. */
+static void
+_cache_schema_event(tag_index idx, void *udata)
+{
+    dax_state *ds = (dax_state *)udata;
+
+    libdax_lock(ds->lock);
+    cache_tag_invalidate(ds, idx);
+    data_cache_drop(ds, idx);
+    ds->generation++;
+    libdax_unlock(ds->lock);
+}
+
+/* Subscribes to the notifications that the server sends when a tag
+ * is deleted or redefined so that stale entries can be dropped.  The
+ * server sends a tag deleted event followed by a tag added event when
+ * an existing tag is resized.  This should be called without the lock */
+int
+cache_subscribe(dax_state *ds)
+{
+    return dax_event_pattern_add(ds, "*", 0, EVENT_TAG_DELETED, NULL,
+                                 _cache_schema_event, ds, NULL);
+}
+
+
+/* Data Cache Handling Code
+ *
+ * The data cache holds the raw bytes of the handles that the module
+ * has asked us to cache with dax_cache_add().  The nodes are chained
+ * in DATA_CACHE_BUCKETS hash buckets keyed on the tag index.  Each node
+ * owns a CHANGE event and the node is freed by the event's
+ * free_callback, so the node lives exactly as long as the event does.
+ * Everything here expects ds->lock to be held unless it says otherwise. */
+
+static inline unsigned int
+_dcache_hash(tag_index idx)
+{
+    return (u_int32_t)idx & (DATA_CACHE_BUCKETS - 1);
+}
+
+static data_cnode *
+_dcache_find(dax_state *ds, Handle *h)
+{
+    data_cnode *this;
+
+    if(ds->dcache == NULL) return NULL;
+    this = ds->dcache[_dcache_hash(h->index)];
+    while(this != NULL) {
+        if(this->idx == h->index && this->byte == h->byte &&
+           this->size == h->size && this->bit == h->bit) {
+            return this;
+        }
+        this = this->next;
+    }
+    return NULL;
+}
+
+static void
+_dcache_unlink(dax_state *ds, data_cnode *node)
+{
+    data_cnode **last;
+
+    last = &ds->dcache[_dcache_hash(node->idx)];
+    while(*last != NULL) {
+        if(*last == node) {
+            *last = node->next;
+            ds->dcache_stats.entries--;
+            return;
+        }
+        last = &(*last)->next;
+    }
+}
+
+/* CHANGE event callback.  This is called without the lock. */
+static void
+_dcache_event(void *udata)
+{
+    data_cnode *node = (data_cnode *)udata;
+    dax_state *ds = node->ds;
+
+    libdax_lock(ds->lock);
+    if(node->valid) {
+        node->valid = 0;
+        ds->dcache_stats.invalidations++;
     }
-    if( strcmp(head->name, tagname) ) {
+    node->seq++;
+    libdax_unlock(ds->lock);
+}
+
+/* free_callback for the CHANGE event.  The node is usually unlinked
+ * before the event is deleted but not when the event goes away because
+ * it couldn't be added again after reconnecting. */
+static void
+_dcache_free(void *udata)
+{
+    data_cnode *node = (data_cnode *)udata;
+
+    _dcache_unlink(node->ds, node);
+    free(node->data);
+    free(node);
+}
+
+/* Returns the number of milliseconds since the node was filled */
+static inline unsigned int
+_dcache_age(data_cnode *node)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - node->stamp.tv_sec) * 1000 +
+           (now.tv_usec - node->stamp.tv_usec) / 1000;
+}
+
+/* Looks up the handle in the data cache.  Returns 0 and copies the
+ * raw data to *data on a hit.  Returns 1 if the handle is cached but
+ * the value has to be read from the server.  In that case *seq should
+ * be passed to data_cache_fill() after the read.  Returns ERR_NOTFOUND
+ * if the handle isn't cached at all.  Called without the lock. */
+int
+data_cache_read(dax_state *ds, Handle *h, void *data, unsigned int *seq)
+{
+    data_cnode *node;
+    int result = ERR_NOTFOUND;
+
+    libdax_lock(ds->lock);
+    node = _dcache_find(ds, h);
+    if(node != NULL) {
+        if(node->valid && ds->dcache_age && _dcache_age(node) > ds->dcache_age) {
+            node->valid = 0;
+            ds->dcache_stats.expired++;
+        }
+        if(node->valid) {
+            memcpy(data, node->data, node->size);
+            ds->dcache_stats.hits++;
+            result = 0;
+        } else {
+            *seq = node->seq;
+            ds->dcache_stats.misses++;
+            result = 1;
+        }
+    }
+    libdax_unlock(ds->lock);
+    return result;
+}
+
+/* Stores the raw data that was just read from the server.  If the value
+ * was thrown away while we were reading then 'seq' won't match and the
+ * data is dropped.  Called without the lock. */
+void
+data_cache_fill(dax_state *ds, Handle *h, void *data, unsigned int seq)
+{
+    data_cnode *node;
+
+    libdax_lock(ds->lock);
+    node = _dcache_find(ds, h);
+    if(node != NULL && node->seq == seq) {
+        memcpy(node->data, data, node->size);
+        gettimeofday(&node->stamp, NULL);
+        node->valid = 1;
+    }
+    libdax_unlock(ds->lock);
+}
+
+/* Throws away any cached values that overlap 'size' bytes starting at
+ * 'byte' of the tag.  This is used when we write to a tag ourselves so
+ * that we don't read our old value back before the event gets here.
+ * Called without the lock. */
+void
+data_cache_invalidate(dax_state *ds, tag_index idx, int byte, int size)
+{
+    data_cnode *this;
+
+    if(ds->dcache == NULL) return;
+    libdax_lock(ds->lock);
+    this = ds->dcache[_dcache_hash(idx)];
+    while(this != NULL) {
+        if(this->idx == idx && this->byte < byte + size && byte < this->byte + this->size) {
+            if(this->valid) {
+                this->valid = 0;
+                ds->dcache_stats.invalidations++;
+            }
+            this->seq++;
+        }
         this = this->next;
-        
-        while(this != head && strcmp(this->name, tagname)) {
-            this = this->next;
+    }
+    libdax_unlock(ds->lock);
+}
+
+/* Removes every node for the given tag.  This is called when the tag
+ * has been deleted.  The server has already dropped the events so we
+ * only have to remove them from our own table. */
+void
+data_cache_drop(dax_state *ds, tag_index idx)
+{
+    data_cnode *this, *next;
+
+    if(ds->dcache == NULL) return;
+    this = ds->dcache[_dcache_hash(idx)];
+    while(this != NULL) {
+        next = this->next;
+        if(this->idx == idx) {
+            _dcache_unlink(ds, this);
+            del_event(ds, this->event); /* Frees the node */
         }
-        if(this == head) {
-            return ERR_NOTFOUND;
+        this = next;
+    }
+}
+
+/* Throws away every cached value.  Used after we reconnect to the
+ * server since we may have missed some events. */
+void
+data_cache_clear(dax_state *ds)
+{
+    data_cnode *this;
+    int n;
+
+    if(ds->dcache == NULL) return;
+    for(n = 0; n < DATA_CACHE_BUCKETS; n++) {
+        for(this = ds->dcache[n]; this != NULL; this = this->next) {
+            this->valid = 0;
+            this->seq++;
         }
     }
-    
-    /* If we get this far the tag was found and 'this' should point to
-     * the tag we want to delete */ 
-    if(this->next == this) { /* Last module */
-        head = NULL;
-    } else {
-        /* disconnect module */
-        (this->next)->prev = this->prev;
-        (this->prev)->next = this->next;
-        /* don't want current to be pointing to the one we are deleting */
-        if(head == this) {
-            head = this->next;
+}
+
+/* Frees the bucket array.  The nodes themselves are freed along with
+ * the events in free_events() */
+void
+free_data_cache(dax_state *ds)
+{
+    free(ds->dcache);
+    ds->dcache = NULL;
+}
+
+/* Starts caching the data that is pointed to by the handle.  Adding
+ * a handle that is already cached does nothing. */
+int
+dax_cache_add(dax_state *ds, Handle *h)
+{
+    data_cnode *node;
+    data_cnode **buckets;
+    int result;
+
+    libdax_lock(ds->lock);
+    if(ds->dcache == NULL) {
+        buckets = calloc(DATA_CACHE_BUCKETS, sizeof(data_cnode *));
+        if(buckets == NULL) {
+            libdax_unlock(ds->lock);
+            return ERR_ALLOC;
         }
+        ds->dcache = buckets;
+        ds->dcache_age = strtoul(dax_get_attr(ds, "cacheage"), NULL, 0);
     }
-    ds->cache_count--;
-    /* free allocated memory */
-    free(this);
+    node = _dcache_find(ds, h);
+    libdax_unlock(ds->lock);
+    if(node != NULL) return 0;
+
+    node = malloc(sizeof(data_cnode));
+    if(node == NULL) return ERR_ALLOC;
+    node->data = malloc(h->size);
+    if(node->data == NULL) {
+        free(node);
+        return ERR_ALLOC;
+    }
+    node->idx = h->index;
+    node->byte = h->byte;
+    node->size = h->size;
+    node->bit = h->bit;
+    node->valid = 0;
+    node->seq = 0;
+    node->ds = ds;
+    /* The event owns the node from here on */
+    result = dax_event_add(ds, h, EVENT_CHANGE, NULL, &node->event,
+                           _dcache_event, node, _dcache_free);
+    if(result) {
+        _dcache_free(node);
+        return result;
+    }
+    libdax_lock(ds->lock);
+    /* Another thread may have added the same handle while we were
+     * talking to the server.  Theirs wins and ours goes away. */
+    if(_dcache_find(ds, h) != NULL) {
+        libdax_unlock(ds->lock);
+        if(dax_event_del(ds, node->event)) {
+            libdax_lock(ds->lock);
+            del_event(ds, node->event);
+            libdax_unlock(ds->lock);
+        }
+        return 0;
+    }
+    node->next = ds->dcache[_dcache_hash(node->idx)];
+    ds->dcache[_dcache_hash(node->idx)] = node;
+    ds->dcache_stats.entries++;
+    libdax_unlock(ds->lock);
     return 0;
 }
 
+/* Stops caching the handle */
+int
+dax_cache_del(dax_state *ds, Handle *h)
+{
+    data_cnode *node;
+    dax_event_id id;
+    int result;
+
+    libdax_lock(ds->lock);
+    node = _dcache_find(ds, h);
+    if(node == NULL) {
+        libdax_unlock(ds->lock);
+        return ERR_NOTFOUND;
+    }
+    _dcache_unlink(ds, node);
+    id = node->event;
+    libdax_unlock(ds->lock);
+    /* The node is freed when the event is removed from our table */
+    result = dax_event_del(ds, id);
+    if(result) {
+        /* Make sure that it's gone from our table even if the server
+         * didn't know about it anymore. */
+        libdax_lock(ds->lock);
+        del_event(ds, id);
+        libdax_unlock(ds->lock);
+    }
+    return result;
+}
+
+int
+dax_cache_stats_get(dax_state *ds, dax_cache_stats *stats)
+{
+    libdax_lock(ds->lock);
+    *stats = ds->dcache_stats;
+    libdax_unlock(ds->lock);
+    return 0;
+}
+
+/* Clears the counters.  The number of entries is left alone */
+void
+dax_cache_stats_reset(dax_state *ds)
+{
+    libdax_lock(ds->lock);
+    ds->dcache_stats.hits = 0;
+    ds->dcache_stats.misses = 0;
+    ds->dcache_stats.expired = 0;
+    ds->dcache_stats.invalidations = 0;
+    libdax_unlock(ds->lock);
+}
+
 
 /* Type specific reading and writing functions.  These should be the most common
  * methods to read and write tags to the sever.*/
 
-/* This is a recursive function that traverses the *data and makes the proper
- * data conversions based on the data type. */
-static inline int
-_read_format(dax_state *ds, tag_type type, int count, void *data, int offset)
+/* BOOL handles that don't start on a byte boundary have to have their
+ * bits shifted into place.  These routines do that a whole byte at a
+ * time by merging the two source bytes that straddle each destination
+ * byte instead of moving each bit on its own. */
+
+/* Size of the scratch buffers that are kept on the stack for shifting
+ * BOOL data.  Handles that are bigger than this get allocated buffers */
+#ifndef BIT_SCRATCH_SIZE
+#  define BIT_SCRATCH_SIZE 64
+#endif
+
+/* Moves 'count' bits that start at bit 'bit' of buff down to the start of
+ * buff.  Any bits past 'count' in the last byte are cleared.  Each
+ * destination byte only depends on source bytes at the same position or
+ * later so this can be done in place. 'size' is the size of buff. */
+static void
+_bits_extract(u_int8_t *buff, int size, int bit, int count)
 {
-    int n, pos, result;
-    char *newdata;
-    datatype *dtype = NULL;
-    cdt_member *this = NULL;
-    
-    newdata = (char *)data + offset;
-    if(IS_CUSTOM(type)) {
-        /* iterate through the list */
-        dtype = get_cdt_pointer(ds, type, NULL);
-        pos = offset;
-        if(dtype != NULL) {
-            this = dtype->members;
-        } else {
-            return ERR_NOTFOUND;
-        }
-        while(this != NULL) {
-            result = _read_format(ds, this->type, this->count, data, pos);
-            if(result) return result;
-            if(IS_CUSTOM(this->type)) {
-                pos += (dax_get_typesize(ds, this->type) * this->count);
-            } else {
-                /* This gets the size in bits */
-                pos += TYPESIZE(this->type) * this->count / 8;
+    int n, bytes;
+
+    buff += bit / 8;
+    size -= bit / 8;
+    bit %= 8;
+    bytes = (count - 1) / 8 + 1;
+    if(bit) {
+        for(n = 0; n < bytes; n++) {
+            buff[n] >>= bit;
+            if(n + 1 < size) {
+                buff[n] |= buff[n + 1] << (8 - bit);
             }
-            this = this->next;
         }
-    } else {
-        switch(type) {
-            case DAX_BOOL:
-            case DAX_BYTE:
-            case DAX_SINT:
-                /* Since there are no conversions for byte level tags we do nothing */
-                break;
-            case DAX_WORD:
-            case DAX_UINT:
-                for(n = 0; n < count; n++) {
-                    ((dax_uint *)newdata)[n] = stom_uint(((dax_uint *)newdata)[n]);
-                }
-                break;
-            case DAX_INT:
-                for(n = 0; n < count; n++) {
-                    ((dax_int *)newdata)[n] = stom_int(((dax_int *)newdata)[n]);
-                }
-                break;
-            case DAX_DWORD:
-            case DAX_UDINT:
-            case DAX_TIME:
-                for(n = 0; n < count; n++) {
-                    ((dax_udint *)newdata)[n] = stom_udint(((dax_udint *)newdata)[n]);
-                }
-                break;
-            case DAX_DINT:
-                for(n = 0; n < count; n++) {
-                    ((dax_dint *)newdata)[n] = stom_dint(((dax_dint *)newdata)[n]);
-                }
-                break;
-            case DAX_REAL:
-                for(n = 0; n < count; n++) {
-                    ((dax_real *)newdata)[n] = stom_real(((dax_real *)newdata)[n]);
-                }
-                break;
-            case DAX_LWORD:
-            case DAX_ULINT:
-                for(n = 0; n < count; n++) {
-                    ((dax_ulint *)newdata)[n] = stom_ulint(((dax_ulint *)newdata)[n]);
-                }
-                break;
-            case DAX_LINT:
-                for(n = 0; n < count; n++) {
-                    ((dax_lint *)newdata)[n] = stom_lint(((dax_lint *)newdata)[n]);
-                }
-                break;
-            case DAX_LREAL:
-                for(n = 0; n < count; n++) {
-                    ((dax_lreal *)newdata)[n] = stom_lreal(((dax_lreal *)newdata)[n]);
-                }
-                break;
-            default:
-                return ERR_ARG;
-                break;
-        }    
     }
-    return 0;
+    if(count % 8) {
+        buff[bytes - 1] &= (1 << (count % 8)) - 1;
+    }
+}
+
+/* The opposite of _bits_extract().  Places 'count' bits from the start of
+ * 'src' at bit 'bit' of 'dst' and builds the matching mask for the server.
+ * If srcmask is not NULL only the bits that are set in it are included in
+ * the mask.  'size' is the size of dst and mask which have to be
+ * zeroed before this is called. */
+static void
+_bits_insert(u_int8_t *dst, u_int8_t *mask, int size, u_int8_t *src,
+             u_int8_t *srcmask, int bit, int count)
+{
+    int n, bytes;
+    u_int8_t m;
+
+    dst += bit / 8;
+    mask += bit / 8;
+    size -= bit / 8;
+    bit %= 8;
+    bytes = (count - 1) / 8 + 1;
+    for(n = 0; n < bytes; n++) {
+        /* Only the bits that belong to this handle */
+        m = 0xFF;
+        if(n == bytes - 1 && count % 8) {
+            m = (1 << (count % 8)) - 1;
+        }
+        if(srcmask != NULL) m &= srcmask[n];
+        dst[n] |= (src[n] & m) << bit;
+        mask[n] |= m << bit;
+        if(bit && n + 1 < size) {
+            dst[n + 1] |= (src[n] & m) >> (8 - bit);
+            mask[n + 1] |= m >> (8 - bit);
+        }
+    }
 }
 
+/* Writes BOOL data that doesn't line up on byte boundaries through the
+ * mask so that the neighbouring bits in the server are left alone. */
+static int
+_bool_mask_write(dax_state *ds, Handle handle, void *data, void *mask)
+{
+    int result;
+    u_int8_t scratch[BIT_SCRATCH_SIZE * 2];
+    u_int8_t *newdata, *newmask;
+
+    if(handle.size <= BIT_SCRATCH_SIZE) {
+        newdata = scratch;
+    } else {
+        newdata = malloc(handle.size * 2);
+        if(newdata == NULL) return ERR_ALLOC;
+    }
+    newmask = newdata + handle.size;
+    bzero(newdata, handle.size * 2);
+    _bits_insert(newdata, newmask, handle.size, data, mask, handle.bit, handle.count);
+    result = dax_mask(ds, handle.index, handle.byte, newdata, newmask, handle.size);
+    if(newdata != scratch) free(newdata);
+    return result;
+}
 
 int
 dax_read_tag(dax_state *ds, Handle handle, void *data)
 {
-    int result, n, i;
-    u_int8_t *newdata;
-    
-    result = dax_read(ds, handle.index, handle.byte, data, handle.size);
-    if(result) return result;
+    int result = ERR_NOTFOUND;
+    int cached;
+    unsigned int seq;
+
+    /* Cached handles only go to the server when the value has changed
+     * or gotten too old */
+    if(ds->dcache != NULL) {
+        result = data_cache_read(ds, &handle, data, &seq);
+    }
+    if(result) {
+        cached = (result > 0);
+        result = dax_read(ds, handle.index, handle.byte, data, handle.size);
+        if(result) return result;
+        if(cached) data_cache_fill(ds, &handle, data, seq);
+    }
     
     /* The only time that the bit index should be greater than 0 is if
      * the tag datatype is BOOL.  If not the bytes should be aligned.
      * If there is a bit index then we need to 'realign' the bits so that
      * the bits that the handle point to start at the top of the *data buffer */
     if(handle.type == DAX_BOOL) {
-        i = handle.bit;
-        newdata = malloc(handle.size);
-        if(newdata == NULL) return ERR_ALLOC;
-        bzero(newdata, handle.size);
-        for(n = 0; n < handle.count; n++) {
-            if( (0x01 << (i % 8)) & ((u_int8_t *)data)[i / 8] ) {
-                ((u_int8_t *)newdata)[n / 8] |= (1 << (n % 8));
-            }
-            i++;
-        }
-        memcpy(data, newdata, handle.size);
-        free(newdata);
-    } else {
-        libdax_lock(ds->lock);
-        result = _read_format(ds, handle.type, handle.count, data, 0);
-        libdax_unlock(ds->lock);
-        return result;
+        _bits_extract(data, handle.size, handle.bit, handle.count);
+    } else if(ds->reformat) {
+        return stom_buffer(ds, handle.type, handle.count, data);
     }
     return 0;
 }
 
 
-/* This reformats the information in *data to prepare it to be written
- * to the server by changing the byte ordering and number format if
- * necessary to match the server */
-static inline int
-_write_format(dax_state *ds, tag_type type, int count, void *data, int offset)
+/* When the server's byte order is different from ours the data is
+ * converted in a copy so that the caller's buffer is left alone.
+ * 'mask' may be NULL.  The copy is returned in *newdata and has to
+ * be freed by the caller.  The mask copy follows the data in the
+ * same allocation. */
+static int
+_write_format(dax_state *ds, Handle handle, void *data, void *mask, u_int8_t **newdata)
 {
-    int n, pos, result;
-    char *newdata;
-    datatype *dtype = NULL;
-    cdt_member *this = NULL;
-    
-    newdata = (char *)data + offset;
-
-    if(IS_CUSTOM(type)) {
-        /* iterate through the list */
-        dtype = get_cdt_pointer(ds, type, NULL);
-        pos = offset;
-        if(dtype != NULL) {
-            this = dtype->members;
-        } else {
-            return ERR_NOTFOUND;
-        }
-        while(this != NULL) {
-            result = _write_format(ds, this->type, this->count, newdata, pos);
-            if(result) return result;
-            if(IS_CUSTOM(this->type)) {
-                pos += (dax_get_typesize(ds, this->type) * this->count);
-            } else {
-                /* This gets the size in bits */
-                pos += TYPESIZE(this->type) * this->count / 8;
-            }
-            this = this->next;
-        }
-    } else {
-        switch(type) {
-            case DAX_BOOL:
-            case DAX_BYTE:
-            case DAX_SINT:
-                break;
-            case DAX_WORD:
-            case DAX_UINT:
-                for(n = 0; n < count; n++) {
-                    ((dax_uint *)newdata)[n] = mtos_uint(((dax_uint *)newdata)[n]);
-                }
-                break;
-            case DAX_INT:
-                for(n = 0; n < count; n++) {
-                    ((dax_int *)newdata)[n] = mtos_int(((dax_int *)newdata)[n]);
-                }
-                break;
-            case DAX_DWORD:
-            case DAX_UDINT:
-            case DAX_TIME:
-                for(n = 0; n < count; n++) {
-                    ((dax_udint *)newdata)[n] = mtos_udint(((dax_udint *)newdata)[n]);
-                }
-                break;
-            case DAX_DINT:
-                for(n = 0; n < count; n++) {
-                    ((dax_dint *)newdata)[n] = mtos_dint(((dax_dint *)newdata)[n]);
-                }
-                break;
-            case DAX_REAL:
-                for(n = 0; n < count; n++) {
-                    ((dax_real *)newdata)[n] = mtos_real(((dax_real *)newdata)[n]);
-                }
-                break;
-            case DAX_LWORD:
-            case DAX_ULINT:
-                for(n = 0; n < count; n++) {
-                    ((dax_ulint *)newdata)[n] = mtos_ulint(((dax_ulint *)newdata)[n]);
-                }
-                break;
-            case DAX_LINT:
-                for(n = 0; n < count; n++) {
-                    ((dax_lint *)newdata)[n] = mtos_lint(((dax_lint *)newdata)[n]);
-                }
-                break;
-            case DAX_LREAL:
-                for(n = 0; n < count; n++) {
-                    ((dax_lreal *)newdata)[n] = mtos_lreal(((dax_lreal *)newdata)[n]);
-                }
-                break;
-            default:
-                return ERR_ARG;
-                break;
-        }
+    int result;
+
+    *newdata = malloc(mask ? handle.size * 2 : handle.size);
+    if(*newdata == NULL) return ERR_ALLOC;
+    memcpy(*newdata, data, handle.size);
+    if(mask) memcpy(*newdata + handle.size, mask, handle.size);
+    result = mtos_buffer(ds, handle.type, handle.count, *newdata);
+    /* The mask bytes move exactly the same way the data bytes do */
+    if(result == 0 && mask) {
+        result = mtos_buffer(ds, handle.type, handle.count, *newdata + handle.size);
     }
-    return 0;
+    if(result) free(*newdata);
+    return result;
 }
 
-
 int
 dax_write_tag(dax_state *ds, Handle handle, void *data)
 {
-    int i, n, result = 0;
-    u_int8_t *mask, *newdata;
+    int result = 0;
+    u_int8_t *newdata;
     
-    if(handle.type == DAX_BOOL && handle.bit > 0) {
-        mask = malloc(handle.size);
-        if(mask == NULL) return ERR_ALLOC;
-        newdata = malloc(handle.size);
-        if(newdata == NULL) {
-            free(mask);
-            return ERR_ALLOC;
-        }
-        bzero(mask, handle.size);
-        bzero(newdata, handle.size);
-            
-        i = handle.bit % 8;
-        for(n = 0; n < handle.count; n++) {
-            if( (0x01 << (n % 8)) & ((u_int8_t *)data)[n / 8] ) {
-                ((u_int8_t *)newdata)[i / 8] |= (1 << (i % 8));
-            }
-            mask[i / 8] |= (1 << (i % 8));
-            i++;
-        }
-        result = dax_mask(ds, handle.index, handle.byte, newdata, mask, handle.size);
+    /* Partial bytes of BOOLs have to go through the mask so that
+     * we don't overwrite the bits around them */
+    if(handle.type == DAX_BOOL && (handle.bit > 0 || handle.count % 8)) {
+        result = _bool_mask_write(ds, handle, data, NULL);
+    } else if(ds->reformat) {
+        result = _write_format(ds, handle, data, NULL, &newdata);
+        if(result) return result;
+        result = dax_write(ds, handle.index, handle.byte, newdata, handle.size);
         free(newdata);
-        free(mask);
     } else {
-        libdax_lock(ds->lock);
-        result =  _write_format(ds, handle.type, handle.count, data, 0);
-        if(result) {
-            libdax_unlock(ds->lock);
-            return result;
-        }
-        /* Unlock here because dax_write() has it's own locking */
-        libdax_unlock(ds->lock);
         result = dax_write(ds, handle.index, handle.byte, data, handle.size);
     }
     return result;
@@ -512,41 +802,248 @@ dax_write_tag(dax_state *ds, Handle handle, void *data)
 int
 dax_mask_tag(dax_state *ds, Handle handle, void *data, void *mask)
 {
-    int i, n, result = 0;
-    u_int8_t *newmask = NULL, *newdata;
+    int result = 0;
+    u_int8_t *newdata;
 
-    if(handle.type == DAX_BOOL && handle.bit > 0) {
-        newmask = malloc(handle.size);
-        if(newmask == NULL) return ERR_ALLOC;
-        newdata = malloc(handle.size);
-        if(newdata == NULL) {
-            free(newmask);
-            return ERR_ALLOC;
+    if(handle.type == DAX_BOOL && (handle.bit > 0 || handle.count % 8)) {
+        result = _bool_mask_write(ds, handle, data, mask);
+    } else if(ds->reformat) {
+        result = _write_format(ds, handle, data, mask, &newdata);
+        if(result) return result;
+        result = dax_mask(ds, handle.index, handle.byte, newdata,
+                          newdata + handle.size, handle.size);
+        free(newdata);
+    } else {
+        result = dax_mask(ds, handle.index, handle.byte, data, mask, handle.size);
+    }
+    return result;
+}
+
+/* Write Batches
+ *
+ * The writes in a batch are kept as the raw data that will be sent to
+ * the server along with a mask of the bits that have been written.  They
+ * are chained into hash buckets on the tag index so that a second write
+ * to the same place can be found and merged into the last one. */
+
+/* Finds the last entry for 'size' bytes at 'byte' in the tag or adds a
+ * new one with nothing written.  The entries in a bucket are chained
+ * newest first, so if we pass one that overlaps before we find ours the
+ * write can't be merged or it would go out before the overlapping one.
+ * Returns NULL if we run out of memory. */
+static struct batch_entry *
+_batch_entry(dax_batch *b, tag_index idx, int byte, int size)
+{
+    struct batch_entry *e;
+    int n, bucket;
+
+    bucket = (u_int32_t)idx & (BATCH_BUCKETS - 1);
+    for(n = b->buckets[bucket]; n >= 0; n = e->next) {
+        e = &b->entries[n];
+        if(e->idx != idx) continue;
+        if(e->byte == byte && e->size == size) return e;
+        if(e->byte < byte + size && byte < e->byte + e->size) break;
+    }
+    if(b->count == b->size) {
+        n = b->size ? b->size * 2 : 16;
+        e = realloc(b->entries, n * sizeof(struct batch_entry));
+        if(e == NULL) return NULL;
+        b->entries = e;
+        for( ; b->size < n; b->size++) {
+            b->entries[b->size].data = NULL;
+            b->entries[b->size].alloc = 0;
         }
-        bzero(newmask, handle.size);
-        bzero(newdata, handle.size);
+    }
+    e = &b->entries[b->count];
+    /* The data buffers are kept so that a scan that writes the same
+     * tags every time doesn't have to allocate them again */
+    if(e->alloc < size * 2) {
+        free(e->data);
+        e->data = malloc(size * 2);
+        if(e->data == NULL) {
+            e->alloc = 0;
+            return NULL;
+        }
+        e->alloc = size * 2;
+    }
+    bzero(e->data, size * 2);
+    e->idx = idx;
+    e->byte = byte;
+    e->size = size;
+    e->next = b->buckets[bucket];
+    b->buckets[bucket] = b->count++;
+    return e;
+}
 
-        i = handle.bit % 8;
-        for(n = 0; n < handle.count; n++) {
-            if( (0x01 << (n % 8)) & ((u_int8_t *)data)[n / 8] ) {
-                ((u_int8_t *)newdata)[i / 8] |= (1 << (i % 8));
-            }
-            newmask[i / 8] |= (1 << (i % 8));
-            i++;
+static void
+_batch_clear(dax_batch *b)
+{
+    int n;
+
+    b->count = 0;
+    for(n = 0; n < BATCH_BUCKETS; n++) b->buckets[n] = -1;
+}
+
+int
+dax_batch_new(dax_state *ds, dax_batch **b)
+{
+    *b = malloc(sizeof(dax_batch));
+    if(*b == NULL) return ERR_ALLOC;
+    (*b)->entries = NULL;
+    (*b)->size = 0;
+    _batch_clear(*b);
+    return 0;
+}
+
+void
+dax_batch_free(dax_batch *b)
+{
+    int n;
+
+    if(b == NULL) return;
+    for(n = 0; n < b->size; n++) {
+        free(b->entries[n].data);
+    }
+    free(b->entries);
+    free(b);
+}
+
+/* Returns the number of writes that are waiting to be flushed */
+int
+dax_batch_count(dax_batch *b)
+{
+    return b->count;
+}
+
+/* Adds the data to the batch.  Only the bits that are set in 'mask' are
+ * written.  If 'mask' is NULL then all of the data is written.  If this
+ * handle has already been written the new bits go on top of the old. */
+int
+dax_batch_mask(dax_state *ds, dax_batch *b, Handle h, void *data, void *mask)
+{
+    struct batch_entry *e;
+    u_int8_t scratch[BIT_SCRATCH_SIZE * 2];
+    u_int8_t *newdata, *newmask, *d, *m;
+    int n, result = 0, bits;
+
+    e = _batch_entry(b, h.index, h.byte, h.size);
+    if(e == NULL) return ERR_ALLOC;
+    d = e->data;
+    m = e->data + e->size;
+    bits = (h.type == DAX_BOOL && (h.bit > 0 || h.count % 8));
+
+    /* A whole write just replaces whatever was there */
+    if(mask == NULL && !bits) {
+        memcpy(d, data, h.size);
+        memset(m, 0xFF, h.size);
+        if(ds->reformat) {
+            return mtos_buffer(ds, h.type, h.count, d);
         }
-        result = dax_mask(ds, handle.index, handle.byte, newdata, newmask, handle.size);
-        free(newmask);
-        free(newdata);
+        return 0;
+    }
+
+    if(h.size <= BIT_SCRATCH_SIZE) {
+        newdata = scratch;
     } else {
-        libdax_lock(ds->lock);
-        result =  _write_format(ds, handle.type, handle.count, data, 0);
-        if(result) {
-            libdax_unlock(ds->lock);
-            return result;
+        newdata = malloc(h.size * 2);
+        if(newdata == NULL) return ERR_ALLOC;
+    }
+    newmask = newdata + h.size;
+    if(bits) {
+        bzero(newdata, h.size * 2);
+        _bits_insert(newdata, newmask, h.size, data, mask, h.bit, h.count);
+    } else {
+        memcpy(newdata, data, h.size);
+        memcpy(newmask, mask, h.size);
+        if(ds->reformat) {
+            /* The mask bytes move exactly the same way the data bytes do */
+            result = mtos_buffer(ds, h.type, h.count, newdata);
+            if(result == 0) result = mtos_buffer(ds, h.type, h.count, newmask);
         }
-        /* Unlock here because dax_mask() has it's own locking */
-        libdax_unlock(ds->lock);
-        result = dax_mask(ds, handle.index, handle.byte, data, mask, handle.size);
     }
+    if(result == 0) {
+        for(n = 0; n < h.size; n++) {
+            d[n] = (d[n] & ~newmask[n]) | (newdata[n] & newmask[n]);
+            m[n] |= newmask[n];
+        }
+    }
+    if(newdata != scratch) free(newdata);
     return result;
 }
+
+int
+dax_batch_write(dax_state *ds, dax_batch *b, Handle h, void *data)
+{
+    return dax_batch_mask(ds, b, h, data, NULL);
+}
+
+/* Returns non zero if any of the bits in the entry haven't been written */
+static inline int
+_batch_masked(struct batch_entry *e)
+{
+    u_int8_t *m = e->data + e->size;
+    int n;
+
+    for(n = 0; n < e->size; n++) {
+        if(m[n] != 0xFF) return 1;
+    }
+    return 0;
+}
+
+/* Sends all of the writes in the batch to the server.  Entries that are
+ * too big for a single message are split.  The batch is emptied if
+ * everything was written.  If there is an error the writes are left in
+ * the batch so that they can be flushed again, but some of them may
+ * have been written already. */
+int
+dax_batch_flush(dax_state *ds, dax_batch *b)
+{
+    struct batch_entry *e;
+    u_int8_t *buff;
+    u_int32_t temp;
+    int n, offset, chunk, max, masked, len, total, result;
+
+    if(b->count == 0) return 0;
+    /* Figure out how big the buffer has to be */
+    total = 0;
+    for(n = 0; n < b->count; n++) {
+        e = &b->entries[n];
+        masked = _batch_masked(e);
+        max = (MSG_DATA_SIZE - 12) / (masked ? 2 : 1);
+        total += e->size * (masked ? 2 : 1) + 12 * ((e->size - 1) / max + 1);
+    }
+    buff = malloc(total);
+    if(buff == NULL) return ERR_ALLOC;
+
+    len = 0;
+    for(n = 0; n < b->count; n++) {
+        e = &b->entries[n];
+        masked = _batch_masked(e);
+        max = (MSG_DATA_SIZE - 12) / (masked ? 2 : 1);
+        for(offset = 0; offset < e->size; offset += chunk) {
+            chunk = e->size - offset;
+            if(chunk > max) chunk = max;
+            temp = mtos_dint(ds, e->idx);
+            memcpy(&buff[len], &temp, 4);
+            temp = mtos_dint(ds, e->byte + offset);
+            memcpy(&buff[len + 4], &temp, 4);
+            temp = mtos_udint(ds, chunk | (masked ? MULTI_MASK : 0));
+            memcpy(&buff[len + 8], &temp, 4);
+            memcpy(&buff[len + 12], e->data + offset, chunk);
+            len += 12 + chunk;
+            if(masked) {
+                memcpy(&buff[len], e->data + e->size + offset, chunk);
+                len += chunk;
+            }
+        }
+    }
+    result = tag_multi_write(ds, buff, len);
+    free(buff);
+    if(result) return result;
+    for(n = 0; n < b->count; n++) {
+        e = &b->entries[n];
+        data_cache_invalidate(ds, e->idx, e->byte, e->size);
+    }
+    _batch_clear(b);
+    return 0;
+}
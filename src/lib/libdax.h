@@ -26,6 +26,8 @@
 #include <common.h>
 #include <opendax.h>
 #include <libcommon.h>
+#include <ioring.h>
+#include <sys/time.h>
 
 
 /* Compiler Options */
@@ -45,16 +47,43 @@ typedef struct OptAttr {
     struct OptAttr *next;
 } optattr;
 
-/* This is the structure for our tag cache */
+/* This is the structure for our tag cache.  The nodes are kept in
+ * an array and each node is chained into two hash tables, one keyed
+ * on the name and one on the index. */
 typedef struct Tag_Cnode {
     tag_index idx;
     unsigned int type;
     unsigned int count;
-    struct Tag_Cnode *next;
-    struct Tag_Cnode *prev;
+    unsigned char used;     /* Node holds a valid tag */
+    unsigned char ref;      /* Reference bit for CLOCK eviction */
+    struct Tag_Cnode *name_next;
+    struct Tag_Cnode *idx_next;
     char name[DAX_TAGNAME_SIZE + 1];
 } tag_cnode;
 
+/* Node for the data cache.  One of these is kept for each handle that
+ * was passed to dax_cache_add().  'seq' is bumped every time the value
+ * is thrown away so that a read that was in flight when the value
+ * changed doesn't put the old value back. */
+typedef struct Data_Cnode {
+    tag_index idx;
+    int byte;
+    int size;
+    unsigned char bit;
+    unsigned char valid;    /* data holds the value from the server */
+    unsigned int seq;
+    struct timeval stamp;   /* When data was read */
+    dax_event_id event;     /* CHANGE event that keeps us up to date */
+    struct dax_state *ds;
+    u_int8_t *data;         /* 'size' bytes, just as the server sent them */
+    struct Data_Cnode *next;
+} data_cnode;
+
+/* Number of hash buckets for the data cache.  Must be a power of two */
+#ifndef DATA_CACHE_BUCKETS
+#  define DATA_CACHE_BUCKETS 32
+#endif
+
 /* This is the compound datatype member definition.  The 
  * members are represented as a linked list */
 struct cdt_member {
@@ -71,6 +100,8 @@ typedef struct cdt_member cdt_member;
 struct datatype{
     char *name;
     cdt_member *members;
+    dax_cdt_op *ops;        /* Flattened conversion plan, built when needed */
+    int op_count;
 };
 
 typedef struct datatype datatype;
@@ -87,19 +118,100 @@ typedef int dax_lock;
 #endif
 
 inline int libdax_lock(dax_lock *lock);
+inline int libdax_trylock(dax_lock *lock);
 inline int libdax_unlock(dax_lock *lock);
 inline int libdax_init_lock(dax_lock *lock);
 inline int libdax_destroy_lock(dax_lock *lock);
 
-/* Right now the event_db is stored within the dax_state as an array. */
+/* One synchronous connection to the server.  The first one is opened
+ * by dax_connect() and the rest are opened as they are needed when
+ * more than one thread is talking to the server at the same time.
+ * Each one has it's own lock so that the requests on different
+ * connections don't wait for each other. */
+typedef struct dax_conn {
+    int fd;                 /* Socket, -1 if it couldn't be opened */
+    dax_lock lock;          /* Held for the whole request / response */
+#ifdef HAVE_LINUX_IO_URING_H
+    ioring *ring;           /* Only used if the "transport" is "uring" */
+    int ring_failed;        /* Set if the ring couldn't be set up */
+#endif
+} dax_conn;
+
+/* Datatype arrays that have been replaced by a bigger one.  They are
+ * kept until dax_free() so that another thread that is still looking
+ * at the old array doesn't read freed memory. */
+struct dt_retired {
+    datatype *datatypes;
+    struct dt_retired *next;
+};
+
+/* The prepared tag.  The data and mask buffers are h.size bytes
+ * long.  The handle is good as long as 'generation' matches the one in
+ * the dax_state. */
+struct dax_prepared {
+    char *name;             /* Tag string that was passed to dax_tag_prepare() */
+    int count;              /* Count that was passed to dax_tag_prepare() */
+    Handle h;
+    unsigned int generation;
+    void *data;
+    void *mask;
+};
+
+/* One write in a dax_batch.  The data is kept in the server's format
+ * and is followed by the mask in the same allocation. */
+struct batch_entry {
+    tag_index idx;
+    int byte;
+    int size;
+    int next;               /* Next entry in the same bucket, -1 for none */
+    int alloc;              /* Bytes allocated for data, kept between flushes */
+    u_int8_t *data;
+};
+
+/* Number of hash buckets in a dax_batch.  Must be a power of two */
+#ifndef BATCH_BUCKETS
+#  define BATCH_BUCKETS 64
+#endif
+
+/* The entries are kept in the order that they were written so that
+ * overlapping writes end up on the server in the same order.  A write is
+ * only merged into an earlier one to the same place if nothing that
+ * overlaps it has been written since. */
+struct dax_batch {
+    struct batch_entry *entries;
+    int count;              /* Number of entries in use */
+    int size;               /* Number of entries allocated */
+    int buckets[BATCH_BUCKETS]; /* Index of the first entry, -1 for none */
+};
+
+/* The event_db is stored within the dax_state as a hash table that is
+ * keyed on the tag index and the event id.  Collisions are chained. */
 typedef struct event_db {
     u_int32_t idx;  /* Tag index of the event */
     u_int32_t id;   /* Individual id of the event */
+    u_int32_t sid;  /* Id the server uses, changes when we reconnect */
+    u_int8_t *def;  /* MSG_EVNT_ADD data used to add the event again */
+    int defsize;
     void *udata;    /* The user data to be sent with callback() */
     void (*callback)(void *udata);  /* Callback function */
     void (*free_callback)(void *udata); /* Callback to free userdata */
+    void (*pattern_callback)(tag_index idx, void *udata); /* Pattern subscriptions */
+    int dispatching; /* Number of callbacks running on this event right now */
+    int deleted;     /* Removed from the table while a callback was running */
+    struct event_db *next;
 } event_db;
 
+/* Starting number of buckets in the event hash table.  Must be a power of two */
+#ifndef EVENT_HASH_SIZE
+#  define EVENT_HASH_SIZE 16
+#endif
+
+/* Number of event messages that we'll try to read from the socket at once */
+#ifndef EVENT_BUFF_COUNT
+#  define EVENT_BUFF_COUNT 64
+#endif
+#define EVENT_BUFF_SIZE (EVENT_MSGSIZE * EVENT_BUFF_COUNT)
+
 /* This is the main dax_state structure that holds all the information
    for one dax server connection */
 struct dax_state {
@@ -107,22 +219,43 @@ struct dax_state {
     lua_State *L;
     char* modulename;
     int msgtimeout;
+    int uring;  /* Send the requests through io_uring */
     int id;     /* ID uniquely identifies the module to the server */
-    int sfd;   /* Server's File Descriptor */
+    int sfd;   /* Server's File Descriptor, the same as conns[0].fd */
     int afd;   /* Asynchronous File Descriptor */
+    int lost;  /* Set when a socket fails, cleared when we reconnect */
+    u_int32_t server_id;   /* Changes every time the server is started */
+    int backoff;           /* mSec to wait before the next reconnect attempt */
+    struct timeval retry;  /* Time of the next reconnect attempt */
+    void (*reconnect)(dax_state *ds, int restarted);
     unsigned int reformat; /* Flags to show how to reformat the incoming data */
     int logflags;
-    tag_cnode *cache_head; /* First node in the cache list */
+    tag_cnode *cache;      /* Array of cache_limit nodes */
+    tag_cnode **cache_name; /* Hash buckets keyed on the tag name */
+    tag_cnode **cache_idx; /* Hash buckets keyed on the tag index */
+    unsigned int cache_mask; /* Number of buckets - 1 */
     int cache_limit;       /* Total number of nodes that we'll allocate */
-    int cache_count;       /* How many nodes we actually have */
+    int cache_count;       /* How many nodes are holding tags */
+    int cache_fill;        /* How many nodes have been used at least once */
+    int cache_hand;        /* Position of the CLOCK hand */
+    unsigned int generation; /* Changes whenever a tag definition may have changed */
+    data_cnode **dcache;   /* Data cache buckets keyed on the tag index */
+    unsigned int dcache_age; /* Oldest value we'll use in mSec, 0 for no limit */
+    dax_cache_stats dcache_stats;
     datatype *datatypes;
     unsigned int datatype_size;
-    dax_lock *lock;
-    event_db *events;      /* Array of events stored for this connection */
-    int event_size;        /* Current size of the events array */
-    int event_count;       /* Total number of events stored in the array */
-    u_int8_t ebuff[EVENT_MSGSIZE]; /* Temporary buffer for event reception */
-    u_int8_t eindex;       /* Current index into the ebuff */
+    struct dt_retired *retired; /* Old datatype arrays */
+    dax_conn *conns;       /* Array of conn_limit synchronous connections */
+    int conn_count;        /* How many of them have been opened */
+    int conn_limit;
+    int conn_opening;      /* Pooled connections that are being opened */
+    unsigned int conn_next; /* Where the next waiting thread will queue */
+    dax_lock *lock;        /* Protects the caches, the event table and conn_count */
+    event_db **events;     /* Hash table of events stored for this connection */
+    int event_size;        /* Number of buckets in the events hash table */
+    int event_count;       /* Total number of events stored in the table */
+    u_int8_t ebuff[EVENT_BUFF_SIZE]; /* Buffer for event reception */
+    int eindex;            /* Current index into the ebuff */
     void (*dax_debug)(const char *output);
     void (*dax_error)(const char *output);
     void (*dax_log)(const char *output);
@@ -132,6 +265,10 @@ struct dax_state {
 #define MAX_TIMEOUT      30000
 #define DEFAULT_TIMEOUT  "1000"
 
+/* The first reconnect attempt is made right away and the time between
+ * them doubles from MIN_BACKOFF up to the 'reconnect' attribute */
+#define MIN_BACKOFF      100
+
 /* Data Conversion Functions */
 #define REF_INT_SWAP 0x0001
 #define REF_FLT_SWAP 0x0002
@@ -140,41 +277,45 @@ struct dax_state {
 #define mtos_word mtos_uint
 #define stom_word stom_uint
 
-dax_int mtos_int(dax_int);
-dax_uint mtos_uint(dax_uint);
+dax_int mtos_int(dax_state *ds, dax_int);
+dax_uint mtos_uint(dax_state *ds, dax_uint);
 
-dax_int stom_int(dax_int);
-dax_uint stom_uint(dax_uint);
+dax_int stom_int(dax_state *ds, dax_int);
+dax_uint stom_uint(dax_state *ds, dax_uint);
 
 /* 32 Bit conversion functions */
-#define mtos_dword mtos_uint
-#define stom_dword stom_uint
-#define mtos_time mtos_uint
-#define stom_time stom_uint
+#define mtos_dword mtos_udint
+#define stom_dword stom_udint
+#define mtos_time mtos_udint
+#define stom_time stom_udint
 
-dax_dint mtos_dint(dax_dint);
-dax_udint mtos_udint(dax_udint);
-dax_real mtos_real(dax_real);
+dax_dint mtos_dint(dax_state *ds, dax_dint);
+dax_udint mtos_udint(dax_state *ds, dax_udint);
+dax_real mtos_real(dax_state *ds, dax_real);
 
-dax_dint stom_dint(dax_dint);
-dax_udint stom_udint(dax_udint);
-dax_real stom_real(dax_real);
+dax_dint stom_dint(dax_state *ds, dax_dint);
+dax_udint stom_udint(dax_state *ds, dax_udint);
+dax_real stom_real(dax_state *ds, dax_real);
 
 /* 64 bit Conversions */
 #define mtos_lword mtos_ulint
 #define stom_lword stom_ulint
 
-dax_lint mtos_lint(dax_lint);
-dax_ulint mtos_ulint(dax_ulint);
-dax_lreal mtos_lreal(dax_lreal);
+dax_lint mtos_lint(dax_state *ds, dax_lint);
+dax_ulint mtos_ulint(dax_state *ds, dax_ulint);
+dax_lreal mtos_lreal(dax_state *ds, dax_lreal);
 
-dax_lint stom_lint(dax_lint);
-dax_ulint stom_ulint(dax_ulint);
-dax_lreal stom_lreal(dax_lreal);
+dax_lint stom_lint(dax_state *ds, dax_lint);
+dax_ulint stom_ulint(dax_state *ds, dax_ulint);
+dax_lreal stom_lreal(dax_state *ds, dax_lreal);
 
 /* Generic Conversion Functions */
-int mtos_generic(tag_type type, void *dst, void *src);
-int stom_generic(tag_type type, void *dst, void *src);
+int mtos_generic(dax_state *ds, tag_type type, void *dst, void *src);
+int stom_generic(dax_state *ds, tag_type type, void *dst, void *src);
+
+/* Whole buffer conversions, done in place */
+int mtos_buffer(dax_state *ds, tag_type type, int count, void *data);
+int stom_buffer(dax_state *ds, tag_type type, int count, void *data);
 
 /* These functions handle the tag cache */
 int init_tag_cache(dax_state *ds);
@@ -182,16 +323,38 @@ int check_cache_index(dax_state *, tag_index, dax_tag *);
 int check_cache_name(dax_state *, char *, dax_tag *);
 int cache_tag_add(dax_state *, dax_tag *);
 int cache_tag_del(dax_state *, char *);
+int cache_tag_invalidate(dax_state *, tag_index);
+int cache_subscribe(dax_state *);
+void free_tag_cache(dax_state *);
+
+/* These functions handle the data cache */
+int data_cache_read(dax_state *, Handle *, void *, unsigned int *);
+void data_cache_fill(dax_state *, Handle *, void *, unsigned int);
+void data_cache_invalidate(dax_state *, tag_index, int, int);
+void data_cache_drop(dax_state *, tag_index);
+void data_cache_clear(dax_state *);
+void free_data_cache(dax_state *);
+
+int tag_multi_write(dax_state *, u_int8_t *, int);
 
 int opt_get_msgtimeout(dax_state *);
+void free_conns(dax_state *);
+int check_connection(dax_state *, int);
 
 datatype *get_cdt_pointer(dax_state *, tag_type, int *);
 int add_cdt_to_cache(dax_state *, tag_type type, char *typedesc);
+void free_datatypes(dax_state *);
 int dax_cdt_get(dax_state *ds, tag_type type, char *name);
 
 int add_event(dax_state *ds, dax_event_id id, void *udata, void (*callback)(void *udata),
               void (*free_callback)(void *));
+int add_pattern_event(dax_state *ds, dax_event_id id, void *udata,
+                      void (*callback)(tag_index idx, void *udata),
+                      void (*free_callback)(void *));
 int del_event(dax_state *ds, dax_event_id id);
-int exec_event(dax_state *ds, dax_event_id id);
+int set_event_def(dax_state *ds, dax_event_id id, void *def, int size);
+u_int32_t event_server_id(dax_state *ds, dax_event_id id);
+int event_rehash(dax_state *ds);
+void free_events(dax_state *ds);
 
 #endif /* !__LIBDAX_H */
@@ -21,6 +21,8 @@
 
 #include <libdax.h>
 #include <common.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
 
 /* This function returns the proper event type that matches the string.
  * Returns 0 for error */
@@ -42,6 +44,18 @@ dax_event_string_to_type(char *string) {
         return EVENT_LESS;
     } else if(!strcasecmp(string, "DEADBAND")) {
         return EVENT_DEADBAND;
+    } else if(!strcasecmp(string, "TAG_ADDED")) {
+        return EVENT_TAG_ADDED;
+    } else if(!strcasecmp(string, "TAG_DELETED")) {
+        return EVENT_TAG_DELETED;
+    } else if(!strcasecmp(string, "CDT_CREATED")) {
+        return EVENT_CDT_CREATED;
+    } else if(!strcasecmp(string, "RISE")) {
+        return EVENT_RISE;
+    } else if(!strcasecmp(string, "FALL")) {
+        return EVENT_FALL;
+    } else if(!strcasecmp(string, "COMPOUND")) {
+        return EVENT_COMPOUND;
     } else {
         return 0;
     }
@@ -67,61 +81,247 @@ dax_event_type_to_string(int type) {
             return "LESS";
         case EVENT_DEADBAND:
             return "DEADBAND";
+        case EVENT_TAG_ADDED:
+            return "TAG_ADDED";
+        case EVENT_TAG_DELETED:
+            return "TAG_DELETED";
+        case EVENT_CDT_CREATED:
+            return "CDT_CREATED";
+        case EVENT_RISE:
+            return "RISE";
+        case EVENT_FALL:
+            return "FALL";
+        case EVENT_COMPOUND:
+            return "COMPOUND";
         default:
             return NULL;
     }
 }
 
+/* Returns the bucket in the event hash table for the given tag index
+ * and event id.  ds->event_size is always a power of two.  The table is
+ * keyed on the id that the server uses for the event, which is only
+ * different from the id that we gave to the module after we have
+ * reconnected to the server. */
+static inline int
+_event_hash(dax_state *ds, u_int32_t idx, u_int32_t id)
+{
+    return (idx * 31 + id) & (ds->event_size - 1);
+}
+
+static event_db *
+_find_event(dax_state *ds, u_int32_t idx, u_int32_t id)
+{
+    event_db *this;
+
+    this = ds->events[_event_hash(ds, idx, id)];
+    while(this != NULL) {
+        if(this->idx == idx && this->sid == id) {
+            return this;
+        }
+        this = this->next;
+    }
+    return NULL;
+}
+
+/* Finds the event by the id that the module knows it by.  Returns a
+ * pointer to the link that points to the event so that it can be
+ * removed, or NULL if it isn't there. */
+static event_db **
+_find_module_event(dax_state *ds, u_int32_t idx, u_int32_t id)
+{
+    event_db **last;
+    int n;
+
+    /* Unless we have reconnected it's in the bucket for this id */
+    last = &ds->events[_event_hash(ds, idx, id)];
+    while(*last != NULL) {
+        if((*last)->idx == idx && (*last)->id == id) return last;
+        last = &(*last)->next;
+    }
+    for(n = 0; n < ds->event_size; n++) {
+        last = &ds->events[n];
+        while(*last != NULL) {
+            if((*last)->idx == idx && (*last)->id == id) return last;
+            last = &(*last)->next;
+        }
+    }
+    return NULL;
+}
+
+/* Moves all of the events in the table into a new table with 'size'
+ * buckets.  This is used to grow the table and to put the events back
+ * into the right buckets after the server has given them new ids. */
+static int
+_rehash_event_table(dax_state *ds, int size)
+{
+    event_db **old, *this, *next;
+    int oldsize, n, bucket;
+
+    old = ds->events;
+    oldsize = ds->event_size;
+    ds->events = calloc(size, sizeof(event_db *));
+    if(ds->events == NULL) {
+        ds->events = old;
+        return ERR_ALLOC;
+    }
+    ds->event_size = size;
+    for(n = 0; n < oldsize; n++) {
+        this = old[n];
+        while(this != NULL) {
+            next = this->next;
+            bucket = _event_hash(ds, this->idx, this->sid);
+            this->next = ds->events[bucket];
+            ds->events[bucket] = this;
+            this = next;
+        }
+    }
+    free(old);
+    return 0;
+}
+
+/* Should be called after the server ids of any of the events have
+ * been changed. */
+int
+event_rehash(dax_state *ds)
+{
+    return _rehash_event_table(ds, ds->event_size);
+}
+
 int
 add_event(dax_state *ds, dax_event_id id, void *udata, void (*callback)(void *udata),
           void (*free_callback)(void *udata))
 {
-    event_db *new_db;
+    event_db *new;
+    int bucket;
 
-    /* TODO: Should find holes in the array from previous deletions and add new ones there. */
-    
-    /* check to see if we need to grow the database */
-    if(ds->event_count == ds->event_size) {
-        /* For now we just double the size */
-        new_db = realloc(ds->events, (ds->event_size * 2) * sizeof(event_db));
-        if(new_db != NULL) {
-            ds->events = new_db;
-            ds->event_size *= 2;
-        } else {
-            return ERR_ALLOC;
-        }
+    /* Keep the chains short by growing the table when it gets full */
+    if(ds->event_count >= ds->event_size) {
+        /* If this fails we can still add the event to the smaller table */
+        _rehash_event_table(ds, ds->event_size * 2);
     }
-    /* For now we are just putting these in unsorted and the search
-     * routine in the dispatch function will be a simple linear search */
-    /* TODO: Sort this array and add binary search to event_dispatch() */
-    ds->events[ds->event_count].idx = id.index;
-    ds->events[ds->event_count].id = id.id;
-    ds->events[ds->event_count].udata = udata;
-    ds->events[ds->event_count].callback = callback;
-    ds->events[ds->event_count].free_callback = free_callback;
-        
+    new = malloc(sizeof(event_db));
+    if(new == NULL) {
+        return ERR_ALLOC;
+    }
+    new->idx = id.index;
+    new->id = id.id;
+    new->sid = id.id;
+    new->def = NULL;
+    new->defsize = 0;
+    new->udata = udata;
+    new->callback = callback;
+    new->free_callback = free_callback;
+    new->pattern_callback = NULL;
+    new->dispatching = 0;
+    new->deleted = 0;
+
+    bucket = _event_hash(ds, id.index, id.id);
+    new->next = ds->events[bucket];
+    ds->events[bucket] = new;
     ds->event_count++;
     return 0;
 }
 
+/* Adds a pattern subscription to the table.  These are stored with the
+ * index set to EVENT_PATTERN_INDEX and the callback is passed the index
+ * of the tag that caused the event. */
+int
+add_pattern_event(dax_state *ds, dax_event_id id, void *udata,
+                  void (*callback)(tag_index idx, void *udata),
+                  void (*free_callback)(void *udata))
+{
+    int result;
+
+    id.index = EVENT_PATTERN_INDEX;
+    result = add_event(ds, id, udata, NULL, free_callback);
+    if(result) return result;
+    _find_event(ds, id.index, id.id)->pattern_callback = callback;
+    return 0;
+}
+
+static void
+_free_event_db(event_db *this)
+{
+    if(this->free_callback) {
+        this->free_callback(this->udata);
+    }
+    free(this->def);
+    free(this);
+}
+
 /* Finds the event in the list and removes it.  It also calls the free_callback()
- * function if it is assigned */
+ * function if it is assigned.  If the event's callback is running in another
+ * thread the event is only taken out of the table here and the dispatcher
+ * frees it when the callback returns. */
 int
 del_event(dax_state *ds, dax_event_id id)
 {
+    event_db *this, **last;
+
+    last = _find_module_event(ds, id.index, id.id);
+    if(last == NULL) return ERR_NOTFOUND;
+    this = *last;
+    *last = this->next;
+    ds->event_count--;
+    if(this->dispatching) {
+        this->deleted = 1;
+    } else {
+        _free_event_db(this);
+    }
+    return 0;
+}
+
+/* Keeps a copy of the MSG_EVNT_ADD data that was used to add the event
+ * so that the event can be added again if we have to reconnect to the
+ * server. */
+int
+set_event_def(dax_state *ds, dax_event_id id, void *def, int size)
+{
+    event_db **last;
+
+    last = _find_module_event(ds, id.index, id.id);
+    if(last == NULL) return ERR_NOTFOUND;
+    free((*last)->def);
+    (*last)->def = malloc(size);
+    if((*last)->def == NULL) {
+        (*last)->defsize = 0;
+        return ERR_ALLOC;
+    }
+    memcpy((*last)->def, def, size);
+    (*last)->defsize = size;
+    return 0;
+}
+
+/* Returns the id that the server knows the event by */
+u_int32_t
+event_server_id(dax_state *ds, dax_event_id id)
+{
+    event_db **last;
+
+    last = _find_module_event(ds, id.index, id.id);
+    if(last == NULL) return id.id;
+    return (*last)->sid;
+}
+
+/* Removes every event from the table and calls the free_callback()
+ * for each one that has it assigned.  The table itself is not freed. */
+void
+free_events(dax_state *ds)
+{
+    event_db *this, *next;
     int n;
 
-    for(n = 0; n < ds->event_count; n++) {
-        if(ds->events[n].idx == id.index && ds->events[n].id == id.id) {
-            memmove(&ds->events[n], &ds->events[n+1], sizeof(event_db) * (ds->event_count - n-1));
-            if(ds->events[n].free_callback) {
-                ds->events[n].free_callback(ds->events[n].udata);
-            }
-            ds->event_count--;
-            return 0;
+    for(n = 0; n < ds->event_size; n++) {
+        this = ds->events[n];
+        while(this != NULL) {
+            next = this->next;
+            _free_event_db(this);
+            this = next;
         }
+        ds->events[n] = NULL;
     }
-    return ERR_NOTFOUND;
+    ds->event_count = 0;
 }
 
 
@@ -137,6 +337,10 @@ dax_event_wait(dax_state *ds, int timeout, dax_event_id *id)
     fd_set fds;
     int done = 0;
     
+    if(ds->lost) {
+        result = check_connection(ds, timeout ? timeout : MAX_TIMEOUT);
+        if(result) return result;
+    }
     while(!done) {
         FD_ZERO(&fds);
         FD_SET(ds->afd, &fds);
@@ -150,6 +354,8 @@ dax_event_wait(dax_state *ds, int timeout, dax_event_id *id)
         if(result > 0) {
             result = dax_event_dispatch(ds, id);
             if(result == 0) done = 1;
+            /* Anything other than a partial message is a real problem */
+            else if(result != ERR_NOTFOUND) return result;
         } else if (result < 0) {
             return result;
         } else {
@@ -170,6 +376,10 @@ dax_event_poll(dax_state *ds, dax_event_id *id)
     struct timeval tval;
     fd_set fds;
     
+    if(ds->lost) {
+        result = check_connection(ds, 0);
+        if(result) return result;
+    }
     FD_ZERO(&fds);
     FD_SET(ds->afd, &fds);
     tval.tv_sec = 0;
@@ -188,66 +398,168 @@ dax_event_poll(dax_state *ds, dax_event_id *id)
 /* This function will return the asynchronous event handling file
  * descriptor to the module.  This is used if the module wants to handle
  * it's own file descriptor management.  Handy for event driven programs
- * that need to select() on multiple file descriptors */
+ * that need to select() on multiple file descriptors.  The library never
+ * blocks reading this descriptor so it can also be added to an epoll()
+ * set, even edge triggered, as long as dax_event_dispatch_batch() is
+ * called each time it becomes readable. */
 int
 dax_event_get_fd(dax_state *ds)
 {
     return ds->afd;
 }
 
-/* This calls the read() system call to get the event that SHOULD be pending
- * on the ds->afd file descriptor, then it calls the event callback if it
- * is necessary and returns the id through the pointer.  This is used from
- * both the dax_event_select() and dax_event_poll() library function calls and
+/* Event messages may not be aligned in the buffer so we can't just
+ * cast the pointer to a u_int32_t */
+static inline u_int32_t
+_get_u32(u_int8_t *buff)
+{
+    u_int32_t temp;
+
+    memcpy(&temp, buff, 4);
+    return ntohl(temp);
+}
+
+/* Decodes the single event message that starts at buff and calls the
+ * callback for that event.  Returns 0 on success */
+static int
+_dispatch_message(dax_state *ds, u_int8_t *buff, dax_event_id *id)
+{
+    u_int32_t idx, eid;
+    event_db *event;
+    void *udata;
+    void (*callback)(void *udata) = NULL;
+    void (*pattern_callback)(tag_index idx, void *udata) = NULL;
+
+    /* The rest of the message (etype, byte, count, datatype and bit)
+     * isn't used by the callbacks yet. */
+    idx = _get_u32(&buff[4]);
+    eid = _get_u32(&buff[8]);
+
+    /* Other threads may be adding or deleting events so we only hold
+     * the lock long enough to copy what we need out of the table.  The
+     * callback is run without it so that it can call the library.  The
+     * event is marked as dispatching so that a del_event() while the
+     * callback is running leaves the user data alone until we're done. */
+    libdax_lock(ds->lock);
+    if(eid & EVENT_PATTERN_FLAG) {
+        /* Pattern subscriptions are stored by the pattern id alone */
+        eid &= ~EVENT_PATTERN_FLAG;
+        event = _find_event(ds, EVENT_PATTERN_INDEX, eid);
+    } else if(eid & EVENT_COMPOUND_FLAG) {
+        eid &= ~EVENT_COMPOUND_FLAG;
+        event = _find_event(ds, EVENT_COMPOUND_INDEX, eid);
+    } else {
+        event = _find_event(ds, idx, eid);
+    }
+    if(event == NULL) {
+        libdax_unlock(ds->lock);
+        dax_error(ds, "dax_event_dispatch() recieved an event that does not exist in database");
+        return ERR_GENERIC;
+    }
+    udata = event->udata;
+    pattern_callback = event->pattern_callback;
+    callback = event->callback;
+    eid = event->id;
+    event->dispatching++;
+    libdax_unlock(ds->lock);
+    if(pattern_callback != NULL) {
+        pattern_callback(idx, udata);
+    } else if(callback != NULL) {
+        callback(udata);
+    }
+    libdax_lock(ds->lock);
+    event->dispatching--;
+    if(event->dispatching == 0 && event->deleted) {
+        _free_event_db(event);
+    }
+    libdax_unlock(ds->lock);
+    if(id != NULL) {
+        id->id = eid;
+        id->index = idx;
+    }
+    return 0;
+}
+
+/* Reads as much as the socket will give us without blocking into the
+ * event buffer and then dispatches every complete message that is in
+ * it.  Any partial message at the end is moved to the front of the
+ * buffer to be finished on the next read.  The id of the last event
+ * is returned in *id and the number of bytes that were read in *got,
+ * which is zero once the socket is empty.  Returns the number of events
+ * that were dispatched, or an error code. */
+static int
+_read_events(dax_state *ds, dax_event_id *id, int *got)
+{
+    int result, offset, count = 0;
+
+    *got = 0;
+    do {
+        result = recv(ds->afd, &ds->ebuff[ds->eindex], EVENT_BUFF_SIZE - ds->eindex, MSG_DONTWAIT);
+    } while(result < 0 && errno == EINTR);
+    if(result < 0) {
+        if(errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+        dax_error(ds, "dax_event_dispatch() - %s", strerror(errno));
+        return ERR_MSG_RECV;
+    } else if(result == 0) {
+        /* The server went away.  The next call will try to reconnect */
+        dax_error(ds, "dax_event_dispatch() - Lost connection to the server");
+        ds->lost = 1;
+        return ERR_NO_SOCKET;
+    }
+    *got = result;
+    ds->eindex += result;
+    for(offset = 0; offset + EVENT_MSGSIZE <= ds->eindex; offset += EVENT_MSGSIZE) {
+        if(_dispatch_message(ds, &ds->ebuff[offset], id) == 0) {
+            count++;
+        }
+    }
+    ds->eindex -= offset;
+    if(ds->eindex > 0 && offset > 0) {
+        memmove(ds->ebuff, &ds->ebuff[offset], ds->eindex);
+    }
+    return count;
+}
+
+/* This reads the event(s) that SHOULD be pending on the ds->afd file
+ * descriptor, then it calls the event callbacks if necessary and returns the
+ * id of the last event through the pointer.  This is used from
+ * both the dax_event_wait() and dax_event_poll() library function calls and
  * can be called from modules that choose to take care of dealing with the
  * file descriptor themselves.  It returns 0 if it was able to dispatch
- * the event, ERR_NOTFOUND if it only received a partial event message from
- * the server and other errors if necessary. */
+ * at least one event, ERR_NOTFOUND if it only received a partial event
+ * message from the server and other errors if necessary. */
 int
 dax_event_dispatch(dax_state *ds, dax_event_id *id)
 {
-    int result, n;
-    u_int32_t etype, idx, eid, byte, count, datatype;
-    u_int8_t bit;
-    
-//    fprintf(stderr, "dax_event_dispatch() called\n");
-    result = read(ds->afd, &(ds->ebuff[ds->eindex]), EVENT_MSGSIZE - ds->eindex);
-    ds->eindex += result;
-//    fprintf(stderr, "ds->eindex = %d\n", ds->eindex);
-    if(ds->eindex == EVENT_MSGSIZE) { /* We have a full message now */
-//        fprintf(stderr, "dax_event_dispatch() firing event\n");
-        etype =    ntohl(*(u_int32_t *)(&ds->ebuff[0]));
-        idx =      ntohl(*(u_int32_t *)(&ds->ebuff[4]));
-        eid =      ntohl(*(u_int32_t *)(&ds->ebuff[8]));
-        byte =     ntohl(*(u_int32_t *)(&ds->ebuff[12]));
-        count =    ntohl(*(u_int32_t *)(&ds->ebuff[16]));
-        datatype = ntohl(*(u_int32_t *)(&ds->ebuff[20]));
-        bit =      *(u_int8_t *)(&ds->ebuff[24]);
-//        fprintf(stderr, "event type  = %d\n", etype);
-//        fprintf(stderr, "event idx   = %d\n", idx);
-//        fprintf(stderr, "event id    = %d\n", eid);
-//        fprintf(stderr, "event byte  = %d\n", byte);
-//        fprintf(stderr, "event bit   = %d\n", bit);
-//        fprintf(stderr, "event count = %d\n", count);
-//        fprintf(stderr, "event datatype = %s\n", dax_type_to_string(ds, datatype));
-        ds->eindex = 0; /* Reset for the next time */
-        for(n = 0; n < ds->event_count; n ++) {
-//            fprintf(stderr, "checking for event at n = %d, idx = %d, id = %d\n", n, ds->events[n].idx, ds->events[n].id );
-            if(ds->events[n].idx == idx && ds->events[n].id == eid) {
-                if(ds->events[n].callback != NULL) {
-                    ds->events[n].callback(ds->events[n].udata);
-                }
-                if(id != NULL) {
-                    id->id = eid;
-                    id->index = idx;
-                }
-                return 0;
-            }
-        }
-        dax_error(ds, "dax_event_dispatch() recieved an event that does not exist in database");
-        return ERR_GENERIC;
-    } else {
-        return ERR_NOTFOUND;
-    }
+    int result, got;
+
+    result = _read_events(ds, id, &got);
+    if(result < 0) return result;
+    if(result == 0) return ERR_NOTFOUND;
     return 0;
 }
+
+/* Keeps reading and dispatching events until there is nothing left on the
+ * socket.  This is the function to call when the event file descriptor is
+ * being handled by the module's own poll()/epoll() loop.  Returns the number
+ * of events that were dispatched, which may be zero, or an error code. */
+int
+dax_event_dispatch_batch(dax_state *ds)
+{
+    int result, got, total = 0;
+
+    do {
+        result = _read_events(ds, NULL, &got);
+        if(result < 0) {
+            return total ? total : result;
+        }
+        total += result;
+        /* A read that only finished part of a message, or only had events
+         * that we don't know about, doesn't mean the socket is empty.  With
+         * an edge triggered epoll() we won't be told again so we have to
+         * read until recv() says there is nothing left. */
+    } while(got > 0);
+    return total;
+}
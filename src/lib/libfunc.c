@@ -157,6 +157,16 @@ libdax_lock(dax_lock *lock) {
     return 0;
 }
 
+/* Returns 0 if we got the lock and ERR_INUSE if somebody else has it */
+inline int
+libdax_trylock(dax_lock *lock) {
+    int result;
+    result = pthread_mutex_trylock(lock);
+    if(result == EBUSY) return ERR_INUSE;
+    if(result) return ERR_GENERIC;
+    return 0;
+}
+
 inline int
 libdax_unlock(dax_lock *lock) {
     int result;
@@ -190,6 +200,11 @@ libdax_lock(dax_lock *lock) {
     return 0;
 }
 
+inline int
+libdax_trylock(dax_lock *lock) {
+    return 0;
+}
+
 inline int
 libdax_unlock(dax_lock *lock) {
     return 0;
@@ -37,26 +37,48 @@ dax_init(char *name)
     if(ds->modulename == NULL) return NULL;
     
     ds->msgtimeout = 0;
+    ds->uring = 0;
     ds->sfd = 0;       /* Server's File Descriptor */
     ds->afd = 0;       /* Asynchronous File Descriptor */
+    ds->lost = 0;
+    ds->server_id = 0;
+    ds->backoff = 0;
+    ds->reconnect = NULL;
     ds->reformat = 0;  /* Flags to show how to reformat the incoming data */
     ds->logflags = 0;
     /* Tag Cache */
-    ds->cache_head = NULL;     /* First node in the cache list */
+    ds->cache = NULL;          /* Array of cache nodes */
+    ds->cache_name = NULL;     /* Hash buckets by name */
+    ds->cache_idx = NULL;      /* Hash buckets by index */
+    ds->cache_mask = 0;
     ds->cache_limit = 0;       /* Total number of nodes that we'll allocate */
     ds->cache_count = 0;       /* How many nodes we actually have */
+    ds->cache_fill = 0;
+    ds->cache_hand = 0;
+    ds->generation = 0;
+    /* Data Cache */
+    ds->dcache = NULL;
+    ds->dcache_age = 0;
+    memset(&ds->dcache_stats, 0, sizeof(dax_cache_stats));
     /* datatype list */
     ds->datatypes = NULL;
     ds->datatype_size = 0;
-    /* Event list array */
-    ds->events = malloc(sizeof(event_db));
+    ds->retired = NULL;
+    /* Connection pool, allocated in dax_connect() */
+    ds->conns = NULL;
+    ds->conn_count = 0;
+    ds->conn_limit = 0;
+    ds->conn_next = 0;
+    /* Event hash table */
+    ds->events = calloc(EVENT_HASH_SIZE, sizeof(event_db *));
     if(ds->events == NULL) {
         free(ds->modulename);
         free(ds);
         return NULL;
     }
-    ds->event_size = 1;
+    ds->event_size = EVENT_HASH_SIZE;
     ds->event_count = 0;
+    ds->eindex = 0;
     /* Logging functions */
     ds->dax_debug = NULL;
     ds->dax_error = NULL;
@@ -86,8 +108,12 @@ dax_free(dax_state *ds)
     libdax_unlock(ds->lock);
     libdax_destroy_lock(ds->lock);
     free(ds->modulename);
-    /* TODO: gotta loop through and free the udata in the events. */
+    free_events(ds);
     free(ds->events);
+    free_data_cache(ds);
+    free_tag_cache(ds);
+    free_datatypes(ds);
+    free_conns(ds);
     free(ds->lock);
     free(ds);
     return 0;
@@ -25,14 +25,13 @@
 #include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
-#include <math.h>
 
 
 /* These are the generic message functions.  They simply send the message of
  * the type given by command, attach the payload.  The payloads size should be
  * given in bytes */
 static int
-_message_send(dax_state *ds, int command, void *payload, size_t size)
+_message_send(dax_state *ds, int fd, int command, void *payload, size_t size)
 {
     int result;
     char buff[DAX_MSGMAX];
@@ -44,31 +43,35 @@ _message_send(dax_state *ds, int command, void *payload, size_t size)
 
     /* TODO: We need to set some kind of timeout here.  This could block
        forever if something goes wrong.  It may be a signal or something too. */
-    result = write(ds->sfd, buff, size + MSG_HDR_SIZE);
+    /* MSG_NOSIGNAL keeps a dead server from killing us with SIGPIPE */
+    result = send(fd, buff, size + MSG_HDR_SIZE, MSG_NOSIGNAL);
     
     if(result < 0) {
     /* TODO: Should we handle the case when this returns due to a signal */
         dax_error(ds, "_message_send: %s", strerror(errno));
+        ds->lost = 1;
         return ERR_MSG_SEND;
     }
     return 0;
 }
 
-/* This function waits for a message with the given command to come in. If
-   a message of another command comes in it will send that message out to
-   an asynchronous command handler.  This is due to a race condition that could
-   happen if the server puts a message in the queue after we send a request but
-   before we retrieve the result. */
-/* TODO: Do a better job of explaining the functionality of this function */
+/* Reads from 'fd' until there is a whole message in 'buff'.  'index' is
+ * the number of bytes that are already there.  Returns the size of the
+ * message or an error code. */
 static int
-_message_recv(dax_state *ds, int command, void *payload, int *size, int response)
+_message_read(dax_state *ds, int fd, char *buff, int index)
 {
-    char buff[DAX_MSGMAX];
-    int index, done, msg_size, result;
-    done = index = msg_size = 0;
+    int msg_size = 0, result;
     
+    if(index >= MSG_HDR_SIZE) {
+        msg_size = ntohl(*(u_int32_t *)buff);
+        if(msg_size > DAX_MSGMAX) {
+            dax_debug(ds, LOG_COMM, "_message_recv message size is too big");
+            return ERR_MSG_BAD;
+        }
+    }
     while( index < msg_size || index < MSG_HDR_SIZE) {
-        result = read(ds->sfd, &buff[index], DAX_MSGMAX);
+        result = read(fd, &buff[index], DAX_MSGMAX - index);
         /*****TESTING STUFF******/
 //        printf("_message_recv() returned %d\n", result);
 //        for(done = 0; done < result; done ++) {
@@ -81,11 +84,13 @@ _message_recv(dax_state *ds, int command, void *payload, int *size, int response
                 return ERR_TIMEOUT;
             } else {
                 dax_debug(ds, LOG_COMM, "_message_recv failed: %s", strerror(errno));
+                ds->lost = 1;
                 return ERR_MSG_RECV;
             }
         } else if(result == 0) {
-            printf("TODO: I don't know what to do with read returning 0\n");
-            return ERR_GENERIC;
+            dax_debug(ds, LOG_COMM, "_message_recv server closed the connection");
+            ds->lost = 1;
+            return ERR_NO_SOCKET;
         } else {
             index += result;
         }
@@ -98,12 +103,23 @@ _message_recv(dax_state *ds, int command, void *payload, int *size, int response
             }
         }
     }
+    return msg_size;
+}
+
+/* Checks that the message in 'buff' is the response to 'command' and
+ * copies the data to *payload.  If the server sent an error it is
+ * returned. */
+static int
+_message_decode(dax_state *ds, char *buff, int msg_size, int command, void *payload, int *size, int response)
+{
+    int result;
+    
     /* This gets the command out of the buffer */
     result = ntohl(*((u_int32_t *)&buff[4]));
     
     /* Test if the error flag is set and then return the error code */
     if(result == (command | MSG_ERROR)) {
-        return stom_dint((*(int32_t *)&buff[8]));
+        return stom_dint(ds, (*(int32_t *)&buff[8]));
     } else if(result == (command | (response ? MSG_RESPONSE : 0))) {
         if(size) {
             if((msg_size - MSG_HDR_SIZE) > *size) {
@@ -120,6 +136,201 @@ _message_recv(dax_state *ds, int command, void *payload, int *size, int response
     return 0;
 }
 
+/* This function waits for a message with the given command to come in. If
+   a message of another command comes in it will send that message out to
+   an asynchronous command handler.  This is due to a race condition that could
+   happen if the server puts a message in the queue after we send a request but
+   before we retrieve the result. */
+/* TODO: Do a better job of explaining the functionality of this function */
+static int
+_message_recv(dax_state *ds, int fd, int command, void *payload, int *size, int response)
+{
+    char buff[DAX_MSGMAX];
+    int msg_size;
+    
+    msg_size = _message_read(ds, fd, buff, 0);
+    if(msg_size < 0) return msg_size;
+    return _message_decode(ds, buff, msg_size, command, payload, size, response);
+}
+
+/* Returns the number of milliseconds from now until *tv */
+static int
+_msec_until(struct timeval *tv)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (tv->tv_sec - now.tv_sec) * 1000 + (tv->tv_usec - now.tv_usec) / 1000;
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+/* Sets up the ring for the connection the first time it's used.  If it
+ * can't be done we use the socket calls on this connection from then on. */
+static ioring *
+_conn_ring(dax_state *ds, dax_conn *c)
+{
+    int result;
+    
+    if(c->ring != NULL || c->ring_failed) return c->ring;
+    c->ring = malloc(sizeof(ioring));
+    if(c->ring == NULL) {
+        c->ring_failed = 1;
+        return NULL;
+    }
+    result = ioring_init(c->ring, 4);
+    if(result) {
+        dax_debug(ds, LOG_COMM, "Unable to use io_uring, using sockets: %s", strerror(-result));
+        free(c->ring);
+        c->ring = NULL;
+        c->ring_failed = 1;
+    }
+    return c->ring;
+}
+
+/* Frees the connection's ring if it has one */
+static void
+_conn_ring_free(dax_conn *c)
+{
+    if(c->ring) {
+        ioring_free(c->ring);
+        free(c->ring);
+        c->ring = NULL;
+    }
+}
+
+/* Sends the request and receives the response with one io_uring_enter().
+ * The send and the receive are linked so that the receive doesn't start
+ * until the request is gone.  If there isn't a response in 'msgtimeout'
+ * the receive is cancelled. */
+static int
+_ring_xfer(dax_state *ds, dax_conn *c, ioring *r, int command, void *payload, size_t size, void *rpayload, int *rsize)
+{
+    char buff[DAX_MSGMAX], rbuff[DAX_MSGMAX];
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    struct timeval deadline;
+    int n, count, wait, sres = 0, rres = 0, timedout = 0, result;
+    
+    ((u_int32_t *)buff)[0] = htonl(size + MSG_HDR_SIZE);
+    ((u_int32_t *)buff)[1] = htonl(command);
+    memcpy(&buff[MSG_HDR_SIZE], payload, size);
+    
+    sqe = ioring_get_sqe(r);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = c->fd;
+    sqe->addr = (u_int64_t)(unsigned long)buff;
+    sqe->len = size + MSG_HDR_SIZE;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = 1;
+    
+    sqe = ioring_get_sqe(r);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->addr = (u_int64_t)(unsigned long)rbuff;
+    sqe->len = DAX_MSGMAX;
+    sqe->user_data = 2;
+    
+    gettimeofday(&deadline, NULL);
+    deadline.tv_sec += ds->msgtimeout / 1000;
+    deadline.tv_usec += (ds->msgtimeout % 1000) * 1000;
+    
+    result = ioring_submit(r, 2, ds->msgtimeout);
+    if(result != 2) {
+        /* This ring is thrown away and we go back to the socket calls.
+         * If the kernel took some of the requests they're still using
+         * our buffers, so the socket is shut down to make them finish
+         * and we wait for them before the buffers and the ring go away.
+         * Waiting submits whatever was left in the queue as well. */
+        dax_error(ds, "io_uring submit failed: %s", strerror(result < 0 ? -result : EIO));
+        count = result > 0 ? result : 0;
+        if(count > 0) {
+            shutdown(c->fd, SHUT_RDWR);
+        }
+        while(count > 0) {
+            n = ioring_submit(r, 1, -1);
+            if(n < 0) break;
+            count += n;
+            while((cqe = ioring_peek(r)) != NULL) {
+                ioring_advance(r);
+                count--;
+            }
+        }
+        _conn_ring_free(c);
+        c->ring_failed = 1;
+        ds->lost = 1;
+        return ERR_MSG_SEND;
+    }
+    count = 2;
+    for(n = 0; n < count; n++) {
+        while((cqe = ioring_peek(r)) == NULL) {
+            wait = _msec_until(&deadline);
+            if(wait > 0 || timedout) {
+                ioring_submit(r, 1, timedout ? -1 : wait);
+            } else {
+                /* The response never came so we cancel the receive and
+                 * wait for it to come back */
+                sqe = ioring_get_sqe(r);
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->addr = 2;
+                sqe->user_data = 3;
+                count++;
+                timedout = 1;
+            }
+        }
+        if(cqe->user_data == 1) {
+            sres = cqe->res;
+        } else if(cqe->user_data == 2) {
+            rres = cqe->res;
+        }
+        ioring_advance(r);
+    }
+    
+    if(sres < 0) {
+        dax_error(ds, "_message_send: %s", strerror(-sres));
+        ds->lost = 1;
+        return ERR_MSG_SEND;
+    }
+    if(rres < 0) {
+        if(timedout && rres == -ECANCELED) {
+            dax_debug(ds, LOG_COMM, "_message_recv Timed out");
+            return ERR_TIMEOUT;
+        }
+        dax_debug(ds, LOG_COMM, "_message_recv failed: %s", strerror(-rres));
+        ds->lost = 1;
+        return ERR_MSG_RECV;
+    } else if(rres == 0) {
+        dax_debug(ds, LOG_COMM, "_message_recv server closed the connection");
+        ds->lost = 1;
+        return ERR_NO_SOCKET;
+    }
+    /* The rest of a long response is read the old way */
+    result = _message_read(ds, c->fd, rbuff, rres);
+    if(result < 0) return result;
+    return _message_decode(ds, rbuff, result, command, rpayload, rsize, 1);
+}
+
+#endif /* HAVE_LINUX_IO_URING_H */
+
+/* Sends a request on the connection and waits for the response.  This
+ * is used for the messages that modules send over and over again. */
+static int
+_message_xfer(dax_state *ds, dax_conn *c, int command, void *payload, size_t size, void *rpayload, int *rsize)
+{
+    int result;
+#ifdef HAVE_LINUX_IO_URING_H
+    ioring *r;
+    
+    if(ds->uring && (r = _conn_ring(ds, c)) != NULL) {
+        return _ring_xfer(ds, c, r, command, payload, size, rpayload, rsize);
+    }
+#endif
+    result = _message_send(ds, c->fd, command, payload, size);
+    if(result) return result;
+    return _message_recv(ds, c->fd, command, rpayload, rsize, 1);
+}
+
 /* Connect to the server.  If the "server" attribute is local we
  * connect via LOCAL domain socket called out in "socketname" else
  * we connect to the server at IP address "serverip" on port "serverport".
@@ -148,6 +359,7 @@ _get_connection(dax_state *ds)
         len = offsetof(struct sockaddr_un, sun_path) + strlen(addr_un.sun_path);
         if (connect(fd, (struct sockaddr *)&addr_un, len) < 0) {
             dax_error(ds, "Unable to connect to local socket - %s", strerror(errno));
+            close(fd);
             return ERR_NO_SOCKET;
         } else {
             dax_debug(ds, LOG_COMM, "Connected to Local Server fd = %d", fd);
@@ -166,6 +378,7 @@ _get_connection(dax_state *ds)
         
         if (connect(fd, (struct sockaddr *)&addr_in, sizeof(addr_in)) < 0) {
             dax_error(ds, "Unable to connect to remote socket - %s", strerror(errno));
+            close(fd);
             return ERR_NO_SOCKET;
         } else {
             dax_debug(ds, LOG_COMM, "Connected to Network Server fd = %d", fd);
@@ -184,6 +397,57 @@ _get_connection(dax_state *ds)
 
 #define CON_HDR_SIZE 8
 
+/* Compares the test numbers that the server sends in the registration
+ * response with what we expect and figures out what has to be done to
+ * the data that goes back and forth.  The server only ever sends in its
+ * native format so either the bytes match ours or they are reversed.
+ * Anything else is a number format that we can't convert and we return
+ * ERR_GENERIC. Otherwise we return the ds->reformat flags. */
+static int
+_negotiate_format(char *buff)
+{
+    int flags = 0;
+    u_int16_t i16;
+    u_int32_t i32;
+    u_int64_t i64;
+    float f32, t32;
+    double f64, t64;
+    unsigned char sw[8];
+    int n;
+
+    memcpy(&i16, &buff[4], 2);
+    memcpy(&i32, &buff[6], 4);
+    memcpy(&i64, &buff[10], 8);
+    if(i16 != REG_TEST_INT || i32 != REG_TEST_DINT || i64 != REG_TEST_LINT) {
+        i16 = (i16 >> 8) | (i16 << 8);
+        for(n = 0; n < 4; n++) sw[n] = buff[9 - n];
+        memcpy(&i32, sw, 4);
+        for(n = 0; n < 8; n++) sw[n] = buff[17 - n];
+        memcpy(&i64, sw, 8);
+        if(i16 != REG_TEST_INT || i32 != REG_TEST_DINT || i64 != REG_TEST_LINT) {
+            return ERR_GENERIC;
+        }
+        flags |= REF_INT_SWAP;
+    }
+    /* The server does the same float conversions that we do so the
+     * bits have to match exactly in one order or the other */
+    t32 = REG_TEST_REAL;
+    t64 = REG_TEST_LREAL;
+    memcpy(&f32, &buff[18], 4);
+    memcpy(&f64, &buff[22], 8);
+    if(memcmp(&f32, &t32, 4) || memcmp(&f64, &t64, 8)) {
+        for(n = 0; n < 4; n++) sw[n] = buff[21 - n];
+        memcpy(&f32, sw, 4);
+        for(n = 0; n < 8; n++) sw[n] = buff[29 - n];
+        memcpy(&f64, sw, 8);
+        if(memcmp(&f32, &t32, 4) || memcmp(&f64, &t64, 8)) {
+            return ERR_GENERIC;
+        }
+        flags |= REF_FLT_SWAP;
+    }
+    return flags;
+}
+
 static int
 _mod_connect(dax_state *ds, char *name)
 {
@@ -204,63 +468,412 @@ _mod_connect(dax_state *ds, char *name)
     *((u_int32_t *)&buff[4]) = htonl(CONNECT_SYNC);  /* registration flags */
     strcpy(&buff[CON_HDR_SIZE], name);                /* The rest is the name */
 
-    if((result = _message_send(ds, MSG_MOD_REG, buff, CON_HDR_SIZE + len)))
+    if((result = _message_send(ds, ds->sfd, MSG_MOD_REG, buff, CON_HDR_SIZE + len)))
         return result;
     len = DAX_MSGMAX;
-    if((result = _message_recv(ds, MSG_MOD_REG, buff, &len, 1)))
+    if((result = _message_recv(ds, ds->sfd, MSG_MOD_REG, buff, &len, 1)))
         return result;
 
+    result = _negotiate_format(buff);
+    if(result < 0) {
+        dax_error(ds, "Unable to match the number format of the server");
+        return result;
+    }
+    ds->reformat = result;
     /* Store the unique ID that the server has sent us. */
-    ds->id =  *((u_int32_t *)&buff[0]);
-    /* Here we check to see if the data that we got in the registration message is in the same
-       format as we use here on the client module. This should be offloaded to a separate
-       function that can determine what needs to be done to the incoming and outgoing data to
-       get it to match with the server */
-    if( (*((u_int16_t *)&buff[4]) != REG_TEST_INT) ||
-        (*((u_int32_t *)&buff[6]) != REG_TEST_DINT) ||
-        (*((u_int64_t *)&buff[10]) != REG_TEST_LINT)) {
-        /* TODO: right now this is just to show error.  We need to determine if we can
-           get the right data from the server by some means. */
-        ds->reformat = REF_INT_SWAP;
+    ds->id = stom_udint(ds, *((u_int32_t *)&buff[0]));
+    /* Newer servers send an id that changes each time they are started
+     * so that we can tell a restarted server from a broken connection */
+    if(len >= 34) {
+        ds->server_id = stom_udint(ds, *((u_int32_t *)&buff[30]));
     } else {
-        ds->reformat = 0; /* this is redundant, already done in dax_init() */
-    }
-    /* There has got to be a better way to compare that we are getting good floating point numbers */
-    if( fabs(*((float *)&buff[18]) - REG_TEST_REAL) / REG_TEST_REAL   > 0.0000001 ||
-        fabs(*((double *)&buff[22]) - REG_TEST_LREAL) / REG_TEST_REAL > 0.0000001) {
-        ds->reformat |= REF_FLT_SWAP;
+        ds->server_id = 0;
     }
-    /* TODO: returning _reformat is only good until we figure out how to reformat the
-     * messages. Then we should return 0.  Right now since there isn't any reformating
-     * of messages being done we consider it an error and return that so that the module
-     * won't try to communicate */
-    return ds->reformat;
+    return 0;
 }
 
+/* Sends the registration message for one of the extra sockets.  'fd' is
+ * the new socket and 'flags' tells the server what it's for. */
 static int
-_event_connect(dax_state *ds)
+_aux_connect(dax_state *ds, int fd, u_int32_t flags)
 {
-    int result, len, tmpfd;
+    int result, len;
     char buff[DAX_MSGMAX];
     
     *((u_int32_t *)&buff[0]) = htonl(ds->id); /* Send our ID so that the server knows which module we are */
-    *((u_int32_t *)&buff[4]) = htonl(CONNECT_EVENT); /* registration flags */
+    *((u_int32_t *)&buff[4]) = htonl(flags); /* registration flags */
     
-    /* This is to trick the _message_send into sending on the new connection
-     * instead of the existing one. */
-    tmpfd = ds->sfd;
-    ds->sfd = ds->afd;
     /* For registration we pack the data no matter what */
-    if((result = _message_send(ds, MSG_MOD_REG, buff, CON_HDR_SIZE))) {
-        ds->sfd = tmpfd;
+    if((result = _message_send(ds, fd, MSG_MOD_REG, buff, CON_HDR_SIZE))) {
         return result;
     }
     len = DAX_MSGMAX;
-    result = _message_recv(ds, MSG_MOD_REG, buff, &len, 1);
-    ds->sfd = tmpfd;
+    result = _message_recv(ds, fd, MSG_MOD_REG, buff, &len, 1);
+    return result;
+}
+
+/* Opens another synchronous connection to the server and registers it
+ * as part of this module.  Returns the file descriptor or an error. */
+static int
+_pool_connect(dax_state *ds)
+{
+    int fd, result;
+    
+    fd = _get_connection(ds);
+    if(fd <= 0) return fd ? fd : ERR_NO_SOCKET;
+    result = _aux_connect(ds, fd, CONNECT_POOL);
+    if(result) {
+        close(fd);
+        return result;
+    }
+    dax_debug(ds, LOG_COMM, "Opened pooled connection fd = %d", fd);
+    return fd;
+}
+
+/* Returns a connection that the calling thread can use for one request
+ * and response.  The connection is locked and has to be given back
+ * with _conn_put().  We take the first connection that nobody else is
+ * using.  If they are all busy we open another one, up to the
+ * 'connections' attribute, and after that we wait in turn on the ones
+ * that we have.  If the connection to the server has been lost we try
+ * to get it back first.  Returns NULL if we aren't connected. */
+static dax_conn *
+_conn_get(dax_state *ds)
+{
+    int n, count, fd;
+    unsigned int generation;
+    dax_conn *c = NULL;
+
+    if(ds->conns == NULL) return NULL;
+    if(ds->lost && check_connection(ds, 0)) return NULL;
+    libdax_lock(ds->lock);
+    count = ds->conn_count;
+    libdax_unlock(ds->lock);
+    if(count == 0) return NULL;
+
+    for(n = 0; n < count; n++) {
+        c = &ds->conns[n];
+        if(libdax_trylock(&c->lock) == 0) {
+            if(c->fd > 0) return c;
+            libdax_unlock(&c->lock); /* Closed when we lost the server */
+        }
+    }
+
+    libdax_lock(ds->lock);
+    if(ds->conn_count > 0 && ds->conn_count + ds->conn_opening < ds->conn_limit) {
+        /* The slot isn't taken until the connection is open so that one
+         * that fails doesn't leave a dead one in the pool */
+        ds->conn_opening++;
+        generation = ds->generation;
+        libdax_unlock(ds->lock);
+        fd = _pool_connect(ds);
+        libdax_lock(ds->lock);
+        ds->conn_opening--;
+        if(fd > 0) {
+            /* If we reconnected in the meantime it belongs to the old
+             * registration and is no good to us */
+            if(generation == ds->generation && ds->conn_count > 0) {
+                c = &ds->conns[ds->conn_count];
+                libdax_lock(&c->lock);
+                c->fd = fd;
+                ds->conn_count++;
+                libdax_unlock(ds->lock);
+                return c;
+            }
+            close(fd);
+        }
+    }
+    if(ds->conn_count == 0) { /* We lost the connection in the meantime */
+        libdax_unlock(ds->lock);
+        return NULL;
+    }
+    /* Spread the waiting threads over the connections */
+    for(n = 0; n < ds->conn_count; n++) {
+        c = &ds->conns[ds->conn_next++ % ds->conn_count];
+        if(c->fd > 0) break;
+    }
+    if(n == ds->conn_count) {
+        libdax_unlock(ds->lock);
+        return NULL;
+    }
+    libdax_unlock(ds->lock);
+    /* We can't wait on the connection with ds->lock held but it may be
+     * closed while we wait, so it's checked again once we have it */
+    libdax_lock(&c->lock);
+    if(c->fd > 0) return c;
+    libdax_unlock(&c->lock);
+    return _conn_get(ds);
+}
+
+/* Gives the connection back after the response has been read */
+static inline void
+_conn_put(dax_conn *c)
+{
+    libdax_unlock(&c->lock);
+}
+
+/* Allocates the connection pool.  The first connection is the one that
+ * dax_connect() opens. */
+static int
+_init_conns(dax_state *ds)
+{
+    int n, limit;
+
+    free_conns(ds);
+    limit = strtol(dax_get_attr(ds, "connections"), NULL, 0);
+    if(limit < 1) limit = 1;
+    ds->conns = malloc(limit * sizeof(dax_conn));
+    if(ds->conns == NULL) return ERR_ALLOC;
+    for(n = 0; n < limit; n++) {
+        ds->conns[n].fd = -1;
+        libdax_init_lock(&ds->conns[n].lock);
+#ifdef HAVE_LINUX_IO_URING_H
+        ds->conns[n].ring = NULL;
+        ds->conns[n].ring_failed = 0;
+#endif
+    }
+    ds->conn_limit = limit;
+    ds->conn_count = 0;
+    ds->conn_next = 0;
+    ds->conn_opening = 0;
+    return 0;
+}
+
+/* Closes all of the pooled connections but not the first one and
+ * frees the pool */
+void
+free_conns(dax_state *ds)
+{
+    int n;
+
+    if(ds->conns == NULL) return;
+    for(n = 0; n < ds->conn_limit; n++) {
+        if(n > 0 && ds->conns[n].fd > 0) {
+            close(ds->conns[n].fd);
+        }
+#ifdef HAVE_LINUX_IO_URING_H
+        _conn_ring_free(&ds->conns[n]);
+#endif
+        libdax_destroy_lock(&ds->conns[n].lock);
+    }
+    free(ds->conns);
+    ds->conns = NULL;
+    ds->conn_count = ds->conn_limit = 0;
+}
+
+/* Adds all of the events in our table to the server again after we
+ * have reconnected.  As many events as will fit are sent in each
+ * MSG_EVNT_RESUME message.  Each event is the size of its MSG_EVNT_ADD
+ * data followed by the data itself and the server answers with the new
+ * event id, or an error code, for each one.  The module keeps using the
+ * ids that it already has.  If the server has been restarted the tag
+ * indexes don't mean anything anymore so only the pattern and compound
+ * events, which are found by name, are kept.  Events that can't be
+ * added again are removed so that their free_callback() is called.
+ * This is called with ds->lock held. */
+static int
+_resume_events(dax_state *ds, int restarted)
+{
+    event_db *this, **list;
+    u_int8_t *keep;
+    char buff[MSG_DATA_SIZE];
+    dax_dint ids[MSG_DATA_SIZE / sizeof(dax_dint)];
+    dax_udint temp;
+    dax_event_id id;
+    int n, i, first, last, total, sent, size, len, result = 0;
+
+    if(ds->event_count == 0) return 0;
+    list = malloc(ds->event_count * (sizeof(event_db *) + 1));
+    if(list == NULL) return ERR_ALLOC;
+    keep = (u_int8_t *)&list[ds->event_count];
+    total = 0;
+    for(n = 0; n < ds->event_size; n++) {
+        for(this = ds->events[n]; this != NULL; this = this->next) {
+            list[total] = this;
+            keep[total] = (this->def != NULL && this->defsize <= MSG_DATA_SIZE - 4);
+            if(restarted && this->idx != (u_int32_t)EVENT_PATTERN_INDEX &&
+                            this->idx != (u_int32_t)EVENT_COMPOUND_INDEX) {
+                keep[total] = 0;
+            }
+            total++;
+        }
+    }
+    for(first = 0; first < total && result == 0; first = last) {
+        size = sent = 0;
+        for(last = first; last < total; last++) {
+            if(!keep[last]) continue;
+            if(size + 4 + list[last]->defsize > MSG_DATA_SIZE) break;
+            temp = mtos_udint(ds, list[last]->defsize);
+            memcpy(&buff[size], &temp, 4);
+            memcpy(&buff[size + 4], list[last]->def, list[last]->defsize);
+            size += 4 + list[last]->defsize;
+            sent++;
+        }
+        if(sent == 0) continue;
+        result = _message_send(ds, ds->sfd, MSG_EVNT_RESUME, buff, size);
+        if(result) break;
+        len = sizeof(ids);
+        result = _message_recv(ds, ds->sfd, MSG_EVNT_RESUME, ids, &len, 1);
+        if(result) break;
+        len /= sizeof(dax_dint);
+        for(n = first, i = 0; n < last; n++) {
+            if(!keep[n]) continue;
+            if(i < len && stom_dint(ds, ids[i]) >= 0) {
+                list[n]->sid = stom_dint(ds, ids[i]);
+            } else {
+                keep[n] = 0;
+            }
+            i++;
+        }
+    }
+    /* The table is keyed on the server's ids so they have to be moved */
+    event_rehash(ds);
+    if(result == 0) {
+        for(n = 0; n < total; n++) {
+            if(keep[n]) continue;
+            id.index = list[n]->idx;
+            id.id = list[n]->id;
+            dax_error(ds, "Unable to restore event %d for tag index %d", id.id, id.index);
+            del_event(ds, id);
+        }
+    }
+    free(list);
     return result;
 }
 
+/* Closes the old sockets and goes through the whole connection and
+ * registration process again.  The tag cache is cleared and the
+ * generation is changed so that prepared tags will find their tags
+ * again.  *restarted is set if it's a different server than the one
+ * that we were connected to before.  This is called with ds->lock held
+ * and it waits for any other threads to finish with their connections. */
+static int
+_reconnect(dax_state *ds, int *restarted)
+{
+    int n, fd, result;
+    u_int32_t old_id;
+
+    for(n = 0; n < ds->conn_limit; n++) {
+        libdax_lock(&ds->conns[n].lock);
+    }
+    for(n = 0; n < ds->conn_limit; n++) {
+        if(ds->conns[n].fd > 0) close(ds->conns[n].fd);
+        ds->conns[n].fd = -1;
+    }
+    ds->conn_count = 0;
+    ds->sfd = 0;
+    if(ds->afd > 0) close(ds->afd);
+    ds->afd = 0;
+    ds->eindex = 0;
+
+    old_id = ds->server_id;
+    fd = _get_connection(ds);
+    if(fd <= 0) {
+        result = fd ? fd : ERR_NO_SOCKET;
+    } else {
+        ds->sfd = fd;
+        result = _mod_connect(ds, ds->modulename);
+    }
+    if(result == 0) {
+        fd = _get_connection(ds);
+        if(fd <= 0) {
+            result = fd ? fd : ERR_NO_SOCKET;
+        } else {
+            ds->afd = fd;
+            result = _aux_connect(ds, ds->afd, CONNECT_EVENT);
+        }
+    }
+    if(result == 0) {
+        /* If the server doesn't send an id we have to assume the worst */
+        *restarted = (ds->server_id != old_id || ds->server_id == 0);
+        /* Tags may have been changed or deleted while we were gone */
+        init_tag_cache(ds);
+        data_cache_clear(ds);
+        ds->generation++;
+        result = _resume_events(ds, *restarted);
+    }
+    if(result == 0) {
+        ds->conns[0].fd = ds->sfd;
+        ds->conn_count = 1;
+        ds->lost = 0;
+    } else {
+        if(ds->sfd > 0) close(ds->sfd);
+        if(ds->afd > 0) close(ds->afd);
+        ds->sfd = ds->afd = 0;
+    }
+    for(n = 0; n < ds->conn_limit; n++) {
+        libdax_unlock(&ds->conns[n].lock);
+    }
+    return result;
+}
+
+/* Called when one of the sockets to the server has failed.  Tries to
+ * reconnect unless the last attempt was too recent.  The time between
+ * attempts doubles after each failure up to the 'reconnect' attribute so
+ * that a whole plant full of modules doesn't pound on a server that is
+ * trying to start.  If 'wait' is non zero we'll sleep up to that many
+ * milliseconds for the next attempt.  Returns 0 if we are connected. */
+int
+check_connection(dax_state *ds, int wait)
+{
+    int result, delay, limit, restarted = 0;
+
+    if(! ds->lost) return 0;
+    if(ds->conns == NULL) return ERR_NO_SOCKET; /* dax_disconnect() was called */
+    limit = strtol(dax_get_attr(ds, "reconnect"), NULL, 0);
+    if(limit <= 0) return ERR_NO_SOCKET;
+
+    libdax_lock(ds->lock);
+    delay = ds->backoff ? _msec_until(&ds->retry) : 0;
+    libdax_unlock(ds->lock);
+    if(delay > 0) {
+        if(delay > wait) {
+            if(wait > 0) usleep(wait * 1000);
+            return ERR_NO_SOCKET;
+        }
+        usleep(delay * 1000);
+    }
+
+    libdax_lock(ds->lock);
+    /* Another thread may have done it while we were waiting */
+    if(! ds->lost) {
+        libdax_unlock(ds->lock);
+        return 0;
+    }
+    if(ds->backoff && _msec_until(&ds->retry) > 0) {
+        libdax_unlock(ds->lock);
+        return ERR_NO_SOCKET;
+    }
+    dax_debug(ds, LOG_COMM, "Reconnecting to the server");
+    result = _reconnect(ds, &restarted);
+    if(result) {
+        ds->backoff = ds->backoff ? ds->backoff * 2 : MIN_BACKOFF;
+        if(ds->backoff > limit) ds->backoff = limit;
+        gettimeofday(&ds->retry, NULL);
+        ds->retry.tv_sec += ds->backoff / 1000;
+        ds->retry.tv_usec += (ds->backoff % 1000) * 1000;
+        if(ds->retry.tv_usec >= 1000000) {
+            ds->retry.tv_sec++;
+            ds->retry.tv_usec -= 1000000;
+        }
+        dax_debug(ds, LOG_COMM, "Reconnect failed, next try in %d mSec", ds->backoff);
+        libdax_unlock(ds->lock);
+        return ERR_NO_SOCKET;
+    }
+    ds->backoff = 0;
+    libdax_unlock(ds->lock);
+    dax_log(ds, "Reconnected to the %s server", restarted ? "restarted" : "same");
+    if(ds->reconnect) ds->reconnect(ds, restarted);
+    return 0;
+}
+
+/* Sets the function that is called after we have reconnected */
+void
+dax_set_reconnect(dax_state *ds, void (*reconnect)(dax_state *ds, int restarted))
+{
+    ds->reconnect = reconnect;
+}
+
 /* Setup the module data structures and send registration message
  * to the server.  *name is the name that we want to give our 
  * module */
@@ -271,6 +884,11 @@ dax_connect(dax_state *ds)
     
     libdax_lock(ds->lock);
     dax_debug(ds, LOG_COMM, "Sending registration for name - %s", ds->modulename);
+    result = _init_conns(ds);
+    if(result) {
+        libdax_unlock(ds->lock);
+        return result;
+    }
     
     /* This is the connection that we used for all the functional
      * request / response messages. */
@@ -297,34 +915,53 @@ dax_connect(dax_state *ds)
         libdax_unlock(ds->lock);
         return fd;
     }
-    result = _event_connect(ds); 
+    result = _aux_connect(ds, ds->afd, CONNECT_EVENT); 
     if(result) {
         libdax_unlock(ds->lock);
         return result;
     }
     init_tag_cache(ds);
+    /* The rest of the library can use the connection now */
+    ds->conns[0].fd = ds->sfd;
+    ds->conn_count = 1;
+    ds->lost = 0;
+    ds->backoff = 0;
     
     libdax_unlock(ds->lock);
+    /* Drop cached tags when the server tells us they have changed */
+    if(cache_subscribe(ds)) {
+        dax_error(ds, "Unable to subscribe to tag cache notifications");
+    }
     return 0;
 }
 
 int
 dax_disconnect(dax_state *ds)
 {
-    int len, result = -1;
-    libdax_lock(ds->lock);
+    int n, len, result = -1;
 
+    if(ds->conns == NULL) return result;
+    libdax_lock(ds->lock);
+    /* Wait for any requests that other threads have going */
+    for(n = 0; n < ds->conn_limit; n++) {
+        libdax_lock(&ds->conns[n].lock);
+    }
     if(ds->sfd) {
-        result = _message_send(ds, MSG_MOD_REG, NULL, 0);
+        result = _message_send(ds, ds->sfd, MSG_MOD_REG, NULL, 0);
         if(! result ) {
             len = 0;
-            result = _message_recv(ds, MSG_MOD_REG, NULL, &len, 1);
+            result = _message_recv(ds, ds->sfd, MSG_MOD_REG, NULL, &len, 1);
         }
         close(ds->sfd);
         ds->sfd = 0;
         close(ds->afd);
         ds->afd = 0;
     }
+    for(n = 0; n < ds->conn_limit; n++) {
+        libdax_unlock(&ds->conns[n].lock);
+    }
+    free_conns(ds);
+    ds->lost = 0;
     libdax_unlock(ds->lock);
     return result;
 }
@@ -341,31 +978,32 @@ dax_mod_get(dax_state *ds, char *modname)
 int
 dax_mod_set(dax_state *ds, u_int8_t cmd, void *param)
 {
+    dax_conn *c;
     int result, size;
     char buff[1];  /* So far this is as big as we need */
 
-    libdax_lock(ds->lock);
     buff[0] = cmd;
     if(cmd == MOD_CMD_RUNNING) {
         size = 1;
     } else {
         return ERR_ARG;
     }
+    if((c = _conn_get(ds)) == NULL) return ERR_NO_SOCKET;
         /* Send the message to the server.  Add 2 to the size for the subcommand and the NULL */
-    result = _message_send(ds, MSG_MOD_SET, buff, size);
+    result = _message_send(ds, c->fd, MSG_MOD_SET, buff, size);
     if(result) {
         dax_error(ds, "Can't send MSG_MOD_SET message");
-        libdax_unlock(ds->lock);
+        _conn_put(c);
         return result;
     }
     size = 0;
-    result = _message_recv(ds, MSG_MOD_SET, buff, &size, 1);
+    result = _message_recv(ds, c->fd, MSG_MOD_SET, buff, &size, 1);
     if(result) {
         dax_error(ds, "Problem receiving message MSG_MOD_SET : result = %d", result);
-        libdax_unlock(ds->lock);
+        _conn_put(c);
         return result;
     }
-    libdax_unlock(ds->lock);
+    _conn_put(c);
     return 0;
 }
 
@@ -377,6 +1015,7 @@ dax_tag_add(dax_state *ds, Handle *h, char *name, tag_type type, int count)
 {
     int size, result;
     dax_tag tag;
+    dax_conn *c;
     char buff[DAX_TAGNAME_SIZE + 8 + 1];
     
     if(count == 0) return ERR_ARG;
@@ -387,27 +1026,28 @@ dax_tag_add(dax_state *ds, Handle *h, char *name, tag_type type, int count)
         /* Add the 8 bytes for type and count to one byte for NULL */
         size += 9;
         /* TODO Need to do some more error checking here */
-        *((u_int32_t *)&buff[0]) = mtos_udint(type);
-        *((u_int32_t *)&buff[4]) = mtos_udint(count);
+        *((u_int32_t *)&buff[0]) = mtos_udint(ds, type);
+        *((u_int32_t *)&buff[4]) = mtos_udint(ds, count);
         
         strcpy(&buff[8], name);
     } else {
         return ERR_TAG_BAD;
     }
-    libdax_lock(ds->lock);
+    if((c = _conn_get(ds)) == NULL) return ERR_NO_SOCKET;
 
-    result = _message_send(ds, MSG_TAG_ADD, buff, size);
+    result = _message_send(ds, c->fd, MSG_TAG_ADD, buff, size);
     if(result) { 
-        libdax_unlock(ds->lock);
+        _conn_put(c);
         return ERR_MSG_SEND;
     }
     
     size = 4; /* we just need the handle */
-    result = _message_recv(ds, MSG_TAG_ADD, buff, &size, 1);
+    result = _message_recv(ds, c->fd, MSG_TAG_ADD, buff, &size, 1);
+    _conn_put(c);
 
     if(result == 0) {
         if(h != NULL) {
-            h->index = *(tag_index *)buff;
+            h->index = stom_dint(ds, *(tag_index *)buff);
             h->byte = 0;
             h->bit = 0;
             h->type = type;
@@ -419,14 +1059,16 @@ dax_tag_add(dax_state *ds, Handle *h, char *name, tag_type type, int count)
             }
         }
         strcpy(tag.name, name);
-        tag.idx = *(tag_index *)buff;
+        tag.idx = stom_dint(ds, *(tag_index *)buff);
         tag.type = type;
         tag.count = count;
+        libdax_lock(ds->lock);
         /* Just in case this call modifies the tag */
         cache_tag_del(ds, name);
         cache_tag_add(ds, &tag);
+        ds->generation++;
+        libdax_unlock(ds->lock);
     }
-    libdax_unlock(ds->lock);
     return result;
 }
 
@@ -439,45 +1081,53 @@ dax_tag_byname(dax_state *ds, dax_tag *tag, char *name)
 {
     int result, size;
     char *buff;
+    dax_conn *c;
         
     if(name == NULL) return ERR_ARG;
     
     if((size = strlen(name)) > DAX_TAGNAME_SIZE) return ERR_2BIG;
     
     libdax_lock(ds->lock);
-    if(check_cache_name(ds, name, tag)) {
-        /* We make buff big enough for the outgoing message and the incoming
-           response message which would have 3 additional int32s */
-        buff = malloc(size + 14);
-        if(buff == NULL) return ERR_ALLOC;
-        buff[0] = TAG_GET_NAME;
-        strcpy(&buff[1], name);
-        /* Send the message to the server.  Add 2 to the size for the subcommand and the NULL */
-        result = _message_send(ds, MSG_TAG_GET, buff, size + 2);
-        if(result) {
-            dax_error(ds, "Can't send MSG_TAG_GET message");
-            free(buff);
-            libdax_unlock(ds->lock);
-            return result;
-        }
-        size += 14; /* This makes room for the type, count and handle */
-        
-        result = _message_recv(ds, MSG_TAG_GET, buff, &size, 1);
-        if(result) {
-            dax_error(ds, "Problem receiving message MSG_TAG_GET : result = %d", result);
-            free(buff);
-            libdax_unlock(ds->lock);
-            return result;
-        }
-        tag->idx = stom_dint( *((int *)&buff[0]) );
-        tag->type = stom_udint(*((u_int32_t *)&buff[4]));
-        tag->count = stom_udint(*((u_int32_t *)&buff[8]));
-        buff[size - 1] = '\0'; /* Just to make sure */
-        strcpy(tag->name, &buff[12]);
-        cache_tag_add(ds, tag);
+    result = check_cache_name(ds, name, tag);
+    libdax_unlock(ds->lock);
+    if(result == 0) return 0;
+
+    /* We make buff big enough for the outgoing message and the incoming
+       response message which would have 3 additional int32s */
+    buff = malloc(size + 14);
+    if(buff == NULL) return ERR_ALLOC;
+    buff[0] = TAG_GET_NAME;
+    strcpy(&buff[1], name);
+    if((c = _conn_get(ds)) == NULL) {
+        free(buff);
+        return ERR_NO_SOCKET;
+    }
+    /* Send the message to the server.  Add 2 to the size for the subcommand and the NULL */
+    result = _message_send(ds, c->fd, MSG_TAG_GET, buff, size + 2);
+    if(result) {
+        dax_error(ds, "Can't send MSG_TAG_GET message");
+        free(buff);
+        _conn_put(c);
+        return result;
+    }
+    size += 14; /* This makes room for the type, count and handle */
+    
+    result = _message_recv(ds, c->fd, MSG_TAG_GET, buff, &size, 1);
+    _conn_put(c);
+    if(result) {
+        dax_error(ds, "Problem receiving message MSG_TAG_GET : result = %d", result);
         free(buff);
+        return result;
     }
+    tag->idx = stom_dint(ds, *((int *)&buff[0]));
+    tag->type = stom_udint(ds, *((u_int32_t *)&buff[4]));
+    tag->count = stom_udint(ds, *((u_int32_t *)&buff[8]));
+    buff[size - 1] = '\0'; /* Just to make sure */
+    strcpy(tag->name, &buff[12]);
+    libdax_lock(ds->lock);
+    cache_tag_add(ds, tag);
     libdax_unlock(ds->lock);
+    free(buff);
     return 0;
 }
 
@@ -487,33 +1137,38 @@ dax_tag_byindex(dax_state *ds, dax_tag *tag, tag_index handle)
 {
     int result, size;
     char buff[DAX_TAGNAME_SIZE + 13];
+    dax_conn *c;
 
     libdax_lock(ds->lock);
-    if(check_cache_index(ds, handle, tag)) {
-        buff[0] = TAG_GET_INDEX;
-        *((tag_index *)&buff[1]) = handle;
-        result = _message_send(ds, MSG_TAG_GET, buff, sizeof(tag_index) + 1);
-        if(result) {
-            dax_error(ds, "Can't send MSG_TAG_GET message");
-            libdax_unlock(ds->lock);
-            return result;
-        }
-        /* Maximum size of buffer, the 13 is the NULL plus three integers */
-        size = DAX_TAGNAME_SIZE + 13;
-        result = _message_recv(ds, MSG_TAG_GET, buff, &size, 1);
-        if(result) {
-            //dax_error("Unable to retrieve tag for handle %d", handle);
-            libdax_unlock(ds->lock);
-            return result;
-        }
-        tag->idx = stom_dint(*((int32_t *)&buff[0]));
-        tag->type = stom_dint(*((int32_t *)&buff[4]));
-        tag->count = stom_dint(*((int32_t *)&buff[8]));
-        buff[DAX_TAGNAME_SIZE + 12] = '\0'; /* Just to be safe */
-        strcpy(tag->name, &buff[12]);
-        /* Add the tag to the tag cache */
-        cache_tag_add(ds, tag);
+    result = check_cache_index(ds, handle, tag);
+    libdax_unlock(ds->lock);
+    if(result == 0) return 0;
+
+    buff[0] = TAG_GET_INDEX;
+    *((tag_index *)&buff[1]) = mtos_dint(ds, handle);
+    if((c = _conn_get(ds)) == NULL) return ERR_NO_SOCKET;
+    result = _message_send(ds, c->fd, MSG_TAG_GET, buff, sizeof(tag_index) + 1);
+    if(result) {
+        dax_error(ds, "Can't send MSG_TAG_GET message");
+        _conn_put(c);
+        return result;
     }
+    /* Maximum size of buffer, the 13 is the NULL plus three integers */
+    size = DAX_TAGNAME_SIZE + 13;
+    result = _message_recv(ds, c->fd, MSG_TAG_GET, buff, &size, 1);
+    _conn_put(c);
+    if(result) {
+        //dax_error("Unable to retrieve tag for handle %d", handle);
+        return result;
+    }
+    tag->idx = stom_dint(ds, *((int32_t *)&buff[0]));
+    tag->type = stom_dint(ds, *((int32_t *)&buff[4]));
+    tag->count = stom_dint(ds, *((int32_t *)&buff[8]));
+    buff[DAX_TAGNAME_SIZE + 12] = '\0'; /* Just to be safe */
+    strcpy(tag->name, &buff[12]);
+    /* Add the tag to the tag cache */
+    libdax_lock(ds->lock);
+    cache_tag_add(ds, tag);
     libdax_unlock(ds->lock);
     return 0;
 }
@@ -526,42 +1181,39 @@ dax_tag_byindex(dax_state *ds, dax_tag *tag, tag_index handle)
  * and 'size' is the number of bytes to read. If data isn't allocated
  * then bad things will happen.  The data will come out of here exactly
  * like it appears in the server.  It is up to the module to convert
- * the data to the module's number format. */
+ * the data to the module's number format.  Data that is too big for
+ * one message is sent as several messages on the same connection. */
 int
 dax_read(dax_state *ds, tag_index idx, int offset, void *data, size_t size)
 {
     int n, count, m_size, sendsize;
     int result = 0;
     int buff[3];
+    dax_conn *c;
     
     /* This calculates the amount of data that we can send with a single message
         It subtracts a handle_t from the data size for use as the tag handle.*/
     m_size = MSG_DATA_SIZE;
     count = ((size - 1) / m_size) + 1;
+    if((c = _conn_get(ds)) == NULL) return ERR_NO_SOCKET;
     for(n = 0; n < count; n++) {
         if(n == (count - 1)) { /* Last Packet */
-            sendsize = size % m_size; /* What's left over */
+            sendsize = size - n * m_size; /* What's left over */
         } else {
             sendsize = m_size;
         }
-        buff[0] = mtos_dint(idx);
-        buff[1] = mtos_dint(offset + n * m_size);
-        buff[2] = mtos_dint(sendsize);
+        buff[0] = mtos_dint(ds, idx);
+        buff[1] = mtos_dint(ds, offset + n * m_size);
+        buff[2] = mtos_dint(ds, sendsize);
 
-        libdax_lock(ds->lock);
-        result = _message_send(ds, MSG_TAG_READ, (void *)buff, sizeof(buff));
-        if(result) {
-            libdax_unlock(ds->lock);
-            return result;
-        }
-        result = _message_recv(ds, MSG_TAG_READ, &((char *)data)[m_size * n], &sendsize, 1);
-        
+        result = _message_xfer(ds, c, MSG_TAG_READ, (void *)buff, sizeof(buff),
+                               &((char *)data)[m_size * n], &sendsize);
         if(result) {
-            libdax_unlock(ds->lock);
+            _conn_put(c);
             return result;
         }
     }
-    libdax_unlock(ds->lock);
+    _conn_put(c);
     return 0;
 }
 
@@ -576,6 +1228,7 @@ dax_write(dax_state *ds, tag_index idx, int offset, void *data, size_t size)
     size_t n, count, m_size, sendsize;
     int result;
     char buff[MSG_DATA_SIZE];
+    dax_conn *c;
     
     /* This calculates the amount of data that we can send with a single message
        It subtracts a handle_t from the data size for use as the tag handle and
@@ -583,30 +1236,26 @@ dax_write(dax_state *ds, tag_index idx, int offset, void *data, size_t size)
     m_size = MSG_DATA_SIZE - sizeof(tag_index) - sizeof(int);
     /* count is the number of messages that we will have to send to transport this data. */
     count = ( (size - 1) / m_size ) + 1;
+    if((c = _conn_get(ds)) == NULL) return ERR_NO_SOCKET;
     for(n = 0; n < count; n++) {
         if(n == (count - 1)) { /* Last Packet */
-            sendsize = size % m_size; /* What's left over */
+            sendsize = size - n * m_size; /* What's left over */
         } else {
             sendsize = m_size;
         }
         /* Write the data to the message buffer */
-        *((tag_index *)&buff[0]) = mtos_dint(idx);
-        *((int *)&buff[4]) = mtos_dint(offset + n * m_size);
+        *((tag_index *)&buff[0]) = mtos_dint(ds, idx);
+        *((int *)&buff[4]) = mtos_dint(ds, offset + n * m_size);
         memcpy(&buff[8], data + (m_size * n), sendsize);
 
-        libdax_lock(ds->lock);
-        result = _message_send(ds, MSG_TAG_WRITE, buff, sendsize + sizeof(tag_index) + sizeof(int));
-        if(result) {
-            libdax_unlock(ds->lock);
-            return result;
-        }
-        result = _message_recv(ds, MSG_TAG_WRITE, buff, 0, 1);
+        result = _message_xfer(ds, c, MSG_TAG_WRITE, buff, sendsize + sizeof(tag_index) + sizeof(int), NULL, 0);
         if(result) {
-            libdax_unlock(ds->lock);
+            _conn_put(c);
             return result;
         }
     }
-    libdax_unlock(ds->lock);
+    _conn_put(c);
+    data_cache_invalidate(ds, idx, offset, size);
     return 0;
 }
 
@@ -618,81 +1267,115 @@ dax_mask(dax_state *ds, tag_index idx, int offset, void *data, void *mask, size_
     size_t n, count, m_size, sendsize;
     u_int8_t buff[MSG_DATA_SIZE];
     int result;
+    dax_conn *c;
 
     /* This calculates the amount of data that we can send with a single message
        It subtracts a handle_t from the data size for use as the tag handle.*/
     m_size = (MSG_DATA_SIZE - sizeof(tag_index) - sizeof(int)) / 2;
     count=((size - 1) / m_size) + 1;
+    if((c = _conn_get(ds)) == NULL) return ERR_NO_SOCKET;
     for(n = 0; n < count; n++) {
         if(n == (count - 1)) { /* Last Packet */
-            sendsize = (size % m_size); /* What's left over */
+            sendsize = size - n * m_size; /* What's left over */
         } else {
             sendsize = m_size;
         }
         /* Write the data to the message buffer */
-        *((tag_index *)&buff[0]) = mtos_dint(idx);
-        *((int *)&buff[4]) = mtos_dint(offset + n * m_size);
+        *((tag_index *)&buff[0]) = mtos_dint(ds, idx);
+        *((int *)&buff[4]) = mtos_dint(ds, offset + n * m_size);
         memcpy(&buff[8], data + (m_size * n), sendsize);
         memcpy(&buff[8 + sendsize], mask + (m_size * n), sendsize);
 
-        libdax_lock(ds->lock);
-        result = _message_send(ds, MSG_TAG_MWRITE, buff, sendsize * 2 + sizeof(tag_index) + sizeof(int));
+        result = _message_xfer(ds, c, MSG_TAG_MWRITE, buff, sendsize * 2 + sizeof(tag_index) + sizeof(int), NULL, 0);
         if(result) {
-            libdax_unlock(ds->lock);
-            return result;
-        }
-        result = _message_recv(ds, MSG_TAG_MWRITE, buff, 0, 1);
-        if(result) {
-            libdax_unlock(ds->lock);
+            _conn_put(c);
             return result;
         }
     }
-    libdax_unlock(ds->lock);
+    _conn_put(c);
+    data_cache_invalidate(ds, idx, offset, size);
     return 0;
 }
 
+/* Sends the writes that dax_batch_flush() has put together.  'buff' holds
+ * 'size' bytes of MSG_TAG_MULTI records and none of them is bigger than
+ * a message.  As many records as will fit go in each message and they
+ * are all sent on the same connection. */
+int
+tag_multi_write(dax_state *ds, u_int8_t *buff, int size)
+{
+    dax_conn *c;
+    int offset, len, next, result = 0;
+    u_int32_t rsize;
+
+    if((c = _conn_get(ds)) == NULL) return ERR_NO_SOCKET;
+    for(offset = 0; offset < size && result == 0; offset += len) {
+        /* Find out how many records will fit */
+        for(len = 0; offset + len < size; len += next) {
+            memcpy(&rsize, &buff[offset + len + 8], 4);
+            rsize = stom_udint(ds, rsize);
+            next = 12 + (rsize & ~MULTI_MASK) * ((rsize & MULTI_MASK) ? 2 : 1);
+            if(len + next > MSG_DATA_SIZE) break;
+        }
+        if(len == 0) {
+            result = ERR_2BIG;
+            break;
+        }
+        result = _message_xfer(ds, c, MSG_TAG_MULTI, &buff[offset], len, NULL, 0);
+    }
+    _conn_put(c);
+    return result;
+}
+
 int
 dax_event_add(dax_state *ds, Handle *h, int event_type, void *data,
               dax_event_id *id, void (*callback)(void *udata),
               void *udata, void (*free_callback)(void *udata))
 {
+    dax_conn *c;
     int test;
     dax_dint result;
     dax_dint temp;
     dax_udint u_temp;
-    int size;
+    int size, len;
     dax_event_id eid;
     char buff[MSG_DATA_SIZE];
 
-    temp = mtos_dint(h->index);      /* Index */
+    temp = mtos_dint(ds, h->index);      /* Index */
     memcpy(buff, &temp, 4);
-    temp = mtos_dint(h->byte);       /* Byte ofset */
+    temp = mtos_dint(ds, h->byte);       /* Byte ofset */
     memcpy(&buff[4], &temp, 4);
-    temp = mtos_dint(h->count);      /* Tag Count */
+    temp = mtos_dint(ds, h->count);      /* Tag Count */
     memcpy(&buff[8], &temp, 4);
-    temp = mtos_dint(h->type);       /* Datatype */
+    temp = mtos_dint(ds, h->type);       /* Datatype */
     memcpy(&buff[12], &temp, 4);
-    temp = mtos_dint(event_type);    /* Event Type */
+    temp = mtos_dint(ds, event_type);    /* Event Type */
     memcpy(&buff[16], &temp, 4);
-    u_temp = mtos_udint(h->size);    /* Size in Bytes */
+    u_temp = mtos_udint(ds, h->size);    /* Size in Bytes */
     memcpy(&buff[20], &u_temp, 4);
     buff[24]=h->bit;                 /* Bit offset */
     
     if(data != NULL) {
-        mtos_generic(h->type, &buff[25], data);
+        mtos_generic(ds, h->type, &buff[25], data);
         size = 25 + TYPESIZE(h->type) / 8;
+        /* Edge events are passed the threshold and the hysteresis */
+        if(event_type == EVENT_RISE || event_type == EVENT_FALL) {
+            mtos_generic(ds, h->type, &buff[size], (char *)data + TYPESIZE(h->type) / 8);
+            size += TYPESIZE(h->type) / 8;
+        }
     } else {
         size = 25;
     }
     
-    libdax_lock(ds->lock);
-    if(_message_send(ds, MSG_EVNT_ADD, buff, size)) {
-        libdax_unlock(ds->lock);
+    if((c = _conn_get(ds)) == NULL) return ERR_NO_SOCKET;
+    if(_message_send(ds, c->fd, MSG_EVNT_ADD, buff, size)) {
+        _conn_put(c);
         return ERR_MSG_SEND;
     } else {
-        test = _message_recv(ds, MSG_EVNT_ADD, &result, &size, 1);
+        len = sizeof(result);
+        test = _message_recv(ds, c->fd, MSG_EVNT_ADD, &result, &len, 1);
+        _conn_put(c);
         if(test) {
-            libdax_unlock(ds->lock);
             return test;
         } else {
             if(id != NULL) {
@@ -701,48 +1384,162 @@ dax_event_add(dax_state *ds, Handle *h, int event_type, void *data,
             }
             eid.id = result;
             eid.index = h->index;
+            libdax_lock(ds->lock);
             result = add_event(ds, eid, udata, callback, free_callback);
+            /* Kept so that we can add it again if we have to reconnect */
+            if(result == 0) set_event_def(ds, eid, buff, size);
+            libdax_unlock(ds->lock);
             if(result) {
-                libdax_unlock(ds->lock);
                 return result;
             }
         }
     }
-    libdax_unlock(ds->lock);
     return 0;
 }
 
+/* Subscribes to WRITE or CHANGE events on every tag whose name matches
+ * 'pattern' and whose datatype matches 'type'.  The pattern is either
+ * a complete tag name or the start of a name followed by '*'.  A type
+ * of zero matches any datatype.  The server keeps the subscription up
+ * to date as new tags are created.  The callback is passed the index of
+ * the tag that caused the event.  The returned id can be passed to
+ * dax_event_del() to remove the subscription. */
+int
+dax_event_pattern_add(dax_state *ds, char *pattern, tag_type type, int event_type,
+                      dax_event_id *id, void (*callback)(tag_index idx, void *udata),
+                      void *udata, void (*free_callback)(void *udata))
+{
+    dax_conn *c;
+    int test, size, len;
+    dax_dint result;
+    dax_dint temp;
+    dax_event_id eid;
+    char buff[MSG_DATA_SIZE];
+
+    size = strlen(pattern);
+    if(size > DAX_TAGNAME_SIZE + 1) {
+        return ERR_2BIG;
+    }
+    bzero(buff, 25);
+    temp = mtos_dint(ds, EVENT_PATTERN_INDEX); /* Index */
+    memcpy(buff, &temp, 4);
+    temp = mtos_dint(ds, type);          /* Datatype */
+    memcpy(&buff[12], &temp, 4);
+    temp = mtos_dint(ds, event_type);    /* Event Type */
+    memcpy(&buff[16], &temp, 4);
+    strcpy(&buff[25], pattern);
+    size += 26;
+
+    if((c = _conn_get(ds)) == NULL) return ERR_NO_SOCKET;
+    if(_message_send(ds, c->fd, MSG_EVNT_ADD, buff, size)) {
+        _conn_put(c);
+        return ERR_MSG_SEND;
+    }
+    len = sizeof(result);
+    test = _message_recv(ds, c->fd, MSG_EVNT_ADD, &result, &len, 1);
+    _conn_put(c);
+    if(test) {
+        return test;
+    }
+    eid.id = result;
+    eid.index = EVENT_PATTERN_INDEX;
+    if(id != NULL) {
+        *id = eid;
+    }
+    libdax_lock(ds->lock);
+    test = add_pattern_event(ds, eid, udata, callback, free_callback);
+    if(test == 0) set_event_def(ds, eid, buff, size);
+    libdax_unlock(ds->lock);
+    return test;
+}
+
+/* Adds an event that fires when the boolean expression becomes true.
+ * The expression can use tag names with an optional array index, the
+ * comparison operators ==, !=, <, <=, > and >=, the logical operators
+ * &&, || and ! and parentheses.  A tag without a comparison is true if
+ * it is non zero.  For example "Run && !Fault || Level[2] > 80.5".  The
+ * server evaluates the expression whenever one of the tags changes. */
+int
+dax_event_compound_add(dax_state *ds, char *expression, dax_event_id *id,
+                       void (*callback)(void *udata), void *udata,
+                       void (*free_callback)(void *udata))
+{
+    dax_conn *c;
+    int test, size, len;
+    dax_dint result;
+    dax_dint temp;
+    dax_event_id eid;
+    char buff[MSG_DATA_SIZE];
+
+    size = strlen(expression);
+    if(size > MSG_DATA_SIZE - 26) {
+        return ERR_2BIG;
+    }
+    bzero(buff, 25);
+    temp = mtos_dint(ds, EVENT_COMPOUND_INDEX); /* Index */
+    memcpy(buff, &temp, 4);
+    temp = mtos_dint(ds, EVENT_COMPOUND);    /* Event Type */
+    memcpy(&buff[16], &temp, 4);
+    strcpy(&buff[25], expression);
+    size += 26;
+
+    if((c = _conn_get(ds)) == NULL) return ERR_NO_SOCKET;
+    if(_message_send(ds, c->fd, MSG_EVNT_ADD, buff, size)) {
+        _conn_put(c);
+        return ERR_MSG_SEND;
+    }
+    len = sizeof(result);
+    test = _message_recv(ds, c->fd, MSG_EVNT_ADD, &result, &len, 1);
+    _conn_put(c);
+    if(test) {
+        return test;
+    }
+    eid.id = result;
+    eid.index = EVENT_COMPOUND_INDEX;
+    if(id != NULL) {
+        *id = eid;
+    }
+    libdax_lock(ds->lock);
+    test = add_event(ds, eid, udata, callback, free_callback);
+    if(test == 0) set_event_def(ds, eid, buff, size);
+    libdax_unlock(ds->lock);
+    return test;
+}
+
 int
 dax_event_del(dax_state *ds, dax_event_id id)
 {
+    dax_conn *c;
     int test, size;
-    dax_dint result;
     dax_dint temp;
     char buff[MSG_DATA_SIZE];
 
-    temp = mtos_dint(id.index);      /* Tag Index */
+    temp = mtos_dint(ds, id.index);      /* Tag Index */
     memcpy(buff, &temp, 4);
-    temp = mtos_dint(id.id);       /* Event ID */
+    /* The server may know the event by a different id if we've reconnected */
+    libdax_lock(ds->lock);
+    temp = mtos_dint(ds, event_server_id(ds, id)); /* Event ID */
+    libdax_unlock(ds->lock);
     memcpy(&buff[4], &temp, 4);
     size = 8;
     
-    libdax_lock(ds->lock);
-    if(_message_send(ds, MSG_EVNT_DEL, buff, size)) {
-        libdax_unlock(ds->lock);
+    if((c = _conn_get(ds)) == NULL) return ERR_NO_SOCKET;
+    if(_message_send(ds, c->fd, MSG_EVNT_DEL, buff, size)) {
+        _conn_put(c);
         return ERR_MSG_SEND;
     } else {
-        test = _message_recv(ds, MSG_EVNT_DEL, &result, &size, 1);
+        /* There's nothing in the response but we make sure of it */
+        size = 0;
+        test = _message_recv(ds, c->fd, MSG_EVNT_DEL, NULL, &size, 1);
+        _conn_put(c);
         if(test) {
-            libdax_unlock(ds->lock);
             return test;
         } else {
+            libdax_lock(ds->lock);
             del_event(ds, id);
+            libdax_unlock(ds->lock);
         }
     }
-    libdax_unlock(ds->lock);
-    return result;
-
-    
     return 0;
 }
 
@@ -768,6 +1565,7 @@ dax_event_mod(dax_state *ds, dax_event_id id, Handle *h, int event_type, void *d
 int
 dax_cdt_create(dax_state *ds, dax_cdt *cdt, tag_type *type)
 {
+    dax_conn *c;
     int size = 0, result;
     cdt_member *this;
     char test[DAX_TAGNAME_SIZE + 1];
@@ -808,25 +1606,25 @@ dax_cdt_create(dax_state *ds, dax_cdt *cdt, tag_type *type)
         this = this->next;
     }
 
-    libdax_lock(ds->lock);
-    result = _message_send(ds, MSG_CDT_CREATE, buff, size);
+    if((c = _conn_get(ds)) == NULL) return ERR_NO_SOCKET;
+    result = _message_send(ds, c->fd, MSG_CDT_CREATE, buff, size);
     
     if(result) { 
-        libdax_unlock(ds->lock);
+        _conn_put(c);
         return result;
     }
     
     size = 10;
-    result = _message_recv(ds, MSG_CDT_CREATE, rbuff, &size, 1);
+    result = _message_recv(ds, c->fd, MSG_CDT_CREATE, rbuff, &size, 1);
+    _conn_put(c);
     
     if(result == 0) {
         if(type != NULL) {
-            *type = stom_udint(*((tag_type *)rbuff));
+            *type = stom_udint(ds, *((tag_type *)rbuff));
         }
-        result = add_cdt_to_cache(ds, stom_udint(*((tag_type *)rbuff)), buff);
+        result = add_cdt_to_cache(ds, stom_udint(ds, *((tag_type *)rbuff)), buff);
         dax_cdt_free(cdt);
     }
-    libdax_unlock(ds->lock);
     return result;
 }
 
@@ -843,6 +1641,7 @@ dax_cdt_create(dax_state *ds, dax_cdt *cdt, tag_type *type)
 int
 dax_cdt_get(dax_state *ds, tag_type cdt_type, char *name)
 {
+    dax_conn *c;
     int result, size;
     char buff[MSG_DATA_SIZE];
     tag_type type;
@@ -855,24 +1654,25 @@ dax_cdt_get(dax_state *ds, tag_type cdt_type, char *name)
         size++; /* Add one for the sub command */
     } else {
         buff[0] = CDT_GET_TYPE;  /* Put the subcommand in the first byte */
-        *((u_int32_t *)&buff[1]) = mtos_udint(cdt_type); /* type in the next four */
+        *((u_int32_t *)&buff[1]) = mtos_udint(ds, cdt_type); /* type in the next four */
         size = 5;
     }
 
-    libdax_lock(ds->lock);
-    result = _message_send(ds, MSG_CDT_GET, buff, size);
+    if((c = _conn_get(ds)) == NULL) return ERR_NO_SOCKET;
+    result = _message_send(ds, c->fd, MSG_CDT_GET, buff, size);
     
     if(result) { 
-        libdax_unlock(ds->lock);
+        _conn_put(c);
         return ERR_MSG_SEND;
     }
     
     size = MSG_DATA_SIZE;
-    result = _message_recv(ds, MSG_CDT_GET, buff, &size, 1);
+    result = _message_recv(ds, c->fd, MSG_CDT_GET, buff, &size, 1);
+    _conn_put(c);
     if(result == 0) {
-        type = stom_udint(*((tag_type *)buff));
+        type = stom_udint(ds, *((tag_type *)buff));
+        /* This does it's own locking */
         result = add_cdt_to_cache(ds, type, &(buff[4]));
     }
-    libdax_unlock(ds->lock);
     return result;
 }
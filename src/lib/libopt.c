@@ -47,7 +47,11 @@ dax_init_config(dax_state *ds, char *name)
     result += dax_add_attribute(ds, "debugtopic", "topic", 'T', flags, "MAJOR");
     result += dax_add_attribute(ds, "name", "name", 'N', flags, name);
     result += dax_add_attribute(ds, "cachesize", "cachesize", 'Z', flags, "8");
+    result += dax_add_attribute(ds, "cacheage", "cacheage", 'A', flags, "1000");
+    result += dax_add_attribute(ds, "reconnect", "reconnect", 'R', flags, "5000");
+    result += dax_add_attribute(ds, "connections", "connections", 'Y', flags, "4");
     result += dax_add_attribute(ds, "msgtimeout", "msgtimeout", 'O', flags, DEFAULT_TIMEOUT);
+    result += dax_add_attribute(ds, "transport", "transport", 'X', flags, "socket");
 
     flags = CFG_CMDLINE | CFG_ARG_REQUIRED;
     result += dax_add_attribute(ds, "config", "config", 'C', flags, NULL);
@@ -428,6 +432,7 @@ _verify_config(dax_state *ds)
     if(ds->msgtimeout < MIN_TIMEOUT || ds->msgtimeout > MAX_TIMEOUT) {
         ds->msgtimeout = strtol(DEFAULT_TIMEOUT, NULL, 0);
     }
+    ds->uring = ! strcasecmp(dax_get_attr(ds, "transport"), "uring");
 //    if(inet_pton(AF_INET, dax_get_attr("serverip"), NULL)) != 1) {
 //        dax_error("serverip not set properly.  Going with default.");
 //
@@ -25,15 +25,6 @@
 
 static dax_state *ds;
 
-/* This is just a convenience since I needs to pass multiple pieces
- * of data back from the cdt_iter callback. */
-struct iter_udata {
-    lua_State *L;
-    void *data;
-    void *mask;
-    int error;
-};
-
 /* This function figures out what type of data the tag is and translates
  * buff appropriately and pushes the value onto the lua stack */
 static inline void
@@ -80,6 +71,57 @@ _read_to_stack(lua_State *L, tag_type type, void *buff)
 }
 
 
+/* Fills the table on the top of the stack with 'count' items of 'type'
+ * from buff.  The type is only checked once for the whole array. */
+#define ARRAY_TO_STACK(ctype) \
+    for(n = 0; n < count; n++) { \
+        lua_pushnumber(L, (lua_Number)((ctype *)buff)[n]); \
+        lua_rawseti(L, -2, n + 1); /* Lua likes 1 indexed arrays */ \
+    }
+
+static void
+_read_array_to_stack(lua_State *L, tag_type type, int count, void *buff)
+{
+    int n;
+
+    switch (type) {
+        case DAX_BYTE:
+            ARRAY_TO_STACK(dax_byte);
+            break;
+        case DAX_SINT:
+            ARRAY_TO_STACK(dax_sint);
+            break;
+        case DAX_WORD:
+        case DAX_UINT:
+            ARRAY_TO_STACK(dax_uint);
+            break;
+        case DAX_INT:
+            ARRAY_TO_STACK(dax_int);
+            break;
+        case DAX_DWORD:
+        case DAX_UDINT:
+        case DAX_TIME:
+            ARRAY_TO_STACK(dax_udint);
+            break;
+        case DAX_DINT:
+            ARRAY_TO_STACK(dax_dint);
+            break;
+        case DAX_REAL:
+            ARRAY_TO_STACK(dax_real);
+            break;
+        case DAX_LWORD:
+        case DAX_ULINT:
+            ARRAY_TO_STACK(dax_ulint);
+            break;
+        case DAX_LINT:
+            ARRAY_TO_STACK(dax_lint);
+            break;
+        case DAX_LREAL:
+            ARRAY_TO_STACK(dax_lreal);
+            break;
+    }
+}
+
 static void
 _push_base_datatype(lua_State *L, cdt_iter tag, void *data)
 {
@@ -110,51 +152,56 @@ _push_base_datatype(lua_State *L, cdt_iter tag, void *data)
         /* Push the data up to the lua interpreter stack */
         if(tag.count > 1) { /* We need to return a table */
             lua_createtable(L, tag.count, 0);
-            for(n = 0; n < tag.count ; n++) {
-                _read_to_stack(L, tag.type, data + (TYPESIZE(tag.type) / 8) * n);
-                lua_rawseti(L, -2, n + 1); /* Lua likes 1 indexed arrays */
-            }
+            _read_array_to_stack(L, tag.type, tag.count, data);
         } else { /* It's a single value */
             _read_to_stack(L, tag.type, data);
         }
     }
 }
 
-/* When the dax_cdt_iter() function that refers to this function returns
- * there should be a table at the top of the stack that represents the
- * contents of the member given by 'member' */
+/* Copies a conversion plan op into the cdt_iter that the base
+ * datatype functions use */
+static inline void
+_op_to_iter(dax_cdt_op *op, cdt_iter *iter)
+{
+    iter->name = op->name;
+    iter->type = op->type;
+    iter->count = op->count;
+    iter->byte = op->byte;
+    iter->bit = op->bit;
+}
+
+/* Runs the conversion plan for one element of a compound datatype.  The
+ * members are added to the table on the top of the stack.  Nested
+ * datatypes get their own tables that are pushed at CDT_OP_ENTER and
+ * stored in their parent at CDT_OP_LEAVE so the stack always mirrors
+ * the nesting of the plan. */
 static void
-_read_callback(cdt_iter member, void *udata)
+_ops_to_lua(lua_State *L, dax_cdt_op *ops, int count, unsigned char *data)
 {
-    lua_State *L = ((struct iter_udata *)udata)->L;
-    unsigned char *data = ((struct iter_udata *)udata)->data;
-    int offset, n;
-    struct iter_udata newdata;
+    int n;
+    cdt_iter iter;
 
-    lua_pushstring(L, member.name);
-            
-    if(IS_CUSTOM(member.type)) {
-        lua_newtable(L);
-        newdata.L = L;
-        newdata.mask = NULL;
-        newdata.error = 0;
-        
-        if(member.count > 1) {
-            for(n = 0;n < member.count; n++) {
+    for(n = 0; n < count; n++) {
+        switch(ops[n].op) {
+            case CDT_OP_VALUE:
+                _op_to_iter(&ops[n], &iter);
+                _push_base_datatype(L, iter, data + ops[n].byte);
+                lua_setfield(L, -2, ops[n].name);
+                break;
+            case CDT_OP_ENTER:
+                luaL_checkstack(L, 2, "Datatype nested too deep");
                 lua_newtable(L);
-                offset = member.byte + (n * dax_get_typesize(ds, member.type));
-                newdata.data = data + offset;
-                dax_cdt_iter(ds, member.type, &newdata , _read_callback);
-                lua_rawseti(L, -2, n + 1);
-            }
-        } else {
-            newdata.data = data + member.byte;
-            dax_cdt_iter(ds, member.type, &newdata, _read_callback);
+                break;
+            case CDT_OP_LEAVE:
+                if(ops[n].name != NULL) {
+                    lua_setfield(L, -2, ops[n].name);
+                } else {
+                    lua_rawseti(L, -2, ops[n].index + 1);
+                }
+                break;
         }
-    } else {
-        _push_base_datatype(L, member, data + member.byte);
     }
-    lua_rawset(L, -3);
 }
 
 /* This is the top level function for taking the data that is is in *data,
@@ -164,27 +211,25 @@ static void
 _send_tag_to_lua(lua_State *L, Handle h, void *data)
 {
     cdt_iter tag;
-    struct iter_udata udata;
-    int offset, n;
-    
-    udata.L = L;
-    udata.data = data;
-    udata.mask = NULL;
-    udata.error = 0;
+    dax_cdt_op *ops;
+    int opcount, size, n, result;
 
     if(IS_CUSTOM(h.type)) {
-        lua_newtable(L);
-        
+        result = dax_cdt_ops(ds, h.type, &ops, &opcount);
+        if(result) {
+            luaL_error(L, "Unable to get datatype conversion - %d", result);
+        }
         if(h.count > 1) {
+            size = dax_get_typesize(ds, h.type);
+            lua_createtable(L, h.count, 0);
             for(n = 0; n < h.count; n++) {
-                lua_newtable(L);    
-                offset = n * dax_get_typesize(ds, h.type);
-                udata.data = (char *)data + offset;
-                dax_cdt_iter(ds, h.type, &udata, _read_callback);
+                lua_newtable(L);
+                _ops_to_lua(L, ops, opcount, (unsigned char *)data + n * size);
                 lua_rawseti(L, -2, n+1);
             }
         } else {
-            dax_cdt_iter(ds, h.type, &udata, _read_callback);
+            lua_newtable(L);
+            _ops_to_lua(L, ops, opcount, data);
         }
     } else {
         tag.count = h.count;
@@ -321,131 +366,96 @@ _pop_base_datatype(lua_State *L, cdt_iter tag, void *data, void *mask)
     return 0;
 }
 
-/* This is the recursive callback function that is passed to
- * dax_cdt_iter() to handle the compound data types.  If the
- * type has nested cdt's then this function will call itself */
-static void
-_write_callback(cdt_iter member, void *udata)
+/* Runs the conversion plan for one element of a compound datatype
+ * taking the values from the table on the top of the stack.  Members
+ * that are nil are skipped, for a nested datatype that means skipping
+ * ahead to its CDT_OP_LEAVE.  On error the message is left on the top
+ * of the stack. */
+static int
+_ops_from_lua(lua_State *L, dax_cdt_op *ops, int count, unsigned char *data, unsigned char *mask)
 {
-    struct iter_udata newdata;
-    
-    lua_State *L = ((struct iter_udata *)udata)->L;
-    unsigned char *data = ((struct iter_udata *)udata)->data;
-    unsigned char *mask = ((struct iter_udata *)udata)->mask;
-    int offset, n, result = 0;
-    
-    if(IS_CUSTOM(member.type)) {
-        newdata.L = L;
-        newdata.error = 0;
-        lua_pushstring(L, member.name);
-        lua_rawget(L, -2);
-        if(member.count > 1) {
-            for(n = 0;n < member.count; n++) {
-                offset = member.byte + (n * dax_get_typesize(ds, member.type));
-                newdata.data = (char *)data + offset;
-                newdata.mask = (char *)mask + offset;
-                if( ! lua_istable(L, -1) ) {
-                    lua_pushfstring(L, "Table needed to set - %s", member.name);
-                    ((struct iter_udata *)udata)->error = -1;
-                    return;
-                }
-                lua_rawgeti(L, -1, n+1);
+    int n, result;
+    cdt_iter iter;
+
+    for(n = 0; n < count; n++) {
+        switch(ops[n].op) {
+            case CDT_OP_VALUE:
+                lua_pushstring(L, ops[n].name);
+                lua_rawget(L, -2);
                 if(! lua_isnil(L, -1)) {
-                    if( ! lua_istable(L, -1) ) {
-                        lua_pop(L, 1);
-                        lua_pushfstring(L, "Table needed to set - %s", member.name);
-                        ((struct iter_udata *)udata)->error = -1;
-                        return;
-                    }
-                    dax_cdt_iter(ds, member.type, &newdata , _write_callback);
+                    _op_to_iter(&ops[n], &iter);
+                    result = _pop_base_datatype(L, iter, data + ops[n].byte, mask + ops[n].byte);
+                    if(result) return result;
                 }
                 lua_pop(L, 1);
-                if(newdata.error) {
-                    ((struct iter_udata *)udata)->error = newdata.error;
-                    return;
+                break;
+            case CDT_OP_ENTER:
+                luaL_checkstack(L, 2, "Datatype nested too deep");
+                if(ops[n].name != NULL) {
+                    lua_pushstring(L, ops[n].name);
+                    lua_rawget(L, -2);
+                } else {
+                    lua_rawgeti(L, -1, ops[n].index + 1);
                 }
-            }
-        } else {
-            newdata.data = (char *)data + member.byte;
-            newdata.mask = (char *)mask + member.byte;
-            if(! lua_isnil(L, -1)) {
-                if( ! lua_istable(L, -1) ) {
-                    lua_pushfstring(L, "Table needed to set - %s", member.name);
-                    ((struct iter_udata *)udata)->error = -1;
-                    return;
+                if(lua_isnil(L, -1)) {
+                    lua_pop(L, 1);
+                    n = ops[n].skip; /* Jump to the matching CDT_OP_LEAVE */
+                } else if(! lua_istable(L, -1)) {
+                    if(ops[n].name != NULL) {
+                        lua_pushfstring(L, "Table needed to set - %s", ops[n].name);
+                    } else {
+                        lua_pushfstring(L, "Table needed to set element %d", ops[n].index);
+                    }
+                    return -1;
                 }
-                dax_cdt_iter(ds, member.type, &newdata, _write_callback);
-            }
-            if(newdata.error) {
-                ((struct iter_udata *)udata)->error = newdata.error;
-                return;
-            }
-        }
-        lua_pop(L, 1);
-    } else {
-        lua_pushstring(L, member.name);
-        lua_rawget(L, -2);
-        if(! lua_isnil(L, -1)) {
-            result = _pop_base_datatype(L, member, data + member.byte, mask + member.byte);
+                break;
+            case CDT_OP_LEAVE:
+                lua_pop(L, 1);
+                break;
         }
-        lua_pop(L, 1);
-    }
-    if(result) {
-        ((struct iter_udata *)udata)->error = result;
     }
+    return 0;
 }
 
 /* This function takes care of the top level of the tag.  If the tag
  * is a simple base datatype tag then the _pop_base_datatype() function
  * is called directly and write is complete.  If the tag is a compound
- * datatype then the top level is taken care of and then it's turned
- * over to the recursive write_callback() function through the
- * cdt iterator. */
+ * datatype then each element is handed to _ops_from_lua() along with
+ * the conversion plan for the datatype. */
 static int
 _get_tag_from_lua(lua_State *L, Handle h, void* data, void *mask){
     cdt_iter tag;
-    struct iter_udata udata;
-    int n, offset;
+    dax_cdt_op *ops;
+    int n, offset, opcount, result;
     
     if(IS_CUSTOM(h.type)) {
-        udata.L = L;
-        udata.error = 0;
+        if(lua_isnil(L, -1)) return 0;
+        if( ! lua_istable(L, -1) ) {
+            lua_pushstring(L, "Table needed to set Tag");
+            return -1;
+        }
+        result = dax_cdt_ops(ds, h.type, &ops, &opcount);
+        if(result) {
+            lua_pushfstring(L, "Unable to get datatype conversion - %d", result);
+            return result;
+        }
         if(h.count > 1) {
             for(n = 0; n < h.count; n++) {
                 offset = n * dax_get_typesize(ds, h.type);
-                udata.data = (char *)data + offset;
-                udata.mask = (char *)mask + offset;
-                if( ! lua_istable(L, -1) ) {
-                    lua_pushfstring(L, "Table needed to set - %s", tag.name);
-                    return -1;
-                }
                 lua_rawgeti(L, -1, n+1);
                 if(! lua_isnil(L, -1)) {
                     if( ! lua_istable(L, -1) ) {
-                        lua_pop(L, 1);
                         lua_pushstring(L, "Table needed to set tag");
                         return -1;
                     }
-                    dax_cdt_iter(ds, h.type, &udata , _write_callback);
+                    result = _ops_from_lua(L, ops, opcount, (unsigned char *)data + offset,
+                                           (unsigned char *)mask + offset);
+                    if(result) return result;
                 }
                 lua_pop(L, 1);
-                if(udata.error) {
-                    return udata.error;
-                }
             }
         } else {
-            udata.data = data;
-            udata.mask = mask;
-            if(! lua_isnil(L, -1)) {
-                if( ! lua_istable(L, -1) ) {
-                    lua_pushstring(L, "Table needed to set Tag");
-                    return -1;
-                }
-                dax_cdt_iter(ds, h.type, &udata, _write_callback);
-            }
-            if(udata.error) {
-                return udata.error;
-            }
+            return _ops_from_lua(L, ops, opcount, data, mask);
         }
     } else {
         tag.count = h.count;
@@ -621,6 +631,67 @@ _tag_get(lua_State *L)
 }
 
 
+/* Prepared tags are passed to Lua as full userdata that holds the
+ * dax_prepared pointer.  The metatable frees the prepared tag when
+ * the garbage collector gets the userdata. */
+#define PREPARED_META "dax_prepared"
+
+static int
+_prepared_gc(lua_State *L)
+{
+    dax_prepared **p;
+
+    p = (dax_prepared **)luaL_checkudata(L, 1, PREPARED_META);
+    dax_prepared_free(*p);
+    *p = NULL;
+    return 0;
+}
+
+/* Returns the prepared tag at 'index' or NULL if it isn't one */
+static dax_prepared *
+_to_prepared(lua_State *L, int index)
+{
+    dax_prepared **p;
+
+    if(lua_type(L, index) != LUA_TUSERDATA) return NULL;
+    p = (dax_prepared **)luaL_checkudata(L, index, PREPARED_META);
+    if(*p == NULL) {
+        luaL_error(L, "Prepared tag has already been freed");
+    }
+    return *p;
+}
+
+/* Parses the tag name once and returns an object that can be passed
+ * to tag_read() and tag_write() in place of the name.  Arguments...
+    First - tagname
+    Second - count (optional) */
+static int
+_tag_prepare(lua_State *L)
+{
+    int result;
+    dax_prepared **p;
+
+    if(ds == NULL) {
+        luaL_error(L, "OpenDAX is not initialized");
+    }
+    if(lua_gettop(L) < 1 || lua_gettop(L) > 2) {
+        luaL_error(L, "Wrong number of arguments passed to tag_prepare()");
+    }
+    p = (dax_prepared **)lua_newuserdata(L, sizeof(dax_prepared *));
+    *p = NULL;
+    if(luaL_newmetatable(L, PREPARED_META)) {
+        lua_pushcfunction(L, _prepared_gc);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+
+    result = dax_tag_prepare(ds, p, (char *)lua_tostring(L, 1), lua_tointeger(L, 2));
+    if(result) {
+        luaL_error(L, "dax_tag_prepare() returned %d", result);
+    }
+    return 1;
+}
+
 /* These are the main data transfer functions.  These are wrappers for
  * the dax_read/write/mask function. */
 static int
@@ -629,10 +700,20 @@ _tag_read(lua_State *L) {
     int count, result;
     Handle h;
     void *data;
+    dax_prepared *p;
     
     if(ds == NULL) {
         luaL_error(L, "OpenDAX is not initialized");
     }
+    if((p = _to_prepared(L, 1)) != NULL) {
+        result = dax_prepared_read(ds, p);
+        if(result) {
+            luaL_error(L, "dax_prepared_read() returned %d", result);
+        }
+        dax_prepared_handle(ds, p, &h);
+        _send_tag_to_lua(L, h, dax_prepared_data(p));
+        return 1;
+    }
     if(lua_gettop(L) != 2) {
         luaL_error(L, "Wrong number of arguments passed to tag_read()");
     }
@@ -677,6 +758,7 @@ _tag_write(lua_State *L) {
     int result, n;
     Handle h;
     void *data, *mask;
+    dax_prepared *p;
     
     if(ds == NULL) {
         luaL_error(L, "OpenDAX is not initialized");
@@ -684,6 +766,32 @@ _tag_write(lua_State *L) {
     if(lua_gettop(L) != 2) {
         luaL_error(L, "Wrong number of arguments passed to tag_write()");
     }
+    if((p = _to_prepared(L, 1)) != NULL) {
+        result = dax_prepared_handle(ds, p, &h);
+        if(result) {
+            luaL_error(L, "dax_prepared_handle() returned %d", result);
+        }
+        data = dax_prepared_data(p);
+        mask = dax_prepared_mask(p);
+        bzero(mask, h.size);
+        if(_get_tag_from_lua(L, h, data, mask)) {
+            lua_error(L);
+        }
+        for(n = 0; n < h.size && q == 0; n++) {
+            if( ((unsigned char *)mask)[n] != 0xFF) {
+                q = 1;
+            }
+        }
+        if(q) {
+            result = dax_prepared_mask_write(ds, p);
+        } else {
+            result = dax_prepared_write(ds, p);
+        }
+        if(result) {
+            luaL_error(L, "dax_prepared_write() returned %d", result);
+        }
+        return 0;
+    }
     name = (char *)lua_tostring(L, 1);
     //printf("Getting Handle for %s\n", name);
     result = dax_tag_handle(ds, &h, name, 0);
@@ -766,6 +874,19 @@ _event_callback(void *data) {
     lua_call(rdata->L, 1, 0);
 }
 
+/* Same as above but for pattern subscriptions.  The Lua function is
+ * passed the index of the tag that caused the event as its second
+ * argument */
+static void
+_event_pattern_callback(tag_index idx, void *data) {
+    event_ref_data *rdata;
+    rdata = (event_ref_data *)data;
+    lua_rawgeti(rdata->L, LUA_REGISTRYINDEX, rdata->function);
+    lua_rawgeti(rdata->L, LUA_REGISTRYINDEX, rdata->data);
+    lua_pushinteger(rdata->L, idx);
+    lua_call(rdata->L, 2, 0);
+}
+
 /* Takes a string as an argument and returns the event type that the
  * string represents.  Returns ERR_ARG if it can't find a match */
 static int
@@ -786,6 +907,16 @@ _get_event_type(char *str) {
         return EVENT_GREATER;
     } else if(strcasecmp(str, "LESS") == 0) {
         return EVENT_LESS;
+    } else if(strcasecmp(str, "TAG_ADDED") == 0) {
+        return EVENT_TAG_ADDED;
+    } else if(strcasecmp(str, "TAG_DELETED") == 0) {
+        return EVENT_TAG_DELETED;
+    } else if(strcasecmp(str, "CDT_CREATED") == 0) {
+        return EVENT_CDT_CREATED;
+    } else if(strcasecmp(str, "RISE") == 0) {
+        return EVENT_RISE;
+    } else if(strcasecmp(str, "FALL") == 0) {
+        return EVENT_FALL;
     } else {
         return ERR_ARG;
     }
@@ -859,19 +990,21 @@ _convert_lua_number(tag_type datatype, void **data, lua_Number x) {
  * 4 - number - event data
  * 5 - function - callback function
  * 6 - ** - callback data
+ * 7 - number - hysteresis for RISE and FALL events (optional)
  * The function returns a table that can be used in other functions.  The
  * Lua script should probably not mess with the members of this table. */ 
 static int
 _event_add(lua_State *L) {
     char *str;
-    int count, type, result;
+    int count, type, result, size;
     lua_Number number;
     Handle h;
     event_ref_data *edata;
     dax_event_id id;
     void *data;
+    char values[sizeof(dax_type_union) * 2];
 
-    if(lua_gettop(L) != 6) {
+    if(lua_gettop(L) != 6 && lua_gettop(L) != 7) {
         luaL_error(L, "Wrong number of arguments passed to event_add()");
     }
     if(lua_isnil(L, 5) || lua_tonumber(L, 5) == 0) {
@@ -903,6 +1036,17 @@ _event_add(lua_State *L) {
     /* Get the data that we need for < > = and deadband events. */
     number = lua_tonumber(L, 4);
     _convert_lua_number(h.type, &data, number);
+    /* Edge events need the hysteresis right after the threshold */
+    if((type == EVENT_RISE || type == EVENT_FALL) && data != NULL) {
+        size = TYPESIZE(h.type) / 8;
+        memcpy(values, data, size);
+        _convert_lua_number(h.type, &data, lua_tonumber(L, 7));
+        memcpy(&values[size], data, size);
+        data = values;
+    }
+    if(lua_gettop(L) == 7) {
+        lua_pop(L, 1);
+    }
     /* The data that was passed is actually at the top of the stack */
     edata->data = luaL_ref(L, LUA_REGISTRYINDEX); /* Also pops the value */
     /* Now the function should be at the top of the stack */
@@ -921,6 +1065,107 @@ _event_add(lua_State *L) {
     return 1;
 }
 
+/* Used to add a pattern subscription to the server.  The arguments are...
+ * 1 - string - tagname pattern ie "Line3_*"
+ * 2 - string - datatype or nil for any type
+ * 3 - string - event type (WRITE, CHANGE, TAG_ADDED, TAG_DELETED or CDT_CREATED)
+ * 4 - function - callback function
+ * 5 - ** - callback data
+ * The callback is passed the callback data and the index of the tag.
+ * The function returns a table that can be passed to event_del() */
+static int
+_event_pattern_add(lua_State *L) {
+    char *pattern, *str;
+    int type, result;
+    tag_type datatype = 0;
+    event_ref_data *edata;
+    dax_event_id id;
+
+    if(lua_gettop(L) != 5) {
+        luaL_error(L, "Wrong number of arguments passed to event_pattern_add()");
+    }
+    if(!lua_isfunction(L, 4)) {
+        luaL_error(L, "Argument 4 to event_pattern_add() should be a function");
+    }
+    pattern = (char *)lua_tostring(L, 1);
+    if(pattern == NULL) {
+        luaL_error(L, "Argument 1 to event_pattern_add() should be a string");
+    }
+    if(!lua_isnil(L, 2)) {
+        datatype = dax_string_to_type(ds, (char *)lua_tostring(L, 2));
+        if(datatype == 0) {
+            luaL_error(L, "%s is not a valid datatype", lua_tostring(L, 2));
+        }
+    }
+    str = (char *)lua_tostring(L, 3);
+    type = _get_event_type(str);
+    if(type < 0) {
+        luaL_error(L, "%s is not a valid event type", str);
+    }
+    edata = malloc(sizeof(event_ref_data));
+    if(edata == NULL) {
+        luaL_error(L, "Unable to allocate memory");
+    }
+    /* The data is at the top of the stack with the function below it */
+    edata->data = luaL_ref(L, LUA_REGISTRYINDEX);
+    edata->function = luaL_ref(L, LUA_REGISTRYINDEX);
+    edata->L = L;
+    result = dax_event_pattern_add(ds, pattern, datatype, type, &id,
+                                   _event_pattern_callback, edata, NULL);
+    if(result) {
+        free(edata);
+        luaL_error(L, "Unable to add pattern event to server - result = %d", result);
+    }
+    lua_createtable(L, 2, 0);
+    lua_pushinteger(L, id.index);
+    lua_rawseti(L, -2, 1);
+    lua_pushinteger(L, id.id);
+    lua_rawseti(L, -2, 2);
+    return 1;
+}
+
+/* Used to add a compound event to the server.  The arguments are...
+ * 1 - string - expression ie "Run && !Fault || Level > 80"
+ * 2 - function - callback function
+ * 3 - ** - callback data
+ * The function returns a table that can be passed to event_del() */
+static int
+_event_compound_add(lua_State *L) {
+    char *expression;
+    int result;
+    event_ref_data *edata;
+    dax_event_id id;
+
+    if(lua_gettop(L) != 3) {
+        luaL_error(L, "Wrong number of arguments passed to event_compound_add()");
+    }
+    if(!lua_isfunction(L, 2)) {
+        luaL_error(L, "Argument 2 to event_compound_add() should be a function");
+    }
+    expression = (char *)lua_tostring(L, 1);
+    if(expression == NULL) {
+        luaL_error(L, "Argument 1 to event_compound_add() should be a string");
+    }
+    edata = malloc(sizeof(event_ref_data));
+    if(edata == NULL) {
+        luaL_error(L, "Unable to allocate memory");
+    }
+    edata->data = luaL_ref(L, LUA_REGISTRYINDEX);
+    edata->function = luaL_ref(L, LUA_REGISTRYINDEX);
+    edata->L = L;
+    result = dax_event_compound_add(ds, expression, &id, _event_callback, edata, NULL);
+    if(result) {
+        free(edata);
+        luaL_error(L, "Unable to add compound event to server - result = %d", result);
+    }
+    lua_createtable(L, 2, 0);
+    lua_pushinteger(L, id.index);
+    lua_rawseti(L, -2, 1);
+    lua_pushinteger(L, id.id);
+    lua_rawseti(L, -2, 2);
+    return 1;
+}
+
 /* Used to delete an event from the server.  The arguement is a single
  * table that would have been returned from _add_event().  It returns
  * nothing */
@@ -983,6 +1228,80 @@ _event_poll(lua_State *L) {
 }
 
 
+/* Wrappers for dax_cache_add() and dax_cache_del().  The arguments are
+ * the same as tag_read().  Reads of the same tag and count will be
+ * answered from the data cache until the tag changes. */
+static int
+_cache_handle(lua_State *L, char *func, Handle *h)
+{
+    int result;
+
+    if(ds == NULL) {
+        luaL_error(L, "OpenDAX is not initialized");
+    }
+    if(lua_gettop(L) != 2) {
+        luaL_error(L, "Wrong number of arguments passed to %s()", func);
+    }
+    result = dax_tag_handle(ds, h, (char *)lua_tostring(L, 1), lua_tointeger(L, 2));
+    if(result) {
+        luaL_error(L, "dax_tag_handle() returned %d", result);
+    }
+    return 0;
+}
+
+static int
+_cache_add(lua_State *L) {
+    int result;
+    Handle h;
+
+    _cache_handle(L, "cache_add", &h);
+    result = dax_cache_add(ds, &h);
+    if(result) {
+        luaL_error(L, "dax_cache_add() returned %d", result);
+    }
+    return 0;
+}
+
+static int
+_cache_del(lua_State *L) {
+    int result;
+    Handle h;
+
+    _cache_handle(L, "cache_del", &h);
+    result = dax_cache_del(ds, &h);
+    if(result) {
+        luaL_error(L, "dax_cache_del() returned %d", result);
+    }
+    return 0;
+}
+
+/* Returns a table with the data cache statistics.  If the first
+ * argument is true the counters are reset after they are read. */
+static int
+_cache_stats(lua_State *L) {
+    dax_cache_stats stats;
+
+    if(ds == NULL) {
+        luaL_error(L, "OpenDAX is not initialized");
+    }
+    dax_cache_stats_get(ds, &stats);
+    if(lua_toboolean(L, 1)) {
+        dax_cache_stats_reset(ds);
+    }
+    lua_createtable(L, 0, 5);
+    lua_pushinteger(L, stats.hits);
+    lua_setfield(L, -2, "hits");
+    lua_pushinteger(L, stats.misses);
+    lua_setfield(L, -2, "misses");
+    lua_pushinteger(L, stats.expired);
+    lua_setfield(L, -2, "expired");
+    lua_pushinteger(L, stats.invalidations);
+    lua_setfield(L, -2, "invalidations");
+    lua_pushinteger(L, stats.entries);
+    lua_setfield(L, -2, "entries");
+    return 1;
+}
+
 /* This is used by C program / modules that would like to take care of all
  * the allocation, initialization and configuration of their dax_state
  * objects.  It is very critical for that C function not to lose track of
@@ -1001,12 +1320,18 @@ static const struct luaL_Reg daxlib[] = {
     {"cdt_create", _cdt_create},
     {"tag_add", _tag_add},
     {"tag_get", _tag_get},
+    {"tag_prepare", _tag_prepare},
     {"tag_read", _tag_read},
     {"tag_write", _tag_write},
     {"event_add", _event_add},
+    {"event_pattern_add", _event_pattern_add},
+    {"event_compound_add", _event_compound_add},
     {"event_del", _event_del},
     {"event_wait", _event_wait},
     {"event_poll", _event_poll},
+    {"cache_add", _cache_add},
+    {"cache_del", _cache_del},
+    {"cache_stats", _cache_stats},
     {NULL, NULL}  /* sentinel */
 };
 
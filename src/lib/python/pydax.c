@@ -394,158 +394,252 @@ _dax_to_python(tag_type type, dax_type_union value)
     return po;
 }
 
-static void
-_read_callback(cdt_iter member, void *udata)
+/* Builds a list of 'count' items of 'type' from buff.  The type is
+ * only checked once for the whole array. */
+#define ARRAY_TO_LIST(ctype, make) \
+    for(n = 0; n < count; n++) { \
+        item = make(((ctype *)buff)[n]); \
+        if(item == NULL) { \
+            Py_DECREF(po); \
+            return NULL; \
+        } \
+        PyList_SET_ITEM(po, n, item); \
+    }
+
+static PyObject *
+_array_to_python(tag_type type, u_int32_t count, void *buff)
 {
-    unsigned char *data = ((struct iter_udata *)udata)->data;
-    PyObject *po = ((struct iter_udata *)udata)->po;
-    PyObject *item = NULL;
-    int bit, byte, n;
-
-/********TESTING*************
-    PySys_WriteStdout("_read_callback() called for member %s\n", member.name);
-    PySys_WriteStdout("member.type = %s\n", dax_type_to_string(ds, member.type));
-    PySys_WriteStdout("member.byte = %d\n", member.byte);
-    PySys_WriteStdout("member.bit = %d\n", member.bit);
-    PySys_WriteStdout("member.count = %d\n", member.count);
-    PySys_WriteStdout("_read_callback() called for member %s\n", member.name);
-    PySys_WriteStdout("_read_callback() - udata = %p\n", udata);
-    PySys_WriteStdout("_read_callback() - data = %p\n", data);
-    PySys_WriteStdout("_read_callback() - po = %p\n", po);
-    for(n = 0; n < 3; n++) {
-        PySys_WriteStdout("_read_callback() - data[%d] = 0x%2X\n", n, data[n]);
-    }
-*/
-    /* This handles the odd case where we have BOOLS that have a bit index
-     * other than 0.  _create_py_object() can handle the others.  We put
-     * this here because having a bit offset other than 0 only makes sense
-     * in the context of a CDT */
-    if(member.type == DAX_BOOL && member.bit != 0) {
-        byte = member.byte;
-        bit = member.bit;
-        if(member.count > 1) {
-            item = PyList_New(member.count);
-            if(item == NULL) {
-                ((struct iter_udata *)udata)->error = 1;
-                return;
-            }
-            for(n = 0; n < member.count; n++) {
-//                PySys_WriteStdout("_read_callback() - byte = %d, bit -= %d, 0x%X << 0x%X\n", byte, bit, ((u_int8_t *)data)[byte], (0x01 << bit));
+    int n;
+    PyObject *po, *item;
+
+    po = PyList_New(count);
+    if(po == NULL) return NULL;
+    switch (type) {
+        case DAX_BYTE:
+            ARRAY_TO_LIST(dax_byte, PyInt_FromLong);
+            break;
+        case DAX_SINT:
+            ARRAY_TO_LIST(dax_sint, PyInt_FromLong);
+            break;
+        case DAX_WORD:
+        case DAX_UINT:
+            ARRAY_TO_LIST(dax_uint, PyInt_FromLong);
+            break;
+        case DAX_INT:
+            ARRAY_TO_LIST(dax_int, PyInt_FromLong);
+            break;
+        case DAX_DWORD:
+        case DAX_UDINT:
+        case DAX_TIME:
+            ARRAY_TO_LIST(dax_udint, PyLong_FromUnsignedLong);
+            break;
+        case DAX_DINT:
+            ARRAY_TO_LIST(dax_dint, PyLong_FromLong);
+            break;
+        case DAX_REAL:
+            ARRAY_TO_LIST(dax_real, PyFloat_FromDouble);
+            break;
+        case DAX_LWORD:
+        case DAX_ULINT:
+            ARRAY_TO_LIST(dax_ulint, PyFloat_FromDouble);
+            break;
+        case DAX_LINT:
+            ARRAY_TO_LIST(dax_lint, PyFloat_FromDouble);
+            break;
+        case DAX_LREAL:
+            ARRAY_TO_LIST(dax_lreal, PyFloat_FromDouble);
+            break;
+        default:
+            Py_DECREF(po);
+            PyErr_SetString(PyExc_Exception, "Bad Data Type Passed");
+            return NULL;
+    }
+    return po;
+}
 
-                if(((u_int8_t *)data)[byte] & (0x01 << bit)) {
-                    Py_INCREF(Py_True);
-                    PyList_SetItem(item, n, Py_True);
+/* Converts 'count' BOOLs starting at 'bit' in buff */
+static PyObject *
+_bool_to_python(u_int32_t count, int bit, void *buff)
+{
+    int n, b;
+    PyObject *po, *item;
+
+    if(count == 1) {
+        if(((u_int8_t *)buff)[bit/8] & (0x01 << bit%8)) {
+            Py_RETURN_TRUE;
+        } else {
+            Py_RETURN_FALSE;
+        }
+    }
+    po = PyList_New(count);
+    if(po == NULL) return NULL;
+    for(n = 0; n < count; n++) {
+        b = n + bit;
+        item = (((u_int8_t *)buff)[b/8] & (0x01 << b%8)) ? Py_True : Py_False;
+        Py_INCREF(item);
+        PyList_SET_ITEM(po, n, item);
+    }
+    return po;
+}
+
+/* Runs the conversion plan for one element of a compound datatype and
+ * returns a dictionary of the members.  Nested datatypes are built on
+ * an explicit stack of containers instead of by recursion.  A datatype
+ * member that is an array becomes a list of dictionaries. */
+static PyObject *
+_ops_to_python(dax_cdt_op *ops, int count, unsigned char *data)
+{
+    int n, depth = 0;
+    PyObject **stack, *item;
+
+    /* Every CDT_OP_ENTER has a CDT_OP_LEAVE so we can't go deeper than this */
+    stack = malloc(sizeof(PyObject *) * (count / 2 + 1));
+    if(stack == NULL) return PyErr_NoMemory();
+    stack[0] = PyDict_New();
+    if(stack[0] == NULL) goto error;
+
+    for(n = 0; n < count; n++) {
+        switch(ops[n].op) {
+            case CDT_OP_VALUE:
+                if(ops[n].type == DAX_BOOL) {
+                    item = _bool_to_python(ops[n].count, ops[n].bit, data + ops[n].byte);
                 } else {
-                    Py_INCREF(Py_False);
-                    PyList_SetItem(item, n, Py_False);
+                    item = _create_py_object(data + ops[n].byte, ops[n].type, ops[n].count);
                 }
-                bit++;
-                if(bit == 8) {
-                    bit = 0;
-                    byte++;
+                if(item == NULL) goto error;
+                PyDict_SetItemString(stack[depth], ops[n].name, item);
+                Py_DECREF(item);
+                break;
+            case CDT_OP_ENTER:
+                if(ops[n].name != NULL && ops[n].count > 1) {
+                    item = PyList_New(ops[n].count);
+                } else {
+                    item = PyDict_New();
                 }
-            }
-        } else {
-            if(((u_int8_t *)data)[byte] & (0x01 << bit)) {
-                Py_INCREF(Py_True);
-                item = Py_True;
-            } else {
-                Py_INCREF(Py_False);
-                item = Py_False;
-            }
-        }
-    } else {
-//        PySys_WriteStdout("_read_callback() - About to call _create_py_object() for...\n");
-        item = _create_py_object((void *)(data + member.byte), member.type, member.count);
-        if(item == NULL) {
-            ((struct iter_udata *)udata)->error = 1;
-            return;
+                if(item == NULL) goto error;
+                stack[++depth] = item;
+                break;
+            case CDT_OP_LEAVE:
+                item = stack[depth--];
+                if(ops[n].name != NULL) {
+                    PyDict_SetItemString(stack[depth], ops[n].name, item);
+                    Py_DECREF(item);
+                } else {
+                    PyList_SET_ITEM(stack[depth], ops[n].index, item);
+                }
+                break;
         }
     }
-    PyDict_SetItemString(po, member.name, item);
-    Py_DECREF(item);
-
+    item = stack[0];
+    free(stack);
+    return item;
+error:
+    while(depth >= 0) {
+        Py_XDECREF(stack[depth]);
+        depth--;
+    }
+    free(stack);
+    return NULL;
 }
 
 /* This function takes a read buffer, tag type and tag count and converts
  * data in the buffer into a Python object that is best described by this
- * data.  The function is re-entrant and may be called recursively through
- * the cdt iterater callback mechanism */
+ * data.  Compound datatypes are converted with the flattened conversion
+ * plan from the library. */
 static PyObject *
 _create_py_object(void *buff, tag_type type, u_int32_t count)
 {
-    int n, offset;
+    int n, opcount, size;
     PyObject *po, *item;
-    struct iter_udata udata;
+    dax_cdt_op *ops;
     
     if(type == DAX_BOOL) {
+        return _bool_to_python(count, 0, buff);
+    } else if(IS_CUSTOM(type)) {
+        if(dax_cdt_ops(ds, type, &ops, &opcount)) {
+            PyErr_SetString(PyExc_Exception, "Unable to get datatype");
+            return NULL;
+        }
         if(count > 1) {
+            size = dax_get_typesize(ds, type);
             po = PyList_New(count);
             if(po == NULL) return NULL;
             for(n = 0; n < count; n++) {
-                if(((u_int8_t *)buff)[n/8] & (0x01 << n%8)) {
-                    Py_INCREF(Py_True);
-                    PyList_SetItem(po, n, Py_True);
-                } else {
-                    Py_INCREF(Py_False);
-                    PyList_SetItem(po, n, Py_False);
+                item = _ops_to_python(ops, opcount, (unsigned char *)buff + n * size);
+                if(item == NULL) {
+                    Py_DECREF(po);
+                    return NULL;
                 }
+                PyList_SET_ITEM(po, n, item);
             }
             return po;
         } else {
-            if(((u_int8_t *)buff)[0]) {
-                Py_RETURN_TRUE;
-            } else {
-                Py_RETURN_FALSE;
-            }
+            return _ops_to_python(ops, opcount, buff);
         }
-    } else if(IS_CUSTOM(type)) {
-        if(count > 1) {
-            for(n = 0; n < count; n++) {
-                // Make dict
-                // setup user data
-                // call dax_cdt_iter()
-                // assign dict object to list
-            }
-            // return list
-        } else {
-            po = PyDict_New();
-            if(po == NULL) return NULL;
-            udata.po = po;
-            udata.data = buff;
-            udata.error = 0;
-//            PySys_WriteStdout("_create_py_object() - data = %p\n", udata.data);
-//            PySys_WriteStdout("_create_py_object() - po = %p\n", udata.po);
-//            PySys_WriteStdout("_create_py_object() - &udata = %p\n", &udata);
-            dax_cdt_iter(ds, type, &udata, _read_callback);
-            return po;
-        }
-        goto denied; // Not ready for this yet
     } else {  /* Base Datatype */
         if(count > 1) {
-            po = PyList_New(count);
-            if(po == NULL) return NULL;
-            for(n = 0; n < count; n++) {
-                offset = n * TYPESIZE(type)/8;
-                item = _dax_to_python(type, *((dax_type_union *)(buff + offset)));
-                if(item == NULL) return NULL;
-                PyList_SetItem(po, n, item);
-            }
-            return po;
+            return _array_to_python(type, count, buff);
         } else {
             return _dax_to_python(type, *((dax_type_union *)buff));
         }
     }
-denied:
-    PyErr_SetString(PyExc_Exception, "Denied");
-    return NULL; /* If we make it this far we have a problem */
 }
         
+static void
+_prepared_destroy(void *p)
+{
+    dax_prepared_free((dax_prepared *)p);
+}
+
+/* This function is called as pydax.prepare("TagName", count) and
+ * returns an object that can be passed to pydax.read() in place of
+ * the tag name so that the name only has to be parsed once. */
+static PyObject *
+pydax_prepare(PyObject *pSelf, PyObject *pArgs)
+{
+    char *tagname;
+    int count = 0, result;
+    dax_prepared *p;
+
+    if(ds == NULL) {
+        PyErr_SetString(PyExc_Exception, "OpenDAX is not initialized");
+        return NULL;
+    }
+
+    if(!PyArg_ParseTuple(pArgs, "s|i", &tagname, &count)) return NULL;
+
+    result = dax_tag_prepare(ds, &p, tagname, count);
+    if(result) {
+        PyErr_Format(PyExc_Exception, "Unable to prepare tag '%s'", tagname);
+        return NULL;
+    }
+    return PyCObject_FromVoidPtr(p, _prepared_destroy);
+}
+
+static PyObject *
+_read_prepared(PyObject *pPrep)
+{
+    int result;
+    Handle h;
+    dax_prepared *p;
+
+    p = (dax_prepared *)PyCObject_AsVoidPtr(pPrep);
+    result = dax_prepared_read(ds, p);
+    if(result == 0) {
+        result = dax_prepared_handle(ds, p, &h);
+    }
+    if(result) {
+        PyErr_SetString(PyExc_IOError, "Unable to read prepared tag");
+        return NULL;
+    }
+    return _create_py_object(dax_prepared_data(p), h.type, h.count);
+}
+
 static PyObject *
 pydax_read(PyObject *pSelf, PyObject *pArgs)
 {
     char *tagname;
-    int count, result;
+    int count = 0, result;
     Handle h;
     void *buff;
     PyObject *po;
@@ -555,6 +649,9 @@ pydax_read(PyObject *pSelf, PyObject *pArgs)
         return NULL;
     }
 
+    if(PyTuple_Size(pArgs) == 1 && PyCObject_Check(PyTuple_GetItem(pArgs, 0))) {
+        return _read_prepared(PyTuple_GetItem(pArgs, 0));
+    }
     if(!PyArg_ParseTuple(pArgs, "si", &tagname, &count)) return NULL;
 
     result = dax_tag_handle(ds, &h, tagname, count);
@@ -661,6 +758,7 @@ static PyMethodDef pydax_methods[] = {
     {"add", pydax_add, METH_VARARGS, NULL},
     {"cdt_create", pydax_cdt_create, METH_VARARGS, NULL},
     {"cdt_get", pydax_cdt_get, METH_VARARGS, NULL},
+    {"prepare", pydax_prepare, METH_VARARGS, NULL},
     {"read", pydax_read, METH_VARARGS, NULL},
     {"get", pydax_get, METH_VARARGS, NULL},
     {"write", pydax_write, METH_VARARGS, NULL},
@@ -22,8 +22,3 @@
 #include <Python.h>
 #include <opendax.h>
 
-struct iter_udata {
-    PyObject *po;
-    void *data;
-    int error;
-};
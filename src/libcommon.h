@@ -44,6 +44,8 @@
 #define MSG_EVNT_MOD   0x000D /* Get an event definition */
 #define MSG_CDT_CREATE 0x000E /* Create a Custom Datatype */
 #define MSG_CDT_GET    0x000F /* Get the definition of a Custom Datatype */
+#define MSG_EVNT_RESUME 0x0010 /* Add a list of events again after reconnecting */
+#define MSG_TAG_MULTI  0x0011 /* Write a list of tags at once */
 /* More to come */
 
 #define MSG_RESPONSE   0x1000000LL /* Flag for defining a response message */
@@ -52,6 +54,7 @@
 /* These are flags for the registration command */
 #define CONNECT_SYNC  0x01 /* Used to identify the synchronous socket during registration */
 #define CONNECT_EVENT 0x02 /* Identifies the asynchronous event socket during registration */
+#define CONNECT_POOL  0x04 /* Extra synchronous socket for another thread of the same module */
 
 /* These are the values that the registration system uses to 
    determine whether or not the module will have to reformat
@@ -67,6 +70,11 @@
 #define REG_TEST_REAL   3.14159265
 #define REG_TEST_LREAL  -58765463.8766677
 
+/* Each write in a MSG_TAG_MULTI message is the tag index, the byte
+ * offset and the size followed by the data.  If this flag is set in the
+ * size then a mask of the same size follows the data. */
+#define MULTI_MASK      0x80000000
+
 /* Subcommands for the MSG_TAG_GET command */
 #define TAG_GET_NAME    0x01 /* Retrieve the tag by name */
 #define TAG_GET_INDEX   0x02 /* Retrieve the tag by it's index */
@@ -75,6 +83,18 @@
 #define CDT_GET_NAME    0x01 /* Retrieve the type by name */
 #define CDT_GET_TYPE    0x02 /* Retrieve the type by it's type */
 
+/* Pattern event subscriptions are sent with MSG_EVNT_ADD and MSG_EVNT_DEL
+ * using this as the tag index.  Event messages that are sent because of a
+ * pattern subscription have the pattern flag set in the event id. */
+#define EVENT_PATTERN_INDEX -1
+#define EVENT_PATTERN_FLAG  0x80000000
+
+/* Compound condition events are added and deleted the same way using this
+ * index and their event messages have the compound flag set in the id.
+ * The expression string follows the fixed part of the MSG_EVNT_ADD data. */
+#define EVENT_COMPOUND_INDEX -2
+#define EVENT_COMPOUND_FLAG  0x40000000
+
 /* Some Macros for manipulating CDT types */
 #define CDT_TO_INDEX(TYPE) (TYPE & ~DAX_CUSTOM)
 #define CDT_TO_TYPE(INDEX) (INDEX | DAX_CUSTOM)
@@ -101,19 +101,24 @@ _receive_globals(lua_State *L, script_t *s)
 
 /* Looks into the list of tags in the script and reads these global
    variables from the script and then writes the values out to the
-   server */
+   server.  The writes are collected in the script's batch and sent
+   together at the end. */
 static inline int
 _send_globals(lua_State*L, script_t *s)
 {
     global_t *this;
     
     this = s->globals;
+    /* Without a batch we just write them one at a time */
+    if(s->batch == NULL && dax_batch_new(ds, &s->batch)) {
+        s->batch = NULL;
+    }
     
     while(this != NULL) {
         if(this->mode & MODE_WRITE) {
             lua_getglobal(L, this->name);
             
-            if(send_tag(L, this->handle)) {
+            if(send_tag(L, this->handle, s->batch)) {
                 return -1;
             }
             lua_pop(L, 1);
@@ -127,6 +132,9 @@ _send_globals(lua_State*L, script_t *s)
         }
         this = this->next;
     }
+    if(s->batch && dax_batch_flush(ds, s->batch)) {
+        return -1;
+    }
 
     lua_getglobal(L, "_rate");
     s->rate = lua_tointeger(L, -1);
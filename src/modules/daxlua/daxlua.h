@@ -67,6 +67,7 @@ typedef struct Script_t {
     long lastscan;
     long executions;
     global_t *globals;
+    dax_batch *batch;   /* Collects the global writes for each scan */
 } script_t;
 
 /* options.c - Configuration functions */
@@ -83,7 +84,7 @@ int get_verbosity(void);
 int daxlua_init(void);
 int setup_interpreter(lua_State *L);
 int fetch_tag(lua_State *L, Handle h);
-int send_tag(lua_State *L, Handle h);
+int send_tag(lua_State *L, Handle h, dax_batch *batch);
 void tag_dax_to_lua(lua_State *L, Handle h, void* data);
 int tag_lua_to_dax(lua_State *L, Handle h, void* data, void *mask);
 
@@ -489,9 +489,10 @@ fetch_tag(lua_State *L, Handle h)
 }
 
 /* This function reads the variable from the top of the Lua stack
-   and sends it to the opendax tag given by *tagname */
+   and sends it to the opendax tag given by *tagname.  If 'batch' isn't
+   NULL the write is added to it instead of being sent right away. */
 int
-send_tag(lua_State *L, Handle h)
+send_tag(lua_State *L, Handle h, dax_batch *batch)
 {
     int result, n;
     char q = 0;
@@ -525,7 +526,9 @@ send_tag(lua_State *L, Handle h)
             q = 1;
         }
     }
-    if(q) {
+    if(batch) {
+        result = dax_batch_mask(ds, batch, h, data, q ? mask : NULL);
+    } else if(q) {
         result = dax_mask_tag(ds, h, data, mask);
     } else {
         result = dax_write_tag(ds, h, data);
@@ -60,6 +60,7 @@ _get_new_script(void)
     scriptcount++;
     /* Initialize the script structure */
     scripts[n].globals = NULL;
+    scripts[n].batch = NULL;
     scripts[n].firstrun = 1;
     scripts[n].name = NULL;
     return n;
@@ -37,6 +37,15 @@ _write_data(struct mb_cmd *c, void *userdata, u_int8_t *data, int datasize)
 }
 
 
+/* FC 23 only writes back the registers that it read.  The ones that it
+ * writes come from the tag and may have been changed since we read them.
+ * The handle for the read part follows the one for the whole tag. */
+static void
+_write_read_data(struct mb_cmd *c, void *userdata, u_int8_t *data, int datasize)
+{
+    dax_write_tag(ds, ((Handle *)userdata)[1], data);
+}
+
 static void
 _read_data(struct mb_cmd *c, void *userdata, u_int8_t *data, int datasize)
 {
@@ -45,6 +54,104 @@ _read_data(struct mb_cmd *c, void *userdata, u_int8_t *data, int datasize)
 }
 
 
+/* Write commands keep a copy of their tag's value that is updated by a
+ * change event from the server.  The event callback runs in the main
+ * thread and the pre_send callback in the port's thread so the copy is
+ * protected by the lock.  The handle has to be first since the other
+ * callbacks treat the userdata as a Handle. */
+typedef struct write_data {
+    Handle h;
+    dax_event_id event;
+    pthread_mutex_t lock;
+    int changed;             /* Set when the value has changed since the last send */
+    u_int8_t *value;
+} write_data;
+
+static void
+_write_event_callback(void *udata)
+{
+    u_int8_t buff[((write_data *)udata)->h.size];
+    write_data *wd;
+    int result;
+
+    wd = (write_data *)udata;
+
+    result = dax_read_tag(ds, wd->h, buff);
+    if(result) {
+        dax_error(ds, "Unable to read tag data, %d", result);
+        return;
+    }
+    pthread_mutex_lock(&wd->lock);
+    memcpy(wd->value, buff, wd->h.size);
+    wd->changed = 1;
+    pthread_mutex_unlock(&wd->lock);
+}
+
+/* pre_send callback for write commands that have a change event.  The
+ * command's data is only touched if the tag has changed so the library
+ * can tell that a conditional command doesn't need to be sent. */
+static void
+_changed_data(struct mb_cmd *c, void *userdata, u_int8_t *data, int datasize)
+{
+    write_data *wd;
+
+    wd = (write_data *)userdata;
+    pthread_mutex_lock(&wd->lock);
+    if(wd->changed) {
+        memcpy(data, wd->value, wd->h.size < datasize ? wd->h.size : datasize);
+        wd->changed = 0;
+    }
+    pthread_mutex_unlock(&wd->lock);
+}
+
+static void
+_free_write_data(struct mb_cmd *c, void *userdata)
+{
+    write_data *wd;
+
+    wd = (write_data *)userdata;
+    dax_event_del(ds, wd->event);
+    pthread_mutex_destroy(&wd->lock);
+    free(wd->value);
+    free(wd);
+}
+
+/* Sets up the change event for a write command.  Returns 0 on success and
+ * the command's userdata is replaced with the write_data structure.  If
+ * this fails the command just reads the tag every time it's sent. */
+static int
+_setup_write_event(mb_cmd *c, Handle *h, u_int8_t *data, int datasize)
+{
+    write_data *wd;
+    int result;
+
+    wd = malloc(sizeof(write_data));
+    if(wd == NULL) return ERR_ALLOC;
+    wd->value = malloc(h->size);
+    if(wd->value == NULL) {
+        free(wd);
+        return ERR_ALLOC;
+    }
+    wd->h = *h;
+    wd->changed = 0;
+    pthread_mutex_init(&wd->lock, NULL);
+    result = dax_event_add(ds, &wd->h, EVENT_CHANGE, NULL, &wd->event,
+                           _write_event_callback, wd, NULL);
+    if(result) {
+        pthread_mutex_destroy(&wd->lock);
+        free(wd->value);
+        free(wd);
+        return result;
+    }
+    /* Get whatever is in the tag now so that it's sent the first time */
+    _write_event_callback(wd);
+    free(h);
+    mb_set_cmd_userdata(c, wd, _free_write_data);
+    mb_pre_send_callback(c, _changed_data);
+    _changed_data(c, wd, data, datasize);
+    return 0;
+}
+
 /* This function was setup as the pre_send callback to the modbus library.
  * If this function is called it means that the command is about to be sent for
  * the first time.  We add the OpenDAX tags, change the userdata in the command
@@ -53,19 +160,23 @@ _read_data(struct mb_cmd *c, void *userdata, u_int8_t *data, int datasize)
 void
 setup_command(mb_cmd *c, void *userdata, u_int8_t *data, int datasize)
 {
-    int result, count;
+    int result, count, function;
+    u_int16_t rlength;
     cmd_temp_data *cdata;
     Handle *h;
     char tagname[DAX_TAGNAME_SIZE + 20];
     
-    h = malloc(sizeof(Handle));
+    cdata = (cmd_temp_data *)userdata;
+    function = cdata->function;
+    rlength = cdata->rlength;
+    
+    /* FC 23 needs a second handle for the registers that it reads */
+    h = malloc(sizeof(Handle) * (function == 23 ? 2 : 1));
     if(h == NULL) {
         return;
     }
     
-    cdata = (cmd_temp_data *)userdata;
-    
-    switch(cdata->function) {
+    switch(function) {
         case 1:
         case 2:
         case 15:
@@ -86,6 +197,20 @@ setup_command(mb_cmd *c, void *userdata, u_int8_t *data, int datasize)
             count = 1;
             result = dax_tag_add(ds, h, cdata->tagname, DAX_UINT, cdata->index + 1);
             break;
+        case 22:
+            /* The AND mask and the OR mask */
+            count = 2;
+            result = dax_tag_add(ds, h, cdata->tagname, DAX_UINT, cdata->index + 2);
+            break;
+        case 23:
+            /* The registers that are read followed by the ones that are written */
+            count = cdata->length;
+            result = dax_tag_add(ds, h, cdata->tagname, DAX_UINT, cdata->index + cdata->length);
+            break;
+        case 43:
+            count = cdata->length;
+            result = dax_tag_add(ds, h, cdata->tagname, DAX_BYTE, cdata->index + cdata->length);
+            break;
         default:
             assert(0);
     }
@@ -109,10 +234,21 @@ setup_command(mb_cmd *c, void *userdata, u_int8_t *data, int datasize)
         mb_disable_cmd(c);
     }
     mb_pre_send_callback(c, NULL);
+    /* FC 23 is both so it gets both callbacks */
     if(mb_is_write_cmd(c)) {
-        mb_pre_send_callback(c, _read_data);
-        /* Since this is a pre call we go ahead and call the function here */
-        _read_data(c, h, data, datasize);
+        /* FC 23 reads the registers back into the same tag so a change
+         * event would fire on every response.  It reads the tag instead. */
+        if(function == 23 || result || _setup_write_event(c, h, data, datasize)) {
+            mb_pre_send_callback(c, _read_data);
+            /* Since this is a pre call we go ahead and call the function here */
+            _read_data(c, h, data, datasize);
+        }
+    }
+    if(function == 23) {
+        h[1] = h[0];
+        h[1].count = rlength;
+        h[1].size = rlength * 2;
+        mb_post_send_callback(c, _write_read_data);
     } else if(mb_is_read_cmd(c)) {
         mb_post_send_callback(c, _write_data);
     }
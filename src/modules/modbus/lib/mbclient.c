@@ -0,0 +1,316 @@
+/* mbclient.c - Modbus (tm) Communications Library
+ * Copyright (C) 2010 Phil Birkelbach
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Source file for TCP Client functionality.  The connections to the
+ * servers are kept in a pool so that every client port that points at the
+ * same address and port uses the same socket.  The socket stays open
+ * between scans and if it fails it is reconnected with an increasing delay.
+ */
+
+#include <mblib.h>
+#include <modbus.h>
+#include <netinet/tcp.h>
+
+/* Size of the MBAP header including the unit id */
+#define MBAP_SIZE 7
+
+static struct mb_tcp_conn *_pool_head = NULL;
+static pthread_mutex_t _pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Closes the socket.  If 'failed' is set the connection attempt failed so
+ * we wait for the backoff time before trying again and double it for the
+ * next time.  Otherwise we can reconnect right away since it's most likely
+ * just the server dropping an idle connection. */
+static void
+_disconnect(struct mb_tcp_conn *conn, int failed)
+{
+    if(conn->fd >= 0) {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    monotime(&conn->retry);
+    if(failed) {
+        conn->failures++;
+        time_add_msec(&conn->retry, conn->backoff);
+        conn->backoff *= 2;
+        if(conn->backoff > conn->backoff_max) conn->backoff = conn->backoff_max;
+    }
+}
+
+/* Connects the socket to the server.  The connection is made non-blocking
+ * so that we can use the port timeout for the connect too. */
+static int
+_connect(struct mb_tcp_conn *conn, mb_port *mp)
+{
+    struct sockaddr_in addr;
+    struct pollfd pfd;
+    socklen_t len;
+    int fd, result, opt;
+
+    if(msec_until(&conn->retry) > 0) {
+        return MB_ERR_OPEN; /* Still waiting for the backoff */
+    }
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0) {
+        _disconnect(conn, 1);
+        return MB_ERR_OPEN;
+    }
+    conn->fd = fd;
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(conn->ipaddress);
+    addr.sin_port = htons(conn->bindport);
+
+    result = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+    if(result < 0 && errno == EINPROGRESS) {
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        do {
+            result = poll(&pfd, 1, mp->timeout);
+        } while(result < 0 && errno == EINTR);
+        if(result == 1) {
+            len = sizeof(opt);
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &opt, &len);
+            result = opt ? -1 : 0;
+        } else {
+            result = -1;
+        }
+    }
+    if(result < 0) {
+        DEBUGMSG2("_connect() - Unable to connect to %s", conn->ipaddress);
+        _disconnect(conn, 1);
+        return MB_ERR_OPEN;
+    }
+    opt = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &opt, sizeof(opt));
+    conn->backoff = conn->backoff_min;
+    conn->connects++;
+    DEBUGMSG2("_connect() - Connected to server, fd = %d", fd);
+    return 0;
+}
+
+/* Reads exactly 'size' bytes unless the deadline passes first.  Returns the
+ * number of bytes read or -1 if the socket failed or was closed. */
+static int
+_read_full(int fd, u_int8_t *buff, int size, struct timespec *deadline)
+{
+    struct pollfd pfd;
+    int result, count = 0;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while(count < size) {
+        result = read(fd, &buff[count], size - count);
+        if(result > 0) {
+            count += result;
+        } else if(result == 0) {
+            return -1;
+        } else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+            result = poll(&pfd, 1, msec_until(deadline));
+            if(result == 0) return count;
+            if(result < 0 && errno != EINTR) return -1;
+        } else if(errno != EINTR) {
+            return -1;
+        }
+    }
+    return count;
+}
+
+/* Finds the connection for the port's server in the pool or adds a new one
+ * and attaches it to the port.  The socket isn't opened until the first
+ * request is sent. */
+int
+tcp_conn_open(mb_port *port)
+{
+    struct mb_tcp_conn *conn;
+
+    if(port->conn != NULL) return 0;
+    pthread_mutex_lock(&_pool_lock);
+    for(conn = _pool_head; conn != NULL; conn = conn->next) {
+        if(conn->bindport == port->bindport && !strcmp(conn->ipaddress, port->ipaddress)) {
+            break;
+        }
+    }
+    if(conn == NULL) {
+        conn = malloc(sizeof(struct mb_tcp_conn));
+        if(conn == NULL) {
+            pthread_mutex_unlock(&_pool_lock);
+            return MB_ERR_ALLOC;
+        }
+        bzero(conn, sizeof(struct mb_tcp_conn));
+        strcpy(conn->ipaddress, port->ipaddress);
+        conn->bindport = port->bindport;
+        conn->fd = -1;
+        conn->backoff_min = port->backoff_min;
+        conn->backoff_max = port->backoff_max;
+        conn->backoff = conn->backoff_min;
+        pthread_mutex_init(&conn->lock, NULL);
+        conn->next = _pool_head;
+        _pool_head = conn;
+    }
+    conn->refcount++;
+    port->conn = conn;
+    pthread_mutex_unlock(&_pool_lock);
+    return 0;
+}
+
+/* Detaches the connection from the port.  The last port to let go of the
+ * connection closes the socket. */
+void
+tcp_conn_close(mb_port *port)
+{
+    struct mb_tcp_conn *conn, **node;
+
+    conn = port->conn;
+    if(conn == NULL) return;
+    port->conn = NULL;
+    pthread_mutex_lock(&_pool_lock);
+    if(--conn->refcount == 0) {
+        for(node = &_pool_head; *node != NULL; node = &(*node)->next) {
+            if(*node == conn) {
+                *node = conn->next;
+                break;
+            }
+        }
+        if(conn->fd >= 0) close(conn->fd);
+        pthread_mutex_destroy(&conn->lock);
+        free(conn);
+    }
+    pthread_mutex_unlock(&_pool_lock);
+}
+
+/* Locks the connection for the port and connects it if it isn't already.
+ * Returns 0 with the connection locked or a negative error code with it
+ * unlocked.  Every successful call has to be matched by tcp_end() */
+int
+tcp_begin(mb_port *mp)
+{
+    struct mb_tcp_conn *conn;
+    int result;
+
+    conn = mp->conn;
+    if(conn == NULL) return MB_ERR_NO_SOCKET;
+    pthread_mutex_lock(&conn->lock);
+    result = tcp_reconnect(mp);
+    if(result) {
+        pthread_mutex_unlock(&conn->lock);
+    }
+    return result;
+}
+
+void
+tcp_end(mb_port *mp)
+{
+    pthread_mutex_unlock(&mp->conn->lock);
+}
+
+/* Connects the socket again after tcp_read() or tcp_write() failed.  The
+ * connection has to be locked. */
+int
+tcp_reconnect(mb_port *mp)
+{
+    if(mp->conn->fd >= 0) return 0;
+    return _connect(mp->conn, mp);
+}
+
+/* Sends the request in 'pdu' which starts with the unit id.  The MBAP
+ * header is put in front of it here and the transaction id that was used
+ * is written to 'tid'.  Returns the number of bytes sent or a negative
+ * error code if the socket failed, in which case it's closed. */
+int
+tcp_write(mb_port *mp, u_int8_t *pdu, int length, u_int16_t *tid)
+{
+    struct mb_tcp_conn *conn;
+    u_int8_t buff[MB_FRAME_LEN + MBAP_SIZE];
+    u_int16_t temp;
+    int result, count = 0;
+
+    conn = mp->conn;
+    if(conn->fd < 0) return MB_ERR_NO_SOCKET;
+    if(length > MB_FRAME_LEN) return MB_ERR_OVERFLOW;
+
+    *tid = ++conn->tid;
+    COPYWORD(&buff[0], tid);
+    buff[2] = 0x00; buff[3] = 0x00;     /* Protocol identifier */
+    temp = length;                      /* Unit id + PDU */
+    COPYWORD(&buff[4], &temp);
+    memcpy(&buff[6], pdu, length);
+    length += 6;
+
+    if(mp->out_callback) {
+        mp->out_callback(mp, buff, length);
+    }
+    while(count < length) {
+        result = send(conn->fd, &buff[count], length - count, MSG_NOSIGNAL);
+        if(result < 0) {
+            if(errno == EINTR) continue;
+            /* The socket is non-blocking so this can also mean that the
+             * server has stopped reading.  Either way it's no good to us. */
+            DEBUGMSG2("tcp_write() - %s", strerror(errno));
+            _disconnect(conn, 0);
+            return MB_ERR_PORTFAIL;
+        }
+        count += result;
+    }
+    return length;
+}
+
+/* Reads the next response from the connection.  The unit id and the PDU
+ * are written to 'buff' so that it looks like an RTU message without the
+ * checksum and the transaction id is written to 'tid'.  Returns the length,
+ * zero if nothing came in before 'deadline' or MB_ERR_RECV_FAIL if the
+ * socket failed or we lost our place in the stream.  The socket is closed
+ * in that case. */
+int
+tcp_read(mb_port *mp, u_int8_t *buff, int size, struct timespec *deadline, u_int16_t *tid)
+{
+    struct mb_tcp_conn *conn;
+    u_int8_t head[MBAP_SIZE];
+    u_int16_t proto, length;
+    int result;
+
+    conn = mp->conn;
+    if(conn->fd < 0) return MB_ERR_NO_SOCKET;
+    result = _read_full(conn->fd, head, MBAP_SIZE, deadline);
+    if(result == 0) return 0; /* Timeout between messages is harmless */
+    if(result != MBAP_SIZE) {
+        /* Either the socket failed or we are in the middle of a message
+         * and won't be able to find the start of the next one */
+        _disconnect(conn, 0);
+        return MB_ERR_RECV_FAIL;
+    }
+    COPYWORD(tid, &head[0]);
+    COPYWORD(&proto, &head[2]);
+    COPYWORD(&length, &head[4]);
+    if(proto != 0 || length < 2 || length > size) {
+        DEBUGMSG("tcp_read() - Bad MBAP header");
+        _disconnect(conn, 0);
+        return MB_ERR_RECV_FAIL;
+    }
+    buff[0] = head[6];
+    result = _read_full(conn->fd, &buff[1], length - 1, deadline);
+    if(result != length - 1) {
+        _disconnect(conn, 0);
+        return MB_ERR_RECV_FAIL;
+    }
+    if(mp->in_callback) {
+        mp->in_callback(mp, buff, length);
+    }
+    return length;
+}
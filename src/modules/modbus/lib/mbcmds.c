@@ -34,6 +34,19 @@ initcmd(struct mb_cmd *c)
     c->data = NULL;
     c->datasize = 0;
     c->interval = 0;
+    c->period = 0;
+    c->priority = 0;
+    c->scheduled = 0;
+    c->runs = 0;
+    c->overruns = 0;
+    c->jitter_last = 0;
+    c->jitter_max = 0;
+    c->jitter_sum = 0;
+    c->w_register = 0;
+    c->w_length = 0;
+    c->block = NULL;
+    c->members = NULL;
+    c->nmembers = 0;
 
     c->icount = 0;
     c->requests = 0;
@@ -42,8 +55,8 @@ initcmd(struct mb_cmd *c)
     c->crcerrors = 0;
     c->exceptions = 0;
     c->lasterror = 0;
-    c->lastcrc = 0;
     c->firstrun = 0;
+    c->sent = NULL;
     c->userdata = NULL;
     c->pre_send = NULL;
     c->post_send = NULL;
@@ -96,6 +109,7 @@ mb_destroy_cmd(mb_cmd *cmd) {
             free(cmd->userdata);
         }
     }
+    if(cmd->sent != NULL) free(cmd->sent);
     free(cmd);
 }
 
@@ -126,11 +140,19 @@ mb_set_command(mb_cmd *cmd, u_int8_t node, u_int8_t function, u_int16_t reg, u_i
         case 6:
         case 15:
         case 16:
+        case 22:
+        case 23:
+        case 43:
             cmd->function = function;
             break;
         default:
             return MB_ERR_FUNCTION; 
     }
+    if(function == 22) length = 1; /* Only ever one register */
+    /* Whatever was written before doesn't mean anything now */
+    if(cmd->sent != NULL) free(cmd->sent);
+    cmd->sent = NULL;
+    cmd->firstrun = 0;
     cmd->m_register = reg;
     cmd->length = length;
     /* This will even reallocate the *data area if this command is called again */
@@ -154,7 +176,20 @@ mb_set_command(mb_cmd *cmd, u_int8_t node, u_int8_t function, u_int16_t reg, u_i
             /* Single word function code */
             newsize = 2;
             break;
+        case 22:
+            /* The AND mask followed by the OR mask */
+            newsize = 4;
+            break;
+        case 23:
+            /* The registers that are read followed by the ones that are written */
+            newsize = (length + cmd->w_length) * 2;
+            break;
+        case 43:
+            /* The objects are stored as they come in the response */
+            newsize = length;
+            break;
     }
+    if(newsize == 0) newsize = 1;
     newdata = realloc(cmd->data, newsize);
     if(newdata == NULL) {
         return MB_ERR_ALLOC;
@@ -165,6 +200,51 @@ mb_set_command(mb_cmd *cmd, u_int8_t node, u_int8_t function, u_int16_t reg, u_i
     return 0;
 }
 
+/* Sets the registers that a Read/Write Multiple Registers (FC 23) command
+ * writes.  The registers that it reads are set with mb_set_command().  The
+ * command's data holds the registers that are read followed by the ones
+ * that are written. */
+int
+mb_set_write_range(mb_cmd *cmd, u_int16_t reg, u_int16_t length)
+{
+    u_int8_t *newdata;
+
+    if(cmd->function != 23) return MB_ERR_FUNCTION;
+    newdata = realloc(cmd->data, (cmd->length + length) * 2);
+    if(newdata == NULL) return MB_ERR_ALLOC;
+    cmd->data = newdata;
+    cmd->datasize = (cmd->length + length) * 2;
+    cmd->w_register = reg;
+    cmd->w_length = length;
+    return 0;
+}
+
+/* Finds 'object' in the data of a Read Device Identification (FC 43)
+ * command and copies it to 'buff' as a string.  The command's register is
+ * the first object to read and its length is the number of bytes to keep
+ * for the objects.  Returns the length of the object or MB_ERR_BAD_ARG if
+ * the device didn't send it. */
+int
+mb_get_device_id(mb_cmd *cmd, u_int8_t object, char *buff, int size)
+{
+    int n, count, offset = 1;
+
+    if(cmd->function != 43 || cmd->datasize < 1) return MB_ERR_FUNCTION;
+    count = cmd->data[0];
+    for(n = 0; n < count && offset + 2 <= cmd->datasize; n++) {
+        if(offset + 2 + cmd->data[offset + 1] > cmd->datasize) break;
+        if(cmd->data[offset] == object) {
+            if(size <= 0) return MB_ERR_OVERFLOW;
+            count = cmd->data[offset + 1] < size ? cmd->data[offset + 1] : size - 1;
+            memcpy(buff, &cmd->data[offset + 2], count);
+            buff[count] = '\0';
+            return count;
+        }
+        offset += cmd->data[offset + 1] + 2;
+    }
+    return MB_ERR_BAD_ARG;
+}
+
 int
 mb_set_interval(mb_cmd *cmd, int interval)
 {
@@ -172,6 +252,36 @@ mb_set_interval(mb_cmd *cmd, int interval)
     return 0;
 }
 
+/* Sets the time in mSec between the times the command is sent.  If this
+ * is zero the command is sent every 'interval' times the port's scanrate */
+int
+mb_set_period(mb_cmd *cmd, unsigned int period)
+{
+    cmd->period = period;
+    return 0;
+}
+
+/* When more than one command is due at the same time the one with the
+ * highest priority is sent first.  The default is 0. */
+void
+mb_set_priority(mb_cmd *cmd, int priority)
+{
+    cmd->priority = priority;
+}
+
+/* Gets the scheduling statistics for the command.  'runs' is the number of
+ * times it has been sent and 'overruns' is the number of times it was
+ * still late when the next period came around.  The jitter is how late,
+ * in uSec, the command was sent compared to when it was due. */
+void
+mb_get_cmd_timing(mb_cmd *cmd, unsigned int *runs, unsigned int *overruns,
+                  unsigned int *jitter_avg, unsigned int *jitter_max)
+{
+    if(runs) *runs = cmd->runs;
+    if(overruns) *overruns = cmd->overruns;
+    if(jitter_avg) *jitter_avg = cmd->runs ? cmd->jitter_sum / cmd->runs : 0;
+    if(jitter_max) *jitter_max = cmd->jitter_max;
+}
 
 void
 mb_set_mode(mb_cmd *cmd, unsigned char mode)
@@ -200,6 +310,8 @@ mb_is_read_cmd(mb_cmd *cmd)
         case 2:
         case 3:
         case 4:
+        case 23:
+        case 43:
             return 1;
         default:
             return 0;
@@ -216,6 +328,8 @@ mb_is_write_cmd(mb_cmd *cmd)
         case 6:
         case 15:
         case 16:
+        case 22:
+        case 23:
             return 1;
         default:
             return 0;
@@ -58,6 +58,8 @@
 #include <sys/uio.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
+#include <time.h>
+#include <poll.h>
 #include <pthread.h>
 
 #include <modbus.h>
@@ -113,15 +115,87 @@ int __mb_mutex_unlock(mb_port *, _mb_mutex_t *);
 #define MB_SERIAL  0
 #define MB_NETWORK 1
 
+/* Most requests a TCP Client will have waiting for responses */
+#define MB_MAX_WINDOW 32
+
+/* Number of device identification objects a slave can answer with */
+#define MB_DEVID_COUNT 7
+
+/* The most that can be read in one request */
+#define MB_MAX_READ_REGS 125
+#define MB_MAX_READ_BITS 2000
+/* The most that can be written in one request */
+#define MB_MAX_WRITE_REGS 123
+#define MB_MAX_WRITE_BITS 1968
+#define MB_MAX_RW_REGS    121   /* Registers written by FC 23 */
+
+/* MEI type for Read Device Identification (FC 43) */
+#define MB_MEI_DEVICE_ID 0x0E
+
 /* Maximum size of the receive buffer */
-#define MB_BUFF_SIZE 150
-
-/* This is used in the port for client connections for the TCP Server */
-struct client_buffer {
-	int fd;                /* File descriptor of the socket */
-	int buffindex;         /* index where the next character will be placed */
-	unsigned char buff[MB_BUFF_SIZE];   /* data buffer */
-	struct client_buffer *next;
+#define MB_BUFF_SIZE 260   /* MBAP header and the largest PDU */
+
+/* Size of the receive and send buffers for each TCP Server connection.
+ * There is room for a few frames so that pipelined requests can be read
+ * and answered together. */
+#define MB_CLIENT_BUFF (MB_BUFF_SIZE * 4)
+#define MB_MAX_CONNECTIONS 1024
+
+/* A connection from a client to a TCP Server port.  It's defined in
+ * mbserver.c */
+struct mb_client {
+    int fd;                   /* File descriptor of the socket */
+    char ipaddress[16];
+    unsigned int port;
+    u_int8_t in[MB_CLIENT_BUFF];  /* Received data that isn't a whole frame yet */
+    int inlen;
+    u_int8_t out[MB_CLIENT_BUFF]; /* Responses that the socket wouldn't take yet */
+    int outlen;
+    int events;               /* Events we are waiting for on the socket */
+    struct timespec connected;
+    struct timespec last;     /* Last time anything was received */
+    unsigned int requests;
+    unsigned int exceptions;
+    unsigned long bytes_in;
+    unsigned long bytes_out;
+    int index;                /* Index in the poll() arrays if there is no epoll */
+    struct mb_client *prev;   /* List of connections, least recently used first */
+    struct mb_client *next;
+};
+
+/* The connections of a TCP Server port */
+struct mb_server {
+    int pollfd;               /* epoll descriptor */
+    struct pollfd *pfds;      /* Used instead of epoll if we don't have it */
+    struct mb_client **pclients;
+    int npfds;
+    struct mb_client *head;   /* Least recently used */
+    struct mb_client *tail;
+    int count;
+    unsigned int accepted;
+    unsigned int rejected;    /* Refused because we were at the limit */
+    unsigned int timeouts;    /* Closed because they were idle too long */
+    unsigned int errors;      /* Closed because of a bad frame or socket error */
+    pthread_mutex_t lock;     /* Protects the list and statistics from mb_get_client_stats() */
+};
+
+/* A connection from a TCP client to a server.  Client ports that point at
+ * the same address and port share one of these so that all of the unit
+ * ids behind a gateway go over one socket.  It's defined in mbclient.c */
+struct mb_tcp_conn {
+    char ipaddress[16];
+    unsigned int bindport;
+    int fd;                   /* Socket or -1 if not connected */
+    unsigned int refcount;    /* Number of ports using the connection */
+    u_int16_t tid;            /* Last MBAP transaction id that was sent */
+    int backoff;              /* Current reconnect delay in mSec */
+    int backoff_min;
+    int backoff_max;
+    struct timespec retry;    /* Don't try to connect again before this */
+    unsigned int connects;    /* Number of times we have connected */
+    unsigned int failures;    /* Number of failed connection attempts */
+    pthread_mutex_t lock;     /* Held from the request until the response */
+    struct mb_tcp_conn *next;
 };
 
 /* Internal struct that defines a single Modbus(tm) Port */
@@ -141,9 +215,14 @@ struct mb_port {
     char ipaddress[16];
     unsigned int bindport;    /* IP port to bind to */
     unsigned char socket;     /* either UDP_SOCK or TCP_SOCK */
+    struct mb_tcp_conn *conn; /* Pooled connection (TCP Client only) */
+    int backoff_min;          /* First reconnect delay in mSec (TCP Client only) */
+    int backoff_max;          /* Longest reconnect delay in mSec */
+    int window;               /* Requests that can be waiting for responses (TCP Client only) */
     
     int delay;       /* Intercommand delay */
-    int frame;       /* Interbyte timeout */
+    int frame;       /* Interbyte timeout in mSec, 0 to use the gap */
+    int gap;         /* 3.5 character times in uSec */
     int retries;     /* Number of retries to try */
     int scanrate;    /* Scanrate in mSeconds */
     int timeout;     /* Response timeout */
@@ -157,6 +236,9 @@ struct mb_port {
     unsigned int coilsize;    /* size of the internal bank of coils in 16-bit registers */
     u_int16_t *discreg;       /* discrete input register */
     unsigned int discsize;    /* size of the internal bank of coils */
+    u_int8_t *holdwritten;    /* Bit for each holding register a client has written */
+    u_int8_t *coilwritten;    /* and each coil, if mb_track_writes() was called */
+    char *devid[MB_DEVID_COUNT]; /* Device identification objects (slave only) */
 #ifdef __MB_THREAD_SAFE
     _mb_mutex_t hold_mutex;  /* mutexes used to lock the above register areas when needed */
     _mb_mutex_t input_mutex;
@@ -164,11 +246,21 @@ struct mb_port {
     _mb_mutex_t disc_mutex;
     _mb_mutex_t ctrl_mutex;  /* used to lock control bits */
 #endif    
-    fd_set fdset;
-    int maxfd;
-    struct client_buffer *buff_head; /* Head of a linked list of client connection buffers */
+    int maxconn;              /* Most connections allowed at once (TCP Server only) */
+    int idle;                 /* mSec a connection can be idle before it's closed, 0 for never */
+    struct mb_server *server; /* Connections to the TCP Server */
     
     struct mb_cmd *commands;  /* Linked list of Modbus commands */
+    int cmd_count;            /* Number of commands in the list */
+    struct mb_cmd **waiting;  /* Heap of commands ordered by deadline */
+    int nwaiting;
+    struct mb_cmd **due;      /* Heap of due commands ordered by priority */
+    int ndue;
+    int sched_size;           /* Room in each of the heaps */
+    int sched_count;          /* Number of commands that have been scheduled */
+    unsigned char overrun;    /* What to do when a command misses its period */
+    int coalesce;             /* Gap in registers allowed when combining reads, -1 to not combine */
+    struct mb_cmd *blocks;    /* Linked list of the commands that read for several others */
     int fd;                   /* File descriptor to the port */
     int ctrl_flags;
     int dienow;
@@ -193,7 +285,22 @@ struct mb_cmd {
     u_int8_t function;       /* Function Code */
     u_int16_t m_register;    /* Modbus Register */
     u_int16_t length;        /* length of modbus data */
+    u_int16_t w_register;    /* Register to write (FC 23 only) */
+    u_int16_t w_length;      /* Number of registers to write (FC 23 only) */
     unsigned int interval;   /* number of port scans between messages */
+    unsigned int period;     /* mSec between messages, 0 to use interval * scanrate */
+    int priority;            /* Higher priority commands go first when several are due */
+    unsigned char scheduled; /* Set once the command is in the port's scheduler */
+    struct timespec deadline; /* When the command is due next */
+    struct timespec started; /* When it was last taken from the scheduler */
+    unsigned int runs;       /* Number of times the scheduler has sent it */
+    unsigned int overruns;   /* Number of times it missed its period */
+    unsigned int jitter_last; /* uSec late the last time it was sent */
+    unsigned int jitter_max;
+    unsigned long long jitter_sum;
+    struct mb_cmd *block;    /* Command that reads the data for this one, NULL if it's sent itself */
+    struct mb_cmd **members; /* Commands that this one reads for if it's a block */
+    int nmembers;
     u_int8_t *data;          /* pointer to the actual modbus data that this command refers */
     int datasize;            /* size of the *data memory area */
     unsigned int icount;     /* number of intervals passed */
@@ -203,8 +310,8 @@ struct mb_cmd {
     unsigned int crcerrors;  /* number of checksum errors */
     unsigned int exceptions; /* number of modbus exceptions recieved from slave */
     u_int8_t lasterror;      /* last error on command */
-    u_int16_t lastcrc;       /* used to determine if a conditional message should be sent */
     unsigned char firstrun;  /* Indicates that this command has been sent once */
+    u_int8_t *sent;          /* Copy of the data last written to the slave (MB_ONCHANGE only) */
     void *userdata;          /* Data that can be assigned by the user.  Use free function callback */
     void (*pre_send)(struct mb_cmd *cmd, void *userdata, u_int8_t *data, int size);
     void (*post_send)(struct mb_cmd *cmd, void *userdata, u_int8_t *data, int size);
@@ -220,15 +327,35 @@ int add_cmd(mb_port *p, mb_cmd *mc);
 /* Command Functions - defined in modcmds.c */
 
 
+/* Scheduler Functions - defined in mbsched.c */
+mb_cmd *sched_next(mb_port *mp);
+void sched_done(mb_port *mp, mb_cmd *mc);
+void sched_sleep(mb_port *mp);
+void sched_free(mb_port *mp);
+
+/* TCP Client Functions - defined in mbclient.c */
+int tcp_conn_open(mb_port *port);
+void tcp_conn_close(mb_port *port);
+int tcp_begin(mb_port *mp);
+void tcp_end(mb_port *mp);
+int tcp_reconnect(mb_port *mp);
+int tcp_write(mb_port *mp, u_int8_t *pdu, int length, u_int16_t *tid);
+int tcp_read(mb_port *mp, u_int8_t *buff, int size, struct timespec *deadline, u_int16_t *tid);
+
 /* TCP Server Functions - defined in mbserver.c */
 int server_loop(mb_port *port);
+void server_free(mb_port *port);
 
 /* Protocol Functions - defined in modbus.c */
-int create_response(mb_port * port, unsigned char *buff, int size);
+int create_response(mb_port * port, unsigned char *buff, int length, int size);
 
 /* Utility Functions - defined in modutil.c */
 u_int16_t crc16(unsigned char *msg, unsigned short length);
 int crc16check(u_int8_t *buff, int length);
+void monotime(struct timespec *ts);
+void time_add_msec(struct timespec *ts, int msec);
+int time_cmp(struct timespec *a, struct timespec *b);
+int msec_until(struct timespec *ts);
 
 #ifdef DEBUG
  #define DEBUGMSG(x) debug(x)
@@ -20,11 +20,14 @@
  
 #include <modbus.h>
 #include <mblib.h>
+#include <trace.h>
 
 /* Initializes the port structure given by pointer p */
 static void
 initport(mb_port *p)
 {
+    int n;
+
     p->name = NULL;
     p->flags = 0x00;
     p->device = NULL;
@@ -38,11 +41,16 @@ initport(mb_port *p)
     p->databits = 8;
     p->stopbits = 1;
     p->timeout = 1000;      
-    p->frame = 10;
+    p->frame = 0;
+    p->gap = 4000;
     p->delay = 0;     
     p->retries = 3;
     p->parity = MB_NONE;  
     p->bindport = 5001;
+    p->conn = NULL;
+    p->backoff_min = 250;
+    p->backoff_max = 30000;
+    p->window = 1;
     p->scanrate = 1000; 
     p->holdreg = NULL;  
     p->holdsize = 0; 
@@ -52,12 +60,31 @@ initport(mb_port *p)
     p->coilsize = 0;
     p->discreg = NULL;
     p->discsize = 0;
-    p->buff_head = NULL;
-    FD_ZERO(&(p->fdset));
-    p->maxfd = 0;
+    p->holdwritten = NULL;
+    p->coilwritten = NULL;
+    for(n = 0; n < MB_DEVID_COUNT; n++) {
+        p->devid[n] = NULL;
+    }
+    p->maxconn = 32;
+    p->idle = 0;
+    p->server = NULL;
     p->running = 0;
     p->inhibit = 0;
+    p->inhibit_time = 0;
+    p->maxattempts = 0;
+    p->attempt = 0;
+    p->dienow = 0;
     p->commands = NULL;
+    p->cmd_count = 0;
+    p->waiting = NULL;
+    p->nwaiting = 0;
+    p->due = NULL;
+    p->ndue = 0;
+    p->sched_size = 0;
+    p->sched_count = 0;
+    p->overrun = MB_OVERRUN_SKIP;
+    p->coalesce = 0;
+    p->blocks = NULL;
     p->out_callback = NULL;
     p->in_callback = NULL;
     p->slave_read = NULL;
@@ -241,11 +268,20 @@ _free_cmd(mb_cmd *cmd)
 void
 mb_destroy_port(mb_port *port)
 {
+    int n;
+
     mb_close_port(port);
     
     if(port->name != NULL) free(port->name);
     if(port->device != NULL) free(port->device);
     
+    for(n = 0; n < MB_DEVID_COUNT; n++) {
+        if(port->devid[n] != NULL) free(port->devid[n]);
+    }
+    sched_free(port);
+    server_free(port);
+    if(port->holdwritten != NULL) free(port->holdwritten);
+    if(port->coilwritten != NULL) free(port->coilwritten);
     /* destroys all of the commands */
     _free_cmd(port->commands);
 }
@@ -280,6 +316,14 @@ mb_set_serial_port(mb_port *port, const char *device, int baudrate, short databi
         DEBUGMSG("mb_set_serial_port() - Wrong number of stopbits passed");
         return MB_ERR_STOPBITS;
     }
+    port->parity = parity;
+    /* The end of an RTU frame is 3.5 character times of silence.  Above
+     * 19200 baud the spec says to use a fixed 1.75 mSec */
+    if(baudrate > 19200) {
+        port->gap = 1750;
+    } else {
+        port->gap = 3500000 * (1 + databits + (parity != MB_NONE) + stopbits) / baudrate;
+    }
     return 0;
 }
 
@@ -350,6 +394,10 @@ mb_open_port(mb_port *m_port)
     if(m_port->devtype == MB_NETWORK && m_port->type == MB_SERVER) {
     	return 0;
     }
+    /* A TCP Client gets its connection from the pool */
+    if(m_port->devtype == MB_NETWORK && m_port->protocol == MB_TCP) {
+        return tcp_conn_open(m_port);
+    }
     if(m_port->devtype == MB_NETWORK) {
         fd = openIPport(m_port);
     } else {
@@ -364,6 +412,10 @@ mb_close_port(mb_port *port)
 {
     int result;
     
+    if(port->conn != NULL) {
+        tcp_conn_close(port);
+        return 0;
+    }
     result = close(port->fd);
     port->fd = 0;
     return result;
@@ -412,6 +464,103 @@ mb_set_maxfailures(mb_port *port, int maxfailures, int inhibit)
     return 0;
 }
 
+/* Sets the reconnect delay for a TCP Client.  After a failed connection
+ * attempt we wait 'min' mSec before trying again and the delay is doubled
+ * after each failure up to 'max' mSec.  This has to be set before the port
+ * is opened.  If several ports share a connection the first one that is
+ * opened sets the delays. */
+int
+mb_set_backoff(mb_port *port, int min, int max)
+{
+    if(min <= 0 || max < min) return MB_ERR_BAD_ARG;
+    port->backoff_min = min;
+    port->backoff_max = max;
+    return 0;
+}
+
+/* Sets the number of requests that a TCP Client will send before it has
+ * to wait for a response.  The responses are matched to the requests with
+ * the MBAP transaction id so the server can answer them in any order.  The
+ * default is 1 which sends each request only after the last one has been
+ * answered.  Not all servers can handle more than one request at a time. */
+int
+mb_set_window(mb_port *port, int window)
+{
+    if(window < 1 || window > MB_MAX_WINDOW) return MB_ERR_BAD_ARG;
+    port->window = window;
+    return 0;
+}
+
+/* Sets the most connections a TCP Server port will accept at once.  Any
+ * more than this are closed as soon as they are accepted.  The default
+ * is 32. */
+int
+mb_set_max_connections(mb_port *port, int max)
+{
+    if(max < 1 || max > MB_MAX_CONNECTIONS) return MB_ERR_BAD_ARG;
+    port->maxconn = max;
+    return 0;
+}
+
+/* Sets the time in mSec that a connection to a TCP Server port can go
+ * without sending anything before it is closed.  Zero, the default,
+ * leaves them open until the client closes them. */
+int
+mb_set_idle_timeout(mb_port *port, int msec)
+{
+    if(msec < 0) return MB_ERR_BAD_ARG;
+    port->idle = msec;
+    return 0;
+}
+
+/* Read commands on the same node with the same function code and period
+ * that cover registers next to each other are combined into one request
+ * when the port starts.  'gap' is the number of registers that can be read
+ * for nothing between two commands to let them be combined.  The default
+ * is 0, which only combines commands that touch or overlap, and -1 turns
+ * it off.  It has to be set before the first command is sent. */
+int
+mb_set_coalesce(mb_port *port, int gap)
+{
+    if(gap < -1 || gap >= MB_MAX_READ_REGS) return MB_ERR_BAD_ARG;
+    port->coalesce = gap;
+    return 0;
+}
+
+/* Sets one of the strings that a slave returns for Read Device
+ * Identification (FC 43/14).  Only the basic and regular objects, 0 - 6,
+ * are supported.  Setting 'value' to NULL removes the object. */
+int
+mb_set_device_id(mb_port *port, u_int8_t object, const char *value)
+{
+    char *newvalue = NULL;
+
+    if(object >= MB_DEVID_COUNT) return MB_ERR_BAD_ARG;
+    if(value != NULL) {
+        newvalue = strdup(value);
+        if(newvalue == NULL) return MB_ERR_ALLOC;
+    }
+    if(port->devid[object] != NULL) free(port->devid[object]);
+    port->devid[object] = newvalue;
+    return 0;
+}
+
+/* Sets what the scheduler does when a command is still late when its next
+ * period comes around.  MB_OVERRUN_SKIP drops the periods that were missed
+ * and keeps the command on its original phase, MB_OVERRUN_CATCHUP sends it
+ * again right away for each one that was missed and MB_OVERRUN_DELAY starts
+ * a new period from the time it was sent. */
+int
+mb_set_overrun(mb_port *port, unsigned char policy)
+{
+    if(policy != MB_OVERRUN_SKIP && policy != MB_OVERRUN_CATCHUP &&
+       policy != MB_OVERRUN_DELAY) {
+        return MB_ERR_BAD_ARG;
+    }
+    port->overrun = policy;
+    return 0;
+}
+
 unsigned char
 mb_get_port_type(mb_port *port)
 {
@@ -480,12 +629,12 @@ mb_alloc_coil(mb_port *port, unsigned int size)
     void *new;
 
     mb_mutex_lock(port, &port->coil_mutex);	
-    new = realloc(port->coilreg, (size - 1)/8 + 1);
+    new = realloc(port->coilreg, ((size - 1)/16 + 1) * 2);
     if(new != NULL) {
         port->coilsize = size;
         port->coilreg = new;
     }
-    bzero(port->coilreg, (size - 1)/8 + 1);
+    bzero(port->coilreg, ((size - 1)/16 + 1) * 2);
     mb_mutex_unlock(port, &port->coil_mutex);
     return new;
 }
@@ -496,12 +645,12 @@ mb_alloc_discrete(mb_port *port, unsigned int size)
     void *new;
 
     mb_mutex_lock(port, &port->disc_mutex);	
-    new = realloc(port->discreg, (size - 1)/8 + 1);
+    new = realloc(port->discreg, ((size - 1)/16 + 1) * 2);
     if(new != NULL) {
         port->discsize = size;
         port->discreg = new;
     }
-    bzero(port->coilreg, (size - 1)/8 + 1);
+    bzero(port->discreg, ((size - 1)/16 + 1) * 2);
     mb_mutex_unlock(port, &port->disc_mutex);	
     return new;
 }
@@ -527,20 +676,26 @@ mb_get_discrete_size(mb_port *port) {
 }
 
 
-/* These functions are thread safe ways to read/write the data tables */
+#define _WRITTEN(map, n) ((map)[(n) / 8] & (0x01 << ((n) % 8)))
+
+/* These functions are thread safe ways to read/write the data tables.  If
+ * the port is tracking writes, registers that a client has written that
+ * haven't been taken with mb_take_written() yet are not overwritten. */
 int
 mb_write_register(mb_port *port, int regtype, u_int16_t *buff, u_int16_t index, u_int16_t count)
 {
     u_int16_t *reg_ptr;
+    u_int8_t *written = NULL;
     unsigned int reg_size, word, n;
     _mb_mutex_t *reg_mutex;
     unsigned char bit;
-    fprintf(stderr, "mb_write_register() called with regtype = %d\n", regtype);
+    DAX_TRACE(TRACE_MB_WRITE_REG, regtype, index, count, 0, 0);
     switch(regtype) {
         case MB_REG_HOLDING:
             reg_ptr = port->holdreg;
             reg_size = port->holdsize;
             reg_mutex = &port->hold_mutex;
+            written = port->holdwritten;
             break;
         case MB_REG_INPUT:
             reg_ptr = port->inputreg;
@@ -551,6 +706,7 @@ mb_write_register(mb_port *port, int regtype, u_int16_t *buff, u_int16_t index,
             reg_ptr = port->coilreg;
             reg_size = port->coilsize;
             reg_mutex = &port->coil_mutex;
+            written = port->coilwritten;
             break;
         case MB_REG_DISC:
             reg_ptr = port->discreg;
@@ -567,14 +723,22 @@ mb_write_register(mb_port *port, int regtype, u_int16_t *buff, u_int16_t index,
     switch(regtype) {
         case MB_REG_HOLDING:
         case MB_REG_INPUT:
-            memcpy(&(reg_ptr[index]), buff, count * 2);
+            if(written == NULL) {
+                memcpy(&(reg_ptr[index]), buff, count * 2);
+                break;
+            }
+            for(n = 0; n < count; n++) {
+                if(!_WRITTEN(written, index + n)) reg_ptr[index + n] = buff[n];
+            }
             break;
         case MB_REG_COIL:
         case MB_REG_DISC:
             word = index / 16;
             bit = index % 16;
             for(n = 0; n < count; n++) {
-                if((0x01 << (n % 16)) & buff[n/16] ) {
+                if(written != NULL && _WRITTEN(written, index + n)) {
+                    ; /* Leave what the client wrote alone */
+                } else if((0x01 << (n % 16)) & buff[n/16] ) {
                     reg_ptr[word] |= (0x01 << bit);
                 } else {
                     reg_ptr[word] &= ~(0x01 << bit);
@@ -598,7 +762,7 @@ mb_read_register(mb_port *port, int regtype, u_int16_t *buff, u_int16_t index, u
     unsigned int reg_size, word, n;
     _mb_mutex_t *reg_mutex;
     unsigned char bit;
-    fprintf(stderr, "mb_read_register() called with regtype = %d\n", regtype);
+    DAX_TRACE(TRACE_MB_READ_REG, regtype, index, count, 0, 0);
     switch(regtype) {
         case MB_REG_HOLDING:
             reg_ptr = port->holdreg;
@@ -654,6 +818,73 @@ mb_read_register(mb_port *port, int regtype, u_int16_t *buff, u_int16_t index, u
     return 0;
 }
 
+/* Starts keeping track of which holding registers and coils the clients
+ * write.  Has to be called after the registers are allocated.  From then
+ * on mb_write_register() won't overwrite them until the application has
+ * taken them with mb_take_written(). */
+int
+mb_track_writes(mb_port *port)
+{
+    int result = 0;
+
+    mb_mutex_lock(port, &port->hold_mutex);
+    if(port->holdwritten == NULL && port->holdsize) {
+        port->holdwritten = malloc(port->holdsize / 8 + 1);
+        if(port->holdwritten == NULL) result = MB_ERR_ALLOC;
+        else bzero(port->holdwritten, port->holdsize / 8 + 1);
+    }
+    mb_mutex_unlock(port, &port->hold_mutex);
+    mb_mutex_lock(port, &port->coil_mutex);
+    if(port->coilwritten == NULL && port->coilsize) {
+        port->coilwritten = malloc(port->coilsize / 8 + 1);
+        if(port->coilwritten == NULL) result = MB_ERR_ALLOC;
+        else bzero(port->coilwritten, port->coilsize / 8 + 1);
+    }
+    mb_mutex_unlock(port, &port->coil_mutex);
+    return result;
+}
+
+/* Finds the first run of registers between 'index' and 'index + count'
+ * that a client has written, clears their marks and returns 1 with the
+ * run in 'first' and 'length'.  The values can then be read with
+ * mb_read_register().  Returns 0 if none have been written. */
+int
+mb_take_written(mb_port *port, int regtype, u_int16_t index, u_int16_t count,
+                u_int16_t *first, u_int16_t *length)
+{
+    u_int8_t *written;
+    unsigned int reg_size, n, end;
+    _mb_mutex_t *reg_mutex;
+
+    if(regtype == MB_REG_HOLDING) {
+        written = port->holdwritten;
+        reg_size = port->holdsize;
+        reg_mutex = &port->hold_mutex;
+    } else if(regtype == MB_REG_COIL) {
+        written = port->coilwritten;
+        reg_size = port->coilsize;
+        reg_mutex = &port->coil_mutex;
+    } else {
+        return MB_ERR_BAD_ARG;
+    }
+    if(written == NULL) return 0;
+    end = index + count;
+    if(end > reg_size) end = reg_size;
+    mb_mutex_lock(port, reg_mutex);
+    for(n = index; n < end && !_WRITTEN(written, n); n++);
+    if(n == end) {
+        mb_mutex_unlock(port, reg_mutex);
+        return 0;
+    }
+    *first = n;
+    for(; n < end && _WRITTEN(written, n); n++) {
+        written[n / 8] &= ~(0x01 << (n % 8));
+    }
+    mb_mutex_unlock(port, reg_mutex);
+    *length = n - *first;
+    return 1;
+}
+
 
 /* This sets the msgout callback function.  The given function will receive the bytes
  * that are actually being sent by the modbus functions. */
@@ -729,6 +960,7 @@ add_cmd(mb_port *p, mb_cmd *mc)
         }
         node->next = mc;
     }
+    p->cmd_count++;
     return 0;
 }
     
@@ -756,6 +988,10 @@ mb_print_portconfig(FILE *fd, mb_port *mp)
     /* Network Port Specific Configuration */
     } else if(mp->devtype == MB_NETWORK) {
         fprintf(fd, "Network Port %s:%d\n", mp->ipaddress, mp->bindport);
+        if(mp->protocol == MB_TCP && mp->type == MB_CLIENT) {
+            fprintf(fd, "Reconnect Delay: %d - %d mSec\n", mp->backoff_min, mp->backoff_max);
+            fprintf(fd, "Request Window: %d\n", mp->window);
+        }
     }
     fprintf(fd, "Port Type: ");
     if(mp->protocol == MB_RTU) fprintf(fd, "RTU - ");
@@ -776,23 +1012,35 @@ mb_print_portconfig(FILE *fd, mb_port *mp)
     }
     fprintf(fd, "\n");
     fprintf(fd, "Intercommand delay: %d mSec\n", mp->delay);
-    fprintf(fd, "Interbyte Timeout: %d mSec\n", mp->frame);
+    if(mp->frame > 0) {
+        fprintf(fd, "Interbyte Timeout: %d mSec\n", mp->frame);
+    } else {
+        fprintf(fd, "Interbyte Timeout: %d uSec\n", mp->gap);
+    }
     fprintf(fd, "Retries: %d\n", mp->retries);
     fprintf(fd, "Scan Rate: %d mSec\n", mp->scanrate);
     fprintf(fd, "Timeout: %d mSec\n", mp->timeout);
     fprintf(fd, "Max Failures: %d\n", mp->maxattempts);
     fprintf(fd, "Inhibit Time: %d Seconds\n", mp->inhibit_time);
+    if(mp->coalesce < 0) {
+        fprintf(fd, "Combine Reads: No\n");
+    } else {
+        fprintf(fd, "Combine Reads: Gap of %d\n", mp->coalesce);
+    }
         
     mc = mp->commands;
     if(mc == NULL) fprintf(fd, "No commands configured for this port\n");
     else {
-        fprintf(fd, "  Cmd  Node  FC Register Len\n");
+        fprintf(fd, "  Cmd  Node  FC Register Len Period Pri\n");
         i = 0;
         while(mc != NULL) {
-            fprintf(fd, " %4d  %4d  %2d %5d   %3d\n",i++,mc->node,
+            fprintf(fd, " %4d  %4d  %2d %5d   %3d %6d %3d\n",i++,mc->node,
                                                   mc->function,
                                                   mc->m_register,
-                                                  mc->length);
+                                                  mc->length,
+                                                  mc->period ? mc->period : 
+                                                  (mc->interval > 1 ? mc->interval : 1) * mp->scanrate,
+                                                  mc->priority);
             mc = mc->next;
         }
     }
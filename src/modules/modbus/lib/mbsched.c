@@ -0,0 +1,429 @@
+/* mbsched.c - Modbus (tm) Communications Library
+ * Copyright (C) 2010 Phil Birkelbach
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * Source file for the master command scheduler.  Each command has its own
+ * period and the time that it's due next on the monotonic clock.  The
+ * commands that are waiting are kept in a heap ordered by that time.  When
+ * they come due they are moved to a second heap that is ordered by
+ * priority so that if several commands are due at once the most important
+ * one goes first.
+ *
+ * Before the first command is scheduled the read commands that can share a
+ * request are combined into blocks.  The block is scheduled in place of its
+ * members and the response is copied back out to each of them.
+ */
+
+#include <mblib.h>
+#include <modbus.h>
+
+/* Returns true if 'a' should come off the waiting heap before 'b' */
+static int
+_wait_before(mb_cmd *a, mb_cmd *b)
+{
+    int result;
+
+    result = time_cmp(&a->deadline, &b->deadline);
+    if(result) return result < 0;
+    return a->priority > b->priority;
+}
+
+/* Returns true if 'a' should come off the due heap before 'b' */
+static int
+_due_before(mb_cmd *a, mb_cmd *b)
+{
+    if(a->priority != b->priority) return a->priority > b->priority;
+    return time_cmp(&a->deadline, &b->deadline) < 0;
+}
+
+static void
+_heap_push(mb_cmd **heap, int *count, mb_cmd *mc, int (*before)(mb_cmd *, mb_cmd *))
+{
+    int n, parent;
+
+    n = (*count)++;
+    while(n > 0) {
+        parent = (n - 1) / 2;
+        if(!before(mc, heap[parent])) break;
+        heap[n] = heap[parent];
+        n = parent;
+    }
+    heap[n] = mc;
+}
+
+static mb_cmd *
+_heap_pop(mb_cmd **heap, int *count, int (*before)(mb_cmd *, mb_cmd *))
+{
+    mb_cmd *top, *last;
+    int n, child;
+
+    if(*count == 0) return NULL;
+    top = heap[0];
+    last = heap[--(*count)];
+    n = 0;
+    while((child = n * 2 + 1) < *count) {
+        if(child + 1 < *count && before(heap[child + 1], heap[child])) child++;
+        if(!before(heap[child], last)) break;
+        heap[n] = heap[child];
+        n = child;
+    }
+    heap[n] = last;
+    return top;
+}
+
+/* Returns the command's period in mSec.  If one hasn't been set we use the
+ * old idea of a number of port scans. */
+static unsigned int
+_period(mb_port *mp, mb_cmd *mc)
+{
+    if(mc->period) return mc->period;
+    if(mp->scanrate <= 0) return 1;
+    if(mc->interval > 1) return mc->interval * mp->scanrate;
+    return mp->scanrate;
+}
+
+/* Used to sort the read commands so that the ones that can be combined are
+ * next to each other */
+struct sched_sort {
+    mb_cmd *cmd;
+    unsigned int period;
+};
+
+static int
+_sort_compare(const void *a, const void *b)
+{
+    const struct sched_sort *x = a, *y = b;
+
+    if(x->cmd->node != y->cmd->node) return x->cmd->node - y->cmd->node;
+    if(x->cmd->function != y->cmd->function) return x->cmd->function - y->cmd->function;
+    if(x->period != y->period) return x->period < y->period ? -1 : 1;
+    return x->cmd->m_register - y->cmd->m_register;
+}
+
+/* Returns true if the block is enabled, which is whenever any of its
+ * members are */
+static int
+_block_enable(mb_cmd *block)
+{
+    int n;
+
+    block->enable = 0;
+    for(n = 0; n < block->nmembers; n++) {
+        if(block->members[n]->enable) block->enable = 1;
+    }
+    return block->enable;
+}
+
+/* The members' pre_send() callbacks are called from the block's so that
+ * whatever setup they do still gets done */
+static void
+_block_pre_send(mb_cmd *block, void *userdata, u_int8_t *data, int size)
+{
+    mb_cmd *mc;
+    int n;
+
+    for(n = 0; n < block->nmembers; n++) {
+        mc = block->members[n];
+        if(mc->enable && mc->pre_send != NULL) {
+            mc->pre_send(mc, mc->userdata, mc->data, mc->datasize);
+        }
+    }
+    _block_enable(block);
+}
+
+/* Copies each member's part of the block's data out to it and calls its
+ * post_send() callback */
+static void
+_block_post_send(mb_cmd *block, void *userdata, u_int8_t *data, int size)
+{
+    mb_cmd *mc;
+    int n, bit, offset;
+
+    for(n = 0; n < block->nmembers; n++) {
+        mc = block->members[n];
+        if(!mc->enable) continue;
+        offset = mc->m_register - block->m_register;
+        if(mc->function == 1 || mc->function == 2) {
+            bzero(mc->data, mc->datasize);
+            for(bit = 0; bit < mc->length; bit++) {
+                if(data[(offset + bit) / 8] & (1 << ((offset + bit) % 8))) {
+                    mc->data[bit / 8] |= 1 << (bit % 8);
+                }
+            }
+        } else {
+            memcpy(mc->data, &((u_int16_t *)data)[offset], mc->length * 2);
+        }
+        mc->responses++;
+        mc->lasterror = 0;
+        if(mc->post_send != NULL) {
+            mc->post_send(mc, mc->userdata, mc->data, mc->datasize);
+        }
+    }
+}
+
+static void
+_block_send_fail(mb_cmd *block, void *userdata)
+{
+    mb_cmd *mc;
+    int n;
+
+    for(n = 0; n < block->nmembers; n++) {
+        mc = block->members[n];
+        if(mc->enable && mc->send_fail != NULL) {
+            mc->send_fail(mc, mc->userdata);
+        }
+    }
+}
+
+/* Makes a block that reads for the 'count' commands in 'list' */
+static int
+_block_new(mb_port *mp, struct sched_sort *list, int count, u_int16_t start, u_int16_t end)
+{
+    mb_cmd *block;
+    int n;
+
+    block = mb_new_cmd(NULL);
+    if(block == NULL) return MB_ERR_ALLOC;
+    block->members = malloc(count * sizeof(mb_cmd *));
+    if(block->members == NULL || mb_set_command(block, list[0].cmd->node, list[0].cmd->function,
+                                                start, end - start)) {
+        free(block->members);
+        mb_destroy_cmd(block);
+        return MB_ERR_ALLOC;
+    }
+    block->period = list[0].period;
+    block->priority = list[0].cmd->priority;
+    for(n = 0; n < count; n++) {
+        block->members[n] = list[n].cmd;
+        list[n].cmd->block = block;
+        if(list[n].cmd->priority > block->priority) block->priority = list[n].cmd->priority;
+    }
+    block->nmembers = count;
+    mb_pre_send_callback(block, _block_pre_send);
+    mb_post_send_callback(block, _block_post_send);
+    mb_send_fail_callback(block, _block_send_fail);
+    block->next = mp->blocks;
+    mp->blocks = block;
+    DEBUGMSG2("Combined %d commands into one request", count);
+    return 0;
+}
+
+/* Combines the read commands on the port into as few requests as we can.
+ * Commands can share a request if they are for the same node and function
+ * code and have the same period.  They are sorted by register and then
+ * taken in order for as long as the next one starts within the port's gap
+ * of the end of the block and the whole block fits in one request. */
+static int
+_sched_combine(mb_port *mp)
+{
+    struct sched_sort *list;
+    mb_cmd *mc;
+    int n, first, count = 0, limit, result = 0;
+    unsigned int start, end;
+
+    list = malloc(mp->cmd_count * sizeof(struct sched_sort));
+    if(list == NULL) return MB_ERR_ALLOC;
+    for(mc = mp->commands; mc != NULL; mc = mc->next) {
+        if(mc->function >= 1 && mc->function <= 4 && mc->length > 0 && mc->block == NULL) {
+            list[count].cmd = mc;
+            list[count].period = _period(mp, mc);
+            count++;
+        }
+    }
+    qsort(list, count, sizeof(struct sched_sort), _sort_compare);
+    first = 0;
+    while(first < count && result == 0) {
+        mc = list[first].cmd;
+        limit = mc->function <= 2 ? MB_MAX_READ_BITS : MB_MAX_READ_REGS;
+        start = mc->m_register;
+        end = start + mc->length;
+        for(n = first + 1; n < count; n++) {
+            mc = list[n].cmd;
+            if(mc->node != list[first].cmd->node ||
+               mc->function != list[first].cmd->function ||
+               list[n].period != list[first].period) break;
+            if(mc->m_register > end + mp->coalesce) break;
+            if(mc->m_register + mc->length > end) {
+                if(mc->m_register + mc->length - start > limit) break;
+                end = mc->m_register + mc->length;
+            }
+        }
+        if(n - first > 1) {
+            result = _block_new(mp, &list[first], n - first, start, end);
+        }
+        first = n;
+    }
+    free(list);
+    return result;
+}
+
+/* Makes sure the heaps have room for every command on the port and adds
+ * any commands that aren't in the scheduler yet.  New commands are due
+ * right away.  Commands that are added after the port has started are
+ * never combined with the others. */
+static int
+_sched_grow(mb_port *mp)
+{
+    mb_cmd *mc, **new;
+    int count = 0, size;
+
+    if(mp->sched_count == 0 && mp->blocks == NULL && mp->coalesce >= 0) {
+        _sched_combine(mp);
+    }
+    for(mc = mp->commands; mc != NULL; mc = mc->next) count++;
+    size = count;
+    for(mc = mp->blocks; mc != NULL; mc = mc->next) size++;
+    if(size > mp->sched_size) {
+        new = realloc(mp->waiting, size * sizeof(mb_cmd *));
+        if(new == NULL) return MB_ERR_ALLOC;
+        mp->waiting = new;
+        new = realloc(mp->due, size * sizeof(mb_cmd *));
+        if(new == NULL) return MB_ERR_ALLOC;
+        mp->due = new;
+        mp->sched_size = size;
+    }
+    for(mc = mp->commands; mc != NULL; mc = mc->next) {
+        if(!mc->scheduled && mc->block == NULL) {
+            mc->scheduled = 1;
+            monotime(&mc->deadline);
+            _heap_push(mp->waiting, &mp->nwaiting, mc, _wait_before);
+        }
+    }
+    for(mc = mp->blocks; mc != NULL; mc = mc->next) {
+        if(!mc->scheduled) {
+            mc->scheduled = 1;
+            monotime(&mc->deadline);
+            _heap_push(mp->waiting, &mp->nwaiting, mc, _wait_before);
+        }
+    }
+    mp->sched_count = count;
+    return 0;
+}
+
+/* Returns the next command that is due to be sent or NULL if there aren't
+ * any.  The caller has to give the command back with sched_done() after it
+ * has been sent.  Commands that are disabled are rescheduled here. */
+mb_cmd *
+sched_next(mb_port *mp)
+{
+    struct timespec now;
+    mb_cmd *mc;
+
+    if(mp->sched_count != mp->cmd_count) {
+        if(_sched_grow(mp)) return NULL;
+    }
+    monotime(&now);
+    while(mp->nwaiting && time_cmp(&mp->waiting[0]->deadline, &now) <= 0) {
+        mc = _heap_pop(mp->waiting, &mp->nwaiting, _wait_before);
+        _heap_push(mp->due, &mp->ndue, mc, _due_before);
+    }
+    while((mc = _heap_pop(mp->due, &mp->ndue, _due_before)) != NULL) {
+        if(mc->members) _block_enable(mc);
+        if(mc->enable) {
+            mc->started = now;
+            return mc;
+        }
+        sched_done(mp, mc);
+    }
+    return NULL;
+}
+
+/* Records the timing for a command that sched_next() returned and puts it
+ * back in the waiting heap with its next deadline.  The next deadline is a
+ * whole period after the last one so the command doesn't drift.  If that
+ * time has already passed the command has overrun its period and the
+ * port's overrun policy decides what to do. */
+void
+sched_done(mb_port *mp, mb_cmd *mc)
+{
+    struct timespec now;
+    unsigned int period;
+    mb_cmd *this;
+    long late;
+    int n;
+
+    /* A command can be taken a little before its deadline which counts
+     * as being on time */
+    late = (mc->started.tv_sec - mc->deadline.tv_sec) * 1000000L +
+           (mc->started.tv_nsec - mc->deadline.tv_nsec) / 1000;
+    if(late < 0) late = 0;
+    /* The members of a block were sent when it was */
+    for(n = -1; n < mc->nmembers; n++) {
+        this = n < 0 ? mc : mc->members[n];
+        if(!this->enable) continue;
+        this->runs++;
+        this->jitter_last = late;
+        this->jitter_sum += late;
+        if(late > this->jitter_max) this->jitter_max = late;
+    }
+    period = _period(mp, mc);
+    time_add_msec(&mc->deadline, period);
+    monotime(&now);
+    if(time_cmp(&mc->deadline, &now) <= 0) {
+        mc->overruns++;
+        if(mp->overrun == MB_OVERRUN_SKIP) {
+            while(time_cmp(&mc->deadline, &now) <= 0) {
+                time_add_msec(&mc->deadline, period);
+            }
+        } else if(mp->overrun == MB_OVERRUN_DELAY) {
+            mc->deadline = now;
+            time_add_msec(&mc->deadline, period);
+        }
+        /* MB_OVERRUN_CATCHUP leaves it due right away */
+    }
+    _heap_push(mp->waiting, &mp->nwaiting, mc, _wait_before);
+}
+
+/* Sleeps until the next command is due or for the scanrate if there are no
+ * commands.  Returns early if a signal comes in. */
+void
+sched_sleep(mb_port *mp)
+{
+    struct timespec ts;
+
+    if(mp->ndue == 0 && mp->nwaiting) {
+        ts = mp->waiting[0]->deadline;
+    } else if(mp->ndue) {
+        return;
+    } else {
+        monotime(&ts);
+        time_add_msec(&ts, mp->scanrate);
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+void
+sched_free(mb_port *mp)
+{
+    mb_cmd *mc;
+
+    for(mc = mp->commands; mc != NULL; mc = mc->next) {
+        mc->scheduled = 0;
+        mc->block = NULL;
+    }
+    while(mp->blocks != NULL) {
+        mc = mp->blocks;
+        mp->blocks = mc->next;
+        free(mc->members);
+        free(mc->data);
+        mb_destroy_cmd(mc);
+    }
+    free(mp->waiting);
+    free(mp->due);
+    mp->waiting = mp->due = NULL;
+    mp->nwaiting = mp->ndue = 0;
+    mp->sched_size = mp->sched_count = 0;
+}
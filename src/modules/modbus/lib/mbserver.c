@@ -15,166 +15,412 @@
  * along with this program; if not, write to the Free Software
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  * 
- * Source file for TCP Server functionality
+ * Source file for TCP Server functionality.  All of the connections are
+ * handled by one thread with epoll(), or poll() where we don't have it.
+ * Each connection has its own buffers so that a request can come in
+ * pieces and a client can send several requests at once without waiting
+ * for the responses.
  */
 
-#include <modbus.h>
 #include <mblib.h>
+#include <modbus.h>
+#include <netinet/tcp.h>
+#ifdef HAVE_SYS_EPOLL_H
+ #include <sys/epoll.h>
+#endif
 
-/* These two functions are wrappers to deal with adding and deleting
-   file descriptors to the global _fdset and dealing with _maxfd */
-static void
-_add_fd(mb_port *port, int fd)
+/* Size of the MBAP header without the unit id */
+#define MBAP_SIZE 6
+/* Most connections that are accepted at once each time the listening
+ * socket is ready, so a flood of them can't starve the others */
+#define ACCEPT_BATCH 16
+/* Most events handled for each call to epoll_wait() */
+#define EVENT_BATCH 64
+
+/* These functions hide the difference between epoll() and poll().  'ptr'
+ * is the client or NULL for the listening socket. */
+#ifdef HAVE_SYS_EPOLL_H
+
+static int
+_watch_init(struct mb_server *server, int max)
 {
-    FD_SET(fd, &(port->fdset));
-    if(fd > port->maxfd) port->maxfd = fd;
+    server->pollfd = epoll_create(max);
+    if(server->pollfd < 0) return MB_ERR_ALLOC;
+    fcntl(server->pollfd, F_SETFD, FD_CLOEXEC);
+    return 0;
 }
 
 static void
-_del_fd(mb_port *port, int fd)
+_watch_free(struct mb_server *server)
 {
-    int n, tmpfd = 0;
-    
-    FD_CLR(fd, &(port->fdset));
-    
-    /* If it's the largest one then we need to re-figure _maxfd */
-    if(fd == port->maxfd) {
-        for(n = 0; n <= port->maxfd; n++) {
-            if(FD_ISSET(n, &(port->fdset))) {
-                tmpfd = n;
-            }
-        }
-        port->maxfd = tmpfd;
-    }
+    if(server->pollfd >= 0) close(server->pollfd);
+    server->pollfd = -1;
 }
 
 static int
-_add_connection(mb_port *port, int fd)
+_watch_add(struct mb_server *server, int fd, struct mb_client *ptr, int events)
 {
-    struct client_buffer *new;
-    
-    DEBUGMSG2("_add_connection() - Adding connection on fd %d", fd);
-    new = malloc(sizeof(struct client_buffer));
-    if(new == NULL) return MB_ERR_ALLOC;
-    
-    new->fd = fd;
-    new->buffindex = 0;
-    
-    if(port->buff_head == NULL) {
-        /* If it's the first one just put it on top */
-        new->next = NULL;
-    } else {
-        /* Just jam the thing onto the top of the list */
-        new->next = port->buff_head;
-    }
-    port->buff_head = new;
-    _add_fd(port, fd);
-    return 0;
+    struct epoll_event ev;
+
+    bzero(&ev, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = ptr;
+    return epoll_ctl(server->pollfd, EPOLL_CTL_ADD, fd, &ev);
 }
 
-/* Loops through the client buffer linked list of the port and sets
- * the index to 0, effectively delteing the buffers. */
+static void
+_watch_mod(struct mb_server *server, struct mb_client *cl, int events)
+{
+    struct epoll_event ev;
+
+    bzero(&ev, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = cl;
+    epoll_ctl(server->pollfd, EPOLL_CTL_MOD, cl->fd, &ev);
+}
+
+static void
+_watch_del(struct mb_server *server, struct mb_client *cl)
+{
+    struct epoll_event ev; /* Old kernels want this even though it isn't used */
+
+    epoll_ctl(server->pollfd, EPOLL_CTL_DEL, cl->fd, &ev);
+}
+
+#else /* HAVE_SYS_EPOLL_H */
+
+/* Without epoll we keep the pollfd array up to date as connections come
+ * and go.  The listening socket is always the first one. */
 static int
-_clear_buffers(mb_port *port)
+_watch_init(struct mb_server *server, int max)
 {
-    struct client_buffer *this;
-    
-    this = port->buff_head;
-    
-    while(this != NULL) {
-        this->buffindex = 0;
-        this = this->next;
+    server->pfds = malloc(sizeof(struct pollfd) * (max + 1));
+    server->pclients = malloc(sizeof(struct mb_client *) * (max + 1));
+    if(server->pfds == NULL || server->pclients == NULL) {
+        free(server->pfds);
+        free(server->pclients);
+        server->pfds = NULL;
+        server->pclients = NULL;
+        return MB_ERR_ALLOC;
     }
+    server->npfds = 0;
     return 0;
 }
 
+static void
+_watch_free(struct mb_server *server)
+{
+    free(server->pfds);
+    free(server->pclients);
+    server->pfds = NULL;
+    server->pclients = NULL;
+    server->npfds = 0;
+}
+
 static int
-_del_connection(mb_port *port, int fd)
+_watch_add(struct mb_server *server, int fd, struct mb_client *ptr, int events)
 {
-    
-    close(fd);
-    _del_fd(port, fd);
+    server->pfds[server->npfds].fd = fd;
+    server->pfds[server->npfds].events = events;
+    server->pclients[server->npfds] = ptr;
+    if(ptr != NULL) ptr->index = server->npfds;
+    server->npfds++;
     return 0;
 }
 
-static struct client_buffer *
-_get_buff_ptr(mb_port *port, int fd)
+static void
+_watch_mod(struct mb_server *server, struct mb_client *cl, int events)
 {
-    struct client_buffer *this;
-    
-    this = port->buff_head;
-    while(this != NULL) {
-        if(this->fd == fd) {
-            return this;
+    server->pfds[cl->index].events = events;
+}
+
+/* The last one is moved into the hole */
+static void
+_watch_del(struct mb_server *server, struct mb_client *cl)
+{
+    int n;
+
+    n = --server->npfds;
+    if(cl->index != n) {
+        server->pfds[cl->index] = server->pfds[n];
+        server->pclients[cl->index] = server->pclients[n];
+        server->pclients[cl->index]->index = cl->index;
+    }
+}
+
+ #define EPOLLIN POLLIN
+ #define EPOLLOUT POLLOUT
+ #define EPOLLERR POLLERR
+ #define EPOLLHUP POLLHUP
+#endif /* HAVE_SYS_EPOLL_H */
+
+/* The list of connections is kept in the order that they last received
+ * anything so the ones that might have timed out are always at the head */
+static void
+_list_remove(struct mb_server *server, struct mb_client *cl)
+{
+    if(cl->prev) cl->prev->next = cl->next;
+    else         server->head = cl->next;
+    if(cl->next) cl->next->prev = cl->prev;
+    else         server->tail = cl->prev;
+    cl->prev = cl->next = NULL;
+}
+
+static void
+_list_append(struct mb_server *server, struct mb_client *cl)
+{
+    cl->prev = server->tail;
+    cl->next = NULL;
+    if(server->tail) server->tail->next = cl;
+    else             server->head = cl;
+    server->tail = cl;
+}
+
+static void
+_touch(struct mb_server *server, struct mb_client *cl)
+{
+    monotime(&cl->last);
+    if(server->tail != cl) {
+        _list_remove(server, cl);
+        _list_append(server, cl);
+    }
+}
+
+static void
+_del_connection(struct mb_server *server, struct mb_client *cl)
+{
+    DEBUGMSG2("_del_connection() - Closing connection on fd %d", cl->fd);
+    _watch_del(server, cl);
+    _list_remove(server, cl);
+    close(cl->fd);
+    server->count--;
+    free(cl);
+}
+
+/* Accepts the connections that are waiting on the listening socket */
+static void
+_accept(mb_port *port, struct mb_server *server)
+{
+    struct mb_client *cl;
+    struct sockaddr_in addr;
+    socklen_t len;
+    int fd, n, opt;
+
+    for(n = 0; n < ACCEPT_BATCH; n++) {
+        len = sizeof(addr);
+        fd = accept(port->fd, (struct sockaddr *)&addr, &len);
+        if(fd < 0) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                DEBUGMSG2("_accept() - Error accepting socket: %s", strerror(errno));
+            }
+            return;
+        }
+        if(server->count >= port->maxconn) {
+            DEBUGMSG2("_accept() - Connection limit reached, closing fd %d", fd);
+            server->rejected++;
+            close(fd);
+            continue;
+        }
+        cl = malloc(sizeof(struct mb_client));
+        if(cl == NULL) {
+            close(fd);
+            continue;
+        }
+        cl->fd = fd;
+        strncpy(cl->ipaddress, inet_ntoa(addr.sin_addr), sizeof(cl->ipaddress) - 1);
+        cl->ipaddress[sizeof(cl->ipaddress) - 1] = '\0';
+        cl->port = ntohs(addr.sin_port);
+        cl->inlen = 0;
+        cl->outlen = 0;
+        cl->events = EPOLLIN;
+        cl->requests = 0;
+        cl->exceptions = 0;
+        cl->bytes_in = 0;
+        cl->bytes_out = 0;
+        monotime(&cl->connected);
+        cl->last = cl->connected;
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        opt = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+        setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &opt, sizeof(opt));
+        if(_watch_add(server, fd, cl, cl->events)) {
+            close(fd);
+            free(cl);
+            continue;
         }
-        this = this->next;
+        _list_append(server, cl);
+        server->count++;
+        server->accepted++;
+        DEBUGMSG2("_accept() - Accepted connection on fd %d", fd);
     }
-    return NULL;
 }
 
+/* Returns 1 if there is at least one whole request, or a bad header that
+ * _client_frames() has to deal with, at the front of the receive buffer */
 static int
-_mb_read(mb_port *port, int fd)
-{   
-    int result, size;
-    unsigned char buff[100];
-    struct client_buffer *cc;
-    u_int16_t msgsize;
-    
-    size = 100;
-    result = read(fd, buff, size);
-    if(result < 0) {
-        DEBUGMSG2("Unable to read data from socket %d", fd);
-        return MB_ERR_RECV_FAIL;
-    } if(result == 0) { /* EOF means the other guy is closed */
-        DEBUGMSG2("Received EOF on socket %d", fd);
-        return MB_ERR_NO_SOCKET;
+_frame_ready(struct mb_client *cl)
+{
+    u_int16_t length;
+
+    if(cl->inlen <= MBAP_SIZE) return 0;
+    COPYWORD(&length, &cl->in[4]);
+    return cl->inlen >= length + MBAP_SIZE;
+}
+
+/* Answers every whole request in the receive buffer as long as there is
+ * room for the response in the send buffer.  Returns the number of
+ * requests answered or MB_ERR_RECV_FAIL if we can't find the frames in
+ * the stream anymore. */
+static int
+_client_frames(mb_port *port, struct mb_client *cl)
+{
+    u_int16_t proto, length, msgsize;
+    u_int8_t *resp;
+    int pos = 0, count = 0, result;
+
+    while(cl->inlen - pos > MBAP_SIZE) {
+        COPYWORD(&proto, &cl->in[pos + 2]);
+        COPYWORD(&length, &cl->in[pos + 4]);
+        if(proto != 0 || length < 2 || length > MB_BUFF_SIZE - MBAP_SIZE) {
+            DEBUGMSG2("_client_frames() - Bad MBAP header on fd %d", cl->fd);
+            return MB_ERR_RECV_FAIL;
+        }
+        if(cl->inlen - pos < length + MBAP_SIZE) break; /* Not all here yet */
+        /* The response is built where it will be sent from */
+        if(cl->outlen + MB_BUFF_SIZE > MB_CLIENT_BUFF) break;
+        resp = &cl->out[cl->outlen];
+        memcpy(resp, &cl->in[pos], length + MBAP_SIZE);
+        pos += length + MBAP_SIZE;
+        if(port->in_callback) {
+            port->in_callback(port, resp, length + MBAP_SIZE);
+        }
+        cl->requests++;
+        result = create_response(port, &resp[MBAP_SIZE], length, MB_BUFF_SIZE - MBAP_SIZE);
+        if(result > 0) {
+            if(resp[MBAP_SIZE + 1] & ME_EXCEPTION) cl->exceptions++;
+            msgsize = result;
+            COPYWORD(&resp[4], &msgsize);
+            if(port->out_callback) {
+                port->out_callback(port, resp, result + MBAP_SIZE);
+            }
+            cl->outlen += result + MBAP_SIZE;
+        } else if(result < 0) {
+            DEBUGMSG2("_client_frames() - create_response() returned %d", result);
+        }
+        count++;
     }
-    
-    cc = _get_buff_ptr(port, fd);
-    assert(cc != NULL); /* If we get this far cc should exist in the port */
-    
-    /* Check that we haven't received too big of a message */
-    if((result + cc->buffindex) > MB_BUFF_SIZE) {
-        return MB_ERR_OVERFLOW;
+    if(pos > 0) {
+        cl->inlen -= pos;
+        memmove(cl->in, &cl->in[pos], cl->inlen);
     }
-    memcpy(&(cc->buff[cc->buffindex]), buff, result); /* Copy the new data to the buffer */
-    cc->buffindex += result;
-    if(cc->buffindex > 5) {
-        COPYWORD(&msgsize, (u_int16_t *)&cc->buff[4]); /* Get the Modbus Message size */
-        if(cc->buffindex >= (msgsize + 6)) {
-            if(port->in_callback) {
-                port->in_callback(port, cc->buff, cc->buffindex);
-            }
+    return count;
+}
+
+/* Sends as much of the send buffer as the socket will take.  Returns 0 or
+ * MB_ERR_PORTFAIL if the socket failed */
+static int
+_client_flush(struct mb_client *cl)
+{
+    int result, count = 0;
+
+    while(count < cl->outlen) {
+        result = send(cl->fd, &cl->out[count], cl->outlen - count, MSG_NOSIGNAL);
+        if(result < 0) {
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+            DEBUGMSG2("_client_flush() - %s", strerror(errno));
+            return MB_ERR_PORTFAIL;
+        }
+        count += result;
+    }
+    cl->bytes_out += count;
+    cl->outlen -= count;
+    if(count && cl->outlen) memmove(cl->out, &cl->out[count], cl->outlen);
+    return 0;
+}
 
-            result = create_response(port, &(cc->buff[6]), MB_BUFF_SIZE - 6);
-            if(result > 0) { /* We have a response */
-                msgsize = result;
-                COPYWORD(&(cc->buff[4]), &msgsize);
-                if(port->out_callback) {
-                    port->out_callback(port, cc->buff, result + 6);
-                }
-                write(cc->fd, cc->buff, result + 6);
-                cc->buffindex = 0;
-            } else if(result < 0) {
-                fprintf(stderr, "Error Code Returned %d\n", result);
-                return result;
+/* Handles the events on one connection.  We only read once for each event
+ * so that one busy client can't keep the others waiting.  Returns 0 or
+ * a negative error code if the connection should be closed. */
+static int
+_client_event(mb_port *port, struct mb_server *server, struct mb_client *cl, int events)
+{
+    int result, events_new;
+
+    /* If the receive buffer is full we have to answer what's in it before
+     * we can read any more.  A read of zero bytes would look like EOF. */
+    if((events & EPOLLIN) && cl->inlen < MB_CLIENT_BUFF) {
+        result = read(cl->fd, &cl->in[cl->inlen], MB_CLIENT_BUFF - cl->inlen);
+        if(result == 0) {
+            DEBUGMSG2("_client_event() - Received EOF on fd %d", cl->fd);
+            return MB_ERR_NO_SOCKET;
+        } else if(result < 0) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                return MB_ERR_RECV_FAIL;
             }
+        } else {
+            cl->inlen += result;
+            cl->bytes_in += result;
+            _touch(server, cl);
         }
+    } else if(events & (EPOLLERR | EPOLLHUP) && !(events & EPOLLIN)) {
+        return MB_ERR_NO_SOCKET;
+    }
+    /* Keep answering requests for as long as the socket takes the
+     * responses.  Otherwise we wait until it can take more and answer
+     * the rest then. */
+    do {
+        result = _client_frames(port, cl);
+        if(result < 0) return result;
+        if(_client_flush(cl)) return MB_ERR_PORTFAIL;
+    } while(cl->outlen == 0 && _frame_ready(cl));
+
+    /* Don't read any more until the responses we have are sent */
+    events_new = cl->outlen ? EPOLLOUT : EPOLLIN;
+    if(events_new != cl->events) {
+        cl->events = events_new;
+        _watch_mod(server, cl, events_new);
     }
     return 0;
 }
 
+/* Closes the connections that have been idle too long.  Returns the mSec
+ * until the next one might time out or -1 if there isn't one. */
+static int
+_expire(mb_port *port, struct mb_server *server)
+{
+    struct timespec deadline;
+    int msec;
+
+    if(port->idle == 0) return -1;
+    while(server->head != NULL) {
+        deadline = server->head->last;
+        time_add_msec(&deadline, port->idle);
+        msec = msec_until(&deadline);
+        if(msec > 0) return msec;
+        DEBUGMSG2("_expire() - Connection on fd %d timed out", server->head->fd);
+        server->timeouts++;
+        _del_connection(server, server->head);
+    }
+    return -1;
+}
+
 /* Open a socket to listen */
 static int
 _server_listen(mb_port *port)
 {
     struct sockaddr_in addr;
-    int fd;
+    int fd, opt;
     
     fd = socket(AF_INET, SOCK_STREAM, 0);
     if(fd < 0) {
-        return -1;
+        return MB_ERR_SOCKET;
     }
+    /* So we can start again right away without waiting for the old
+     * connections to time out of TIME_WAIT */
+    opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
 
     bzero(&addr, sizeof(addr));
 
@@ -183,83 +429,84 @@ _server_listen(mb_port *port)
     addr.sin_addr.s_addr = htonl(INADDR_ANY);
 
     if(bind(fd, (const struct sockaddr *)&addr, sizeof(addr))) {
-        return -1;
+        close(fd);
+        return MB_ERR_SOCKET;
     }
 
-    if(listen(fd, 5) < 0) {
-        return -1;
+    if(listen(fd, 64) < 0) {
+        close(fd);
+        return MB_ERR_SOCKET;
     }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
     /* We store this fd so that we know what socket we are listening on */
     port->fd = fd;
-    _add_fd(port, fd);
 
     return 0;
 }
 
-/* This function blocks waiting for a message to be received.  Once a message
- * is retrieved from the system the proper handling function is called */
-int
-_receive(mb_port *port)
+/* Waits for something to happen on the sockets and handles it.  'timeout'
+ * is in mSec */
+static int
+_receive(mb_port *port, struct mb_server *server, int timeout)
 {
-    fd_set tmpset;
-    struct timeval tm;
-    struct sockaddr_in addr;
-    int result, fd, n;
-    socklen_t len = 0;
-
-    FD_ZERO(&tmpset);
-    FD_COPY(&(port->fdset), &tmpset);
-    tm.tv_sec = 1; /* TODO: this should be configuration */
-    tm.tv_usec = 0;
-
-    result = select(port->maxfd + 1, &tmpset, NULL, NULL, &tm);
+    struct mb_client *cl;
+    int result, count, n, events;
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event ev[EVENT_BATCH];
 
-    if(result < 0) {
-        /* Ignore interruption by signal */
-        if(errno == EINTR) {
-            ; /* TODO: check to see if we should die here */
+    count = epoll_wait(server->pollfd, ev, EVENT_BATCH, timeout);
+#else
+    count = poll(server->pfds, server->npfds, timeout);
+#endif
+    if(count < 0) {
+        if(errno == EINTR) return 0;
+        DEBUGMSG2("_receive() - %s", strerror(errno));
+        return MB_ERR_RECV_FAIL;
+    }
+    pthread_mutex_lock(&server->lock);
+#ifdef HAVE_SYS_EPOLL_H
+    for(n = 0; n < count; n++) {
+        cl = ev[n].data.ptr;
+        events = ev[n].events;
+#else
+    /* Go backwards so that closing a connection, which moves the last
+     * one into its place, doesn't make us miss any */
+    for(n = server->npfds - 1; n >= 0; n--) {
+        cl = server->pclients[n];
+        events = server->pfds[n].revents;
+        if(events == 0) continue;
+#endif
+        if(cl == NULL) {
+            _accept(port, server);
         } else {
-            /* TODO: Deal with these errors */
-            DEBUGMSG2("_receive() - select error: %s", strerror(errno));
-            return MB_ERR_RECV_FAIL;
-        }
-    } else if(result == 0) { /* Timeout */
-//        DEBUGMSG("_receive() - Timeout");
-        _clear_buffers(port); /* this erases all of the _buffer nodes */
-        return 0;
-    } else {
-        for(n = 0; n <= port->maxfd; n++) {
-            if(FD_ISSET(n, &tmpset)) {
-                if(n == port->fd) { /* This is a listening socket */
-                    fd = accept(n, (struct sockaddr *)&addr, &len);
-                    if(fd < 0) {
-                        /* TODO: Need to handle these communication errors */
-                        DEBUGMSG2("_recieve() - Error Accepting socket: %s", strerror(errno));
-                    } else {
-                        DEBUGMSG2("_recieve() - Accepted socket on fd %d", n);
-                        _add_connection(port, fd);
-                    }
-                } else {
-                    result = _mb_read(port, n);
-                    if(result == MB_ERR_NO_SOCKET) { /* This is the end of file */
-                        DEBUGMSG2("Connection Closed for fd %d", n);
-                        _del_connection(port, n);
-                    } else if(result < 0) {
-                        return result; /* Pass the error up */
-                    }
-                }
+            result = _client_event(port, server, cl, events);
+            if(result) {
+                /* The client closing the connection isn't an error */
+                if(result != MB_ERR_NO_SOCKET) server->errors++;
+                _del_connection(server, cl);
             }
         }
     }
+    pthread_mutex_unlock(&server->lock);
     return 0;
 }
 
-
 int
 server_loop(mb_port *port)
 {
-    int result;
+    struct mb_server *server;
+    int result, timeout;
 
+    if(port->server == NULL) {
+        server = malloc(sizeof(struct mb_server));
+        if(server == NULL) return MB_ERR_ALLOC;
+        bzero(server, sizeof(struct mb_server));
+        server->pollfd = -1;
+        pthread_mutex_init(&server->lock, NULL);
+        port->server = server;
+    }
+    server = port->server;
     result = _server_listen(port);
     if(result) {
         DEBUGMSG2("Failed to listen on port - %s", strerror(errno));
@@ -267,16 +514,94 @@ server_loop(mb_port *port)
     } else {
         DEBUGMSG2("Listening on file descriptor %d", port->fd);
     }
-    
-    while(1) {
-        result = _receive(port);
-        if(result) {
-            if(result == MB_ERR_OVERFLOW) {
-                DEBUGMSG("Buffer Overflow Attempt");
-            } else {
-                return result;
-            }
+    result = _watch_init(server, port->maxconn);
+    if(result == 0) result = _watch_add(server, port->fd, NULL, EPOLLIN);
+    if(result) {
+        _watch_free(server);
+        mb_close_port(port);
+        return MB_ERR_ALLOC;
+    }
+    port->running = 1;
+    while(!port->dienow) {
+        pthread_mutex_lock(&server->lock);
+        timeout = _expire(port, server);
+        pthread_mutex_unlock(&server->lock);
+        /* Wake up once in a while to see if we should stop */
+        if(timeout < 0 || timeout > 1000) timeout = 1000;
+        result = _receive(port, server, timeout);
+        if(result) break;
+    }
+    /* Close everything but keep the statistics */
+    pthread_mutex_lock(&server->lock);
+    while(server->head != NULL) {
+        _del_connection(server, server->head);
+    }
+    _watch_free(server);
+    pthread_mutex_unlock(&server->lock);
+    mb_close_port(port);
+    port->running = 0;
+    if(port->dienow) {
+        port->dienow = 0;
+        return MB_ERR_STOPPED;
+    }
+    return result;
+}
+
+/* Called when the port is destroyed */
+void
+server_free(mb_port *port)
+{
+    if(port->server == NULL) return;
+    pthread_mutex_destroy(&port->server->lock);
+    free(port->server);
+    port->server = NULL;
+}
+
+/* Copies the statistics for up to 'size' of the connections to a TCP
+ * Server port into 'stats'.  Returns the number of connections, which may
+ * be more than 'size'. */
+int
+mb_get_client_stats(mb_port *port, mb_client_stats *stats, int size)
+{
+    struct mb_server *server;
+    struct mb_client *cl;
+    struct timespec now;
+    int n = 0;
+
+    server = port->server;
+    if(server == NULL) return 0;
+    monotime(&now);
+    pthread_mutex_lock(&server->lock);
+    for(cl = server->head; cl != NULL; cl = cl->next) {
+        if(n < size) {
+            strcpy(stats[n].ipaddress, cl->ipaddress);
+            stats[n].port = cl->port;
+            stats[n].connected = now.tv_sec - cl->connected.tv_sec;
+            stats[n].idle = (now.tv_sec - cl->last.tv_sec) * 1000 +
+                            (now.tv_nsec - cl->last.tv_nsec) / 1000000;
+            stats[n].requests = cl->requests;
+            stats[n].exceptions = cl->exceptions;
+            stats[n].bytes_in = cl->bytes_in;
+            stats[n].bytes_out = cl->bytes_out;
         }
+        n++;
     }
-    return -1; /* Can never get here */
-}
\ No newline at end of file
+    pthread_mutex_unlock(&server->lock);
+    return n;
+}
+
+/* Returns the number of connections that a TCP Server port has accepted,
+ * that it refused because it had too many, that were closed because they
+ * were idle and that were closed because of an error */
+void
+mb_get_server_stats(mb_port *port, unsigned int *accepted, unsigned int *rejected,
+                    unsigned int *timeouts, unsigned int *errors)
+{
+    struct mb_server *server;
+
+    server = port->server;
+    if(accepted) *accepted = server ? server->accepted : 0;
+    if(rejected) *rejected = server ? server->rejected : 0;
+    if(timeouts) *timeouts = server ? server->timeouts : 0;
+    if(errors) *errors = server ? server->errors : 0;
+}
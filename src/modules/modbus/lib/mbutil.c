@@ -20,7 +20,7 @@
 
 #include <stdarg.h>
 
-#define _XOPEN_SOURCE
+#define _XOPEN_SOURCE 600
 #include <unistd.h>
 #undef _XOPEN_SOURCE
 #include <mblib.h>
@@ -101,6 +101,49 @@ crc16check(u_int8_t *buff, int length)
     else return 0;
 };
 
+/* Time functions that are used for timeouts and scheduling.  These use
+ * the monotonic clock so that setting the system time doesn't upset them */
+void
+monotime(struct timespec *ts)
+{
+    clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+void
+time_add_msec(struct timespec *ts, int msec)
+{
+    ts->tv_sec += msec / 1000;
+    ts->tv_nsec += (msec % 1000) * 1000000;
+    if(ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+/* Returns less than, equal to or greater than zero if 'a' is before, the
+ * same as or after 'b' */
+int
+time_cmp(struct timespec *a, struct timespec *b)
+{
+    if(a->tv_sec != b->tv_sec) return a->tv_sec < b->tv_sec ? -1 : 1;
+    if(a->tv_nsec != b->tv_nsec) return a->tv_nsec < b->tv_nsec ? -1 : 1;
+    return 0;
+}
+
+/* Returns the number of mSec from now until 'ts' or zero if it has passed */
+int
+msec_until(struct timespec *ts)
+{
+    struct timespec now;
+    long long msec;
+
+    monotime(&now);
+    msec = (long long)(ts->tv_sec - now.tv_sec) * 1000 +
+           (ts->tv_nsec - now.tv_nsec) / 1000000;
+    if(msec < 0) return 0;
+    return (int)msec;
+}
+
 #ifdef __MB_THREAD_SAFE
 int
 __mb_mutex_init(_mb_mutex_t *mutex)
@@ -23,29 +23,29 @@
 #include <modbus.h>
 
 int master_loop(mb_port *);
-
-/* Calculates the difference between the two times */
-inline unsigned long long
-timediff(struct timeval oldtime,struct timeval newtime)
-{
-    return (newtime.tv_sec - oldtime.tv_sec) * 1000 + 
-           (newtime.tv_usec / 1000)-(oldtime.tv_usec / 1000);
-};
-
+static int _tcp_scan(mb_port *, int *);
 
 /* Opens the port passed in m_port and starts the loop that
  * will handle the port */
 int
 mb_run_port(struct mb_port *m_port)
 {
-    /* If the port is not already open */
-    if(!m_port->fd) {
-        mb_open_port(m_port);
-    }
-    /* If the port is still not open then we inhibit the port and
-     * let the _loop() functions deal with it */
-    if(m_port->fd == 0) {
-        m_port->inhibit = 1;
+    if(m_port->type == MB_MASTER && m_port->protocol == MB_TCP) {
+        /* TCP Clients get their connection from the pool which takes
+         * care of connecting and reconnecting on its own */
+        if(m_port->conn == NULL && mb_open_port(m_port)) {
+            m_port->inhibit = 1;
+        }
+    } else {
+        /* If the port is not already open */
+        if(!m_port->fd) {
+            mb_open_port(m_port);
+        }
+        /* If the port is still not open then we inhibit the port and
+         * let the _loop() functions deal with it */
+        if(m_port->fd == 0) {
+            m_port->inhibit = 1;
+        }
     }
     printf("mb_run_port() - Port type = %d\n", m_port->type);
             
@@ -71,32 +71,34 @@ int
 mb_scan_port(mb_port *mp)
 {
     int cmds_sent = 0;
-    int result;
+    int result, count;
     mb_cmd *mc;
     
-    mc = mp->commands;
-    while(mc != NULL && mp->inhibit == 0) {
-        /* Only if the command is enabled and the interval counter is over */
-        if(mc->enable && (++mc->icount >= mc->interval)) { 
-            mc->icount = 0;
-            if(mp->maxattempts) {
-                mp->attempt++;
-                DEBUGMSG2("Incrementing attempt - %d", mp->attempt);
-            }
-            result = mb_send_command(mp, mc);
-            if( result > 0 ) {
-                mp->attempt = 0; /* Good response, reset counter */
-                cmds_sent++;
-                if(mp->delay > 0) usleep(mp->delay * 1000);
-            } else if( result == 0 ) mp->maxattempts--; /* Conditional command that was not sent */
-            
-            if((mp->maxattempts && mp->attempt >= mp->maxattempts) || mp->dienow) {
-                mp->inhibit_temp = 0;
-                mp->inhibit = 1;
-            }
-
+    if(mp->protocol == MB_TCP && mp->window > 1) {
+        if(mp->inhibit) return 0;
+        result = _tcp_scan(mp, &count);
+        return result < 0 ? 0 : result;
+    }
+    /* Send every command that is due, but each one only once so that a
+     * command that is always due can't keep us here */
+    count = mp->cmd_count;
+    while(mp->inhibit == 0 && count-- > 0 && (mc = sched_next(mp)) != NULL) {
+        result = mb_send_command(mp, mc);
+        sched_done(mp, mc);
+        if( result > 0 ) {
+            mp->attempt = 0; /* Good response, reset counter */
+            cmds_sent++;
+            if(mp->delay > 0) usleep(mp->delay * 1000);
+        } else if( result < 0 && mp->maxattempts) {
+            /* Zero means a conditional command that wasn't sent at all */
+            mp->attempt++;
+            DEBUGMSG2("Incrementing attempt - %d", mp->attempt);
+        }
+        
+        if((mp->maxattempts && mp->attempt >= mp->maxattempts) || mp->dienow) {
+            mp->inhibit_temp = 0;
+            mp->inhibit = 1;
         }
-        mc = mc->next; /* get next command from the linked list */
     } /* End of while for sending commands */
     return cmds_sent;
 }
@@ -109,10 +111,8 @@ mb_scan_port(mb_port *mp)
 int
 master_loop(mb_port *mp)
 {
-    long time_spent;
-    int result;
+    int result, count;
     struct mb_cmd *mc;
-    struct timeval start, end;
     unsigned char bail = 0;
     
     mp->running = 1; /* Tells the world that we are going */
@@ -121,28 +121,41 @@ master_loop(mb_port *mp)
    
     /* If enable goes negative we bail at the next scan */
     while(1) {
-        gettimeofday(&start, NULL);
         if(mp->enable && !mp->inhibit) { /* If enable=0 then pause for the scanrate and try again. */
-            mc = mp->commands;
-            while(mc != NULL && !bail) {
-                /* Only if the command is enabled and the interval counter is over */
-                if(mc->enable && (++mc->icount >= mc->interval)) { 
-                    mc->icount = 0;
-                    if(mp->maxattempts) {
+            if(mp->protocol == MB_TCP && mp->window > 1) {
+                /* The commands that are due are pipelined so they aren't
+                 * sent one at a time from the loop below.  A scan only
+                 * counts against the port if something was sent and
+                 * failed, not if nothing was due. */
+                result = _tcp_scan(mp, &count);
+                if(result > 0) {
+                    mp->attempt = 0;
+                } else if((result < 0 || count > 0) && mp->maxattempts) {
+                    mp->attempt++;
+                }
+                if((mp->maxattempts && mp->attempt >= mp->maxattempts) || mp->dienow) {
+                    mp->inhibit_temp = 0;
+                    mp->inhibit = 1;
+                }
+            } else {
+                count = mp->cmd_count;
+                while(!bail && count-- > 0 && (mc = sched_next(mp)) != NULL) {
+                    result = mb_send_command(mp, mc);
+                    if( result > 0 ) {
+                        mp->attempt = 0; /* Good response, reset counter */
+                    } else if( result < 0 && mp->maxattempts) {
+                        /* Zero means a conditional command that wasn't sent */
                         mp->attempt++;
-                        //DEBUGMSG2("Incrementing attempt - %d", mp->attempt);
                     }
-                    if( mb_send_command(mp, mc) > 0 )
-                        mp->attempt = 0; /* Good response, reset counter */
+                    sched_done(mp, mc);
                     if((mp->maxattempts && mp->attempt >= mp->maxattempts) || mp->dienow) {
                         bail = 1;
                         mp->inhibit_temp = 0;
                         mp->inhibit = 1;
                     }
-                }
-                if(mp->delay > 0) usleep(mp->delay * 1000);
-                mc = mc->next; /* get next command from the linked list */
-            } /* End of while for sending commands */
+                    if(mp->delay > 0) usleep(mp->delay * 1000);
+                } /* End of while for sending commands */
+            }
         }
         if(mp->inhibit) {
             bail = 0;
@@ -155,14 +168,13 @@ master_loop(mb_port *mp)
                 return MB_ERR_PORTFAIL;
             }    
         }
-        /* This calculates the length of time that it took to send the messages on this port
-           and then subtracts that time from the port's scanrate and calls usleep to hold
-           for the right amount of time.  */
-        gettimeofday(&end, NULL);
-        time_spent = (end.tv_sec-start.tv_sec)*1000 + (end.tv_usec/1000 - start.tv_usec/1000);
-        /* If it takes longer than the scanrate then just go again instead of sleeping */
-        if(time_spent < mp->scanrate)
-            usleep((mp->scanrate - time_spent) * 1000);
+        /* Sleep until the next command is due.  If the port is disabled the
+           commands are all overdue so we just wait for the scanrate. */
+        if(mp->enable && !mp->inhibit) {
+            sched_sleep(mp);
+        } else {
+            usleep(mp->scanrate * 1000);
+        }
     }
     /* Close the port */
     mb_close_port(mp); 
@@ -171,14 +183,63 @@ master_loop(mb_port *mp)
     return MB_ERR_PORTFAIL; 
 }
 
-/* This function formulates and sends the modbus master request */
+/* Returns the value of bit 'n' in 'data' */
+#define _GETBIT(data, n) (((data)[(n) / 8] >> ((n) % 8)) & 0x01)
+
+/* Finds the part of a write command's data that has to be sent.  Continuous
+ * commands always send all of it.  Conditional commands compare the data to
+ * what was last written to the slave and only send from the first coil or
+ * register that changed to the last one.  Returns 0 if nothing has changed
+ * and the command doesn't need to be sent. */
 static int
-sendRTUrequest(mb_port *mp, mb_cmd *cmd)
+_write_range(mb_cmd *cmd, int *first, int *count)
 {
-    u_int8_t buff[MB_FRAME_LEN], length;
-    u_int16_t crc, temp;
+    int n, last;
+
+    *first = 0;
+    *count = cmd->length;
+    if(cmd->mode != MB_ONCHANGE || !cmd->firstrun || cmd->sent == NULL) return 1;
+    if(cmd->function == 15) {
+        for(n = 0; n < cmd->length && _GETBIT(cmd->data, n) == _GETBIT(cmd->sent, n); n++);
+        if(n == cmd->length) return 0;
+        for(last = cmd->length - 1; _GETBIT(cmd->data, last) == _GETBIT(cmd->sent, last); last--);
+    } else if(cmd->function == 16) {
+        for(n = 0; n < cmd->length && ((u_int16_t *)cmd->data)[n] == ((u_int16_t *)cmd->sent)[n]; n++);
+        if(n == cmd->length) return 0;
+        for(last = cmd->length - 1; ((u_int16_t *)cmd->data)[last] == ((u_int16_t *)cmd->sent)[last]; last--);
+    } else {
+        /* Single writes are all or nothing */
+        return memcmp(cmd->data, cmd->sent, cmd->datasize) != 0;
+    }
+    *first = n;
+    *count = last - n + 1;
+    return 1;
+}
+
+/* Remembers what was written to the slave so that conditional commands
+ * can tell what has changed the next time.  Called after the slave has
+ * answered so a write that fails is tried again. */
+static void
+_write_done(mb_cmd *cmd)
+{
+    if(cmd->mode != MB_ONCHANGE) return;
+    if(cmd->sent == NULL) {
+        cmd->sent = malloc(cmd->datasize);
+        if(cmd->sent == NULL) return; /* We'll just send all of it every time */
+    }
+    memcpy(cmd->sent, cmd->data, cmd->datasize);
+    cmd->firstrun = 1;
+}
+
+/* Builds the request for 'cmd' in 'buff' the way it would look in an RTU
+ * message without the checksum.  Returns the length, 0 if the command is
+ * conditional and doesn't need to be sent or a negative error code */
+static int
+_build_request(mb_cmd *cmd, u_int8_t *buff)
+{
+    int length, n, first, count;
+    u_int16_t temp;
     
-    /* build the request message */
     buff[0]=cmd->node;
     buff[1]=cmd->function;
     
@@ -192,37 +253,89 @@ sendRTUrequest(mb_port *mp, mb_cmd *cmd)
             length = 6;
             break;
         case 5:
-            temp = *cmd->data;
-            if(cmd->enable == MB_CONTINUOUS || (temp != cmd->lastcrc) || !cmd->firstrun ) {
-                COPYWORD(&buff[2], &cmd->m_register);
-                if(temp) buff[4] = 0xff;
-                else     buff[4] = 0x00;
-                buff[5] = 0x00;
-                cmd->firstrun = 1;
-                cmd->lastcrc = temp;
-                length = 6;
-                break;
-            } else {
-                return 0;
-            }
+            if(!_write_range(cmd, &first, &count)) return 0;
+            COPYWORD(&buff[2], &cmd->m_register);
+            if(*cmd->data) buff[4] = 0xff;
+            else           buff[4] = 0x00;
+            buff[5] = 0x00;
+            length = 6;
             break;
         case 6:
-            temp = *cmd->data;
-            /* If the command is contiunous go, if conditional then 
-             check the last checksum against the current datatable[] */
-            if(cmd->enable == MB_CONTINUOUS || (temp != cmd->lastcrc)) {
-                COPYWORD(&buff[2], &cmd->m_register);
-                COPYWORD(&buff[4], &temp);
-                cmd->lastcrc = temp; /* Since it's a single just store the word */
-                length = 6;
-                break;
-            } else {
-                return 0;
+            if(!_write_range(cmd, &first, &count)) return 0;
+            COPYWORD(&buff[2], &cmd->m_register);
+            COPYWORD(&buff[4], cmd->data);
+            length = 6;
+            break;
+        case 15: /* Write Multiple Coils */
+            if(cmd->length == 0 || cmd->length > MB_MAX_WRITE_BITS) return MB_ERR_OVERFLOW;
+            if(!_write_range(cmd, &first, &count)) return 0;
+            temp = cmd->m_register + first;
+            COPYWORD(&buff[2], &temp);
+            temp = count;
+            COPYWORD(&buff[4], &temp);
+            buff[6] = (count - 1) / 8 + 1;
+            bzero(&buff[7], buff[6]);
+            for(n = 0; n < count; n++) {
+                if(_GETBIT(cmd->data, first + n)) buff[7 + n / 8] |= 0x01 << (n % 8);
             }
-        /* TODO: Add the rest of the function codes */
-        default:
+            length = buff[6] + 7;
+            break;
+        case 16: /* Write Multiple Registers */
+            if(cmd->length == 0 || cmd->length > MB_MAX_WRITE_REGS) return MB_ERR_OVERFLOW;
+            if(!_write_range(cmd, &first, &count)) return 0;
+            temp = cmd->m_register + first;
+            COPYWORD(&buff[2], &temp);
+            temp = count;
+            COPYWORD(&buff[4], &temp);
+            buff[6] = count * 2;
+            for(n = 0; n < count; n++) {
+                COPYWORD(&buff[7 + n * 2], &((u_int16_t *)cmd->data)[first + n]);
+            }
+            length = buff[6] + 7;
+            break;
+        case 22: /* Mask Write Register */
+            if(!_write_range(cmd, &first, &count)) return 0;
+            COPYWORD(&buff[2], &cmd->m_register);
+            COPYWORD(&buff[4], &((u_int16_t *)cmd->data)[0]); /* AND mask */
+            COPYWORD(&buff[6], &((u_int16_t *)cmd->data)[1]); /* OR mask */
+            length = 8;
+            break;
+        case 23: /* Read/Write Multiple Registers */
+            if(cmd->length == 0 || cmd->length > MB_MAX_READ_REGS) return MB_ERR_OVERFLOW;
+            if(cmd->w_length == 0 || cmd->w_length > MB_MAX_RW_REGS) return MB_ERR_OVERFLOW;
+            COPYWORD(&buff[2], &cmd->m_register);
+            COPYWORD(&buff[4], &cmd->length);
+            COPYWORD(&buff[6], &cmd->w_register);
+            COPYWORD(&buff[8], &cmd->w_length);
+            buff[10] = cmd->w_length * 2;
+            for(n = 0; n < cmd->w_length; n++) {
+                COPYWORD(&buff[11 + n * 2], &((u_int16_t *)cmd->data)[cmd->length + n]);
+            }
+            length = buff[10] + 11;
+            break;
+        case 43: /* Read Device Identification */
+            buff[2] = MB_MEI_DEVICE_ID;
+            /* Stream access to the regular or extended objects */
+            buff[3] = cmd->m_register < 0x80 ? 2 : 3;
+            buff[4] = cmd->m_register;
+            length = 5;
             break;
+        default:
+            return MB_ERR_FUNCTION;
     }
+    return length;
+}
+
+/* This function formulates and sends the modbus master request */
+static int
+sendRTUrequest(mb_port *mp, mb_cmd *cmd)
+{
+    u_int8_t buff[MB_FRAME_LEN];
+    u_int16_t crc;
+    int length;
+    
+    length = _build_request(cmd, buff);
+    if(length <= 0) return length;
     crc = crc16(buff, length);
     COPYWORD(&buff[length], &crc);
     /* Send Request */
@@ -236,13 +349,42 @@ sendRTUrequest(mb_port *mp, mb_cmd *cmd)
     return write(mp->fd, buff, length + 2);
 }
 
-/* This function waits for one interbyte timeout (wait) period and then
- * checks to see if there is data on the port.  If there is no data and
- * we still have not received any data then it compares the current time
- * against the time the loop was started to see about the timeout.  If there
- * is data then it is written into the buffer.  If there is no data on the
- * read() and we have received some data already then the full message should
- * have been received and the function exits. 
+/* Figures out how long the RTU response will be from the part of it that
+ * we have so far.  Returns the length including the checksum or 0 if we
+ * don't know yet, or can't know, in which case the end of the message is
+ * found by waiting for the gap. */
+static int
+_rtu_expected(u_int8_t *buff, int count)
+{
+    if(count < 2) return 0;
+    if(buff[1] & ME_EXCEPTION) return 5;
+    switch(buff[1]) {
+        case 1:
+        case 2:
+        case 3:
+        case 4:
+            if(count < 3) return 0;
+            return buff[2] + 5;
+        case 5:
+        case 6:
+        case 15:
+        case 16:
+            return 8;
+        case 22:
+            return 10;
+        case 23:
+            if(count < 3) return 0;
+            return buff[2] + 5;
+        default:
+            return 0; /* FC 43 has to wait for the gap */
+    }
+}
+
+/* This function waits in poll() for the response to come in.  Once we have
+ * the first byte we know when we have the whole message either because we
+ * can tell how long it will be from the function code or because the line
+ * goes quiet for the frame gap.  The gap is the frame time if it's been set
+ * or 3.5 character times at the port's baudrate.
  
  * Returns 0 on timeout
  * Returns -1 on CRC fail
@@ -250,38 +392,86 @@ sendRTUrequest(mb_port *mp, mb_cmd *cmd)
 static int
 getRTUresponse(u_int8_t *buff, mb_port *mp)
 {
-    unsigned int buffptr = 0;
-    struct timeval oldtime, thistime;
-    int result;
+    struct pollfd pfd;
+    struct timespec deadline, gap;
+    int result, count = 0, expected = 0;
     
-    gettimeofday(&oldtime, NULL);
+    monotime(&deadline);
+    time_add_msec(&deadline, mp->timeout);
+    if(mp->frame > 0) {
+        gap.tv_sec = mp->frame / 1000;
+        gap.tv_nsec = (mp->frame % 1000) * 1000000;
+    } else {
+        gap.tv_sec = 0;
+        gap.tv_nsec = mp->gap * 1000;
+    }
+    pfd.fd = mp->fd;
+    pfd.events = POLLIN;
     
-    while(1) {
-        usleep(mp->frame * 1000);
-        result = read(mp->fd, &buff[buffptr], MB_FRAME_LEN);
-        if(result > 0) { /* Get some data */
-            buffptr += result; // TODO: WE NEED A BOUNDS CHECK HERE.  Seg Fault Commin'
-        } else { /* Message is finished, good or bad */
-            if(buffptr > 0) { /* Is there any data in buffer? */
-                
-                if(mp->in_callback) {
-                    mp->in_callback(mp, buff, buffptr);
-                }
-                /* Check the checksum here. */
-                result = crc16check(buff, buffptr);
-                
-                if(!result) return -1;
-                else return buffptr;
-                
-            } else { /* No data in the buffer */
-                gettimeofday(&thistime,NULL); 
-                if(timediff(oldtime, thistime) > mp->timeout) {
-                    return 0;
-                }
-            }
+    while(expected == 0 || count < expected) {
+        if(count == 0) {
+            result = poll(&pfd, 1, msec_until(&deadline));
+        } else {
+            result = ppoll(&pfd, 1, &gap, NULL);
         }
+        if(result < 0 && errno == EINTR) continue;
+        if(result <= 0) break; /* Timeout, the gap or an error */
+        result = read(mp->fd, &buff[count], MB_FRAME_LEN - count);
+        if(result <= 0) break;
+        count += result;
+        if(expected == 0) expected = _rtu_expected(buff, count);
+        if(count >= MB_FRAME_LEN) break;
     }
-    return 0; /* Should never get here */
+    if(count == 0) return 0;
+    /* Anything after the message we expected is line noise */
+    if(expected && count > expected) count = expected;
+    
+    if(mp->in_callback) {
+        mp->in_callback(mp, buff, count);
+    }
+    /* Check the checksum here. */
+    if(!crc16check(buff, count)) return -1;
+    return count;
+}
+
+/* The MBAP header is added and taken off in mbclient.c.  If
+ * sendTCPrequest() returns a positive number the connection stays locked
+ * until getTCPresponse() is called. */
+static int
+sendTCPrequest(mb_port *mp, mb_cmd *cmd)
+{
+    u_int8_t buff[MB_FRAME_LEN];
+    u_int16_t tid;
+    int length, result;
+
+    length = _build_request(cmd, buff);
+    if(length <= 0) return length;
+    cmd->requests++;
+    result = tcp_begin(mp);
+    if(result) return result;
+    /* getTCPresponse() matches against conn->tid, which tcp_write() sets */
+    result = tcp_write(mp, buff, length, &tid);
+    if(result < 0) tcp_end(mp);
+    return result;
+}
+
+/* Waits for the response to the request that was just sent.  Responses to
+ * older requests that timed out are thrown away */
+static int
+getTCPresponse(u_int8_t *buff, mb_port *mp)
+{
+    struct timespec deadline;
+    u_int16_t tid;
+    int result;
+
+    monotime(&deadline);
+    time_add_msec(&deadline, mp->timeout);
+    do {
+        result = tcp_read(mp, buff, MB_FRAME_LEN, &deadline, &tid);
+    } while(result > 0 && tid != mp->conn->tid);
+    tcp_end(mp);
+    if(result < 0) return 0; /* Treat a dropped connection as a timeout */
+    return result;
 }
 
 static int
@@ -296,6 +486,28 @@ getASCIIresponse(u_int8_t *buff, mb_port *mp)
     return 0;
 }
 
+/* Copies the objects out of a Read Device Identification response into
+ * the command's data.  The first byte of the data is the number of objects
+ * and each object is stored as its id, its length and the value. */
+static int
+_devid_response(u_int8_t *buff, int size, mb_cmd *cmd)
+{
+    int n, count, offset = 8, length = 1;
+
+    if(size < 8 || buff[2] != MB_MEI_DEVICE_ID) return ME_WRONG_FUNCTION;
+    count = 0;
+    for(n = 0; n < buff[7]; n++) {
+        if(offset + 2 > size || offset + 2 + buff[offset + 1] > size) break;
+        if(length + 2 + buff[offset + 1] > cmd->datasize) break;
+        memcpy(&cmd->data[length], &buff[offset], buff[offset + 1] + 2);
+        length += buff[offset + 1] + 2;
+        offset += buff[offset + 1] + 2;
+        count++;
+    }
+    if(cmd->datasize > 0) cmd->data[0] = count;
+    return 0;
+}
+
 /* This function takes the message buffer and the current command and
  * determines what to do with the message.  It may write data to the 
  * datatable or just return if the message is an acknowledge of a write.
@@ -305,7 +517,7 @@ getASCIIresponse(u_int8_t *buff, mb_port *mp)
  * the their responses into RTUish messages */
 /* TODO: There is all kinds of buffer overflow potential here.  It should all be checked */
 static int
-handleresponse(u_int8_t *buff, mb_cmd *cmd)
+handleresponse(u_int8_t *buff, int size, mb_cmd *cmd)
 {
     int n;
     
@@ -331,8 +543,19 @@ handleresponse(u_int8_t *buff, mb_cmd *cmd)
             break;
         case 5:
         case 6:
-            COPYWORD(cmd->data, &buff[2]);
+        case 15:
+        case 16:
+        case 22:
+            /* The response is just an echo so there is no data in it */
+            _write_done(cmd);
             break;
+        case 23:
+            for(n = 0; n < (buff[2] / 2) && n < cmd->length; n++) {
+                COPYWORD(&((u_int16_t *)cmd->data)[n], &buff[(n * 2) + 3]);
+            }
+            break;
+        case 43:
+            return _devid_response(buff, size, cmd);
         default:
             break;
     }
@@ -340,6 +563,60 @@ handleresponse(u_int8_t *buff, mb_cmd *cmd)
 }
 
 
+/* Counts the error against the command.  If the command is a block that
+ * reads for several others it's counted against each of them too since
+ * they would have gotten the same error if they had been sent alone. */
+static void
+_cmd_error(mb_cmd *mc, u_int8_t error)
+{
+    mb_cmd *this;
+    int n;
+
+    for(n = -1; n < mc->nmembers; n++) {
+        this = n < 0 ? mc : mc->members[n];
+        if(!this->enable) continue;
+        if(error == ME_TIMEOUT) {
+            this->timeouts++;
+        } else if(error == ME_CHECKSUM) {
+            this->crcerrors++;
+        } else {
+            this->exceptions++;
+        }
+        this->lasterror = error;
+    }
+}
+
+/* Passes a response to the command and calls the callbacks */
+static void
+_cmd_response(mb_cmd *mc, u_int8_t *buff, int size)
+{
+    int result;
+
+    result = handleresponse(buff, size, mc); /* Returns 0 on success + on failure */
+    if(result > 0) {
+        if(mc->send_fail != NULL) {
+            mc->send_fail(mc, mc->userdata);
+        }
+        _cmd_error(mc, result | ME_EXCEPTION);
+        DEBUGMSG2("Exception Received - %d", result);
+    } else { /* Everything is good */
+        if(mc->post_send != NULL) {
+            mc->post_send(mc, mc->userdata, mc->data, mc->datasize);
+        }
+        mc->lasterror = 0;
+    }
+}
+
+static void
+_cmd_timeout(mb_cmd *mc)
+{
+    if(mc->send_fail != NULL) {
+        mc->send_fail(mc, mc->userdata);
+    }
+    DEBUGMSG("Timeout");
+    _cmd_error(mc, ME_TIMEOUT);
+}
+
 /* External function to send a Modbus commaond (mc) to port (mp).  The function
  * sets some function pointers to the functions that handle the port protocol and
  * then uses those functions generically.  The retry loop tries the command for the
@@ -352,18 +629,22 @@ mb_send_command(mb_port *mp, mb_cmd *mc)
     u_int8_t buff[MB_FRAME_LEN]; /* Modbus Frame buffer */
     int try = 1;
     int result, msglen;
-    static int (*sendrequest)(struct mb_port *, struct mb_cmd *) = NULL;
-    static int (*getresponse)(u_int8_t *,struct mb_port *) = NULL;
+    /* These can't be static since each port runs in its own thread */
+    int (*sendrequest)(struct mb_port *, struct mb_cmd *);
+    int (*getresponse)(u_int8_t *,struct mb_port *);
     
   /* This sets up the function pointers so we don't have to constantly check
    *  which protocol we are using for communication.  From this point on the
-   *  code is generic for RTU or ASCII */
+   *  code is generic for RTU, ASCII or TCP */
     if(mp->protocol == MB_RTU) {
         sendrequest = sendRTUrequest;
         getresponse = getRTUresponse;
     } else if(mp->protocol == MB_ASCII) {
         sendrequest = sendASCIIrequest;
         getresponse = getASCIIresponse;
+    } else if(mp->protocol == MB_TCP) {
+        sendrequest = sendTCPrequest;
+        getresponse = getTCPresponse;
     } else {
         return -1;
     }
@@ -385,36 +666,18 @@ mb_send_command(mb_port *mp, mb_cmd *mc)
         }
         
         if(msglen > 0) {
-            result = handleresponse(buff,mc); /* Returns 0 on success + on failure */
-            if(result > 0) {
-                if(mc->send_fail != NULL) {
-                    mc->send_fail(mc, mc->userdata);
-                }
-                mc->exceptions++;
-                mc->lasterror = result | ME_EXCEPTION;
-                DEBUGMSG2("Exception Received - %d", result);
-            } else { /* Everything is good */
-                if(mc->post_send != NULL) {
-                    mc->post_send(mc, mc->userdata, mc->data, mc->datasize);
-                }
-                mc->lasterror = 0;
-            }
+            /* The RTU checksum isn't part of the message */
+            _cmd_response(mc, buff, mp->protocol == MB_RTU ? msglen - 2 : msglen);
             return msglen; /* We got some kind of message so no sense in retrying */
         } else if(msglen == 0) {
-            if(mc->send_fail != NULL) {
-                mc->send_fail(mc, mc->userdata);
-            }
-            DEBUGMSG("Timeout");
-            mc->timeouts++;
-            mc->lasterror = ME_TIMEOUT;
+            _cmd_timeout(mc);
         } else {
             /* Checksum failed in response */
             if(mc->send_fail != NULL) {
                 mc->send_fail(mc, mc->userdata);
             }
             DEBUGMSG("Checksum");
-            mc->crcerrors++;
-            mc->lasterror = ME_CHECKSUM;
+            _cmd_error(mc, ME_CHECKSUM);
         }
     } while(try++ <= mp->retries);
     /* After all the retries get out with error */
@@ -425,6 +688,174 @@ mb_send_command(mb_port *mp, mb_cmd *mc)
     return 0 - mc->lasterror;
 }
 
+/* A request that is waiting for a response on a pipelined TCP Client */
+struct tcp_slot {
+    mb_cmd *cmd;                /* NULL if the slot is free */
+    u_int16_t tid;              /* Transaction id the request was sent with */
+    int try;                    /* Number of times it has been sent */
+    struct timespec deadline;   /* When the current try times out */
+    int length;
+    u_int8_t pdu[MB_FRAME_LEN]; /* The request is kept for the retries */
+};
+
+/* Sends the request in the slot and starts its timeout.  If the send fails
+ * the socket is closed and the next tcp_read() will tell us. */
+static void
+_tcp_slot_send(mb_port *mp, struct tcp_slot *slot)
+{
+    slot->try++;
+    slot->cmd->requests++;
+    tcp_write(mp, slot->pdu, slot->length, &slot->tid);
+    monotime(&slot->deadline);
+    time_add_msec(&slot->deadline, mp->timeout);
+}
+
+/* Builds the request for the command and sends it from the slot.  Returns
+ * 1 if it was sent and 0 if the command didn't need to be sent, in which
+ * case it goes straight back to the scheduler. */
+static int
+_tcp_slot_start(mb_port *mp, struct tcp_slot *slot, mb_cmd *mc)
+{
+    if(mc->pre_send != NULL) {
+        mc->pre_send(mc, mc->userdata, mc->data, mc->datasize);
+        if(mc->enable == 0) {
+            sched_done(mp, mc);
+            return 0;
+        }
+    }
+    slot->length = _build_request(mc, slot->pdu);
+    if(slot->length <= 0) {
+        sched_done(mp, mc);
+        return 0;
+    }
+    slot->cmd = mc;
+    slot->try = 0;
+    _tcp_slot_send(mp, slot);
+    return 1;
+}
+
+/* Called when the request in the slot has timed out or was lost with the
+ * connection.  It's sent again if there are retries left.  Returns 1 if
+ * the slot is still busy and 0 if the command failed and it was freed. */
+static int
+_tcp_slot_retry(mb_port *mp, struct tcp_slot *slot)
+{
+    _cmd_timeout(slot->cmd);
+    if(slot->try <= mp->retries) {
+        _tcp_slot_send(mp, slot);
+        return 1;
+    }
+    if(slot->cmd->send_fail != NULL) {
+        slot->cmd->send_fail(slot->cmd, slot->cmd->userdata);
+    }
+    sched_done(mp, slot->cmd);
+    slot->cmd = NULL;
+    return 0;
+}
+
+/* Sends all of the commands on a TCP Client port that are due without
+ * waiting for each response before sending the next request.  Up to
+ * mp->window requests are outstanding at once.  Each one has its own
+ * timeout and retries.  The connection is locked for the whole scan so
+ * ports that share it take turns.  Returns the number of responses and
+ * the number of commands that failed in *failed. */
+static int
+_tcp_scan(mb_port *mp, int *failed)
+{
+    struct tcp_slot slots[mp->window];
+    struct timespec *first;
+    u_int8_t buff[MB_FRAME_LEN];
+    u_int16_t tid;
+    mb_cmd *mc;
+    int n, result, busy = 0, responses = 0, count;
+
+    *failed = 0;
+    result = tcp_begin(mp);
+    if(result) return result;
+    for(n = 0; n < mp->window; n++) {
+        slots[n].cmd = NULL;
+    }
+    count = mp->cmd_count;
+    while(1) {
+        /* Keep the window full with the commands that are due.  Each one
+         * is only sent once per scan. */
+        for(n = 0; n < mp->window && count > 0; n++) {
+            while(slots[n].cmd == NULL && count > 0 && (mc = sched_next(mp)) != NULL) {
+                count--;
+                busy += _tcp_slot_start(mp, &slots[n], mc);
+            }
+        }
+        if(busy == 0) break;
+        /* Wait for a response until the next request times out */
+        first = NULL;
+        for(n = 0; n < mp->window; n++) {
+            if(slots[n].cmd != NULL &&
+               (first == NULL || time_cmp(&slots[n].deadline, first) < 0)) {
+                first = &slots[n].deadline;
+            }
+        }
+        result = tcp_read(mp, buff, MB_FRAME_LEN, first, &tid);
+        if(result > 0) {
+            for(n = 0; n < mp->window; n++) {
+                if(slots[n].cmd != NULL && slots[n].tid == tid) break;
+            }
+            /* If there isn't a match it's a late response to a request
+             * that has already timed out so we throw it away */
+            if(n < mp->window) {
+                _cmd_response(slots[n].cmd, buff, result);
+                sched_done(mp, slots[n].cmd);
+                slots[n].cmd = NULL;
+                busy--;
+                responses++;
+            }
+        } else if(result == 0) {
+            for(n = 0; n < mp->window; n++) {
+                if(slots[n].cmd != NULL && msec_until(&slots[n].deadline) == 0) {
+                    if(!_tcp_slot_retry(mp, &slots[n])) {
+                        busy--;
+                        (*failed)++;
+                    }
+                }
+            }
+        } else {
+            /* We lost the connection and everything that was outstanding
+             * went with it.  If we can't get it back we give up on this
+             * scan and the rest of the commands wait for the next one. */
+            if(tcp_reconnect(mp)) {
+                for(n = 0; n < mp->window; n++) {
+                    if(slots[n].cmd != NULL) {
+                        slots[n].try = mp->retries + 1;
+                        _tcp_slot_retry(mp, &slots[n]);
+                        (*failed)++;
+                    }
+                }
+                break;
+            }
+            for(n = 0; n < mp->window; n++) {
+                if(slots[n].cmd != NULL && !_tcp_slot_retry(mp, &slots[n])) {
+                    busy--;
+                    (*failed)++;
+                }
+            }
+        }
+    }
+    tcp_end(mp);
+    return responses;
+}
+
+/* Marks the registers that a client has written if the port is keeping
+ * track of them.  The register's mutex has to be held. */
+static void
+_mark_written(u_int8_t *map, int index, int count)
+{
+    int n;
+
+    if(map == NULL) return;
+    for(n = index; n < index + count; n++) {
+        map[n / 8] |= (0x01 << (n % 8));
+    }
+}
+
 static int
 _create_exception(unsigned char *buff, u_int16_t exception)
 {
@@ -466,6 +897,7 @@ _read_bits_response(mb_port *port, unsigned char *buff, int size, int mbreg)
     word = index / 16;
     buffbit = 0;
     buffbyte = 3;
+    mb_mutex_lock(port, mbreg == MB_REG_COIL ? &port->coil_mutex : &port->disc_mutex);
     for(n = 0; n < count; n++) {
         if(reg[word] & (0x01 << bit)) {
             buff[buffbyte] |= (0x01 << buffbit);
@@ -481,6 +913,7 @@ _read_bits_response(mb_port *port, unsigned char *buff, int size, int mbreg)
             bit = 0; word++;
         }
     }
+    mb_mutex_unlock(port, mbreg == MB_REG_COIL ? &port->coil_mutex : &port->disc_mutex);
     return (count - 1)/8+4;
 }
 
@@ -512,19 +945,135 @@ _read_words_response(mb_port *port, unsigned char *buff, int size, int mbreg)
         return _create_exception(buff, ME_BAD_ADDRESS);
     }
     buff[2] = count * 2;
+    mb_mutex_lock(port, mbreg == MB_REG_HOLDING ? &port->hold_mutex : &port->input_mutex);
     for(n = 0; n < count; n++) {
         COPYWORD(&buff[3+(n*2)], &reg[index+n]);
     }
+    mb_mutex_unlock(port, mbreg == MB_REG_HOLDING ? &port->hold_mutex : &port->input_mutex);
     return (count * 2) + 3;
 }
 
+/* Handles Mask Write Register (FC 22).  The response is the request. */
+static int
+_mask_write_response(mb_port *port, unsigned char *buff, int size)
+{
+    u_int16_t index, and_mask, or_mask;
+
+    COPYWORD(&index, (u_int16_t *)&buff[2]);
+    COPYWORD(&and_mask, (u_int16_t *)&buff[4]);
+    COPYWORD(&or_mask, (u_int16_t *)&buff[6]);
+    if(index >= port->holdsize) {
+        return _create_exception(buff, ME_BAD_ADDRESS);
+    }
+    mb_mutex_lock(port, &port->hold_mutex);
+    port->holdreg[index] = (port->holdreg[index] & and_mask) | (or_mask & ~and_mask);
+    _mark_written(port->holdwritten, index, 1);
+    mb_mutex_unlock(port, &port->hold_mutex);
+    if(port->slave_write) {
+        port->slave_write(port, MB_REG_HOLDING, index, 1, port->userdata);
+    }
+    return 8;
+}
+
+/* Handles Read/Write Multiple Registers (FC 23).  The write is done before
+ * the read so the response shows what was just written if they overlap. */
+static int
+_read_write_response(mb_port *port, unsigned char *buff, int length, int size)
+{
+    u_int16_t rindex, rcount, windex, wcount;
+    int n;
+
+    COPYWORD(&rindex, (u_int16_t *)&buff[2]);
+    COPYWORD(&rcount, (u_int16_t *)&buff[4]);
+    COPYWORD(&windex, (u_int16_t *)&buff[6]);
+    COPYWORD(&wcount, (u_int16_t *)&buff[8]);
+    if(rcount == 0 || rcount > MB_MAX_READ_REGS || wcount == 0 ||
+       wcount > MB_MAX_RW_REGS || buff[10] != wcount * 2 || length < 11 + buff[10]) {
+        return _create_exception(buff, ME_BAD_VALUE);
+    }
+    if((rindex + rcount) > port->holdsize || (windex + wcount) > port->holdsize) {
+        return _create_exception(buff, ME_BAD_ADDRESS);
+    }
+    if((rcount * 2) > (size - 3)) {
+        return MB_ERR_OVERFLOW;
+    }
+    mb_mutex_lock(port, &port->hold_mutex);
+    for(n = 0; n < wcount; n++) {
+        COPYWORD(&port->holdreg[windex + n], &buff[11 + (n * 2)]);
+    }
+    _mark_written(port->holdwritten, windex, wcount);
+    mb_mutex_unlock(port, &port->hold_mutex);
+    if(port->slave_write) {
+        port->slave_write(port, MB_REG_HOLDING, windex, wcount, port->userdata);
+    }
+    if(port->slave_read) {
+        port->slave_read(port, MB_REG_HOLDING, rindex, rcount, port->userdata);
+    }
+    buff[2] = rcount * 2;
+    mb_mutex_lock(port, &port->hold_mutex);
+    for(n = 0; n < rcount; n++) {
+        COPYWORD(&buff[3 + (n * 2)], &port->holdreg[rindex + n]);
+    }
+    mb_mutex_unlock(port, &port->hold_mutex);
+    return (rcount * 2) + 3;
+}
+
+/* Handles Read Device Identification (FC 43/14).  Codes 1 - 3 stream the
+ * objects starting at the requested one and code 4 returns just that one.
+ * If they don't all fit we tell the client where to start the next
+ * request. */
+static int
+_devid_slave_response(mb_port *port, unsigned char *buff, int size)
+{
+    u_int8_t code, object, last;
+    int n, length, offset = 8;
+
+    if(buff[2] != MB_MEI_DEVICE_ID) {
+        return _create_exception(buff, ME_WRONG_FUNCTION);
+    }
+    code = buff[3];
+    object = buff[4];
+    if(code < 1 || code > 4) {
+        return _create_exception(buff, ME_BAD_VALUE);
+    }
+    if(object >= MB_DEVID_COUNT || port->devid[object] == NULL) {
+        /* Streams start over at the first object if this one isn't here */
+        if(code == 4) return _create_exception(buff, ME_BAD_ADDRESS);
+        object = 0;
+    }
+    last = (code == 1) ? MB_DEVID_VERSION : MB_DEVID_COUNT - 1;
+    if(code == 4) last = object;
+    if(size < offset) return MB_ERR_OVERFLOW;
+    buff[4] = 0x82;  /* Regular conformity with individual access */
+    buff[5] = 0x00;  /* More follows */
+    buff[6] = 0x00;  /* Next object */
+    buff[7] = 0;     /* Number of objects */
+    for(n = object; n <= last; n++) {
+        if(port->devid[n] == NULL) continue;
+        length = strlen(port->devid[n]);
+        if(length > 245) length = 245;
+        if(offset + 2 + length > size || offset + 2 + length > MB_FRAME_LEN - 2) {
+            buff[5] = 0xFF;
+            buff[6] = n;
+            break;
+        }
+        buff[offset] = n;
+        buff[offset + 1] = length;
+        memcpy(&buff[offset + 2], port->devid[n], length);
+        offset += length + 2;
+        buff[7]++;
+    }
+    return offset;
+}
+
 /* Creates a generic slave response.  buff should point to a buffer that
- * looks like an RTU request without the checksum.  This function will generate
+ * looks like an RTU request without the checksum and length is the number
+ * of bytes of that request that were received.  This function will generate
  * an RTU response message, and write that back into buff.  size is the total
  * size that we can write into buff.  Returns positive number of bytes written, zero
  * if no bytes written and negative error code if there is a problem. */
 int
-create_response(mb_port *port, unsigned char *buff, int size)
+create_response(mb_port *port, unsigned char *buff, int length, int size)
 {
     u_int8_t node, function;
     u_int16_t index, value, count;
@@ -552,11 +1101,14 @@ create_response(mb_port *port, unsigned char *buff, int size)
             if(index >= port->coilsize) {
                 return _create_exception(buff, ME_BAD_ADDRESS);
             }
+            mb_mutex_lock(port, &port->coil_mutex);
             if(value) {
                 port->coilreg[index / 16] |= (0x01 << (index % 16));
             } else {
                 port->coilreg[index / 16] &= ~(0x01 << (index % 16));
             }
+            _mark_written(port->coilwritten, index, 1);
+            mb_mutex_unlock(port, &port->coil_mutex);
             if(port->slave_write) { /* Call the callback function if it has been set */
                 port->slave_write(port, MB_REG_COIL, index, 1, port->userdata);
             }
@@ -567,7 +1119,10 @@ create_response(mb_port *port, unsigned char *buff, int size)
             if(index >= port->holdsize) {
                 return _create_exception(buff, ME_BAD_ADDRESS);
             }
+            mb_mutex_lock(port, &port->hold_mutex);
             port->holdreg[index] = value;
+            _mark_written(port->holdwritten, index, 1);
+            mb_mutex_unlock(port, &port->hold_mutex);
             if(port->slave_write) { /* Call the callback function if it has been set */
                 port->slave_write(port, MB_REG_HOLDING, index, 1, port->userdata);
             }
@@ -577,23 +1132,27 @@ create_response(mb_port *port, unsigned char *buff, int size)
         case 15: /* Write Multiple Coils */
             COPYWORD(&index, (u_int16_t *)&buff[2]); /* Starting Address */
             COPYWORD(&count, (u_int16_t *)&buff[4]); /* Value */
+            if(count == 0 || count > MB_MAX_WRITE_BITS || buff[6] != (count - 1) / 8 + 1 ||
+               length < 7 + buff[6]) {
+                return _create_exception(buff, ME_BAD_VALUE);
+            }
             if((index + count) > port->coilsize) {
                 return _create_exception(buff, ME_BAD_ADDRESS);
             }
             word = index / 16;
             bit = index % 16;
+            mb_mutex_lock(port, &port->coil_mutex);
             for(n = 0; n < count; n++) {
-                fprintf(stderr, "Buff[%d] = 0x%X\n", 7 +n/8, buff[7+n/8]);
                 if(buff[7 + n/8] & (0x01 << (n%8))) {
-                    fprintf(stderr, "Setting Coil %d to TRUE\n", index + n);
                     port->coilreg[word] |= (0x01 << bit);
                 } else {
-                    fprintf(stderr, "Setting Coil %d to FALSE\n", index + n);
                     port->coilreg[word] &= ~(0x01 << bit);
                 }
                 bit++;
                 if(bit == 16) { bit = 0; word++; }
             }
+            _mark_written(port->coilwritten, index, count);
+            mb_mutex_unlock(port, &port->coil_mutex);
             if(port->slave_write) { /* Call the callback function if it has been set */
                 port->slave_write(port, MB_REG_COIL, index, count, port->userdata);
             }
@@ -601,18 +1160,31 @@ create_response(mb_port *port, unsigned char *buff, int size)
         case 16: /* Write Multiple Registers */
             COPYWORD(&index, (u_int16_t *)&buff[2]); /* Starting Address */
             COPYWORD(&count, (u_int16_t *)&buff[4]); /* Value */
+            if(count == 0 || count > MB_MAX_WRITE_REGS || buff[6] != count * 2 ||
+               length < 7 + buff[6]) {
+                return _create_exception(buff, ME_BAD_VALUE);
+            }
             if((index + count) > port->holdsize) {
                 return _create_exception(buff, ME_BAD_ADDRESS);
             }
+            mb_mutex_lock(port, &port->hold_mutex);
             for(n = 0; n < count; n++) {
                 COPYWORD(&port->holdreg[index + n], &buff[7 + (n*2)]);
             }
+            _mark_written(port->holdwritten, index, count);
+            mb_mutex_unlock(port, &port->hold_mutex);
             if(port->slave_write) { /* Call the callback function if it has been set */
                 port->slave_write(port, MB_REG_HOLDING, index, count, port->userdata);
             }
             return 6;
+        case 22: /* Mask Write Register */
+            return _mask_write_response(port, buff, size);
+        case 23: /* Read/Write Multiple Registers */
+            return _read_write_response(port, buff, length, size);
+        case 43: /* Read Device Identification */
+            return _devid_slave_response(port, buff, size);
         default:
-            break;
+            return _create_exception(buff, ME_WRONG_FUNCTION);
     }
     
     return 0;
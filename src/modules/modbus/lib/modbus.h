@@ -68,6 +68,17 @@
 #define ME_WRONG_DEVICE   3
 #define ME_CHECKSUM       4
 #define ME_TIMEOUT        8
+/* Exception code 3 means something else coming from a slave */
+#define ME_BAD_VALUE      3
+
+/* Device Identification Objects (FC 43/14) */
+#define MB_DEVID_VENDOR   0
+#define MB_DEVID_PRODUCT  1
+#define MB_DEVID_VERSION  2
+#define MB_DEVID_URL      3
+#define MB_DEVID_NAME     4
+#define MB_DEVID_MODEL    5
+#define MB_DEVID_APPNAME  6
 
 /* Command Methods */
 #define	MB_DISABLE     0
@@ -75,6 +86,11 @@
 #define	MB_ONCHANGE    2
 //--#define MB_TRIGGER     3
 
+/* What the scheduler does when a command misses its period */
+#define MB_OVERRUN_SKIP     0  /* Skip the periods that were missed and keep the phase */
+#define MB_OVERRUN_CATCHUP  1  /* Send it again right away */
+#define MB_OVERRUN_DELAY    2  /* Start the next period from now */
+
 /* Port Attribute Flags */
 #define MB_FLAGS_STOP_LOOP    0x01
 #define MB_FLAGS_THREAD_SAFE  0x02
@@ -88,6 +104,18 @@
 typedef struct mb_port mb_port;
 typedef struct mb_cmd  mb_cmd;
 
+/* Statistics for one connection to a TCP Server port */
+typedef struct mb_client_stats {
+    char ipaddress[16];
+    unsigned int port;
+    unsigned int connected;   /* Seconds since the client connected */
+    unsigned int idle;        /* mSec since anything was received */
+    unsigned int requests;
+    unsigned int exceptions;  /* Requests that were answered with an exception */
+    unsigned long bytes_in;
+    unsigned long bytes_out;
+} mb_client_stats;
+
 /* Create a New Modbus Port with the given name */
 mb_port *mb_new_port(const char *name, unsigned int flags);
 /* Frees the memory allocated with mb_new_port() */
@@ -102,6 +130,16 @@ int mb_set_scan_rate(mb_port *port, int rate);
 int mb_set_timeout(mb_port *port, int timeout);
 int mb_set_retries(mb_port *port, int retries);
 int mb_set_maxfailures(mb_port *port, int maxfailures, int inhibit);
+int mb_set_backoff(mb_port *port, int min, int max);
+int mb_set_window(mb_port *port, int window);
+int mb_set_overrun(mb_port *port, unsigned char policy);
+int mb_set_coalesce(mb_port *port, int gap);
+int mb_set_device_id(mb_port *port, u_int8_t object, const char *value);
+int mb_set_max_connections(mb_port *port, int max);
+int mb_set_idle_timeout(mb_port *port, int msec);
+int mb_get_client_stats(mb_port *port, mb_client_stats *stats, int size);
+void mb_get_server_stats(mb_port *port, unsigned int *accepted, unsigned int *rejected,
+                         unsigned int *timeouts, unsigned int *errors);
 
 const char *mb_get_port_name(mb_port *port);
 unsigned char mb_get_port_type(mb_port *port);
@@ -123,6 +161,9 @@ unsigned int mb_get_discrete_size(mb_port *port);
 /* These functions are thread safe ways to read/write the slave data tables */
 int mb_write_register(mb_port *port, int regtype, u_int16_t *buff, u_int16_t index, u_int16_t count);
 int mb_read_register(mb_port *port, int regtype, u_int16_t *buff, u_int16_t index, u_int16_t count);
+int mb_track_writes(mb_port *port);
+int mb_take_written(mb_port *port, int regtype, u_int16_t index, u_int16_t count,
+                    u_int16_t *first, u_int16_t *length);
 
 // I might make these a macro for the above
 //int mb_write_coil(mb_port *port, u_int16_t *buff, u_int16_t index, u_int16_t count);
@@ -161,7 +202,13 @@ void mb_destroy_cmd(mb_cmd *cmd);
 void mb_disable_cmd(mb_cmd *cmd);
 void mb_enable_cmd(mb_cmd *cmd);
 int mb_set_command(mb_cmd *cmd, u_int8_t node, u_int8_t function, u_int16_t reg, u_int16_t length);
+int mb_set_write_range(mb_cmd *cmd, u_int16_t reg, u_int16_t length);
+int mb_get_device_id(mb_cmd *cmd, u_int8_t object, char *buff, int size);
 int mb_set_interval(mb_cmd *cmd, int interval);
+int mb_set_period(mb_cmd *cmd, unsigned int period);
+void mb_set_priority(mb_cmd *cmd, int priority);
+void mb_get_cmd_timing(mb_cmd *cmd, unsigned int *runs, unsigned int *overruns,
+                       unsigned int *jitter_avg, unsigned int *jitter_max);
 void mb_set_mode(mb_cmd *cmd, unsigned char mode);
 void mb_set_cmd_userdata(mb_cmd *cmd, void *data, void (*userdata_free)(struct mb_cmd *, void *));
 int mb_is_write_cmd(mb_cmd *cmd);
@@ -28,6 +28,7 @@
 #include <modopt.h>
 #include <database.h>
 #include <lib/modbus.h>
+#include <trace.h>
 
 extern struct Config config;
 /* For now we'll keep ds as a global to simplify the code.  At some
@@ -52,102 +53,201 @@ _port_thread(void *port) {
     result = mb_run_port((mb_port *)port);
 }
 
-/* This structure and the following functions are used to set up the
- * callback information for a slave port.  It's a bit convoluted but
- * basically there is userdata assigned to the port that contains all
- * the handles and event information for the slave data areas.  These
- * functions set up the callbacks for the slave ports so that they can
- * update the modbus library register tables when the data in OpenDAX
- * changes.  The userdata structure is defined in modopt.h */
-typedef struct _slave_data {
-    Handle h;
+/* The slave register tables in the modbus library are a cache of the
+ * OpenDAX tags.  Requests from the clients are answered from the cache.
+ * Each tag is split into segments that each have their own change event
+ * so when part of a tag changes only that part is read from the server.
+ * The library keeps track of the registers that the clients write and a
+ * separate thread writes them back to the server so the responses don't
+ * have to wait on it.  Everything that has been written while that thread
+ * was busy goes out together the next time around. */
+
+/* Number of registers, or coils, that share one change event */
+#define SEGMENT_REGS 64
+#define SEGMENT_BITS 1024
+
+struct slave_bank;
+
+typedef struct slave_segment {
+    Handle h;                 /* Part of the tag for this segment */
+    int index;                /* First register in the segment */
+    int dirty;                /* Clients have written to this segment */
+    int busy_start;           /* Registers that are being written to the server */
+    int busy_count;
+    struct slave_bank *bank;
+} slave_segment;
+
+typedef struct slave_bank {
     mb_port *port;
-    int modreg;
-} _slave_data;
-
-/* This function is set up as the callback function for change events for the 
- * OpenDAX tags that represent the modbus data areas.  The userdata contains
- * the tag handle, a pointer to the port and the modbus register index so that
- * it can read the newly changed tag data from the server and then write it
- * to the proper register area from the modbus library */
+    int modreg;               /* MB_REG_HOLDING etc. */
+    Handle h;                 /* The whole tag */
+    int size;                 /* Number of registers or coils */
+    int segsize;
+    int nsegs;
+    slave_segment *segs;
+    struct slave_bank *next;
+} slave_bank;
+
+/* The dirty flags and busy ranges of all of the segments are protected by
+ * this lock.  The condition wakes up the writer thread. */
+static pthread_mutex_t _bank_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _bank_cond = PTHREAD_COND_INITIALIZER;
+static slave_bank *_banks = NULL;
+static int _banks_dirty = 0;
+
+/* Builds the handle for 'count' items of the bank's tag starting at
+ * 'index' the same way that dax_tag_handle() would */
 static void
-_slave_event_callback(void *udata)
+_sub_handle(slave_bank *bank, Handle *h, int index, int count)
 {
-    u_int8_t buff[((_slave_data *)udata)->h.size];
-    _slave_data *sd;
-    int result;
-    sd = (_slave_data *)udata;
-
-    result = dax_read_tag(ds, sd->h, buff);
-    if(result) {
-        dax_error(ds, "Unable to read tag data for port %s", mb_get_port_name(sd->port));
+    *h = bank->h;
+    h->count = count;
+    if(bank->h.type == DAX_BOOL) {
+        h->byte += (bank->h.bit + index) / 8;
+        h->bit = (bank->h.bit + index) % 8;
+        h->size = (h->bit + count - 1) / 8 + 1;
     } else {
-        result = mb_write_register(sd->port, sd->modreg, (u_int16_t *)buff, 0, sd->h.count);
+        h->byte += index * 2;
+        h->size = count * 2;
     }
-    return;
 }
 
-/* This function is so we can so this variable length array. */ 
+/* Writes 'count' items of the segment data in 'buff' starting at 'start'
+ * to the modbus register table */
 static void
-_write_data(mb_port *port, Handle h, int reg)
+_write_part(slave_segment *seg, u_int16_t *buff, int start, int count)
 {
+    u_int16_t tmp[SEGMENT_BITS / 16];
     int n;
-    /*Add the extra byte so that we know that the
-     * mb_read_register() function won't overflow our buffer */
-    u_int8_t buff[h.size+1];
-    int result;
 
-    result = mb_read_register(port, reg, (u_int16_t *)buff, 0, h.count);
-    for(n = 0; n < h.size; n++) {
-        fprintf(stderr,"[0x%X]", buff[n]);
+    if(count <= 0) return;
+    if(seg->bank->h.type != DAX_BOOL) {
+        mb_write_register(seg->bank->port, seg->bank->modreg, &buff[start], seg->index + start, count);
+        return;
     }
-    fprintf(stderr, "\n");
+    /* The bits have to start at the beginning of the buffer */
+    bzero(tmp, sizeof(tmp));
+    for(n = 0; n < count; n++) {
+        if(buff[(start + n) / 16] & (0x01 << ((start + n) % 16))) {
+            tmp[n / 16] |= 0x01 << (n % 16);
+        }
+    }
+    mb_write_register(seg->bank->port, seg->bank->modreg, tmp, seg->index + start, count);
+}
+
+/* This function is set up as the callback function for the change event of
+ * each segment of the OpenDAX tags that represent the modbus data areas.
+ * It reads the segment from the server and writes it to the modbus
+ * register table.  The library leaves the registers that a client has
+ * written alone and we skip the ones that are on their way to the server
+ * or we'd undo the write. */
+static void
+_slave_event_callback(void *udata)
+{
+    u_int16_t buff[(((slave_segment *)udata)->h.size + 1) / 2];
+    slave_segment *seg;
+    int result, end;
+
+    seg = (slave_segment *)udata;
+    result = dax_read_tag(ds, seg->h, buff);
     if(result) {
-        dax_error(ds, "Unable to get data from Modbus Registers\n");
+        dax_error(ds, "Unable to read tag data for port %s", mb_get_port_name(seg->bank->port));
+        return;
+    }
+    pthread_mutex_lock(&_bank_lock);
+    if(seg->busy_count == 0) {
+        /* Most of the time the whole segment goes in at once */
+        _write_part(seg, buff, 0, seg->h.count);
     } else {
-        result = dax_write_tag(ds, h, buff);
-        if(result) {
-            dax_error(ds, "Unable to write tag data to server\n");
-        }
+        end = seg->busy_start + seg->busy_count;
+        _write_part(seg, buff, 0, seg->busy_start);
+        _write_part(seg, buff, end, seg->h.count - end);
     }
+    pthread_mutex_unlock(&_bank_lock);
 }
 
 /* This callback function is assigned as the slave_write callback to the modbus
- * library.  After the library updates the modbus tables with new information this
- * function is called which writes the data back to the OpenDAX server */
+ * library.  It's called in the port's thread after a client has written to the
+ * register table so all we do is mark the segments and wake the writer. */
 static void
 _slave_write_callback(mb_port *port, int reg, int index, int count, void *userdata)
 {
-    port_userdata *ud;
-    
-    ud = (port_userdata *)userdata;
-    if(reg == MB_REG_HOLDING) {
-        _write_data(port, ud->reg[HOLD_REG].h, MB_REG_HOLDING);
-    } else if(reg == MB_REG_INPUT) {
-        _write_data(port, ud->reg[INPUT_REG].h, MB_REG_INPUT);
-    } else if(reg == MB_REG_COIL) {
-        _write_data(port, ud->reg[COIL_REG].h, MB_REG_COIL);
-    } else if(reg == MB_REG_DISC) {
-        _write_data(port, ud->reg[DISC_REG].h, MB_REG_DISC);
-    } else {
-        assert(0);
+    slave_bank *bank;
+    int n;
+
+    pthread_mutex_lock(&_bank_lock);
+    for(bank = _banks; bank != NULL; bank = bank->next) {
+        if(bank->port == port && bank->modreg == reg) break;
+    }
+    if(bank != NULL && index + count <= bank->size) {
+        for(n = index / bank->segsize; n <= (index + count - 1) / bank->segsize; n++) {
+            if(!bank->segs[n].dirty) {
+                bank->segs[n].dirty = 1;
+                _banks_dirty++;
+            }
+        }
+        pthread_cond_signal(&_bank_cond);
     }
-        
+    pthread_mutex_unlock(&_bank_lock);
 }
 
+/* Writes the registers of one segment that the clients have written to
+ * the server.  Each run of registers goes in one message.  The lock has
+ * to be held and it's let go while we talk to the server. */
 static void
-_free_slave_data(void *udata) {
-    free(udata);
+_flush_segment(slave_bank *bank, slave_segment *seg)
+{
+    u_int16_t buff[bank->segsize]; /* More than enough for the bits */
+    u_int16_t first, count;
+    Handle h;
+
+    seg->dirty = 0;
+    _banks_dirty--;
+    while(mb_take_written(bank->port, bank->modreg, seg->index, seg->h.count, &first, &count) == 1) {
+        mb_read_register(bank->port, bank->modreg, buff, first, count);
+        seg->busy_start = first - seg->index;
+        seg->busy_count = count;
+        pthread_mutex_unlock(&_bank_lock);
+        _sub_handle(bank, &h, first, count);
+        if(dax_write_tag(ds, h, buff)) {
+            dax_error(ds, "Unable to write tag data to server for port %s", mb_get_port_name(bank->port));
+        }
+        pthread_mutex_lock(&_bank_lock);
+        seg->busy_count = 0;
+    }
+}
+
+/* The thread that writes the registers that the clients have changed back
+ * to the server */
+static void *
+_slave_writer_thread(void *arg)
+{
+    slave_bank *bank;
+    int n;
+
+    pthread_mutex_lock(&_bank_lock);
+    while(1) {
+        while(_banks_dirty == 0) {
+            pthread_cond_wait(&_bank_cond, &_bank_lock);
+        }
+        for(bank = _banks; bank != NULL; bank = bank->next) {
+            for(n = 0; n < bank->nsegs; n++) {
+                if(bank->segs[n].dirty) _flush_segment(bank, &bank->segs[n]);
+            }
+        }
+    }
+    return NULL;
 }
 
 /* This function sets up an individual slave port register.  It's adds the
- * tag to the OpenDAX server, then allocates and sets up a slave userdata
- * structure and assigns it to a change event for the newly created tag */
+ * tag to the OpenDAX server, then allocates the bank that keeps track of
+ * it and assigns a change event to each segment of the newly created tag */
 static int
 _slave_reg_add(mb_port *port, port_ud_item *item, int mbreg, int size)
 {
-    int result;
-    _slave_data *sd;
+    int result, n;
+    slave_bank *bank;
+    slave_segment *seg;
 
     if(mbreg == MB_REG_COIL || mbreg == MB_REG_DISC) {
         result = dax_tag_add(ds, &item->h, item->mbreg, DAX_BOOL, size);
@@ -156,17 +256,45 @@ _slave_reg_add(mb_port *port, port_ud_item *item, int mbreg, int size)
     }
     if(result) return result;
 
-    sd = malloc(sizeof(_slave_data));
-    if(sd) {
-        sd->h = item->h;
-        sd->modreg = mbreg;
-        sd->port = port;
-        result = dax_event_add(ds, &sd->h, EVENT_CHANGE, NULL, &item->event, 
-                               _slave_event_callback, sd, _free_slave_data);
-        /* Now we call the callback to write any existing data to the port */
-        _slave_event_callback(sd);
-    } else {
+    bank = malloc(sizeof(slave_bank));
+    if(bank != NULL) {
+        bank->segsize = item->h.type == DAX_BOOL ? SEGMENT_BITS : SEGMENT_REGS;
+        bank->nsegs = (size + bank->segsize - 1) / bank->segsize;
+        bank->segs = malloc(sizeof(slave_segment) * bank->nsegs);
+    }
+    if(bank == NULL || bank->segs == NULL) {
+        free(bank);
         dax_error(ds, "Unable to add data to port %s", mb_get_port_name(port));
+        return ERR_ALLOC;
+    }
+    bank->port = port;
+    bank->modreg = mbreg;
+    bank->h = item->h;
+    bank->size = size;
+    for(n = 0; n < bank->nsegs; n++) {
+        seg = &bank->segs[n];
+        seg->bank = bank;
+        seg->index = n * bank->segsize;
+        seg->dirty = 0;
+        seg->busy_start = 0;
+        seg->busy_count = 0;
+        _sub_handle(bank, &seg->h, seg->index,
+                    size - seg->index < bank->segsize ? size - seg->index : bank->segsize);
+    }
+    pthread_mutex_lock(&_bank_lock);
+    bank->next = _banks;
+    _banks = bank;
+    pthread_mutex_unlock(&_bank_lock);
+
+    for(n = 0; n < bank->nsegs; n++) {
+        seg = &bank->segs[n];
+        result = dax_event_add(ds, &seg->h, EVENT_CHANGE, NULL, NULL,
+                               _slave_event_callback, seg, NULL);
+        if(result) {
+            dax_error(ds, "Unable to add change event for %s[%d]", item->mbreg, seg->index);
+        }
+        /* Now we call the callback to write any existing data to the port */
+        _slave_event_callback(seg);
     }
     return 0;
 }
@@ -200,6 +328,11 @@ _setup_port(mb_port *port)
         if(size) {
             _slave_reg_add(port, &ud->reg[DISC_REG], MB_REG_DISC, size);
         }        
+        /* Let the library hold on to what the clients write until the
+         * writer thread has sent it to the server */
+        if(mb_track_writes(port)) {
+            dax_error(ds, "Unable to track writes for port %s", mb_get_port_name(port));
+        }
         mb_set_slave_write_callback(port, _slave_write_callback);
     }
     return 0;
@@ -210,6 +343,7 @@ main (int argc, const char * argv[]) {
     int result, n;
     struct sigaction sa;
     pthread_attr_t attr;
+    pthread_t writer;
 
     
     /* Set up the signal handlers */
@@ -235,6 +369,7 @@ main (int argc, const char * argv[]) {
     /* Read the configuration from the command line and the file.
        Bail if there is an error. */
     result = modbus_configure(argc, argv);
+    dax_trace_init("modbus");
     
     result = init_database();
     if(result) {
@@ -267,6 +402,12 @@ main (int argc, const char * argv[]) {
             }
         }
     }
+    /* The slave ports need somebody to write their registers back to the server */
+    if(_banks != NULL) {
+        if(pthread_create(&writer, &attr, _slave_writer_thread, NULL)) {
+            dax_error(ds, "Unable to start the slave register writer thread");
+        }
+    }
     /* TODO: Need some kind of semaphore here to signal when we can go to the running state */
     /* This might be a problem since the threads may not have actually started yet */
     dax_mod_set(ds, MOD_CMD_RUNNING, NULL);
@@ -207,6 +207,26 @@ _get_slave_config(lua_State *L, mb_port *p)
     mb_alloc_discrete(p, size);
     lua_pop(L, 2);
     
+    /* Strings for Read Device Identification */
+    lua_getfield(L, -1, "vendor");
+    mb_set_device_id(p, MB_DEVID_VENDOR, lua_tostring(L, -1));
+    lua_getfield(L, -2, "product");
+    mb_set_device_id(p, MB_DEVID_PRODUCT, lua_tostring(L, -1));
+    lua_getfield(L, -3, "version");
+    mb_set_device_id(p, MB_DEVID_VERSION, lua_tostring(L, -1));
+    lua_pop(L, 3);
+    
+    /* Limits on the connections to a TCP Server */
+    lua_getfield(L, -1, "maxconn");
+    size = (unsigned int)lua_tonumber(L, -1);
+    if(size > 0 && mb_set_max_connections(p, size)) {
+        dax_debug(ds, 1, "Bad connection limit %d for port %s", size, mb_get_port_name(p));
+    }
+    lua_getfield(L, -2, "idletimeout");
+    size = (unsigned int)lua_tonumber(L, -1);
+    mb_set_idle_timeout(p, size);
+    lua_pop(L, 2);
+    
     mb_set_port_userdata(p, ud, NULL);
     return result;
 }
@@ -219,7 +239,7 @@ _add_port(lua_State *L)
     mb_port *p;
     mb_port **newports;
     char *string, *name;
-    int slaveid, tmp, maxfailures, inhibit;
+    int slaveid, tmp, maxfailures, inhibit, backoff, backoffmax;
     unsigned char devtype, protocol, type, enable;
     
     if(!lua_istable(L, -1)) {
@@ -357,6 +377,53 @@ _add_port(lua_State *L)
     lua_pop(L, 2);
     mb_set_maxfailures(p, maxfailures, inhibit);
     
+    /* Reconnect delays for TCP Client ports */
+    lua_getfield(L, -1, "backoff");
+    backoff = (int)lua_tonumber(L, -1);
+    lua_getfield(L, -2, "backoffmax");
+    backoffmax = (int)lua_tonumber(L, -1);
+    lua_pop(L, 2);
+    if(backoff > 0) {
+        if(backoffmax < backoff) backoffmax = backoff * 64;
+        if(mb_set_backoff(p, backoff, backoffmax)) {
+            dax_debug(ds, 1, "Bad reconnect delay for port %s", mb_get_port_name(p));
+        }
+    }
+    /* Number of outstanding requests for TCP Client ports */
+    lua_getfield(L, -1, "window");
+    tmp = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+    if(tmp > 0 && mb_set_window(p, tmp)) {
+        dax_debug(ds, 1, "Bad request window %d for port %s", tmp, mb_get_port_name(p));
+    }
+    /* Register gap allowed when read commands are combined, -1 to not combine */
+    lua_getfield(L, -1, "coalesce");
+    if(!lua_isnil(L, -1)) {
+        tmp = (int)lua_tonumber(L, -1);
+        if(mb_set_coalesce(p, tmp)) {
+            dax_debug(ds, 1, "Bad coalesce gap %d for port %s", tmp, mb_get_port_name(p));
+        }
+    }
+    lua_pop(L, 1);
+    
+    /* Default command period and what to do when a command overruns it */
+    lua_getfield(L, -1, "scanrate");
+    tmp = (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+    if(tmp > 0) mb_set_scan_rate(p, tmp);
+    
+    lua_getfield(L, -1, "overrun");
+    string = (char *)lua_tostring(L, -1);
+    if(string) {
+        if(strcasecmp(string, "SKIP") == 0) mb_set_overrun(p, MB_OVERRUN_SKIP);
+        else if(strcasecmp(string, "CATCHUP") == 0) mb_set_overrun(p, MB_OVERRUN_CATCHUP);
+        else if(strcasecmp(string, "DELAY") == 0) mb_set_overrun(p, MB_OVERRUN_DELAY);
+        else {
+            dax_debug(ds, 1, "Unknown overrun policy %s, using SKIP", string);
+        }
+    }
+    lua_pop(L, 1);
+    
 //    lua_pop(L, 7);
     /* The lua script gets the index +1 */
     lua_pushnumber(L, config.portcount);
@@ -376,7 +443,7 @@ _add_command(lua_State *L)
     cmd_temp_data *cmd_data;
     unsigned char mode;
     u_int8_t node, function;
-    u_int16_t reg, length;
+    u_int16_t reg, length, wlength;
     int p; /* Port ID */
     int tagindex;
     
@@ -444,6 +511,19 @@ _add_command(lua_State *L)
     }
     lua_pop(L, 4);
     
+    /* Read/Write Multiple Registers also needs the registers to write */
+    wlength = 0;
+    if(function == 23) {
+        lua_getfield(L, -1, "wregister");
+        reg = (u_int16_t)lua_tonumber(L, -1);
+        lua_getfield(L, -2, "wlength");
+        wlength = (u_int16_t)lua_tonumber(L, -1);
+        lua_pop(L, 2);
+        if(mb_set_write_range(c, reg, wlength)) {
+            dax_error(ds, "Unable to set the write registers for the command");
+        }
+    }
+    
     lua_getfield(L, -1, "index");
     tagindex = (int)lua_tonumber(L, -1);
     
@@ -463,7 +543,8 @@ _add_command(lua_State *L)
         cmd_data->tagname = strdup(string);
         cmd_data->index = tagindex;
         cmd_data->function = function;
-        cmd_data->length = length;
+        cmd_data->length = length + wlength;
+        cmd_data->rlength = length;
         mb_set_cmd_userdata(c, cmd_data, NULL);
         mb_pre_send_callback(c, setup_command);
         //dt_add_tag(c, string, tagindex, function, length);
@@ -473,7 +554,11 @@ _add_command(lua_State *L)
     
     lua_getfield(L, -3, "interval");
     mb_set_interval(c, (int)lua_tonumber(L, -1));
-    lua_pop(L,3);
+    lua_getfield(L, -4, "period");
+    mb_set_period(c, (unsigned int)lua_tonumber(L, -1));
+    lua_getfield(L, -5, "priority");
+    mb_set_priority(c, (int)lua_tonumber(L, -1));
+    lua_pop(L,5);
     return 0;
 }
 
@@ -47,6 +47,7 @@ typedef struct cmd_temp_data {
     int index;
     u_int8_t function;
     u_int16_t length;
+    u_int16_t rlength;  /* Registers that FC 23 reads */
 } cmd_temp_data;
 
 /* This is a structure of information that we attach to the mb_port userdata
@@ -54,7 +55,6 @@ typedef struct cmd_temp_data {
 typedef struct port_ud_item {
     char *mbreg;        /* OpenDAX Tagname */
     Handle h;           /* OpenDAX Handle */
-    dax_event_id event; /* Event identification */
 } port_ud_item;
 
 #define HOLD_REG 0
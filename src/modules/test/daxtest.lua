@@ -7,9 +7,18 @@ FAIL = 1
 run_test("tests/random.lua", "Random Tag Addition Test")
 run_test("tests/tagname.lua", "Tagname Addition Test")
 run_test("tests/handles.lua", "Tag Handle Retrieval Test")
+run_test("tests/tagcache.lua", "Tag Cache Test")
 
 run_test("tests/status.lua", "Status Retrieve test")
 run_test("tests/readwrite.lua", "Read / Write Test")
+run_test("tests/prepared.lua", "Prepared Tag Test")
+run_test("tests/cdtbulk.lua", "Large CDT Array Test")
+run_test("tests/boolbits.lua", "BOOL Bit Range Test")
+run_test("tests/threads.lua", "Multiple Thread Test")
+run_test("tests/datacache.lua", "Data Cache Test")
+run_test("tests/batch.lua", "Write Batch Test")
+run_test("tests/transport.lua", "Transport Test")
+run_test("tests/reconnect.lua", "Reconnect Test")
 run_test("tests/typefail.lua", "Type Fail Test")
 run_test("tests/tagmodify.lua", "Tag Modification Test")
 
@@ -21,8 +30,13 @@ run_test("tests/eventequal.lua", "Event Equal Test")
 run_test("tests/eventgreater.lua", "Event Greater Than Test")
 run_test("tests/eventless.lua", "Event LessThan Test")
 run_test("tests/eventdeadband.lua", "Event Deadband Test")
+run_test("tests/eventedge.lua", "Event Rise/Fall Test")
+run_test("tests/eventcompound.lua", "Compound Event Test")
+run_test("tests/eventpattern.lua", "Event Pattern Test")
+run_test("tests/eventschema.lua", "Tag Set Change Event Test")
 
 run_test("tests/events.lua", "Event Notification Test")
+run_test("tests/eventcoalesce.lua", "Event Coalescing Test")
 
 --run_test("tests/lazy.lua", "Lazy Programmer Test")
 
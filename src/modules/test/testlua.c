@@ -20,6 +20,9 @@
  */
 
 #include <daxtest.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <sys/socket.h>
 
 extern dax_state *ds;
 
@@ -142,6 +145,307 @@ _handle_test(lua_State *L)
     return 0;
 }
 
+/* Reads and writes BOOL handles that start and end in the middle of
+ * bytes.  For every starting bit from 0 to 7 and every count from 1 to
+ * 'maxcount' a pattern is written through the handle and the whole tag
+ * is read back to make sure that the bits were put in the right place
+ * and that the bits around them weren't disturbed.  This is repeated
+ * 'passes' times and the average time for each read and write is printed.
+ * The tag should be a BOOL array at least maxcount + 8 long.
+ * Lua Call : bool_bench(string tagname, int maxcount, int passes) */
+static int
+_bool_bench(lua_State *L)
+{
+    Handle h, whole;
+    char name[DAX_TAGNAME_SIZE + 16];
+    const char *tagname;
+    u_int8_t pattern[64], buff[64], check[64];
+    int maxcount, passes, pass, bit, count, n, i, result, ops = 0;
+    struct timeval start, end;
+    double usec;
+
+    if(lua_gettop(L) != 3) {
+        luaL_error(L, "wrong number of arguments to bool_bench()");
+    }
+    tagname = lua_tostring(L, 1);
+    maxcount = lua_tointeger(L, 2);
+    passes = lua_tointeger(L, 3);
+    result = dax_tag_handle(ds, &whole, (char *)tagname, 0);
+    if(result) luaL_error(L, "bool_bench() can't get handle for %s", tagname);
+    if(whole.type != DAX_BOOL || maxcount < 1 || whole.count < maxcount + 8 ||
+       whole.size > sizeof(buff)) {
+        luaL_error(L, "bool_bench() maxcount is out of range for %s", tagname);
+    }
+
+    gettimeofday(&start, NULL);
+    for(pass = 0; pass < passes; pass++) {
+        for(bit = 0; bit < 8; bit++) {
+            for(count = 1; count <= maxcount; count++) {
+                snprintf(name, sizeof(name), "%s[%d]", tagname, bit);
+                result = dax_tag_handle(ds, &h, name, count);
+                if(result) luaL_error(L, "bool_bench() can't get handle for %s", name);
+                /* Clear the tag and then write a pattern that changes
+                 * with every pass and count */
+                bzero(buff, whole.size);
+                dax_write_tag(ds, whole, buff);
+                for(n = 0; n < sizeof(pattern); n++) {
+                    pattern[n] = (u_int8_t)((n + 1) * 0x5B + pass + count);
+                }
+                result = dax_write_tag(ds, h, pattern);
+                if(result) luaL_error(L, "bool_bench() write failed for %s, %d", name, count);
+                result = dax_read_tag(ds, h, buff);
+                if(result) luaL_error(L, "bool_bench() read failed for %s, %d", name, count);
+                ops += 2;
+                for(n = 0; n < count; n++) {
+                    if(((buff[n/8] >> (n%8)) ^ (pattern[n/8] >> (n%8))) & 0x01) {
+                        luaL_error(L, "bool_bench() %s, %d read back wrong at bit %d", name, count, n);
+                    }
+                }
+                /* The bits past count should come back cleared */
+                if(count % 8 && buff[count/8] >> (count%8)) {
+                    luaL_error(L, "bool_bench() %s, %d returned extra bits", name, count);
+                }
+                /* Nothing outside of the handle should have been written */
+                dax_read_tag(ds, whole, check);
+                for(i = 0; i < whole.count; i++) {
+                    n = ((check[i/8] >> (i%8)) & 0x01);
+                    if(i < bit || i >= bit + count) {
+                        if(n) luaL_error(L, "bool_bench() %s, %d changed bit %d", name, count, i);
+                    } else if(n != ((pattern[(i-bit)/8] >> ((i-bit)%8)) & 0x01)) {
+                        luaL_error(L, "bool_bench() %s, %d bit %d is wrong in the tag", name, count, i);
+                    }
+                }
+            }
+        }
+    }
+    gettimeofday(&end, NULL);
+    usec = (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_usec - start.tv_usec);
+    printf("BOOL bit range I/O: %d operations, %.1f usec each\n", ops, usec / ops);
+    return 0;
+}
+
+#define THREAD_TEST_MAX 32
+
+struct thread_arg {
+    const char *tagname;
+    int id;
+    int passes;
+    int errors;
+};
+
+/* Each thread looks up it's own element of the tag and writes and reads
+ * it back 'passes' times.  The value changes every pass so that a
+ * response that went to the wrong thread would show up as an error. */
+static void *
+_thread_test_run(void *arg)
+{
+    struct thread_arg *t = (struct thread_arg *)arg;
+    char name[DAX_TAGNAME_SIZE + 16];
+    dax_tag tag;
+    Handle h;
+    dax_dint out, in;
+    int pass;
+
+    snprintf(name, sizeof(name), "%s[%d]", t->tagname, t->id);
+    for(pass = 0; pass < t->passes; pass++) {
+        if(dax_tag_byname(ds, &tag, (char *)t->tagname) ||
+           dax_tag_handle(ds, &h, name, 1)) {
+            t->errors++;
+            continue;
+        }
+        out = (t->id << 16) | pass;
+        if(dax_write_tag(ds, h, &out) || dax_read_tag(ds, h, &in) || in != out) {
+            t->errors++;
+        }
+    }
+    return NULL;
+}
+
+/* Runs 'threads' threads at once that all use the same dax_state.  The
+ * tag should be a DINT array with at least 'threads' elements.  Returns
+ * the number of errors that were seen and prints the time per operation.
+ * Lua Call : thread_test(string tagname, int threads, int passes) */
+static int
+_thread_test(lua_State *L)
+{
+    pthread_t thread[THREAD_TEST_MAX];
+    struct thread_arg arg[THREAD_TEST_MAX];
+    int threads, passes, n, errors = 0;
+    struct timeval start, end;
+    double usec;
+
+    if(lua_gettop(L) != 3) {
+        luaL_error(L, "wrong number of arguments to thread_test()");
+    }
+    threads = lua_tointeger(L, 2);
+    passes = lua_tointeger(L, 3);
+    if(threads < 1 || threads > THREAD_TEST_MAX || passes < 1) {
+        luaL_error(L, "thread_test() argument out of range");
+    }
+    gettimeofday(&start, NULL);
+    for(n = 0; n < threads; n++) {
+        arg[n].tagname = lua_tostring(L, 1);
+        arg[n].id = n;
+        arg[n].passes = passes;
+        arg[n].errors = 0;
+        if(pthread_create(&thread[n], NULL, _thread_test_run, &arg[n])) {
+            luaL_error(L, "thread_test() unable to start thread %d", n);
+        }
+    }
+    for(n = 0; n < threads; n++) {
+        pthread_join(thread[n], NULL);
+        errors += arg[n].errors;
+    }
+    gettimeofday(&end, NULL);
+    usec = (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_usec - start.tv_usec);
+    printf("%d threads: %d operations, %.1f usec each\n", threads,
+           threads * passes * 4, usec / (threads * passes * 4));
+    lua_pushinteger(L, errors);
+    return 1;
+}
+
+static int
+_compare_usec(const void *a, const void *b)
+{
+    return *(int *)a - *(int *)b;
+}
+
+/* Opens a second connection to the same server that ds is connected
+ * to as the module 'name'.  If 'transport' isn't NULL the "transport"
+ * attribute is set to it.  Returns NULL on failure. */
+static dax_state *
+_second_connection(char *name, char *transport)
+{
+    static char *copy[] = {"server", "socketname", "serverip", "serverport", "msgtimeout", NULL};
+    dax_state *ts;
+    int n;
+
+    ts = dax_init(name);
+    if(ts == NULL) return NULL;
+    dax_init_config(ts, name);
+    for(n = 0; copy[n] != NULL; n++) {
+        dax_set_attr(ts, copy[n], dax_get_attr(ds, copy[n]));
+    }
+    if(transport != NULL) {
+        dax_set_attr(ts, "transport", transport);
+    }
+    dax_configure(ts, 0, NULL, 0);
+    if(dax_connect(ts)) {
+        dax_free(ts);
+        return NULL;
+    }
+    return ts;
+}
+
+/* Opens another connection to the server with the "transport" attribute
+ * set to 'transport' and times 'passes' writes and reads of the tag.
+ * Returns the number of errors. */
+static int
+_transport_run(const char *tagname, char *transport, int passes, int *usec)
+{
+    dax_state *ts;
+    Handle h;
+    dax_dint out, in;
+    struct timeval start, end;
+    int n, errors = 0;
+
+    ts = _second_connection("transportbench", transport);
+    if(ts == NULL) return passes;
+    if(dax_tag_handle(ts, &h, (char *)tagname, 1)) {
+        dax_disconnect(ts);
+        dax_free(ts);
+        return passes;
+    }
+    for(n = 0; n < passes; n++) {
+        out = n ^ 0x5A5A;
+        gettimeofday(&start, NULL);
+        if(dax_write_tag(ts, h, &out) || dax_read_tag(ts, h, &in) || in != out) {
+            errors++;
+        }
+        gettimeofday(&end, NULL);
+        usec[n] = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec);
+    }
+    dax_disconnect(ts);
+    dax_free(ts);
+    return errors;
+}
+
+/* Compares the plain socket transport with io_uring.  Each one does
+ * 'passes' write / read pairs on the tag, which should be a DINT, and
+ * the average, median and 99th percentile times are printed.  If io_uring
+ * can't be used the library falls back to the sockets so both should
+ * always work.  Returns the number of errors.
+ * Lua Call : transport_bench(string tagname, int passes) */
+static int
+_transport_bench(lua_State *L)
+{
+    static char *transport[] = {"socket", "uring"};
+    const char *tagname;
+    int *usec;
+    int passes, n, i, errors = 0;
+    double total;
+
+    if(lua_gettop(L) != 2) {
+        luaL_error(L, "wrong number of arguments to transport_bench()");
+    }
+    tagname = lua_tostring(L, 1);
+    passes = lua_tointeger(L, 2);
+    if(passes < 1) luaL_error(L, "transport_bench() passes out of range");
+    usec = malloc(passes * sizeof(int));
+    if(usec == NULL) luaL_error(L, "transport_bench() out of memory");
+    for(i = 0; i < 2; i++) {
+        errors += _transport_run(tagname, transport[i], passes, usec);
+        total = 0;
+        for(n = 0; n < passes; n++) total += usec[n];
+        qsort(usec, passes, sizeof(int), _compare_usec);
+        printf("%s transport: %.1f usec per write / read, median %d, 99%% %d\n",
+               transport[i], total / passes, usec[passes / 2], usec[passes * 99 / 100]);
+    }
+    free(usec);
+    lua_pushinteger(L, errors);
+    return 1;
+}
+
+/* Writes 'value' to the tag from a connection of its own so that this
+ * module only hears about it through the CHANGE event.  The tag should
+ * be a 16 or 32 bit integer.
+ * Lua Call : foreign_write(string tagname, int value) */
+static int
+_foreign_write(lua_State *L)
+{
+    dax_state *ts;
+    Handle h;
+    dax_int ival;
+    dax_dint dval;
+    int result;
+
+    if(lua_gettop(L) != 2) {
+        luaL_error(L, "wrong number of arguments to foreign_write()");
+    }
+    ts = _second_connection("foreignwrite", NULL);
+    if(ts == NULL) {
+        luaL_error(L, "foreign_write() unable to connect to the server");
+    }
+    result = dax_tag_handle(ts, &h, (char *)lua_tostring(L, 1), 1);
+    if(result == 0) {
+        if(h.size == sizeof(dax_int)) {
+            ival = lua_tointeger(L, 2);
+            result = dax_write_tag(ts, h, &ival);
+        } else if(h.size == sizeof(dax_dint)) {
+            dval = lua_tointeger(L, 2);
+            result = dax_write_tag(ts, h, &dval);
+        } else {
+            result = ERR_ARG;
+        }
+    }
+    dax_disconnect(ts);
+    dax_free(ts);
+    if(result) {
+        luaL_error(L, "foreign_write() returned %d", result);
+    }
+    return 0;
+}
+
 /*** LAZY PROGRAMMER TESTS *****************************************
  * This is a temporary place for development of tests.  It puts
  * these tests within the normal testing framework but allows
@@ -185,6 +489,144 @@ _lazy_test(lua_State *L)
 
 /**END OF LAZY PROGRAMMER TESTS**************************************/
 
+/* Writes to a DINT array and a BOOL array through a write batch and
+ * checks what ends up on the server.  Each element is written several
+ * times, partly with masks, so that the merging gets checked too.  The
+ * DINT tag needs at least 'count' elements and the BOOL tag 'count' * 3.
+ * Returns the number of errors.
+ * Lua Call : batch_test(string dinttag, string booltag, int count) */
+static int
+_batch_test(lua_State *L)
+{
+    dax_batch *b;
+    Handle h, whole;
+    char name[DAX_TAGNAME_SIZE + 16];
+    const char *dtag, *btag;
+    dax_dint val, mask, *readback;
+    u_int8_t bit, bmask, *bits;
+    int count, n, errors = 0;
+
+    if(lua_gettop(L) != 3) {
+        luaL_error(L, "wrong number of arguments to batch_test()");
+    }
+    dtag = lua_tostring(L, 1);
+    btag = lua_tostring(L, 2);
+    count = lua_tointeger(L, 3);
+    if(dax_batch_new(ds, &b)) {
+        luaL_error(L, "batch_test() unable to create batch");
+    }
+    for(n = 0; n < count; n++) {
+        snprintf(name, sizeof(name), "%s[%d]", dtag, n);
+        if(dax_tag_handle(ds, &h, name, 1)) {
+            errors++;
+            continue;
+        }
+        /* The second write replaces the first and the masked one only
+         * changes the low 16 bits */
+        val = -1;
+        dax_batch_write(ds, b, h, &val);
+        val = n << 16;
+        dax_batch_write(ds, b, h, &val);
+        val = n;
+        mask = 0xFFFF;
+        dax_batch_mask(ds, b, h, &val, &mask);
+        /* Every third bit, each one in a handle of it's own */
+        snprintf(name, sizeof(name), "%s[%d]", btag, n * 3 + 1);
+        if(dax_tag_handle(ds, &h, name, 1)) {
+            errors++;
+            continue;
+        }
+        bit = 1;
+        dax_batch_write(ds, b, h, &bit);
+    }
+    /* Clearing a bit with a mask of nothing shouldn't do anything */
+    bit = 0;
+    bmask = 0;
+    dax_batch_mask(ds, b, h, &bit, &bmask);
+    /* Bits in the same byte share an entry */
+    n = count + (3 * (count - 1) + 1) / 8 + 1;
+    if(dax_batch_count(b) != n) {
+        printf("batch_test() has %d entries instead of %d\n", dax_batch_count(b), n);
+        errors++;
+    }
+    if(dax_batch_flush(ds, b) || dax_batch_count(b) != 0) {
+        errors++;
+    }
+    dax_batch_free(b);
+
+    if(dax_tag_handle(ds, &whole, (char *)dtag, count)) {
+        luaL_error(L, "batch_test() can't get handle for %s", dtag);
+    }
+    readback = malloc(whole.size);
+    if(readback && dax_read_tag(ds, whole, readback) == 0) {
+        for(n = 0; n < count; n++) {
+            if(readback[n] != ((n << 16) | n)) errors++;
+        }
+    } else {
+        errors++;
+    }
+    free(readback);
+    if(dax_tag_handle(ds, &whole, (char *)btag, count * 3)) {
+        luaL_error(L, "batch_test() can't get handle for %s", btag);
+    }
+    bits = malloc(whole.size);
+    if(bits && dax_read_tag(ds, whole, bits) == 0) {
+        for(n = 0; n < count * 3; n++) {
+            if(((bits[n / 8] >> (n % 8)) & 1) != (n % 3 == 1)) errors++;
+        }
+    } else {
+        errors++;
+    }
+    free(bits);
+
+    /* Writing the whole tag, then part of it and then the whole tag again
+     * has to leave the last write on top.  The second whole write can't
+     * be merged into the first or it would go out before the part. */
+    if(dax_tag_handle(ds, &whole, (char *)dtag, count) ||
+       dax_tag_handle(ds, &h, (char *)dtag, 1)) {
+        luaL_error(L, "batch_test() can't get handle for %s", dtag);
+    }
+    readback = malloc(whole.size);
+    if(readback == NULL || dax_batch_new(ds, &b)) {
+        luaL_error(L, "batch_test() unable to create batch");
+    }
+    for(n = 0; n < count; n++) readback[n] = 1;
+    dax_batch_write(ds, b, whole, readback);
+    val = 2;
+    dax_batch_write(ds, b, h, &val);
+    for(n = 0; n < count; n++) readback[n] = 3;
+    dax_batch_write(ds, b, whole, readback);
+    if(dax_batch_count(b) != 3) {
+        printf("batch_test() has %d entries instead of 3\n", dax_batch_count(b));
+        errors++;
+    }
+    if(dax_batch_flush(ds, b)) errors++;
+    dax_batch_free(b);
+    bzero(readback, whole.size);
+    if(dax_read_tag(ds, whole, readback) == 0) {
+        for(n = 0; n < count; n++) {
+            if(readback[n] != 3) errors++;
+        }
+    } else {
+        errors++;
+    }
+    free(readback);
+    lua_pushinteger(L, errors);
+    return 1;
+}
+
+/* Shuts down the event socket so that the library sees the connection
+ * to the server go away the next time it reads an event.
+ * Lua Call : drop_connection() */
+static int
+_drop_connection(lua_State *L)
+{
+    if(shutdown(dax_event_get_fd(ds), SHUT_RDWR)) {
+        luaL_error(L, "drop_connection() - %s", strerror(errno));
+    }
+    return 0;
+}
+
 /* Adds the functions to the Lua State */
 void
 add_test_functions(lua_State *L)
@@ -193,12 +635,19 @@ add_test_functions(lua_State *L)
     daxlua_register_function(L,"cdt_create");
     daxlua_register_function(L,"tag_add");
     daxlua_register_function(L,"tag_get");
+    daxlua_register_function(L,"tag_prepare");
     daxlua_register_function(L,"tag_read");
     daxlua_register_function(L,"tag_write");
     daxlua_register_function(L,"event_add");
+    daxlua_register_function(L,"event_pattern_add");
+    daxlua_register_function(L,"event_compound_add");
     daxlua_register_function(L,"event_del");
     daxlua_register_function(L,"event_select");
     daxlua_register_function(L,"event_poll");
+    daxlua_register_function(L,"event_wait");
+    daxlua_register_function(L,"cache_add");
+    daxlua_register_function(L,"cache_del");
+    daxlua_register_function(L,"cache_stats");
 
 
     /* These are the functions that only make sense in this module */
@@ -211,6 +660,24 @@ add_test_functions(lua_State *L)
     lua_pushcfunction(L, _handle_test);
     lua_setglobal(L, "handle_test");
     
+    lua_pushcfunction(L, _bool_bench);
+    lua_setglobal(L, "bool_bench");
+
+    lua_pushcfunction(L, _thread_test);
+    lua_setglobal(L, "thread_test");
+
+    lua_pushcfunction(L, _batch_test);
+    lua_setglobal(L, "batch_test");
+
+    lua_pushcfunction(L, _drop_connection);
+    lua_setglobal(L, "drop_connection");
+
+    lua_pushcfunction(L, _transport_bench);
+    lua_setglobal(L, "transport_bench");
+
+    lua_pushcfunction(L, _foreign_write);
+    lua_setglobal(L, "foreign_write");
+
     lua_pushcfunction(L, _lazy_test);
     lua_setglobal(L, "lazy_test");
 
@@ -0,0 +1,18 @@
+--Checks that writes made through a write batch end up on the server
+--after the flush.  batch_test() does the writing in C.
+
+tag_add("BatchDint", "DINT", 50)
+tag_add("BatchBool", "BOOL", 150)
+
+errors = batch_test("BatchDint", "BatchBool", 50)
+if errors ~= 0 then
+    error(errors .. " errors in the batch test")
+end
+
+--Big enough that the batch has to be split into more than one message
+tag_add("BatchBig", "DINT", 2000)
+tag_add("BatchBigBool", "BOOL", 6000)
+errors = batch_test("BatchBig", "BatchBigBool", 2000)
+if errors ~= 0 then
+    error(errors .. " errors in the large batch test")
+end
@@ -0,0 +1,30 @@
+--Checks reading and writing BOOL arrays that don't start or end on byte
+--boundaries.  bool_bench() checks every start bit and count in C and
+--prints the time for each operation.
+
+tag_add("BitRange", "BOOL", 48)
+bool_bench("BitRange", 40, 2)
+
+--The same thing through the Lua interface
+tag_add("BitRangeLua", "BOOL", 24)
+for start=0,7 do
+    for count=1,16 do
+        tag_write("BitRangeLua", {false, false, false, false, false, false, false, false,
+                                  false, false, false, false, false, false, false, false,
+                                  false, false, false, false, false, false, false, false})
+        p = tag_prepare("BitRangeLua[" .. start .. "]", count)
+        x = {}
+        for n=1,count do x[n] = (n % 3 ~= 0) end
+        tag_write(p, x)
+        y = tag_read("BitRangeLua", 0)
+        for n=1,24 do
+            if n > start and n <= start + count then
+                if y[n] ~= x[n - start] then
+                    error("Bit " .. n .. " wrong for start " .. start .. " count " .. count)
+                end
+            elseif y[n] ~= false then
+                error("Bit " .. n .. " disturbed for start " .. start .. " count " .. count)
+            end
+        end
+    end
+end
@@ -0,0 +1,53 @@
+--Round trips a large array of nested compound datatypes to check the
+--flattened datatype conversion
+
+inner = cdt_create("BulkInner", {{"Flag",   "BOOL", 3},
+                                 {"Values", "REAL", 4}})
+outer = cdt_create("BulkOuter", {{"Count",  "DINT",      1},
+                                 {"Inner",  "BulkInner", 2},
+                                 {"Words",  "UINT",      8}})
+
+size = 1000
+tag_add("BulkTag", outer, size)
+
+x = {}
+for n=1,size do
+    x[n] = {Count = n, Inner = {}, Words = {}}
+    for i=1,2 do
+        x[n].Inner[i] = {Flag = {n % 2 == 0, i == 2, true},
+                         Values = {n + 0.5, i, -n, 0}}
+    end
+    for i=1,8 do
+        x[n].Words[i] = (n * 8 + i) % 65536
+    end
+end
+
+tag_write("BulkTag", x)
+y = tag_read("BulkTag", 0)
+
+for n=1,size do
+    if y[n].Count ~= n then error("Count wrong at " .. n) end
+    for i=1,2 do
+        for j=1,3 do
+            if y[n].Inner[i].Flag[j] ~= x[n].Inner[i].Flag[j] then
+                error("Flag wrong at " .. n .. "." .. i .. "." .. j)
+            end
+        end
+        for j=1,4 do
+            if y[n].Inner[i].Values[j] ~= x[n].Inner[i].Values[j] then
+                error("Value wrong at " .. n .. "." .. i .. "." .. j)
+            end
+        end
+    end
+    for i=1,8 do
+        if y[n].Words[i] ~= x[n].Words[i] then error("Word wrong at " .. n) end
+    end
+end
+
+--Writing a single nested member shouldn't disturb its neighbours
+tag_write("BulkTag", {[10] = {Inner = {nil, {Values = {nil, 99}}}}})
+y = tag_read("BulkTag[9]", 1)
+if y.Inner[2].Values[2] ~= 99 or y.Inner[2].Values[1] ~= 10.5 or y.Inner[1].Values[2] ~= 1 then
+    error("Partial nested write failed")
+end
+if y.Count ~= 10 then error("Partial nested write changed another member") end
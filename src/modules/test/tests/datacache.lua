@@ -0,0 +1,75 @@
+--Checks the client side data cache.  Reads of a cached handle should
+--be answered locally until the CHANGE event for the tag comes in.
+
+tag_add("CacheInt", "INT", 10)
+tag_add("CacheBool", "BOOL", 20)
+
+tag_write("CacheInt", {1, 2, 3, 4, 5, 6, 7, 8, 9, 10})
+cache_add("CacheInt", 0)
+cache_add("CacheBool[3]", 9)
+cache_stats(true)
+
+--The first read has to go to the server
+x = tag_read("CacheInt", 0)
+s = cache_stats()
+if s.misses ~= 1 or s.hits ~= 0 then
+    error("First read hits = " .. s.hits .. " misses = " .. s.misses)
+end
+if s.entries ~= 2 then
+    error("Cache has " .. s.entries .. " entries")
+end
+
+--The rest should come from the cache
+for n=1,10 do
+    x = tag_read("CacheInt", 0)
+    if x[n] ~= n then error("CacheInt[" .. (n - 1) .. "] = " .. x[n]) end
+end
+s = cache_stats(true)
+if s.hits ~= 10 then
+    error("Expected 10 hits, got " .. s.hits)
+end
+
+--Writing a part of the tag that we cache has to throw the value away
+--even before the event gets here
+tag_write("CacheInt[4]", 44)
+x = tag_read("CacheInt", 0)
+if x[5] ~= 44 then error("Stale value CacheInt[4] = " .. x[5]) end
+s = cache_stats(true)
+if s.invalidations ~= 1 or s.misses ~= 1 then
+    error("Write invalidations = " .. s.invalidations .. " misses = " .. s.misses)
+end
+
+--A change that another module makes only reaches us as an event
+x = tag_read("CacheInt", 0)
+cache_stats(true)
+foreign_write("CacheInt[0]", 100)
+while cache_stats().invalidations == 0 and event_wait(1000) == 1 do end
+s = cache_stats()
+if s.invalidations ~= 1 then
+    error("Foreign write invalidations = " .. s.invalidations)
+end
+x = tag_read("CacheInt", 0)
+if x[1] ~= 100 then error("Stale value CacheInt[0] = " .. x[1]) end
+s = cache_stats()
+if s.misses ~= 1 then error("Foreign write misses = " .. s.misses) end
+
+--BOOL handles that aren't on a byte boundary
+arr = {}
+for n=1,9 do arr[n] = (n % 2 == 0) end
+tag_write("CacheBool[3]", arr)
+for pass=1,2 do
+    y = tag_read("CacheBool[3]", 9)
+    for n=1,9 do
+        if y[n] ~= arr[n] then error("CacheBool[" .. (n + 1) .. "] pass " .. pass) end
+    end
+end
+
+--After the handle is removed every read goes to the server
+cache_del("CacheInt", 0)
+cache_stats(true)
+x = tag_read("CacheInt", 0)
+s = cache_stats()
+if s.hits ~= 0 or s.misses ~= 0 or s.entries ~= 1 then
+    error("Deleted handle is still being cached")
+end
+cache_del("CacheBool[3]", 9)
@@ -0,0 +1,33 @@
+--Verification that overlapping events fired by a single write are all
+--delivered together
+
+hits = 0
+
+function callback(x)
+   hits = hits + x
+end
+
+tag_add("EventCoalesce", "INT", 20)
+e1 = event_add("EventCoalesce[0]", 10, "WRITE", 0, callback, 1)
+e2 = event_add("EventCoalesce[5]", 10, "WRITE", 0, callback, 10)
+e3 = event_add("EventCoalesce[8]", 2, "CHANGE", 0, callback, 100)
+
+--The server queues all three and sends them with one write so a single
+--poll should pick them all up
+tag_write("EventCoalesce", {1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20})
+event_poll()
+if hits ~= 111 then
+    error("Expected all three events, got " .. hits)
+end
+
+--Writing the same data again should only fire the WRITE events
+hits = 0
+tag_write("EventCoalesce", {1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20})
+event_poll()
+if hits ~= 11 then
+    error("Expected only the write events, got " .. hits)
+end
+
+event_del(e1)
+event_del(e2)
+event_del(e3)
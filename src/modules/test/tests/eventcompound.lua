@@ -0,0 +1,51 @@
+--Verification of the compound condition events
+
+--Some definitions
+HIT = 1
+MISS = 0
+
+lastevent = 0
+
+function callback(x)
+   lastevent = x
+end
+
+function EventTest(tagname, val, test)
+    lastevent = MISS
+    tag_write(tagname, val)
+    event_poll()
+    if test ~= lastevent then
+        error("Event for " .. tagname .. " = " .. val .. " Failed", 2)
+    end
+end
+
+tag_add("CompRun", "BOOL", 1)
+tag_add("CompFault", "BOOL", 8)
+tag_add("CompLevel", "DINT", 4)
+tag_add("CompOverride", "BOOL", 1)
+
+tag_write("CompRun", 0)
+tag_write("CompFault[3]", 0)
+tag_write("CompLevel[1]", 0)
+tag_write("CompOverride", 0)
+
+e = event_compound_add("CompRun && !CompFault[3] && CompLevel[1] >= 80 || CompOverride",
+                       callback, HIT)
+
+EventTest("CompRun", 1, MISS)
+EventTest("CompLevel[1]", 79, MISS)
+EventTest("CompLevel[1]", 80, HIT)
+--Still true so we shouldn't get another one
+EventTest("CompLevel[1]", 85, MISS)
+EventTest("CompFault[3]", 1, MISS)
+EventTest("CompFault[3]", 0, HIT)
+--Other elements of the same tag don't matter
+EventTest("CompFault[2]", 1, MISS)
+EventTest("CompLevel[0]", 100, MISS)
+EventTest("CompRun", 0, MISS)
+EventTest("CompOverride", 1, HIT)
+
+event_del(e)
+
+EventTest("CompOverride", 0, MISS)
+EventTest("CompOverride", 1, MISS)
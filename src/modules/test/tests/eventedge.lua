@@ -0,0 +1,50 @@
+--Verification of the RISE and FALL events with hysteresis
+
+--Some definitions
+HIT = 1
+MISS = 0
+
+lastevent = 0
+
+function callback(x)
+   lastevent = x
+end
+
+function EventTest(tagname, val, test)
+    lastevent = MISS
+    tag_write(tagname, val)
+    event_poll()
+    if test ~= lastevent then
+        error("Event for " .. tagname .. " = " .. val .. " Failed", 2)
+    end
+end
+
+tag_add("EventEdgeInt", "INT", 10)
+tag_write("EventEdgeInt[2]", 0)
+--Rise above 100 and rearm when it drops to 90
+e = event_add("EventEdgeInt[2]", 1, "RISE", 100, callback, HIT, 10)
+
+EventTest("EventEdgeInt[2]", 99, MISS)
+EventTest("EventEdgeInt[2]", 101, HIT)
+EventTest("EventEdgeInt[2]", 102, MISS)
+EventTest("EventEdgeInt[2]", 95, MISS)
+EventTest("EventEdgeInt[2]", 101, MISS)
+EventTest("EventEdgeInt[2]", 90, MISS)
+EventTest("EventEdgeInt[2]", 101, HIT)
+EventTest("EventEdgeInt[3]", 200, MISS)
+
+event_del(e)
+
+tag_add("EventEdgeReal", "REAL", 1)
+tag_write("EventEdgeReal", 50)
+--Fall below 10.0 and rearm when it rises to 12.5
+e = event_add("EventEdgeReal", 1, "FALL", 10.0, callback, HIT, 2.5)
+
+EventTest("EventEdgeReal", 10.0, MISS)
+EventTest("EventEdgeReal", 9.5, HIT)
+EventTest("EventEdgeReal", 11.0, MISS)
+EventTest("EventEdgeReal", 9.0, MISS)
+EventTest("EventEdgeReal", 12.5, MISS)
+EventTest("EventEdgeReal", 9.0, HIT)
+
+event_del(e)
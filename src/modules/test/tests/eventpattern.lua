@@ -0,0 +1,56 @@
+--Verification of pattern event subscriptions
+
+hits = 0
+lastindex = -1
+
+function callback(x, index)
+--   print("Lua Callback - tag index = " .. index)
+   hits = hits + x
+   lastindex = index
+end
+
+function EventTest(tagname, val, test)
+    hits = 0
+    tag_write(tagname, val)
+    event_poll()
+    if test ~= hits then
+        error("Pattern event for " .. tagname .. " Failed", 2)
+    end
+end
+
+tag_add("PatternDint1", "DINT", 1)
+tag_add("PatternInt1", "INT", 1)
+tag_add("OtherDint1", "DINT", 1)
+
+--Prefix pattern with a datatype filter
+e = event_pattern_add("Pattern*", "DINT", "WRITE", callback, 1)
+
+EventTest("PatternDint1", 12, 1)
+EventTest("PatternInt1", 12, 0)
+EventTest("OtherDint1", 12, 0)
+
+--Tags that are added after the subscription should be picked up too
+tag_add("PatternDint2", "DINT", 4)
+EventTest("PatternDint2[2]", 12, 1)
+lastindex = -1
+EventTest("PatternInt1", 12, 0)
+if lastindex ~= -1 then
+    error("Pattern event fired for the wrong datatype")
+end
+
+--Growing a tag has to leave one event on it that covers the new size
+tag_add("PatternDint2", "DINT", 8)
+EventTest("PatternDint2[1]", 13, 1)
+EventTest("PatternDint2[6]", 13, 1)
+
+--Exact pattern with a CHANGE event and no datatype filter
+f = event_pattern_add("PatternInt1", nil, "CHANGE", callback, 1)
+
+EventTest("PatternInt1", 13, 1)
+EventTest("PatternInt1", 13, 0)
+
+event_del(e)
+event_del(f)
+
+EventTest("PatternDint1", 22, 0)
+EventTest("PatternInt1", 22, 0)
@@ -0,0 +1,46 @@
+--Verification of the tag added and CDT created notifications
+
+hits = 0
+lastindex = -1
+
+function callback(x, index)
+   hits = hits + x
+   lastindex = index
+end
+
+function CheckHits(test, msg)
+    event_poll()
+    if test ~= hits then
+        error(msg .. " Failed", 2)
+    end
+    hits = 0
+end
+
+e = event_pattern_add("Schema*", nil, "TAG_ADDED", callback, 1)
+
+tag_add("SchemaDint", "DINT", 1)
+CheckHits(1, "Tag Added Event")
+tag_add("OtherSchemaDint", "DINT", 1)
+CheckHits(0, "Tag Added Event for non matching tag")
+--Adding the same tag again doesn't create a new tag
+tag_add("SchemaDint", "DINT", 1)
+CheckHits(0, "Tag Added Event for existing tag")
+--Growing the tag redefines it
+tag_add("SchemaDint", "DINT", 4)
+CheckHits(1, "Tag Added Event for resized tag")
+
+f = event_pattern_add("*", nil, "CDT_CREATED", callback, 1)
+
+members = {{"Int1", "INT", 1},
+           {"Dint1", "DINT", 1}}
+t = cdt_create("SchemaType", members)
+CheckHits(1, "CDT Created Event")
+if lastindex ~= t then
+    error("CDT Created Event returned the wrong datatype")
+end
+
+event_del(e)
+event_del(f)
+
+tag_add("SchemaDint2", "DINT", 1)
+CheckHits(0, "Tag Added Event after delete")
@@ -0,0 +1,43 @@
+--Checks that prepared tags read and write the same data as the
+--tag names that they were prepared from
+
+tag_add("PrepDint", "DINT", 1)
+tag_add("PrepArray", "INT", 10)
+
+--Single value
+p = tag_prepare("PrepDint")
+for n=1,20 do
+    tag_write(p, n * 1000)
+    x = tag_read("PrepDint", 0)
+    if x ~= n * 1000 then error("Prepared write failed " .. x .. " ~= " .. n * 1000) end
+    tag_write("PrepDint", -n)
+    x = tag_read(p)
+    if x ~= -n then error("Prepared read failed " .. x .. " ~= " .. -n) end
+end
+
+--Part of an array
+p = tag_prepare("PrepArray[2]", 3)
+tag_write("PrepArray", {1, 2, 3, 4, 5, 6, 7, 8, 9, 10})
+x = tag_read(p)
+for n=1,3 do
+    if x[n] ~= n + 2 then error("Prepared array read failed at " .. n) end
+end
+--Only the elements that are given should be written
+tag_write(p, {30, nil, 50})
+x = tag_read("PrepArray", 0)
+check = {1, 2, 30, 4, 50, 6, 7, 8, 9, 10}
+for n=1,10 do
+    if x[n] ~= check[n] then error("Prepared array write failed at " .. n) end
+end
+
+--Resizing the tag shouldn't break the prepared tag
+tag_add("PrepArray", "INT", 20)
+x = tag_read(p)
+if x[1] ~= 30 or x[3] ~= 50 then
+    error("Prepared tag failed after the tag was resized")
+end
+
+--Bad tags should fail when they are prepared
+if pcall(tag_prepare, "NoSuchPrepTag") then
+    error("Should not have been able to prepare a tag that doesn't exist")
+end
@@ -0,0 +1,42 @@
+--Checks that the library gets the connection to the server back on
+--it's own and that the events and the data cache still work with the
+--same ids afterwards.
+
+hits = 0
+function callback(x)
+    hits = hits + x
+end
+
+tag_add("ReconTag", "INT", 4)
+tag_write("ReconTag", {0, 0, 0, 0})
+e = event_add("ReconTag[1]", 1, "CHANGE", 0, callback, 1)
+cache_add("ReconTag", 0)
+x = tag_read("ReconTag", 0)
+
+drop_connection()
+--The first call to find out that the connection is gone fails
+if pcall(event_poll) then
+    error("event_poll() didn't see the connection go away")
+end
+
+--This one reconnects
+tag_write("ReconTag[1]", 12)
+x = tag_read("ReconTag", 0)
+if x[2] ~= 12 then error("ReconTag[1] = " .. x[2] .. " after reconnecting") end
+
+--The event was added again for us
+for n=1,10 do
+    if event_poll() == 0 then break end
+end
+if hits ~= 1 then
+    error("Got " .. hits .. " events after reconnecting")
+end
+
+--The old ids still work
+s = cache_stats()
+if s.entries ~= 1 then error("Data cache has " .. s.entries .. " entries") end
+cache_del("ReconTag", 0)
+event_del(e)
+tag_write("ReconTag[1]", 13)
+event_poll()
+if hits ~= 1 then error("Event was not deleted") end
@@ -0,0 +1,49 @@
+--Checks that tag lookups stay correct when there are many more tags
+--being looked up than will fit in the client's tag cache
+
+count = 100
+tags = {}
+
+for n=1,count do
+    name = "CacheTag" .. n
+    tag_add(name, "DINT", n)
+    tags[n] = name
+end
+
+--Lookups by name in an order that keeps the cache turning over
+for pass=1,3 do
+    for n=1,count do
+        i = ((n * 37 + pass) % count) + 1
+        name, type, size = tag_get(tags[i])
+        if name ~= tags[i] or type ~= "DINT" or size ~= i then
+            error("Bad tag returned for " .. tags[i])
+        end
+    end
+end
+
+--Lookups by index should agree with lookups by name
+for idx=0,count*2 do
+    result, name, type, size = pcall(tag_get, idx)
+    if result == true then
+        name2, type2, size2 = tag_get(name)
+        if name2 ~= name or type2 ~= type or size2 ~= size then
+            error("Index lookup for " .. idx .. " doesn't match " .. name)
+        end
+    end
+end
+
+--A few tags that are looked up a lot should stay correct while
+--the rest of the tags go through the cache
+for n=1,count do
+    name, type, size = tag_get(tags[1])
+    if size ~= 1 then error("Hot tag lookup failed") end
+    name, type, size = tag_get(tags[n])
+    if size ~= n then error("Cold tag lookup failed for " .. tags[n]) end
+end
+
+--Resizing a tag has to replace the cached entry
+tag_add(tags[1], "DINT", 200)
+name, type, size = tag_get(tags[1])
+if size ~= 200 then
+    error("Cache returned the old size of a resized tag")
+end
@@ -0,0 +1,20 @@
+--Checks that several threads can use the same connection to the
+--server at once.  thread_test() runs the threads in C and returns
+--the number of reads or writes that went wrong.
+
+tag_add("ThreadTag", "DINT", 16)
+
+for _,n in ipairs({1, 4, 16}) do
+    errors = thread_test("ThreadTag", n, 200)
+    if errors ~= 0 then
+        error(errors .. " errors with " .. n .. " threads")
+    end
+end
+
+--Every element should be left with the last value that it's thread wrote
+x = tag_read("ThreadTag", 0)
+for n=1,16 do
+    if x[n] ~= (n - 1) * 65536 + 199 then
+        error("ThreadTag[" .. (n - 1) .. "] = " .. x[n])
+    end
+end
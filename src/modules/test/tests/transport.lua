@@ -0,0 +1,10 @@
+--Runs the same writes and reads over the plain sockets and over
+--io_uring and compares the times.  The library falls back to the sockets
+--if io_uring can't be used so the errors should be zero either way.
+
+tag_add("TransportDint", "DINT", 1)
+
+errors = transport_bench("TransportDint", 20000)
+if errors ~= 0 then
+    error(errors .. " errors in the transport test")
+end
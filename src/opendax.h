@@ -120,6 +120,12 @@
 #define EVENT_GREATER  0x07 /* Greater Than */
 #define EVENT_LESS     0x08 /* Less Than */
 #define EVENT_DEADBAND 0x09 /* Changed by X amount since last event */
+#define EVENT_TAG_ADDED   0x0A /* A new tag was added - pattern subscriptions only */
+#define EVENT_TAG_DELETED 0x0B /* A tag was deleted - pattern subscriptions only */
+#define EVENT_CDT_CREATED 0x0C /* A new CDT was created - pattern subscriptions only */
+#define EVENT_RISE     0x0D /* Rises above a threshold, rearms below threshold - hysteresis */
+#define EVENT_FALL     0x0E /* Falls below a threshold, rearms above threshold + hysteresis */
+#define EVENT_COMPOUND 0x0F /* A boolean expression over several tags becomes true */
 
 /* Defines the maximum length of a tagname */
 #ifndef DAX_TAGNAME_SIZE
@@ -269,6 +275,10 @@ void dax_fatal(dax_state *ds, const char *format, ...);
 /* Create and destroy connections to the server */
 int dax_connect(dax_state *ds);      /* Connect to the server */
 int dax_disconnect(dax_state *ds);   /* Disconnect from the server */
+/* Called after the library has reconnected to the server on its own.
+ * 'restarted' is true if it's a new server, in which case the tags
+ * and events that the module made may be gone. */
+void dax_set_reconnect(dax_state *ds, void (*reconnect)(dax_state *ds, int restarted));
 
 int dax_mod_get(dax_state *ds, char *modname);  /* Not implemented yet */
 int dax_mod_set(dax_state *ds, u_int8_t cmd, void *param);  /* Set module parameters in the server */
@@ -287,6 +297,58 @@ int dax_tag_byindex(dax_state *ds, dax_tag *tag, tag_index index);
  * items, that we want. */
 int dax_tag_handle(dax_state *ds, Handle *h, char *str, int count);
 
+/* A prepared tag holds the handle and data buffers for a tag so that
+ * the name only has to be parsed once.  Modules that read or write the
+ * same tag over and over should use these.  The handle is figured again
+ * automatically if the server reports that tag definitions have changed. */
+typedef struct dax_prepared dax_prepared;
+
+int dax_tag_prepare(dax_state *ds, dax_prepared **p, char *str, int count);
+int dax_prepared_handle(dax_state *ds, dax_prepared *p, Handle *h);
+void *dax_prepared_data(dax_prepared *p);
+void *dax_prepared_mask(dax_prepared *p);
+int dax_prepared_read(dax_state *ds, dax_prepared *p);
+int dax_prepared_write(dax_state *ds, dax_prepared *p);
+int dax_prepared_mask_write(dax_state *ds, dax_prepared *p);
+void dax_prepared_free(dax_prepared *p);
+
+/* A write batch collects writes so that they can all be sent to the
+ * server in as few messages as possible when dax_batch_flush() is
+ * called.  Writing the same handle twice before the flush only sends
+ * the data once with the later bits on top, unless something that
+ * overlaps it was written in between.  Scan based modules should
+ * use one of these for each scan.  A batch should only be used by one
+ * thread at a time. */
+typedef struct dax_batch dax_batch;
+
+int dax_batch_new(dax_state *ds, dax_batch **b);
+int dax_batch_write(dax_state *ds, dax_batch *b, Handle h, void *data);
+int dax_batch_mask(dax_state *ds, dax_batch *b, Handle h, void *data, void *mask);
+int dax_batch_flush(dax_state *ds, dax_batch *b);
+int dax_batch_count(dax_batch *b);
+void dax_batch_free(dax_batch *b);
+
+/* The data cache keeps the last value that was read through a handle
+ * so that dax_read_tag() can answer without asking the server.  A
+ * CHANGE event is added for each cached handle and the value is thrown
+ * away when the event comes in, so the module has to be dispatching
+ * events.  A value is never used if it's older than the 'cacheage'
+ * attribute in milliseconds. */
+struct dax_cache_stats {
+    u_int32_t hits;          /* Reads that were answered from the cache */
+    u_int32_t misses;        /* Reads of cached handles that went to the server */
+    u_int32_t expired;       /* Misses because the value was too old */
+    u_int32_t invalidations; /* Values thrown away because of changes */
+    u_int32_t entries;       /* Number of handles that are being cached */
+};
+
+typedef struct dax_cache_stats dax_cache_stats;
+
+int dax_cache_add(dax_state *ds, Handle *h);
+int dax_cache_del(dax_state *ds, Handle *h);
+int dax_cache_stats_get(dax_state *ds, dax_cache_stats *stats);
+void dax_cache_stats_reset(dax_state *ds);
+
 /* Returns the size of the datatype in bytes */
 int dax_get_typesize(dax_state *ds, tag_type type);
 
@@ -327,6 +389,12 @@ int dax_mask_tag(dax_state *ds, Handle handle, void *data, void *mask);
 int dax_event_add(dax_state *ds, Handle *handle, int event_type, void *data, 
                   dax_event_id *id, void (*callback)(void *udata), void *udata,
                   void (*free_callback)(void *udata));
+int dax_event_pattern_add(dax_state *ds, char *pattern, tag_type type, int event_type,
+                          dax_event_id *id, void (*callback)(tag_index idx, void *udata),
+                          void *udata, void (*free_callback)(void *udata));
+int dax_event_compound_add(dax_state *ds, char *expression, dax_event_id *id,
+                           void (*callback)(void *udata), void *udata,
+                           void (*free_callback)(void *udata));
 int dax_event_del(dax_state *ds, dax_event_id id);
 int dax_event_get(dax_state *ds, dax_event_id id);
 int dax_event_modify(dax_state *ds, int id);
@@ -334,6 +402,7 @@ int dax_event_wait(dax_state *ds, int timeout, dax_event_id *id);
 int dax_event_poll(dax_state *ds, dax_event_id *id);
 int dax_event_get_fd(dax_state *ds);
 int dax_event_dispatch(dax_state *ds, dax_event_id *id);
+int dax_event_dispatch_batch(dax_state *ds);
 /* Event Utility Functions */
 int dax_event_string_to_type(char *string);
 char *dax_event_type_to_string(int type);
@@ -365,4 +434,28 @@ typedef struct cdt_iter cdt_iter;
 
 int dax_cdt_iter(dax_state *ds, tag_type type, void *udata, void (*callback)(cdt_iter member, void *udata));
 
+/* Flattened conversion plan for a custom datatype.  Nested datatypes and
+ * arrays of them are expanded so that the whole thing can be converted
+ * with a single loop over the list.  Every CDT_OP_ENTER has a matching
+ * CDT_OP_LEAVE.  'name' is NULL for the elements of an array of
+ * datatypes and 'index' is the zero based element number. */
+#define CDT_OP_VALUE 1  /* Base datatype member */
+#define CDT_OP_ENTER 2  /* Start of a CDT member, an array of them or one element */
+#define CDT_OP_LEAVE 3  /* End of the matching CDT_OP_ENTER */
+
+struct dax_cdt_op {
+    u_int8_t op;
+    u_int8_t bit;       /* Starting bit for BOOL values */
+    tag_type type;      /* Datatype of the member */
+    u_int32_t byte;     /* Offset from the start of the datatype */
+    u_int32_t count;    /* Number of items in the member */
+    const char *name;   /* Member name */
+    u_int32_t index;    /* Array index when name is NULL */
+    u_int32_t skip;     /* Position of the matching CDT_OP_LEAVE */
+};
+
+typedef struct dax_cdt_op dax_cdt_op;
+
+int dax_cdt_ops(dax_state *ds, tag_type type, dax_cdt_op **ops, int *count);
+
 #endif /* !__OPENDAX_H */
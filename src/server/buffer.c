@@ -174,6 +174,68 @@ buff_read(int fd)
     return 0;
 }
     
+/* Adds 'len' bytes that have already been read from 'fd' to its buffer
+ * and dispatches every message that is complete.  Unlike buff_read() the
+ * data can hold part of a message or more than one.  A message that is
+ * all there is handled right out of 'data'.  Errors from the message
+ * handlers have already been sent to the module so they are only logged.
+ * Returns an error if the stream doesn't make sense anymore. */
+int
+buff_append(int fd, unsigned char *data, int len)
+{
+    dax_buffnode *node;
+    u_int32_t size;
+    int n, result;
+    
+    while(len > 0) {
+        node = find_buff_slot(fd);
+        if(node == NULL) return ERR_ALLOC;
+        if(node->index == 0 && len >= MSG_HDR_SIZE) {
+            size = ntohl(*(u_int32_t *)data);
+            if(size < MSG_HDR_SIZE || size > DAX_MSGMAX) {
+                buff_free(fd);
+                return ERR_MSG_BAD;
+            }
+            if(size <= len) {
+                result = msg_dispatcher(fd, data);
+                buff_free(fd);
+                if(result < 0) {
+                    xlog(LOG_MSGERR, "Message from fd %d returned %d", fd, result);
+                }
+                data += size;
+                len -= size;
+                continue;
+            }
+        }
+        /* We only want enough to finish the header or the message */
+        if(node->index < MSG_HDR_SIZE) {
+            size = MSG_HDR_SIZE;
+        } else {
+            size = ntohl(*(u_int32_t *)node->buffer);
+        }
+        n = size - node->index;
+        if(n > len) n = len;
+        memcpy(&node->buffer[node->index], data, n);
+        node->index += n;
+        data += n;
+        len -= n;
+        if(node->index < MSG_HDR_SIZE) continue;
+        size = ntohl(*(u_int32_t *)node->buffer);
+        if(size < MSG_HDR_SIZE || size > DAX_MSGMAX) {
+            buff_free(fd);
+            return ERR_MSG_BAD;
+        }
+        if(node->index == size) {
+            result = msg_dispatcher(fd, node->buffer);
+            buff_free(fd);
+            if(result < 0) {
+                xlog(LOG_MSGERR, "Message from fd %d returned %d", fd, result);
+            }
+        }
+    }
+    return 0;
+}
+
 /* TODO: Check boundary conditions where min_buffers = 0 or 1.  Shouldn't
    be able to equal 0 but try to break it. */
 
@@ -0,0 +1,173 @@
+/*  OpenDAX - An open source data acquisition and control system 
+ *  Copyright (c) 2007 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ 
+ * This is the program that reads the binary trace files that are written
+ * by the tagserver and the modules.  The records from all of the files
+ * given on the command line are merged and printed in time order.
+ */
+
+#include <common.h>
+#include <trace.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+typedef struct {
+    dax_trace_rec rec;
+    char *name;
+    u_int32_t thread;
+} _trace_line;
+
+/* Names and formats for the trace points, in the order of the defines */
+static const char *_trace_names[TRACE_COUNT] = {
+    "TAG_ADD", "TAG_WRITE", "TAG_MWRITE", "EVENT_HIT", "EVENT_MISS",
+    "MB_READ_REG", "MB_WRITE_REG"
+};
+
+static const char *_trace_formats[TRACE_COUNT] = {
+    "index=%u type=0x%X count=%u",
+    "index=%u offset=%u size=%u",
+    "index=%u offset=%u size=%u",
+    "index=%u id=%u offset=%u size=%u fired=%u",
+    "index=%u id=%u offset=%u size=%u",
+    "regtype=%u index=%u count=%u",
+    "regtype=%u index=%u count=%u"
+};
+
+static _trace_line *_lines = NULL;
+static int _linecount = 0;
+static int _linesize = 0;
+
+static void
+_usage(void)
+{
+    fprintf(stderr, "Usage: daxtrace [-n count] tracefile ...\n");
+    fprintf(stderr, "  -n count   Only print the last 'count' records\n");
+}
+
+/* Copies the valid records from the trace file into the _lines array */
+static int
+_read_trace(char *filename)
+{
+    dax_trace_hdr *hdr;
+    dax_trace_rec *recs;
+    struct stat st;
+    void *map;
+    u_int64_t head, n, first;
+    int fd;
+    
+    fd = open(filename, O_RDONLY);
+    if(fd < 0) {
+        fprintf(stderr, "Unable to open %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+    if(fstat(fd, &st) || st.st_size < sizeof(dax_trace_hdr)) {
+        fprintf(stderr, "%s is not a trace file\n", filename);
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) {
+        fprintf(stderr, "Unable to map %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+    hdr = (dax_trace_hdr *)map;
+    if(hdr->magic != TRACE_MAGIC || hdr->version != TRACE_VERSION ||
+       st.st_size < sizeof(dax_trace_hdr) + hdr->size * sizeof(dax_trace_rec)) {
+        fprintf(stderr, "%s is not a trace file\n", filename);
+        munmap(map, st.st_size);
+        return -1;
+    }
+    recs = (dax_trace_rec *)(hdr + 1);
+    /* The writer may still be running.  We skip the oldest part of the
+     * ring since that is where it will be writing next. */
+    head = hdr->head;
+    first = (head > hdr->size) ? head - hdr->size + 16 : 0;
+    for(n = first; n < head; n++) {
+        if(_linecount == _linesize) {
+            _linesize = _linesize ? _linesize * 2 : 1024;
+            _lines = realloc(_lines, _linesize * sizeof(_trace_line));
+            if(_lines == NULL) {
+                fprintf(stderr, "Unable to allocate memory\n");
+                exit(-1);
+            }
+        }
+        _lines[_linecount].rec = recs[n & (hdr->size - 1)];
+        _lines[_linecount].name = strdup(hdr->name);
+        _lines[_linecount].thread = hdr->thread;
+        _linecount++;
+    }
+    munmap(map, st.st_size);
+    return 0;
+}
+
+static int
+_compare_lines(const void *a, const void *b)
+{
+    const _trace_line *la = a, *lb = b;
+    
+    if(la->rec.time < lb->rec.time) return -1;
+    if(la->rec.time > lb->rec.time) return 1;
+    return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int n, opt, last = 0;
+    u_int64_t start;
+    dax_trace_rec *rec;
+    
+    while((opt = getopt(argc, argv, "n:h")) != -1) {
+        switch(opt) {
+            case 'n':
+                last = strtol(optarg, NULL, 0);
+                break;
+            default:
+                _usage();
+                return -1;
+        }
+    }
+    if(optind >= argc) {
+        _usage();
+        return -1;
+    }
+    for(n = optind; n < argc; n++) {
+        _read_trace(argv[n]);
+    }
+    if(_linecount == 0) return 0;
+    
+    qsort(_lines, _linecount, sizeof(_trace_line), _compare_lines);
+    n = (last > 0 && last < _linecount) ? _linecount - last : 0;
+    start = _lines[n].rec.time;
+    for(; n < _linecount; n++) {
+        rec = &_lines[n].rec;
+        printf("%12.3f %s:%u ", (rec->time - start) / 1000.0,
+               _lines[n].name, _lines[n].thread);
+        if(rec->id < TRACE_COUNT) {
+            printf("%-12s ", _trace_names[rec->id]);
+            printf(_trace_formats[rec->id], rec->arg[0], rec->arg[1],
+                   rec->arg[2], rec->arg[3], rec->arg[4]);
+        } else {
+            printf("%-12u %u %u %u %u %u", rec->id, rec->arg[0], rec->arg[1],
+                   rec->arg[2], rec->arg[3], rec->arg[4]);
+        }
+        printf("\n");
+    }
+    return 0;
+}
@@ -40,9 +40,17 @@ typedef struct dax_Module {
     unsigned int state; /* Modules Current Running State */
     int fd;             /* The socket file descriptor for this module */
     int efd;            /* The notification file descriptor */
+    int *pool;          /* Extra synchronous sockets opened by the module's threads */
+    int pool_count;
+    int pool_size;
     u_int32_t timeout;  /* Module communication timeout. */
     time_t starttime;
     int event_count;
+    char *equeue;       /* Event messages waiting to be sent to the module */
+    int equeue_size;    /* Allocated size of the event queue */
+    int equeue_len;     /* Bytes waiting in the event queue */
+    unsigned int eflush_count; /* Number of times the event queue has been sent */
+    struct dax_Module *enext;  /* Next module with queued events */
     struct dax_Module *next, *prev;
 } dax_module;
 
@@ -20,7 +20,10 @@
 
 #include <common.h>
 #include <tagbase.h>
+#include <message.h>
+#include <module.h>
 #include <func.h>
+#include <trace.h>
 #include <ctype.h>
 #include <assert.h>
 
@@ -28,25 +31,116 @@ pthread_mutex_t _event_lock;
 
 extern _dax_tag_db *_db;
 
+/* Node in the prefix trie.  Children are kept as a simple linked list
+ * since tag names only use a handful of different characters. */
+typedef struct pattern_node {
+    char c;
+    struct pattern_node *child;
+    struct pattern_node *sibling;
+    _dax_pattern *prefix;    /* Patterns that match names that start here */
+    _dax_pattern *exact;     /* Patterns that match names that end here */
+} _pattern_node;
+
+static _pattern_node _pattern_root;
+static _dax_pattern *_patterns = NULL;  /* List of all the patterns */
+static int _nextpattern = 0;
+
+static _dax_compound *_compounds = NULL; /* List of all the compound events */
+static int _nextcompound = 0;
+
+/* Once a module has this much queued we send it even if we are still
+ * inside of a transaction */
+#ifndef EVENT_QUEUE_MAX
+#  define EVENT_QUEUE_MAX (EVENT_MSGSIZE * 1024)
+#endif
+
+static int _trans_depth = 0;               /* Transaction nesting level */
+static dax_module *_trans_modules = NULL;  /* Modules with queued events */
+
 /* Private function definitions */
 
+/* Removes the module from the list of modules that have events queued */
+static void
+_event_unlink(dax_module *module)
+{
+    dax_module **last;
+    
+    for(last = &_trans_modules; *last != NULL; last = &(*last)->enext) {
+        if(*last == module) {
+            *last = module->enext;
+            return;
+        }
+    }
+}
+
+/* Sends everything that is in the module's event queue with a single
+ * write and removes the module from the list of modules that have
+ * something queued. */
+static void
+_event_flush(dax_module *module)
+{
+    if(module->equeue_len > 0) {
+        _event_unlink(module);
+        xlog(LOG_MSG, "Sending %d queued events to module %d",
+             module->equeue_len / EVENT_MSGSIZE, module->efd);
+        if(msg_write(module->efd, module->equeue, module->equeue_len) < 0) {
+            xerror("_event_flush: %s", strerror(errno));
+        }
+        module->equeue_len = 0;
+    }
+    module->eflush_count++;
+}
+
+/* Adds the event message to the module's queue.  Returns non zero if
+ * the message could not be queued. */
 static int
-_send_event(tag_index idx, _dax_event *event)
+_event_queue(dax_module *module, char *buff)
+{
+    char *new;
+    int size;
+    
+    if(module->equeue_len + EVENT_MSGSIZE > module->equeue_size) {
+        if(module->equeue_size >= EVENT_QUEUE_MAX) {
+            _event_flush(module);
+        } else {
+            size = module->equeue_size ? module->equeue_size * 2 : EVENT_MSGSIZE * 16;
+            new = realloc(module->equeue, size);
+            if(new == NULL) return ERR_ALLOC;
+            module->equeue = new;
+            module->equeue_size = size;
+        }
+    }
+    if(module->equeue_len == 0) {
+        module->enext = _trans_modules;
+        _trans_modules = module;
+    }
+    memcpy(&module->equeue[module->equeue_len], buff, EVENT_MSGSIZE);
+    module->equeue_len += EVENT_MSGSIZE;
+    return 0;
+}
+
+/* Builds the event message and sends it to the module.  If we are inside
+ * of a transaction the message is queued instead. */
+static int
+_send_event_message(dax_module *module, int eventtype, u_int32_t idx, u_int32_t id,
+                    u_int32_t byte, u_int32_t count, u_int32_t datatype, u_int8_t bit)
 {
     int result;
     char buff[EVENT_MSGSIZE];
     
-    *(u_int32_t *)(&buff[0])  = htonl(event->eventtype);
+    *(u_int32_t *)(&buff[0])  = htonl(eventtype);
     *(u_int32_t *)(&buff[4])  = htonl(idx);
-    *(u_int32_t *)(&buff[8])  = htonl(event->id);
-    *(u_int32_t *)(&buff[12]) = htonl(event->byte);
-    *(u_int32_t *)(&buff[16]) = htonl(event->count);
-    *(u_int32_t *)(&buff[20]) = htonl(event->datatype);
-    *(u_int8_t *)(&buff[24])  = event->bit;
-    
-    xlog(LOG_MSG, "Sending %d event to module %d",
-         event->eventtype, event->notify->efd);
-    result = xwrite(event->notify->efd, buff, EVENT_MSGSIZE);
+    *(u_int32_t *)(&buff[8])  = htonl(id);
+    *(u_int32_t *)(&buff[12]) = htonl(byte);
+    *(u_int32_t *)(&buff[16]) = htonl(count);
+    *(u_int32_t *)(&buff[20]) = htonl(datatype);
+    *(u_int8_t *)(&buff[24])  = bit;
+    
+    if(_trans_depth > 0 && _event_queue(module, buff) == 0) {
+        return 0;
+    }
+    xlog(LOG_MSG, "Sending %d event to module %d", eventtype, module->efd);
+    result = msg_write(module->efd, buff, EVENT_MSGSIZE);
     if(result < 0) {
         xerror("_send_event: %s", strerror(errno));
         return ERR_MSG_SEND;
@@ -54,6 +148,70 @@ _send_event(tag_index idx, _dax_event *event)
     return 0;    
 }
 
+static int
+_send_event(tag_index idx, _dax_event *event)
+{
+    u_int32_t id;
+    int result;
+    
+    /* If this event is still waiting in the module's queue from earlier
+     * in the transaction we don't need to send it again */
+    if(_trans_depth > 0 && event->queued == event->notify->eflush_count + 1) {
+        return 0;
+    }
+    /* Events that belong to a pattern subscription are identified to
+     * the module by the pattern id instead of their own */
+    if(event->pattern != NULL) {
+        id = event->pattern->id | EVENT_PATTERN_FLAG;
+    } else {
+        id = event->id;
+    }
+    result = _send_event_message(event->notify, event->eventtype, idx, id,
+                                 event->byte, event->count, event->datatype, event->bit);
+    event->queued = event->notify->eflush_count + 1;
+    return result;
+}
+
+/* Event transactions.  Between event_transaction_begin() and
+ * event_transaction_end() event messages are queued for each module
+ * instead of being written to the socket right away.  An event that
+ * fires more than once is only queued once.  When the outermost
+ * transaction ends each module gets all of its events in a single
+ * write.  Transactions can be nested. */
+void
+event_transaction_begin(void)
+{
+    _trans_depth++;
+}
+
+void
+event_transaction_end(void)
+{
+    if(_trans_depth == 0) return;
+    _trans_depth--;
+    if(_trans_depth == 0) {
+        while(_trans_modules != NULL) {
+            _event_flush(_trans_modules);
+        }
+    }
+}
+
+/* Sends any events that are queued for the module that is connected to
+ * the given command socket.  This is called before a response is sent to
+ * a module so that it will see the events that its own message caused.
+ * The socket can be the module's main one or one from its pool. */
+void
+event_flush_fd(int fd)
+{
+    dax_module *module;
+    
+    if(_trans_modules == NULL) return;
+    module = module_find_fd(fd);
+    if(module != NULL && module->equeue_len > 0) {
+        _event_flush(module);
+    }
+}
+
 static inline int
 _event_change(_dax_event *event, tag_index idx, int offset, int size) {
     int bit, n, i, len, result;
@@ -356,6 +514,81 @@ _event_deadband(_dax_event *event, tag_index idx, int offset, int size) {
 
 
 
+/* Converts the value at *data to an LREAL so that edge events and compound
+ * events can do their arithmetic with one set of code.  64 bit integers
+ * larger than 2^53 will lose some precision. */
+static inline dax_lreal
+_generic_lreal(tag_type datatype, void *data) {
+    switch(datatype) {
+        case DAX_BYTE:
+            return *(dax_byte *)data;
+        case DAX_SINT:
+            return *(dax_sint *)data;
+        case DAX_UINT:
+        case DAX_WORD:
+            return *(dax_uint *)data;
+        case DAX_INT:
+            return *(dax_int *)data;
+        case DAX_UDINT:
+        case DAX_DWORD:
+        case DAX_TIME:
+            return *(dax_udint *)data;
+        case DAX_DINT:
+            return *(dax_dint *)data;
+        case DAX_ULINT:
+        case DAX_LWORD:
+            return *(dax_ulint *)data;
+        case DAX_LINT:
+            return *(dax_lint *)data;
+        case DAX_REAL:
+            return *(dax_real *)data;
+        case DAX_LREAL:
+            return *(dax_lreal *)data;
+    }
+    assert(0); /* Something is seriously wrong if we get here */
+    return 0.0;
+}
+
+/* Rising and falling edge events with hysteresis.  *data holds the
+ * threshold followed by the hysteresis.  'test' is a bit field that
+ * is set when the event has fired for that element.  It is cleared
+ * again once the value has moved back past the threshold by more than
+ * the hysteresis so noise around the threshold doesn't cause a storm
+ * of events. */
+static int
+_event_edge(_dax_event *event, tag_index idx, int offset, int size, int rise) {
+    int n, inc, bit, len, result;
+    u_int8_t *this, *that;
+    u_int8_t mask;
+    dax_lreal x, threshold, hysteresis;
+    result = 0;
+
+    inc = TYPESIZE(event->datatype) / 8;
+    threshold = _generic_lreal(event->datatype, event->data);
+    hysteresis = _generic_lreal(event->datatype, (u_int8_t *)event->data + inc);
+    bit = MAX(0, (offset - event->byte) / inc);
+    this = (u_int8_t *)event->test;
+    that = (u_int8_t *)&(_db[idx].data[MAX(offset, event->byte)]);
+    len = MIN(event->byte + event->size, offset + size) - MAX(offset, event->byte);
+    for(n = 0; n < len; n += inc) {
+        mask = 0x01<<(bit%8);
+        x = _generic_lreal(event->datatype, &(that[n]));
+        if(!(this[bit/8] & mask)) {
+            if((rise && x > threshold) || (!rise && x < threshold)) {
+                this[bit/8] |= mask;
+                result = 1;
+            }
+        } else {
+            if((rise && x <= threshold - hysteresis) ||
+               (!rise && x >= threshold + hysteresis)) {
+                this[bit/8] &= ~mask; /* Rearm the event */
+            }
+        }
+        bit++;
+    }
+    return result;
+}
+
 /* This function is called when the area of data is affected by the write
  * and it determines whether the event should fire or not.  Return 1 if the
  * event hits and 0 otherwise.  There are no errors */
@@ -378,10 +611,16 @@ _event_hit(_dax_event *event, tag_index idx, int offset, int size) {
             return _event_compare(event, idx, offset, size, 1);
         case EVENT_DEADBAND:
             return _event_deadband(event, idx, offset, size);
+        case EVENT_RISE:
+            return _event_edge(event, idx, offset, size, 1);
+        case EVENT_FALL:
+            return _event_edge(event, idx, offset, size, 0);
     }
     return 0;
 }
 
+static void _compound_update(_dax_compound *compound, _dax_event *event, tag_index idx);
+
 /* This function checks to see if an event has occurred.  It should be
  * called from the tag_write() function or the tag_mask_write() function.
  * If it decides that there is an event match to the data area given then
@@ -395,25 +634,32 @@ _event_hit(_dax_event *event, tag_index idx, int offset, int size) {
 void
 event_check(tag_index idx, int offset, int size) {
     _dax_event *this;
+    int hit;
     
-    //fprintf(stderr, "Event Check Called: idx = %d, offset = %d, size = %d\n",idx, offset, size);
     this = _db[idx].events;
-
+    if(this == NULL) return;
+    
+    event_transaction_begin();
     while(this != NULL) {
-        //fprintf(stderr, "Checking Event Index %d, ID %d\n", idx, this->id);
         /* This is to check whether the the data rages intersect.  If this
          * test passes then we have manipulated the data associated with
          * this event. */
         if(offset <= (this->byte + this->size - 1) && (offset + size -1 ) >= this->byte) {
-            fprintf(stderr, "Event Hit offset = %d, size = %d, event.byte = %d, event.size = %d\n",offset, size, this->byte, this->size);
-            if(_event_hit(this, idx, offset, size)) {
-                _send_event(idx, this);
+            hit = _event_hit(this, idx, offset, size);
+            DAX_TRACE(TRACE_EVENT_HIT, idx, this->id, offset, size, hit);
+            if(hit) {
+                if(this->compound != NULL) {
+                    _compound_update(this->compound, this, idx);
+                } else {
+                    _send_event(idx, this);
+                }
             }
         } else {
-            fprintf(stderr, "Event Miss offset = %d, size = %d, event.byte = %d, event.size = %d\n",offset, size, this->byte, this->size);
+            DAX_TRACE(TRACE_EVENT_MISS, idx, this->id, offset, size, 0);
         }
         this = this->next;
     }
+    event_transaction_end();
     return;
 }
 
@@ -443,10 +689,20 @@ _verify_event_type(tag_type ttype, int etype)
             return 0;
         }
     }
-    /* At this point the only ones left are < > and deadband.  All
-     * except Booleans and Custom datatypes can use these */
+    /* These only make sense for pattern subscriptions */
+    if(etype == EVENT_TAG_ADDED || etype == EVENT_TAG_DELETED || etype == EVENT_CDT_CREATED) {
+        xlog(LOG_ERROR, "TAG_ADDED, TAG_DELETED and CDT_CREATED events are only allowed for pattern subscriptions");
+        return -1;
+    }
+    /* Compound events are not attached to a single tag */
+    if(etype == EVENT_COMPOUND) {
+        xlog(LOG_ERROR, "COMPOUND events must be added with an expression");
+        return -1;
+    }
+    /* At this point the only ones left are < >, rise, fall and deadband.
+     * All except Booleans and Custom datatypes can use these */
     if(ttype == DAX_BOOL || ttype >= DAX_CUSTOM) {
-        xlog(LOG_ERROR, "GREATER, LESS and DEADBAND events not allowed for BOOL and Custom types");
+        xlog(LOG_ERROR, "GREATER, LESS, RISE, FALL and DEADBAND events not allowed for BOOL and Custom types");
         return -1;
     } else {
         return 0;
@@ -498,6 +754,12 @@ _set_event_data(_dax_event *event, tag_index index, void *data) {
             datasize = type_size(event->datatype);
             testsize = (event->count - 1)/8 + 1;
             break;
+        case EVENT_RISE:
+        case EVENT_FALL:
+            /* Threshold and hysteresis */
+            datasize = type_size(event->datatype) * 2;
+            testsize = (event->count - 1)/8 + 1;
+            break;
     }
     /* Allocate the memory that we need */
     if(datasize > 0) {
@@ -542,6 +804,14 @@ _set_event_data(_dax_event *event, tag_index index, void *data) {
             memcpy(event->data, data, datasize);
             bzero(event->test, testsize);
             break;
+        case EVENT_RISE:
+        case EVENT_FALL:
+            /* Elements that are already past the threshold won't fire
+             * until they have been rearmed */
+            memcpy(event->data, data, datasize);
+            bzero(event->test, testsize);
+            _event_edge(event, index, event->byte, event->size, event->eventtype == EVENT_RISE);
+            break;
     }
 
     
@@ -621,61 +891,787 @@ _free_event(_dax_event *event) {
 int
 event_del(int index, int id, dax_module *module)
 {
-    _dax_event *this, *last;
-    int result = ERR_NOTFOUND;
+    _dax_event *this, *last = NULL;
     
     if(index >= tag_get_count() || index < 0) {
         xerror("event_del() - index %d is out of range\n", index);
+        return ERR_ARG;
     }
     this = _db[index].events;
-    if(this == NULL) return ERR_NOTFOUND;
-    if(this->id == id) {
-        if(this->notify != module) {
-            xlog(LOG_ERROR | LOG_VERBOSE, "Module cannot delete another module's event");
-            return ERR_AUTH;
-        }
-        _db[index].events = this->next;
-        _free_event(this);
-    }
-    last = this;
-    this = this->next;
     while(this != NULL) {
-        if(this->id == id) {
+        /* Events that were attached by a pattern subscription or a
+         * compound event are removed along with them */
+        if(this->id == id && this->pattern == NULL && this->compound == NULL) {
             if(this->notify != module) {
                 xlog(LOG_ERROR | LOG_VERBOSE, "Module cannot delete another module's event");
                 return ERR_AUTH;
             }
-            last->next = this->next;
+            if(last == NULL) {
+                _db[index].events = this->next;
+            } else {
+                last->next = this->next;
+            }
             _free_event(this);
-            result = 0;
-            break; /* Uggg */
+            module->event_count--;
+            return 0;
         }
         last = this;
         this = this->next;
     }
-    module->event_count--;
-    return result;
+    return ERR_NOTFOUND;
 }
 
 int
 events_cleanup(dax_module *module) {
     int n, count;
-    _dax_event *this;
+    _dax_event *this, *next;
+    _dax_pattern *pattern, *pnext;
+    _dax_compound *compound, *cnext;
 
+    /* Nothing that is queued can be sent to the module now */
+    if(module->equeue_len > 0) {
+        _event_unlink(module);
+        module->equeue_len = 0;
+    }
+    if(module->equeue != NULL) {
+        free(module->equeue);
+        module->equeue = NULL;
+        module->equeue_size = 0;
+    }
+    /* Deleting the patterns also deletes the events that they attached */
+    pattern = _patterns;
+    while(pattern != NULL) {
+        pnext = pattern->lnext;
+        if(pattern->notify == module) {
+            event_pattern_del(pattern->id, module);
+        }
+        pattern = pnext;
+    }
+    compound = _compounds;
+    while(compound != NULL) {
+        cnext = compound->next;
+        if(compound->notify == module) {
+            event_compound_del(compound->id, module);
+        }
+        compound = cnext;
+    }
     count = tag_get_count();
     /* We start our scan at the bottom and work our way up.  It's probably
      * more likely that our modules events are associated with tags at the
      * bottom of the list.  This should prove more efficient */
     for(n = count-1; n >= 0 && module->event_count > 0; n--) {
-        if(_db[n].events != NULL) {
-            this = _db[n].events;
-            while(this != NULL) {
-                if(this->notify == module) {
-                    event_del(n, this->id, module);
-                }
-                this = this->next;
+        this = _db[n].events;
+        while(this != NULL) {
+            next = this->next;
+            if(this->notify == module) {
+                event_del(n, this->id, module);
+            }
+            this = next;
+        }
+    }
+    return 0;
+}
+
+/* Pattern subscriptions.  A module can ask to be notified about every tag
+ * whose name matches a pattern like "Line3_*" and/or every tag of a given
+ * datatype.  The patterns are kept in a prefix trie keyed on the name.
+ * Matching is only done when the subscription is added and when a new tag
+ * is created.  Each match attaches an ordinary event to the tag so writes
+ * don't pay anything more than they would for a normal event. */
+
+/* Returns the child of 'node' for the character 'c'.  If 'create' is
+ * true the child will be created if it doesn't exist. */
+static _pattern_node *
+_pattern_child(_pattern_node *node, char c, int create)
+{
+    _pattern_node *this;
+    
+    for(this = node->child; this != NULL; this = this->sibling) {
+        if(this->c == c) return this;
+    }
+    if(!create) return NULL;
+    this = xmalloc(sizeof(_pattern_node));
+    if(this == NULL) return NULL;
+    this->c = c;
+    this->sibling = node->child;
+    node->child = this;
+    return this;
+}
+
+static _pattern_node *
+_pattern_find_node(char *name, int create)
+{
+    _pattern_node *node = &_pattern_root;
+    
+    while(*name != '\0' && node != NULL) {
+        node = _pattern_child(node, *name, create);
+        name++;
+    }
+    return node;
+}
+
+/* Frees the nodes along the path of 'name' below 'node' that no longer
+ * have any patterns or children of their own. */
+static void
+_pattern_prune(_pattern_node *node, char *name)
+{
+    _pattern_node *child, **last;
+
+    if(*name == '\0') return;
+    last = &node->child;
+    while(*last != NULL && (*last)->c != *name) {
+        last = &(*last)->sibling;
+    }
+    child = *last;
+    if(child == NULL) return;
+    _pattern_prune(child, name + 1);
+    if(child->child == NULL && child->prefix == NULL && child->exact == NULL) {
+        *last = child->sibling;
+        free(child);
+    }
+}
+
+/* Removes 'pattern' from the linked list that starts at *head */
+static void
+_pattern_unlink(_dax_pattern **head, _dax_pattern *pattern)
+{
+    while(*head != NULL) {
+        if(*head == pattern) {
+            *head = pattern->next;
+            return;
+        }
+        head = &(*head)->next;
+    }
+}
+
+/* Adds an event to the tag given by idx that covers the entire tag and
+ * belongs to the pattern subscription. */
+static int
+_pattern_attach(_dax_pattern *pattern, tag_index idx)
+{
+    _dax_event *new;
+    int result;
+    
+    new = xmalloc(sizeof(_dax_event));
+    if(new == NULL) {
+        xerror("Unable to allocate memory for pattern event on tag %s", _db[idx].name);
+        return ERR_ALLOC;
+    }
+    new->id = _db[idx].nextevent++;
+    new->byte = 0;
+    new->bit = 0;
+    new->count = _db[idx].count;
+    new->size = tag_get_size(idx);
+    new->datatype = _db[idx].type;
+    new->eventtype = pattern->eventtype;
+    new->notify = pattern->notify;
+    new->pattern = pattern;
+    result = _set_event_data(new, idx, NULL);
+    if(result) {
+        free(new);
+        return result;
+    }
+    new->next = _db[idx].events;
+    _db[idx].events = new;
+    return 0;
+}
+
+/* Sends a tag added, tag deleted or CDT created notification for the
+ * pattern subscription.  For CDT events 'idx' is the new datatype. */
+static int
+_pattern_notify(_dax_pattern *pattern, u_int32_t idx)
+{
+    u_int32_t id;
+    
+    id = pattern->id | EVENT_PATTERN_FLAG;
+    if(pattern->eventtype == EVENT_CDT_CREATED) {
+        return _send_event_message(pattern->notify, pattern->eventtype, idx, id, 0, 0, idx, 0);
+    } else {
+        return _send_event_message(pattern->notify, pattern->eventtype, idx, id,
+                                   0, _db[idx].count, _db[idx].type, 0);
+    }
+}
+
+/* Handles every pattern in the list that matches 'type'.  When a tag is
+ * added the WRITE and CHANGE patterns are attached to it as well as
+ * sending the TAG_ADDED notifications. */
+static void
+_pattern_list_hit(_dax_pattern *pattern, int eventtype, tag_type type, u_int32_t idx)
+{
+    while(pattern != NULL) {
+        /* The type filter doesn't mean anything for CDT notifications */
+        if(eventtype == EVENT_CDT_CREATED || pattern->type == 0 || pattern->type == type) {
+            if(pattern->eventtype == eventtype) {
+                _pattern_notify(pattern, idx);
+            } else if(eventtype == EVENT_TAG_ADDED &&
+                      (pattern->eventtype == EVENT_WRITE || pattern->eventtype == EVENT_CHANGE)) {
+                _pattern_attach(pattern, idx);
             }
         }
+        pattern = pattern->next;
     }
+}
+
+/* Walks the trie along 'name' and handles every pattern that matches */
+static void
+_pattern_walk(char *name, int eventtype, tag_type type, u_int32_t idx)
+{
+    _pattern_node *node = &_pattern_root;
+    
+    while(node != NULL) {
+        _pattern_list_hit(node->prefix, eventtype, type, idx);
+        if(*name == '\0') {
+            _pattern_list_hit(node->exact, eventtype, type, idx);
+            break;
+        }
+        node = _pattern_child(node, *name, 0);
+        name++;
+    }
+}
+
+/* This is called from tag_add() when a new tag is created.  It attaches
+ * every matching WRITE or CHANGE pattern to the new tag and notifies
+ * the modules that asked to know about new tags. */
+void
+event_tag_added(tag_index idx)
+{
+    _pattern_walk(_db[idx].name, EVENT_TAG_ADDED, _db[idx].type, idx);
+}
+
+/* Removes the events that pattern subscriptions attached to the tag.
+ * They are attached again by event_tag_added() if the tag comes back. */
+static void
+_pattern_detach(tag_index idx)
+{
+    _dax_event *this, **last;
+
+    last = &_db[idx].events;
+    this = _db[idx].events;
+    while(this != NULL) {
+        if(this->pattern != NULL) {
+            *last = this->next;
+            _free_event(this);
+        } else {
+            last = &this->next;
+        }
+        this = *last;
+    }
+}
+
+/* This should be called before a tag is removed from the database.  It's
+ * also called when a tag is resized so the pattern events have to go or
+ * they would be attached twice, the old ones with the old size. */
+void
+event_tag_deleted(tag_index idx)
+{
+    _pattern_detach(idx);
+    _pattern_walk(_db[idx].name, EVENT_TAG_DELETED, _db[idx].type, idx);
+}
+
+/* This is called from cdt_create() when a new datatype is created.  The
+ * pattern is matched against the name of the datatype. */
+void
+event_cdt_created(tag_type type, char *name)
+{
+    _pattern_walk(name, EVENT_CDT_CREATED, type, type);
+}
+
+/* Add a pattern subscription.  'pattern' is either a tag name or the
+ * beginning of a tag name followed by a '*'.  An empty pattern or "*"
+ * matches every tag.  If 'type' is not zero only tags of that datatype
+ * will match.  WRITE and CHANGE events always cover the entire tag.
+ * TAG_ADDED, TAG_DELETED and CDT_CREATED events notify the module when
+ * the tag set changes and CDT_CREATED patterns are matched against the
+ * name of the datatype.  Returns the id of the pattern. */
+int
+event_pattern_add(char *pattern, tag_type type, int event_type, dax_module *module)
+{
+    _dax_pattern *new;
+    _pattern_node *node;
+    int n, len, count;
+    
+    switch(event_type) {
+        case EVENT_WRITE:
+        case EVENT_CHANGE:
+        case EVENT_TAG_ADDED:
+        case EVENT_TAG_DELETED:
+        case EVENT_CDT_CREATED:
+            break;
+        default:
+            xlog(LOG_ERROR, "Event type %d is not allowed for pattern subscriptions", event_type);
+            return ERR_ARG;
+    }
+    len = strlen(pattern);
+    if(len > DAX_TAGNAME_SIZE + 1) {
+        return ERR_2BIG;
+    }
+    for(n = 0; n < len - 1; n++) {
+        if(pattern[n] == '*') {
+            xlog(LOG_ERROR, "Wildcard is only allowed at the end of the pattern %s", pattern);
+            return ERR_ARG;
+        }
+    }
+    new = xmalloc(sizeof(_dax_pattern));
+    if(new == NULL) {
+        xerror("event_pattern_add() - Unable to allocate memory for new pattern");
+        return ERR_ALLOC;
+    }
+    new->name = strdup(pattern);
+    if(new->name == NULL) {
+        free(new);
+        return ERR_ALLOC;
+    }
+    if(len == 0 || new->name[len - 1] == '*') {
+        new->prefix = 1;
+        if(len > 0) new->name[len - 1] = '\0';
+    }
+    node = _pattern_find_node(new->name, 1);
+    if(node == NULL) {
+        free(new->name);
+        free(new);
+        return ERR_ALLOC;
+    }
+    new->id = _nextpattern++;
+    new->type = type;
+    new->eventtype = event_type;
+    new->notify = module;
+    if(new->prefix) {
+        new->next = node->prefix;
+        node->prefix = new;
+    } else {
+        new->next = node->exact;
+        node->exact = new;
+    }
+    new->lnext = _patterns;
+    _patterns = new;
+    
+    /* Attach it to all of the tags that already exist */
+    len = strlen(new->name);
+    count = tag_get_count();
+    if(event_type != EVENT_WRITE && event_type != EVENT_CHANGE) count = 0;
+    for(n = 0; n < count; n++) {
+        if(type != 0 && type != _db[n].type) continue;
+        if(new->prefix) {
+            if(strncmp(new->name, _db[n].name, len)) continue;
+        } else {
+            if(strcmp(new->name, _db[n].name)) continue;
+        }
+        _pattern_attach(new, n);
+    }
+    module->event_count++;
+    return new->id;
+}
+
+/* Deletes the pattern subscription and every event that it attached */
+int
+event_pattern_del(int id, dax_module *module)
+{
+    _dax_pattern *pattern, **last;
+    _pattern_node *node;
+    _dax_event *this, **elast;
+    int n, count;
+    
+    last = &_patterns;
+    for(pattern = _patterns; pattern != NULL; pattern = pattern->lnext) {
+        if(pattern->id == id) break;
+        last = &pattern->lnext;
+    }
+    if(pattern == NULL) return ERR_NOTFOUND;
+    if(pattern->notify != module) {
+        xlog(LOG_ERROR | LOG_VERBOSE, "Module cannot delete another module's pattern");
+        return ERR_AUTH;
+    }
+    *last = pattern->lnext;
+    node = _pattern_find_node(pattern->name, 0);
+    assert(node != NULL);
+    if(pattern->prefix) {
+        _pattern_unlink(&node->prefix, pattern);
+    } else {
+        _pattern_unlink(&node->exact, pattern);
+    }
+    _pattern_prune(&_pattern_root, pattern->name);
+    
+    count = tag_get_count();
+    for(n = 0; n < count; n++) {
+        elast = &_db[n].events;
+        this = _db[n].events;
+        while(this != NULL) {
+            if(this->pattern == pattern) {
+                *elast = this->next;
+                _free_event(this);
+            } else {
+                elast = &this->next;
+            }
+            this = *elast;
+        }
+    }
+    free(pattern->name);
+    free(pattern);
+    module->event_count--;
+    return 0;
+}
+
+/* Compound events.  The expression is a small boolean expression over
+ * tag elements like "Run && !Fault[2] || (Level > 80.5 && Pump)".  Each
+ * tag reference is either tested for non zero or compared to a number
+ * with ==, !=, <, <=, > or >=.  The expression is compiled into postfix
+ * operations and a CHANGE event is attached to each element that it
+ * references.  When one of those fires only that input is evaluated
+ * again and the module is notified when the whole expression goes from
+ * false to true. */
+
+/* Operations in the compiled expression.  Non negative operations are
+ * the index of an input. */
+#define OP_AND -1
+#define OP_OR  -2
+#define OP_NOT -3
+
+/* Comparison operators for the inputs */
+#define CMP_NONZERO 0
+#define CMP_EQ      1
+#define CMP_NE      2
+#define CMP_LT      3
+#define CMP_LE      4
+#define CMP_GT      5
+#define CMP_GE      6
+
+static int _compound_expr(char **s, _dax_compound *c);
+
+static inline void
+_skip_space(char **s)
+{
+    while(isspace(**s)) (*s)++;
+}
+
+static int
+_compound_emit(_dax_compound *c, int op)
+{
+    if(c->opcount >= COMPOUND_MAX_OPS) {
+        return ERR_2BIG;
+    }
+    c->ops[c->opcount++] = op;
+    return 0;
+}
+
+/* Reads the comparison operator at *s if there is one */
+static int
+_compound_cmp(char **s)
+{
+    char *p = *s;
+    
+    if(p[0] == '=' && p[1] == '=') {
+        *s += 2; return CMP_EQ;
+    } else if(p[0] == '!' && p[1] == '=') {
+        *s += 2; return CMP_NE;
+    } else if(p[0] == '<' && p[1] == '=') {
+        *s += 2; return CMP_LE;
+    } else if(p[0] == '>' && p[1] == '=') {
+        *s += 2; return CMP_GE;
+    } else if(p[0] == '<') {
+        *s += 1; return CMP_LT;
+    } else if(p[0] == '>') {
+        *s += 1; return CMP_GT;
+    }
+    return CMP_NONZERO;
+}
+
+/* operand := tagname ['[' index ']'] [comparison number] */
+static int
+_compound_operand(char **s, _dax_compound *c)
+{
+    char name[DAX_TAGNAME_SIZE + 1];
+    char *end;
+    dax_tag tag;
+    _compound_input *in;
+    int n = 0, index = 0, result;
+    
+    while(isalnum(**s) || **s == '_') {
+        if(n >= DAX_TAGNAME_SIZE) return ERR_2BIG;
+        name[n++] = *(*s)++;
+    }
+    name[n] = '\0';
+    if(n == 0) return ERR_ARG;
+    if(**s == '[') {
+        index = strtol(*s + 1, &end, 10);
+        if(end == *s + 1 || *end != ']') return ERR_ARG;
+        *s = end + 1;
+    }
+    result = tag_get_name(name, &tag);
+    if(result) {
+        xlog(LOG_ERROR, "Tag %s in compound event not found", name);
+        return result;
+    }
+    if(index < 0 || index >= tag.count) return ERR_2BIG;
+    if(IS_CUSTOM(tag.type)) return ERR_BADTYPE;
+    if(c->inputcount >= COMPOUND_MAX_INPUTS) return ERR_2BIG;
+    
+    in = &c->inputs[c->inputcount];
+    in->idx = tag.idx;
+    in->type = tag.type;
+    if(tag.type == DAX_BOOL) {
+        in->byte = index / 8;
+        in->bit = index % 8;
+    } else {
+        in->byte = index * TYPESIZE(tag.type) / 8;
+        in->bit = 0;
+    }
+    _skip_space(s);
+    in->cmp = _compound_cmp(s);
+    if(in->cmp != CMP_NONZERO) {
+        _skip_space(s);
+        in->value = strtod(*s, &end);
+        if(end == *s) return ERR_ARG;
+        *s = end;
+    }
+    return _compound_emit(c, c->inputcount++);
+}
+
+/* factor := '!' factor | '(' expression ')' | operand */
+static int
+_compound_factor(char **s, _dax_compound *c)
+{
+    int result;
+    
+    _skip_space(s);
+    if(**s == '!') {
+        (*s)++;
+        if((result = _compound_factor(s, c))) return result;
+        return _compound_emit(c, OP_NOT);
+    } else if(**s == '(') {
+        (*s)++;
+        if((result = _compound_expr(s, c))) return result;
+        _skip_space(s);
+        if(**s != ')') return ERR_ARG;
+        (*s)++;
+        return 0;
+    }
+    return _compound_operand(s, c);
+}
+
+/* term := factor {'&&' factor} */
+static int
+_compound_term(char **s, _dax_compound *c)
+{
+    int result;
+    
+    if((result = _compound_factor(s, c))) return result;
+    while(1) {
+        _skip_space(s);
+        if((*s)[0] != '&' || (*s)[1] != '&') return 0;
+        *s += 2;
+        if((result = _compound_factor(s, c))) return result;
+        if((result = _compound_emit(c, OP_AND))) return result;
+    }
+}
+
+/* expression := term {'||' term} */
+static int
+_compound_expr(char **s, _dax_compound *c)
+{
+    int result;
+    
+    if((result = _compound_term(s, c))) return result;
+    while(1) {
+        _skip_space(s);
+        if((*s)[0] != '|' || (*s)[1] != '|') return 0;
+        *s += 2;
+        if((result = _compound_term(s, c))) return result;
+        if((result = _compound_emit(c, OP_OR))) return result;
+    }
+}
+
+/* Returns the current result of the single input */
+static int
+_compound_input_eval(_compound_input *in)
+{
+    u_int8_t *data;
+    dax_lreal x;
+    
+    data = (u_int8_t *)&_db[in->idx].data[in->byte];
+    if(in->type == DAX_BOOL) {
+        x = (*data >> in->bit) & 0x01;
+    } else {
+        x = _generic_lreal(in->type, data);
+    }
+    switch(in->cmp) {
+        case CMP_EQ:
+            return x == in->value;
+        case CMP_NE:
+            return x != in->value;
+        case CMP_LT:
+            return x < in->value;
+        case CMP_LE:
+            return x <= in->value;
+        case CMP_GT:
+            return x > in->value;
+        case CMP_GE:
+            return x >= in->value;
+    }
+    return x != 0.0;
+}
+
+/* Evaluates the compiled expression using the cached input results.
+ * The parser makes sure that the operations are well formed. */
+static int
+_compound_eval(_dax_compound *c)
+{
+    int stack[COMPOUND_MAX_OPS];
+    int n, sp = 0;
+    
+    for(n = 0; n < c->opcount; n++) {
+        switch(c->ops[n]) {
+            case OP_AND:
+                sp--;
+                stack[sp - 1] = stack[sp - 1] && stack[sp];
+                break;
+            case OP_OR:
+                sp--;
+                stack[sp - 1] = stack[sp - 1] || stack[sp];
+                break;
+            case OP_NOT:
+                stack[sp - 1] = !stack[sp - 1];
+                break;
+            default:
+                stack[sp++] = c->inputs[c->ops[n]].state;
+        }
+    }
+    return stack[0];
+}
+
+/* Called from event_check() when one of the internal events that watch
+ * the inputs of a compound event fires. */
+static void
+_compound_update(_dax_compound *c, _dax_event *event, tag_index idx)
+{
+    int n, state, changed = 0;
+    
+    for(n = 0; n < c->inputcount; n++) {
+        if(c->inputs[n].event == event) {
+            state = _compound_input_eval(&c->inputs[n]);
+            if(state != c->inputs[n].state) {
+                c->inputs[n].state = state;
+                changed = 1;
+            }
+        }
+    }
+    if(!changed) return;
+    state = _compound_eval(c);
+    if(state && !c->result &&
+       !(_trans_depth > 0 && c->queued == c->notify->eflush_count + 1)) {
+        _send_event_message(c->notify, EVENT_COMPOUND, idx,
+                            c->id | EVENT_COMPOUND_FLAG, 0, 0, 0, 0);
+        c->queued = c->notify->eflush_count + 1;
+    }
+    c->result = state;
+}
+
+/* Removes the internal events for the compound event from the tags */
+static void
+_compound_detach(_dax_compound *c)
+{
+    int n;
+    _dax_event *this, **last;
+    
+    for(n = 0; n < c->inputcount; n++) {
+        if(c->inputs[n].event == NULL) continue;
+        last = &_db[c->inputs[n].idx].events;
+        for(this = *last; this != NULL; this = *last) {
+            if(this == c->inputs[n].event) {
+                *last = this->next;
+                _free_event(this);
+                break;
+            }
+            last = &this->next;
+        }
+        c->inputs[n].event = NULL;
+    }
+}
+
+/* Compiles the expression and attaches an internal CHANGE event to each
+ * of the tag elements that it references.  Returns the id of the new
+ * compound event or an error code. */
+int
+event_compound_add(char *expression, dax_module *module)
+{
+    _dax_compound *new;
+    _compound_input *in;
+    _dax_event *event;
+    char *s;
+    int n, result;
+    
+    new = xmalloc(sizeof(_dax_compound));
+    if(new == NULL) {
+        xerror("event_compound_add() - Unable to allocate memory for compound event");
+        return ERR_ALLOC;
+    }
+    s = expression;
+    result = _compound_expr(&s, new);
+    _skip_space(&s);
+    if(result == 0 && *s != '\0') {
+        result = ERR_ARG;
+    }
+    if(result) {
+        xlog(LOG_ERROR, "Unable to compile compound event expression '%s'", expression);
+        free(new);
+        return result;
+    }
+    for(n = 0; n < new->inputcount; n++) {
+        in = &new->inputs[n];
+        in->state = _compound_input_eval(in);
+        event = xmalloc(sizeof(_dax_event));
+        if(event == NULL) {
+            _compound_detach(new);
+            free(new);
+            return ERR_ALLOC;
+        }
+        event->id = _db[in->idx].nextevent++;
+        event->byte = in->byte;
+        event->bit = in->bit;
+        event->count = 1;
+        event->size = (in->type == DAX_BOOL) ? 1 : TYPESIZE(in->type) / 8;
+        event->datatype = in->type;
+        event->eventtype = EVENT_CHANGE;
+        event->notify = module;
+        event->compound = new;
+        result = _set_event_data(event, in->idx, NULL);
+        if(result) {
+            free(event);
+            _compound_detach(new);
+            free(new);
+            return result;
+        }
+        event->next = _db[in->idx].events;
+        _db[in->idx].events = event;
+        in->event = event;
+    }
+    new->result = _compound_eval(new);
+    new->id = _nextcompound++;
+    new->notify = module;
+    new->next = _compounds;
+    _compounds = new;
+    module->event_count++;
+    return new->id;
+}
+
+/* Deletes the compound event and the events that watch its inputs */
+int
+event_compound_del(int id, dax_module *module)
+{
+    _dax_compound *this, **last;
+    
+    last = &_compounds;
+    for(this = _compounds; this != NULL; this = this->next) {
+        if(this->id == id) break;
+        last = &this->next;
+    }
+    if(this == NULL) return ERR_NOTFOUND;
+    if(this->notify != module) {
+        xlog(LOG_ERROR | LOG_VERBOSE, "Module cannot delete another module's compound event");
+        return ERR_AUTH;
+    }
+    *last = this->next;
+    _compound_detach(this);
+    free(this);
+    module->event_count--;
     return 0;
 }
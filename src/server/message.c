@@ -33,6 +33,7 @@
 #include <netinet/in.h>
 #include <sys/un.h>
 #include <string.h>
+#include <time.h>
 
 #define ASYNC 0
 #define RESPONSE 1
@@ -49,9 +50,16 @@ static fd_set _listenfdset;
  * it is used in the select() call in msg_receive() */
 static fd_set _fdset;
 static int _maxfd;
+/* Set if we are using io_uring instead of select() */
+static int _uring;
+
+/* Sent to the modules when they register.  It changes each time the
+ * server is started so that a module that reconnects can tell whether
+ * or not the tags and events that it knew about are still here. */
+static u_int32_t _server_id;
 
 /* This array holds the functions for each message command */
-#define NUM_COMMANDS 16
+#define NUM_COMMANDS 18
 int (*cmd_arr[NUM_COMMANDS])(dax_message *) = {NULL};
 
 /* Macro to check whether or not the command 'x' is valid */
@@ -71,6 +79,8 @@ int msg_evnt_add(dax_message *msg);
 int msg_evnt_del(dax_message *msg);
 int msg_evnt_get(dax_message *msg);
 int msg_evnt_mod(dax_message *msg);
+int msg_evnt_resume(dax_message *msg);
+int msg_tag_multi(dax_message *msg);
 int msg_cdt_create(dax_message *msg);
 int msg_cdt_get(dax_message *msg);
 
@@ -84,6 +94,11 @@ _message_send(int fd, int command, void *payload, size_t size, int response)
     int result;
     char buff[DAX_MSGMAX];
     
+    /* The module should see the events caused by its own message
+     * before it gets the response */
+    if(response == RESPONSE || response == ERROR) {
+        event_flush_fd(fd);
+    }
     ((u_int32_t *)buff)[0] = htonl(size + MSG_HDR_SIZE);
     if(response == RESPONSE) {
         ((u_int32_t *)buff)[1] = htonl(command | MSG_RESPONSE);
@@ -98,7 +113,7 @@ _message_send(int fd, int command, void *payload, size_t size, int response)
         return ERR_2BIG;
     }
     memcpy(&buff[MSG_HDR_SIZE], payload, size);
-    result = xwrite(fd, buff, size + MSG_HDR_SIZE);
+    result = msg_write(fd, buff, size + MSG_HDR_SIZE);
     if(result < 0) {
         xerror("_message_send: %s", strerror(errno));
         return ERR_MSG_SEND;
@@ -182,7 +197,10 @@ _msg_setup_remote_socket(in_addr_t ipaddress, in_port_t ipport)
 int
 msg_setup(void)
 {
+    int n;
+    
     _maxfd = 0;
+    _uring = 0;
     FD_ZERO(&_fdset);
     FD_ZERO(&_listenfdset);
     
@@ -193,6 +211,8 @@ msg_setup(void)
     _msg_setup_remote_socket(INADDR_ANY, DEFAULT_PORT);
     
     buff_initialize(); /* This initializes the communications buffers */
+    _server_id = (u_int32_t)time(NULL) ^ ((u_int32_t)getpid() << 16);
+    if(_server_id == 0) _server_id = 1; /* Zero means an old server */
     
     /* The functions are added to an array of function pointers with their
         message type used as the index.  This makes it really easy to call
@@ -213,7 +233,20 @@ msg_setup(void)
     cmd_arr[MSG_EVNT_MOD]   = &msg_evnt_mod;
     cmd_arr[MSG_CDT_CREATE] = &msg_cdt_create;
     cmd_arr[MSG_CDT_GET]    = &msg_cdt_get;
-    
+    cmd_arr[MSG_EVNT_RESUME] = &msg_evnt_resume;
+    cmd_arr[MSG_TAG_MULTI]  = &msg_tag_multi;
+    
+    if(!strcasecmp(opt_transport(), "uring")) {
+        if(msgring_setup() == 0) {
+            _uring = 1;
+            for(n = 0; n <= _maxfd; n++) {
+                if(FD_ISSET(n, &_listenfdset)) msgring_listen(n);
+            }
+            xlog(LOG_MAJOR, "Using io_uring for module communications");
+        } else {
+            xerror("Falling back to select() for module communications");
+        }
+    }
     return 0;
 }
 
@@ -232,6 +265,7 @@ msg_add_fd(int fd)
 {
     FD_SET(fd, &_fdset);
     if(fd > _maxfd) _maxfd = fd;
+    if(_uring) msgring_add(fd);
 }
 
 void
@@ -250,10 +284,20 @@ msg_del_fd(int fd)
         }
         _maxfd = tmpfd;
     }
+    if(_uring) msgring_close(fd);
     close(fd); /* Just to make sure */
     buff_free(fd);
 }
 
+/* All of the writes to the modules' sockets go through here so that
+ * they can be queued on the ring when we are using io_uring */
+int
+msg_write(int fd, const void *buff, size_t size)
+{
+    if(_uring) return msgring_write(fd, buff, size);
+    return xwrite(fd, buff, size);
+}
+
 /* This function blocks waiting for a message to be received.  Once a message
  * is retrieved from the system the proper handling function is called */
 int
@@ -265,6 +309,8 @@ msg_receive(void)
     int result, fd, n;
     socklen_t len = 0;
     
+    if(_uring) return msgring_receive();
+    
     FD_ZERO(&tmpset);
     FD_COPY(&_fdset, &tmpset);
     tm.tv_sec = 1; /* TODO: this should be configuration */
@@ -283,6 +329,9 @@ msg_receive(void)
         buff_freeall(); /* this erases all of the _buffer nodes */
         return 0;
     } else {
+        /* Events caused by all of the messages that are handled in this
+         * pass are sent together at the end */
+        event_transaction_begin();
         for(n = 0; n <= _maxfd; n++) {
             if(FD_ISSET(n, &tmpset)) {
                 if(FD_ISSET(n, &_listenfdset)) { /* This is a listening socket */
@@ -297,15 +346,17 @@ msg_receive(void)
                 } else {
                     result = buff_read(n);
                     if(result == ERR_NO_SOCKET) { /* This is the end of file */
-                        //module_unregister(n);
                         xlog(LOG_COMM, "Connection Closed for fd %d", n);
+                        module_disconnect(n);
                         msg_del_fd(n);
                     } else if(result < 0) {
+                        event_transaction_end();
                         return result; /* Pass the error up */
                     }
                 }
             }
         }
+        event_transaction_end();
     }
     return 0;
 }
@@ -379,10 +430,11 @@ msg_mod_register(dax_message *msg)
                 *((u_int64_t *)&buff[10]) = REG_TEST_LINT;   /* 64 bit integer test data */
                 *((float *)&buff[18])    = REG_TEST_REAL;   /* 32 bit float test data */
                 *((double *)&buff[22])   = REG_TEST_LREAL;  /* 64 bit float test data */
+                *((u_int32_t *)&buff[30]) = _server_id;
                 //Do we really need to send the name back??
                 //strncpy(&buff[30], mod->name, DAX_MSGMAX - 26 - 1);
                 //_message_send(msg->fd, MSG_MOD_REG, buff, 30 + strlen(mod->name) + 1, RESPONSE);
-                _message_send(msg->fd, MSG_MOD_REG, buff, 30 + 1, RESPONSE);
+                _message_send(msg->fd, MSG_MOD_REG, buff, 34, RESPONSE);
 
             }
         /* Is this the asynchronous event socket registration */
@@ -395,6 +447,16 @@ msg_mod_register(dax_message *msg)
             } else {
                 _message_send(msg->fd, MSG_MOD_REG, NULL, 0, RESPONSE);    
             }
+        /* Is this another synchronous socket from a module thread */
+        } else if(flags & CONNECT_POOL) {
+            xlog(LOG_MSG, "Pooled Connection Registration message received for Module %d fd = %d", parint, msg->fd);
+            mod = pool_register(parint, msg->fd);
+            result = ERR_NOTFOUND;
+            if(!mod) {
+                _message_send(msg->fd, MSG_MOD_REG, &result, sizeof(result) , ERROR);
+            } else {
+                _message_send(msg->fd, MSG_MOD_REG, NULL, 0, RESPONSE);    
+            }
         } else { /* If the flags are bad send error */
             result = ERR_MSG_BAD;
             _message_send(msg->fd, MSG_MOD_REG, &result, sizeof(result) , ERROR);
@@ -562,6 +624,52 @@ msg_tag_mask_write(dax_message *msg)
 }
 
 
+/* A list of writes from a module's write batch.  Each one is the tag
+ * index, the byte offset and the size followed by the data and, if the
+ * MULTI_MASK flag is set in the size, the mask.  All of the writes are
+ * made even if one of them fails and the first error is sent back.
+ * Since we are called from msg_receive() the events that these cause
+ * are sent together when we are done. */
+int
+msg_tag_multi(dax_message *msg)
+{
+    tag_index handle;
+    int result, error = 0, offset, pos = 0, count = 0;
+    u_int32_t size;
+    u_int8_t *data;
+
+    while(pos + 12 <= msg->size) {
+        memcpy(&handle, &msg->data[pos], 4);
+        memcpy(&offset, &msg->data[pos + 4], 4);
+        memcpy(&size, &msg->data[pos + 8], 4);
+        data = (u_int8_t *)&msg->data[pos + 12];
+        pos += 12;
+        if(size & MULTI_MASK) {
+            size &= ~MULTI_MASK;
+            if(size * 2 > msg->size - pos) break;
+            result = tag_mask_write(handle, offset, data, data + size, size);
+            pos += size * 2;
+        } else {
+            if(size > msg->size - pos) break;
+            result = tag_write(handle, offset, data, size);
+            pos += size;
+        }
+        if(result && error == 0) {
+            xerror("Unable to write tag 0x%X with size %d: result %d", handle, size, result);
+            error = result;
+        }
+        count++;
+    }
+    if(pos != msg->size && error == 0) error = ERR_MSG_BAD;
+    xlog(LOG_MSG | LOG_VERBOSE, "Multiple Write Message from module %d, %d writes", msg->fd, count);
+    if(error) {
+        _message_send(msg->fd, MSG_TAG_MULTI, &error, sizeof(error), ERROR);
+    } else {
+        _message_send(msg->fd, MSG_TAG_MULTI, NULL, 0, RESPONSE);
+    }
+    return 0;
+}
+
 int
 msg_mod_get(dax_message *msg)
 {
@@ -596,35 +704,58 @@ msg_mod_set(dax_message *msg)
     return 0;
 }
 
-int
-msg_evnt_add(dax_message *msg)
+/* Adds one event from the MSG_EVNT_ADD data in 'buff' which is 'size'
+ * bytes long.  The data may be the whole message or one of the events
+ * in a MSG_EVNT_RESUME message.  Returns the event id or an error. */
+static dax_dint
+_evnt_add(dax_module *module, int fd, unsigned char *buff, int size)
 {
     Handle h;
     void *data = NULL;
     dax_dint event_type;
+    dax_dint event_id = -1;
+
+    if(size < 25) return ERR_MSG_BAD;
+    memcpy(&h.index, buff, 4);
+    memcpy(&h.byte, &buff[4], 4);
+    memcpy(&h.count, &buff[8], 4);
+    memcpy(&h.type, &buff[12], 4);
+    memcpy(&event_type, &buff[16], 4);
+    memcpy(&h.size, &buff[20], 4);
+    h.bit = buff[24];
+    data = (void *)&buff[25];
+//    fprintf(stderr, "Event Handle Index = %d\n",h.index);
+//    fprintf(stderr, "Event Handle Count = %d\n",h.count);
+//    fprintf(stderr, "Event Handle Datatype = 0x%X\n",h.type);
+//    fprintf(stderr, "Event Handle Size = %d\n",h.size);
+//    fprintf(stderr, "Event Handle Byte = %d\n",h.byte);
+//    fprintf(stderr, "Event Handle Bit = %d\n",h.bit);
+//    fprintf(stderr, "Event Type = %d\n", event_type);
+    if(h.index == EVENT_PATTERN_INDEX) {
+        /* Pattern subscriptions carry the pattern string instead of the data */
+        buff[size - 1] = '\0';
+        xlog(LOG_MSG | LOG_VERBOSE, "Add Pattern Event Message from %d - Pattern = '%s', Type = %d", fd, (char *)data, event_type);
+        event_id = event_pattern_add((char *)data, h.type, event_type, module);
+    } else if(h.index == EVENT_COMPOUND_INDEX) {
+        buff[size - 1] = '\0';
+        xlog(LOG_MSG | LOG_VERBOSE, "Add Compound Event Message from %d - Expression = '%s'", fd, (char *)data);
+        event_id = event_compound_add((char *)data, module);
+    } else {
+        xlog(LOG_MSG | LOG_VERBOSE, "Add Event Message from %d - Index = %d, Count = %d, Type = %d", fd, h.index, h.count, event_type);
+        event_id = event_add(h, event_type, data, module);
+    }
+    return event_id;
+}
+
+int
+msg_evnt_add(dax_message *msg)
+{
     dax_module *module;
     dax_dint event_id = -1;
     
-    
     module = module_find_fd(msg->fd);
     if( module != NULL ) {
-        memcpy(&h.index, msg->data, 4);
-        memcpy(&h.byte, &msg->data[4], 4);
-        memcpy(&h.count, &msg->data[8], 4);
-        memcpy(&h.type, &msg->data[12], 4);
-        memcpy(&event_type, &msg->data[16], 4);
-        memcpy(&h.size, &msg->data[20], 4);
-        h.bit = msg->data[24];
-        data = (void *)&msg->data[25];
-//        fprintf(stderr, "Event Handle Index = %d\n",h.index);
-//        fprintf(stderr, "Event Handle Count = %d\n",h.count);
-//        fprintf(stderr, "Event Handle Datatype = 0x%X\n",h.type);
-//        fprintf(stderr, "Event Handle Size = %d\n",h.size);
-//        fprintf(stderr, "Event Handle Byte = %d\n",h.byte);
-//        fprintf(stderr, "Event Handle Bit = %d\n",h.bit);
-//        fprintf(stderr, "Event Type = %d\n", event_type);
-        xlog(LOG_MSG | LOG_VERBOSE, "Add Event Message from %d - Index = %d, Count = %d, Type = %d", msg->fd, h.index, h.count, event_type);
-        event_id = event_add(h, event_type, data, module);
+        event_id = _evnt_add(module, msg->fd, (unsigned char *)msg->data, msg->size);
     }
     
     if(event_id < 0) { /* Send Error */
@@ -635,6 +766,38 @@ msg_evnt_add(dax_message *msg)
     return 0;
 }
 
+/* A module that has reconnected sends all of its events at once with
+ * this message instead of one MSG_EVNT_ADD for each.  Each event is
+ * the four byte size of the data followed by the same data that would
+ * be in the MSG_EVNT_ADD message.  We send back the event id, or the
+ * error, for each one in the same order. */
+int
+msg_evnt_resume(dax_message *msg)
+{
+    dax_module *module;
+    dax_dint ids[MSG_DATA_SIZE / sizeof(dax_dint)];
+    u_int32_t size;
+    int offset = 0, count = 0;
+    dax_dint result;
+
+    module = module_find_fd(msg->fd);
+    if(module == NULL) {
+        result = ERR_NOTFOUND;
+        _message_send(msg->fd, MSG_EVNT_RESUME, &result, sizeof(result), ERROR);
+        return result;
+    }
+    while(offset + 4 <= msg->size) {
+        memcpy(&size, &msg->data[offset], 4);
+        offset += 4;
+        if(size > msg->size - offset) break;
+        ids[count++] = _evnt_add(module, msg->fd, (unsigned char *)&msg->data[offset], size);
+        offset += size;
+    }
+    xlog(LOG_MSG | LOG_VERBOSE, "Resumed %d events for module fd = %d", count, msg->fd);
+    _message_send(msg->fd, MSG_EVNT_RESUME, ids, count * sizeof(dax_dint), RESPONSE);
+    return 0;
+}
+
 int
 msg_evnt_del(dax_message *msg)
 {
@@ -649,10 +812,16 @@ msg_evnt_del(dax_message *msg)
 
     xlog(LOG_MSG | LOG_VERBOSE, "Event Delete Message from %d", msg->fd);
       
-    result = event_del(idx, id, module);
+    if(idx == EVENT_PATTERN_INDEX) {
+        result = event_pattern_del(id, module);
+    } else if(idx == EVENT_COMPOUND_INDEX) {
+        result = event_compound_del(id, module);
+    } else {
+        result = event_del(idx, id, module);
+    }
     
-    if(idx >= 0) {
-        _message_send(msg->fd, MSG_EVNT_DEL, &idx, 8, RESPONSE);
+    if(result == 0) {
+        _message_send(msg->fd, MSG_EVNT_DEL, NULL, 0, RESPONSE);
     } else {
         _message_send(msg->fd, MSG_EVNT_DEL, &result, sizeof(result), ERROR);
     }
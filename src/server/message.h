@@ -34,11 +34,21 @@ int msg_receive(void);
 void msg_add_fd(int);
 void msg_del_fd(int);
 int msg_dispatcher(int, unsigned char *);
+int msg_write(int fd, const void *buff, size_t size);
+
+/* msgring.c functions */
+int msgring_setup(void);
+int msgring_listen(int fd);
+int msgring_add(int fd);
+void msgring_close(int fd);
+int msgring_write(int fd, const void *buff, size_t size);
+int msgring_receive(void);
 
 
 /* buffer.c functions */
 int buff_initialize(void);
 int buff_read(int fd);
+int buff_append(int fd, unsigned char *data, int len);
 void buff_wipe(void);
 void buff_free(int);
 void buff_freeall(void);
@@ -119,6 +119,29 @@ _get_module_fd(int fd)
     return NULL;
 }
 
+/* Return a pointer to the module that owns the pooled connection
+ * 'fd' and the position of fd in the module's pool in *pos.  Returns
+ * NULL if not found */
+static dax_module *
+_get_module_pool(int fd, int *pos)
+{
+    dax_module *last;
+    int n;
+    
+    if(_current_mod == NULL) return NULL;
+    last = _current_mod;
+    do {
+        for(n = 0; n < _current_mod->pool_count; n++) {
+            if(_current_mod->pool[n] == fd) {
+                if(pos) *pos = n;
+                return _current_mod;
+            }
+        }
+        _current_mod = _current_mod->next;
+    } while(_current_mod != last);
+    return NULL;
+}
+
 /* Return a pointer to the module with a matching event file
  * descriptor (efd).  Returns NULL if not found */
 static dax_module *
@@ -232,6 +255,7 @@ module_del(dax_module *mod)
         _module_count--;
         /* free allocated memory */
         if(mod->name) free(mod->name);
+        if(mod->pool) free(mod->pool);
         free(mod);
         return 0;
     }
@@ -243,7 +267,7 @@ module_set_running(int fd)
 {
     dax_module *mod;
 
-    mod = _get_module_fd(fd);
+    mod = module_find_fd(fd);
     if(mod == NULL) return ERR_NOTFOUND;
     mod->flags &= MSTATE_RUNNING;
     return 0;
@@ -264,6 +288,7 @@ module_register(char *name, u_int32_t timeout, int fd)
     if(test) {
         module_unregister(test->fd);
     }
+    pool_unregister(fd);
     
     mod = module_add(name, 0);
     if(mod) {
@@ -312,6 +337,44 @@ event_register(u_int32_t mid, int fd)
     return mod;
 }
 
+/* Adds 'fd' to the pool of extra synchronous connections for the
+ * module whose id is 'mid'.  Modules open these so that more than
+ * one thread can have a request in with us at a time.  Messages on
+ * these sockets are treated as if they came from the module itself. */
+dax_module *
+pool_register(u_int32_t mid, int fd)
+{
+    dax_module *mod;
+    int *new;
+    
+    /* The OS may have handed us the descriptor of an old connection */
+    pool_unregister(fd);
+    mod = _get_module_fd(mid);
+    if(mod == NULL) return NULL;
+    if(mod->pool_count == mod->pool_size) {
+        new = xrealloc(mod->pool, (mod->pool_size + 4) * sizeof(int));
+        if(new == NULL) return NULL;
+        mod->pool = new;
+        mod->pool_size += 4;
+    }
+    mod->pool[mod->pool_count++] = fd;
+    xlog(LOG_MAJOR, "Added connection %d to module '%s'", fd, mod->name);
+    return mod;
+}
+
+/* Removes 'fd' from the connection pool of the module that owns it.
+ * This is called when the socket is closed. */
+void
+pool_unregister(int fd)
+{
+    dax_module *mod;
+    int n;
+    
+    mod = _get_module_pool(fd, &n);
+    if(mod) {
+        mod->pool[n] = mod->pool[--mod->pool_count];
+    }
+}
 
 void
 module_unregister(int fd)
@@ -329,19 +392,31 @@ module_unregister(int fd)
 }
 
 
+/* Called when a socket is closed.  If it was the module's main socket
+ * then the module and all of it's events are removed so that a module
+ * that reconnects doesn't leave the old ones behind.  Otherwise it may
+ * have been one of the pooled connections. */
+void
+module_disconnect(int fd)
+{
+    if(_get_module_fd(fd)) {
+        module_unregister(fd);
+    } else {
+        pool_unregister(fd);
+    }
+}
+
+/* Finds the module that 'fd' belongs to.  This can be either the
+ * module's main synchronous socket or one of it's pooled connections. */
 dax_module *
 module_find_fd(int fd)
 {
-    dax_module *last;
+    dax_module *mod;
     
-    if(_current_mod == NULL) return NULL;
-    last = _current_mod;
-    do {
-        if(_current_mod->fd == fd) {
-            return _current_mod;
-        }
-        _current_mod = _current_mod->next;
-    } while(_current_mod != last);
-    return NULL;
+    mod = _get_module_fd(fd);
+    if(mod == NULL) {
+        mod = _get_module_pool(fd, NULL);
+    }
+    return mod;
 }
 
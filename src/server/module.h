@@ -44,6 +44,9 @@ void initialize_module(void);
 int module_set_running(int fd);
 dax_module *module_register(char *name, u_int32_t timeout, int fd);
 dax_module *event_register(u_int32_t mid , int fd);
+dax_module *pool_register(u_int32_t mid, int fd);
+void pool_unregister(int fd);
+void module_disconnect(int fd);
 void module_unregister(pid_t pid);
 dax_module *module_find_fd(int fd);
 
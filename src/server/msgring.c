@@ -0,0 +1,495 @@
+/*  OpenDAX - An open source data acquisition and control system
+ *  Copyright (c) 2007 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+
+ * This file contains the io_uring transport for the server's sockets
+ */
+
+#include <message.h>
+#include <func.h>
+#include <module.h>
+#include <tagbase.h>
+#include <ioring.h>
+
+#include <sys/socket.h>
+
+/* Notes:
+ Instead of calling select() and then read() for each socket that has
+ something on it the listening sockets get a multishot accept and every
+ connection gets a multishot receive.  The kernel reads into a ring of
+ buffers that we give it and hands us the data in the completions, so a
+ single io_uring_enter() can bring in the messages from all of the
+ modules at once.  The responses and events that are written while the
+ messages are being handled are appended to an output buffer for each
+ socket and at the end of the pass one send is queued for each socket
+ that has something in its buffer.  Those are submitted by the same
+ io_uring_enter() that waits for the next messages.
+
+ Only one send is ever in flight on a socket so that they can't be
+ reordered.  Anything written while it is in flight goes into the
+ socket's other buffer and is sent when the first one is done.  The
+ sends are queued in the order that the sockets were first written to
+ so the events that a message causes still go out ahead of its response.
+*/
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+#define RING_ENTRIES  256
+#define RING_BUFFERS  256  /* Must be a power of two */
+#define RING_GROUP    1
+#define RING_TIMEOUT  1000 /* msec, the same second that msg_receive() waits */
+
+/* The operation, the connection's generation and the fd are packed
+ * into the user_data of each request */
+#define OP_ACCEPT 1
+#define OP_RECV   2
+#define OP_SEND   3
+#define OP_CANCEL 4
+
+#define RING_DATA(op, gen, fd) (((u_int64_t)(op) << 56) | \
+                                ((u_int64_t)((gen) & 0xFFFFFF) << 32) | \
+                                (u_int32_t)(fd))
+#define RING_OP(d)  ((int)((d) >> 56))
+#define RING_GEN(d) ((u_int32_t)(((d) >> 32) & 0xFFFFFF))
+#define RING_FD(d)  ((int)((d) & 0xFFFFFFFF))
+
+typedef struct ring_conn {
+    int open;
+    u_int32_t gen;          /* Changed each time the fd is closed */
+    u_int8_t *out[2];       /* Output buffers */
+    int len[2];
+    int size[2];
+    int fill;               /* Which buffer writes are added to */
+    int busy;               /* The other buffer is being sent */
+    int sent;               /* How much of it has gone so far */
+    int dirty;              /* On the list of sockets that have output */
+    int next;               /* Next fd on that list or -1 */
+} ring_conn;
+
+static ioring _ring;
+static ioring_bufs _bufs;
+static ring_conn *_conns;
+static int _conn_size;
+static int _dirty_head = -1;
+static int _dirty_tail = -1;
+
+/* Returns a cleared submission entry.  If the ring is full whatever
+ * is in it is submitted to make room. */
+static struct io_uring_sqe *
+_get_sqe(void)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = ioring_get_sqe(&_ring);
+    if(sqe == NULL) {
+        ioring_submit(&_ring, 0, -1);
+        sqe = ioring_get_sqe(&_ring);
+    }
+    return sqe;
+}
+
+static ring_conn *
+_get_conn(int fd)
+{
+    ring_conn *new;
+    int size;
+
+    if(fd < 0) return NULL;
+    if(fd >= _conn_size) {
+        size = _conn_size ? _conn_size : 64;
+        while(size <= fd) size *= 2;
+        new = realloc(_conns, size * sizeof(ring_conn));
+        if(new == NULL) return NULL;
+        bzero(&new[_conn_size], (size - _conn_size) * sizeof(ring_conn));
+        _conns = new;
+        _conn_size = size;
+    }
+    return &_conns[fd];
+}
+
+static int
+_arm_accept(int fd)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = _get_sqe();
+    if(sqe == NULL) return ERR_ALLOC;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = RING_DATA(OP_ACCEPT, 0, fd);
+    return 0;
+}
+
+static int
+_arm_recv(int fd, ring_conn *conn)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = _get_sqe();
+    if(sqe == NULL) return ERR_ALLOC;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RING_GROUP;
+    sqe->user_data = RING_DATA(OP_RECV, conn->gen, fd);
+    return 0;
+}
+
+/* Queues the rest of the buffer that is being sent */
+static int
+_queue_send(int fd, ring_conn *conn)
+{
+    struct io_uring_sqe *sqe;
+    int n;
+
+    n = conn->fill ^ 1;
+    sqe = _get_sqe();
+    if(sqe == NULL) return ERR_ALLOC;
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (u_int64_t)(unsigned long)&conn->out[n][conn->sent];
+    sqe->len = conn->len[n] - conn->sent;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = RING_DATA(OP_SEND, conn->gen, fd);
+    conn->busy = 1;
+    return 0;
+}
+
+/* Puts the socket on the end of the list of sockets with output */
+static void
+_mark_dirty(int fd, ring_conn *conn)
+{
+    if(conn->dirty) return;
+    conn->dirty = 1;
+    conn->next = -1;
+    if(_dirty_tail < 0) {
+        _dirty_head = fd;
+    } else {
+        _conns[_dirty_tail].next = fd;
+    }
+    _dirty_tail = fd;
+}
+
+/* Starts a send on each socket that has something waiting and doesn't
+ * already have one going.  The ones that are busy stay on the list. */
+static void
+_flush(void)
+{
+    ring_conn *conn;
+    int fd, next;
+
+    fd = _dirty_head;
+    _dirty_head = _dirty_tail = -1;
+    for( ; fd >= 0; fd = next) {
+        conn = &_conns[fd];
+        next = conn->next;
+        conn->dirty = 0;
+        if(!conn->open || conn->len[conn->fill] == 0) continue;
+        if(!conn->busy) {
+            conn->fill ^= 1;
+            conn->sent = 0;
+            if(_queue_send(fd, conn) == 0) continue;
+            conn->fill ^= 1; /* Try again next time */
+        }
+        _mark_dirty(fd, conn);
+    }
+}
+
+/* Multishot receive needs kernel 6.0 or newer and there isn't a feature
+ * flag for it so we try it on a socket pair.  Returns 0 if it works. */
+static int
+_probe_recv(void)
+{
+    struct io_uring_cqe *cqe;
+    int sv[2], result = ERR_GENERIC;
+    ring_conn conn;
+
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) return ERR_GENERIC;
+    bzero(&conn, sizeof(conn));
+    _arm_recv(sv[0], &conn);
+    if(write(sv[1], "", 1) == 1 && ioring_submit(&_ring, 1, 1000) >= 0) {
+        cqe = ioring_peek(&_ring);
+        if(cqe != NULL) {
+            if(cqe->res == 1 && (cqe->flags & IORING_CQE_F_MORE)) result = 0;
+            if(cqe->flags & IORING_CQE_F_BUFFER) {
+                ioring_bufs_put(&_bufs, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            }
+            ioring_advance(&_ring);
+        }
+    }
+    /* Closing the other end finishes the receive */
+    close(sv[1]);
+    while(ioring_submit(&_ring, 1, 1000) >= 0 && (cqe = ioring_peek(&_ring)) != NULL) {
+        if(cqe->flags & IORING_CQE_F_BUFFER) {
+            ioring_bufs_put(&_bufs, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+        ioring_advance(&_ring);
+        if(!(cqe->flags & IORING_CQE_F_MORE)) break;
+    }
+    close(sv[0]);
+    return result;
+}
+
+/* Sets up the ring and the receive buffers.  Returns an error if this
+ * kernel can't do it and the caller should stay with select(). */
+int
+msgring_setup(void)
+{
+    int result;
+
+    result = ioring_init(&_ring, RING_ENTRIES);
+    if(result) {
+        xerror("Unable to set up io_uring: %s", strerror(-result));
+        return ERR_GENERIC;
+    }
+    result = ioring_bufs_init(&_ring, &_bufs, RING_GROUP, RING_BUFFERS, DAX_MSGMAX);
+    if(result) {
+        xerror("Unable to register io_uring buffers: %s", strerror(-result));
+        ioring_free(&_ring);
+        return ERR_GENERIC;
+    }
+    if(_probe_recv()) {
+        xerror("This kernel can't do multishot receives on io_uring");
+        ioring_bufs_free(&_ring, &_bufs);
+        ioring_free(&_ring);
+        return ERR_GENERIC;
+    }
+    return 0;
+}
+
+/* Starts accepting connections on the listening socket 'fd' */
+int
+msgring_listen(int fd)
+{
+    return _arm_accept(fd);
+}
+
+/* Starts receiving on a newly accepted socket */
+int
+msgring_add(int fd)
+{
+    ring_conn *conn;
+
+    conn = _get_conn(fd);
+    if(conn == NULL) return ERR_ALLOC;
+    conn->open = 1;
+    conn->len[0] = conn->len[1] = 0;
+    return _arm_recv(fd, conn);
+}
+
+/* Cancels everything that is going on with 'fd'.  This has to be called
+ * before the socket is closed because the kernel finds the requests by
+ * the file that the descriptor points to.  The output buffers belong to
+ * the kernel until the send comes back so 'busy' is left alone. */
+void
+msgring_close(int fd)
+{
+    struct io_uring_sqe *sqe;
+    ring_conn *conn;
+
+    if(fd < 0 || fd >= _conn_size || !_conns[fd].open) return;
+    conn = &_conns[fd];
+    sqe = _get_sqe();
+    if(sqe != NULL) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = fd;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        sqe->user_data = RING_DATA(OP_CANCEL, conn->gen, fd);
+    }
+    ioring_submit(&_ring, 0, -1);
+    conn->open = 0;
+    conn->gen++;
+    conn->len[conn->fill] = 0;
+}
+
+/* Adds the data to the socket's output buffer.  It's sent at the end
+ * of the pass.  Returns -1 with errno set like write() on failure. */
+int
+msgring_write(int fd, const void *buff, size_t size)
+{
+    ring_conn *conn;
+    u_int8_t *new;
+    int n, len;
+
+    if(fd < 0 || fd >= _conn_size || !_conns[fd].open) {
+        errno = EBADF;
+        return -1;
+    }
+    conn = &_conns[fd];
+    n = conn->fill;
+    if(conn->len[n] + size > conn->size[n]) {
+        len = conn->size[n] ? conn->size[n] : DAX_MSGMAX;
+        while(len < conn->len[n] + size) len *= 2;
+        new = realloc(conn->out[n], len);
+        if(new == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        conn->out[n] = new;
+        conn->size[n] = len;
+    }
+    memcpy(&conn->out[n][conn->len[n]], buff, size);
+    conn->len[n] += size;
+    _mark_dirty(fd, conn);
+    return size;
+}
+
+static void
+_handle_accept(struct io_uring_cqe *cqe)
+{
+    int fd;
+
+    fd = RING_FD(cqe->user_data);
+    if(cqe->res < 0) {
+        xerror("Error Accepting socket: %s", strerror(-cqe->res));
+    } else {
+        xlog(LOG_COMM, "Accepted socket on fd %d", fd);
+        msg_add_fd(cqe->res);
+    }
+    if(!(cqe->flags & IORING_CQE_F_MORE)) {
+        _arm_accept(fd);
+    }
+}
+
+static void
+_handle_recv(struct io_uring_cqe *cqe)
+{
+    ring_conn *conn;
+    unsigned bid;
+    int fd, result;
+
+    fd = RING_FD(cqe->user_data);
+    conn = &_conns[fd];
+    if(cqe->flags & IORING_CQE_F_BUFFER) {
+        bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if(conn->open && conn->gen == RING_GEN(cqe->user_data) && cqe->res > 0) {
+            result = buff_append(fd, ioring_buf_addr(&_bufs, bid), cqe->res);
+            if(result) {
+                xerror("Unable to read the message from fd %d, closing", fd);
+                ioring_bufs_put(&_bufs, bid);
+                module_disconnect(fd);
+                msg_del_fd(fd);
+                return;
+            }
+        }
+        ioring_bufs_put(&_bufs, bid);
+    }
+    if(!conn->open || conn->gen != RING_GEN(cqe->user_data)) return;
+    if(cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS)) {
+        if(cqe->res < 0) {
+            xlog(LOG_COMM, "Receive failed on fd %d: %s", fd, strerror(-cqe->res));
+        }
+        xlog(LOG_COMM, "Connection Closed for fd %d", fd);
+        module_disconnect(fd);
+        msg_del_fd(fd);
+    } else if(!(cqe->flags & IORING_CQE_F_MORE)) {
+        /* We ran out of buffers or the kernel stopped for some other
+         * reason.  The buffers have been given back by now. */
+        _arm_recv(fd, conn);
+    }
+}
+
+static void
+_handle_send(struct io_uring_cqe *cqe)
+{
+    ring_conn *conn;
+    int fd, n;
+
+    fd = RING_FD(cqe->user_data);
+    conn = &_conns[fd];
+    n = conn->fill ^ 1;
+    conn->busy = 0;
+    if(!conn->open || conn->gen != RING_GEN(cqe->user_data)) {
+        conn->len[n] = 0;
+        return;
+    }
+    if(cqe->res < 0) {
+        /* The receive will tell us if the socket is gone */
+        xerror("Send failed on fd %d: %s", fd, strerror(-cqe->res));
+    } else if(conn->sent + cqe->res < conn->len[n]) {
+        conn->sent += cqe->res;
+        if(_queue_send(fd, conn) == 0) return;
+    }
+    conn->len[n] = 0;
+    if(conn->len[conn->fill] > 0) _mark_dirty(fd, conn);
+}
+
+/* This takes the place of the select() loop in msg_receive().  It
+ * waits up to a second for something to happen and then handles all
+ * of the completions that are there. */
+int
+msgring_receive(void)
+{
+    struct io_uring_cqe *cqe;
+    struct io_uring_cqe copy;
+    int result;
+
+    _flush();
+    result = ioring_submit(&_ring, 1, RING_TIMEOUT);
+    if(result < 0 && result != -ETIME && result != -EBUSY) {
+        xerror("msg_receive io_uring error: %s", strerror(-result));
+        return ERR_MSG_RECV;
+    }
+    cqe = ioring_peek(&_ring);
+    if(cqe == NULL) { /* Timeout */
+        buff_freeall();
+        return 0;
+    }
+    /* Events caused by all of the messages that are handled in this
+     * pass are sent together at the end */
+    event_transaction_begin();
+    while(cqe != NULL) {
+        /* The handlers can submit more requests so we don't hold on to
+         * the slot in the completion ring */
+        copy = *cqe;
+        ioring_advance(&_ring);
+        switch(RING_OP(copy.user_data)) {
+            case OP_ACCEPT:
+                _handle_accept(&copy);
+                break;
+            case OP_RECV:
+                _handle_recv(&copy);
+                break;
+            case OP_SEND:
+                _handle_send(&copy);
+                break;
+        }
+        cqe = ioring_peek(&_ring);
+    }
+    event_transaction_end();
+    _flush();
+    return 0;
+}
+
+#else
+
+int
+msgring_setup(void)
+{
+    xerror("This server was built without io_uring support");
+    return ERR_GENERIC;
+}
+
+int msgring_listen(int fd) { return ERR_GENERIC; }
+int msgring_add(int fd) { return ERR_GENERIC; }
+void msgring_close(int fd) { }
+int msgring_write(int fd, const void *buff, size_t size) { return -1; }
+int msgring_receive(void) { return ERR_GENERIC; }
+
+#endif /* HAVE_LINUX_IO_URING_H */
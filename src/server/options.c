@@ -37,6 +37,7 @@ static int _verbosity;
 static int _maxstartup;
 static int _min_buffers;
 static int _start_timeout;  /* module startup tier timeout */
+static char *_transport;
 
 
 /* Initialize the configuration to NULL or 0 for cleanliness */
@@ -58,6 +59,7 @@ static void initconfig(void) {
     _socketname = NULL;
     _serverport = 0;
     _start_timeout = 0;
+    _transport = NULL;
 }
 
 /* This function sets the defaults if nothing else has been done 
@@ -72,6 +74,7 @@ setdefaults(void)
     if(!_socketname) _socketname = strdup("/tmp/opendax");
     if(!_serverport) _serverport = DEFAULT_PORT;
     if(!_start_timeout) _start_timeout = 3;
+    if(!_transport) _transport = strdup("socket");
 }
 
 /* This function parses the command line options and sets
@@ -87,6 +90,7 @@ parsecommandline(int argc, const char *argv[])
         {"socketname", required_argument, 0, 'S'},
         {"serverport", required_argument, 0, 'P'},
         {"start_time", required_argument, 0, 'T'},
+        {"transport", required_argument, 0, 'X'},
         {"version", no_argument, 0, 'V'},
         {"verbose", no_argument, 0, 'v'},
         {0, 0, 0, 0}
@@ -112,6 +116,9 @@ parsecommandline(int argc, const char *argv[])
         case 'T':
             _start_timeout = strtol(optarg, NULL, 0);
             break;
+        case 'X':
+            _transport = strdup(optarg);
+            break;
         case 'V':
             printf("%s Version %s\n", PACKAGE, VERSION);
             break;
@@ -193,6 +200,14 @@ readconfigfile(void)
     }
     lua_pop(L, 1);
 
+    lua_getglobal(L, "transport");
+    if(_transport == NULL) {
+        if( (string = (char *)lua_tostring(L, -1)) ) {
+            _transport = strdup(string);
+        }
+    }
+    lua_pop(L, 1);
+
     /* TODO: This needs to be changed to handle the new topic handlers */
     if(_verbosity == 0) { /* Make sure we didn't get anything on the commandline */
         //_verbosity = (int)lua_tonumber(L, 4);
@@ -270,3 +285,10 @@ opt_start_timeout(void)
 {
     return _start_timeout;
 }
+
+/* "socket" or "uring" */
+char *
+opt_transport(void)
+{
+    return _transport;
+}
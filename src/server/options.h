@@ -55,5 +55,7 @@ char *opt_socketname(void);
 /* Minimum number of communication buffers to allocate */
 int opt_min_buffers(void);
 int opt_start_timeout(void);
+/* How the server talks to the modules */
+char *opt_transport(void);
 
 #endif /* !__OPTIONS_H */
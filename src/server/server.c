@@ -21,6 +21,7 @@
 #include <tagbase.h>
 #include <common.h>
 #include <func.h>
+#include <trace.h>
 #include <pthread.h>
 #include <syslog.h>
 #include <signal.h>
@@ -55,6 +56,7 @@ main(int argc, const char *argv[])
     
     /* Read configuration from defaults, file and command line */
     opt_configure(argc, argv);
+    dax_trace_init("tagserver");
 	
 // Remove since opendax master will control this.
     /* Go to the background */
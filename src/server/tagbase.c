@@ -21,6 +21,7 @@
 #include <common.h>
 #include <tagbase.h>
 #include <func.h>
+#include <trace.h>
 #include <ctype.h>
 #include <assert.h>
 
@@ -309,7 +310,6 @@ tag_add(char *name, tag_type type, unsigned int count)
         return ERR_ARG;
     }
 
-    printf("tag_add() called with name = %s, type = 0x%X, count = %d\n", name, type, count);
     if(_tagcount >= _dbsize) {
         if(_database_grow()) {
             xerror("Failure to increae database size");
@@ -345,9 +345,13 @@ tag_add(char *name, tag_type type, unsigned int count)
              try to increase the size of the tags data */
             newdata = xrealloc(_db[n].data, size);
             if(newdata) {
+                /* Modules that have the old definition cached see this
+                 * as the old tag going away and a new one taking its place */
+                event_tag_deleted(n);
                 _db[n].data = newdata;
                 _db[n].count = count;
                 /* TODO: Zero the new part of the allocation */
+                event_tag_added(n);
                 return n;
             } else {
                 xerror("Unable to allocate memory to grow the size of tag %s", name);
@@ -385,6 +389,9 @@ tag_add(char *name, tag_type type, unsigned int count)
         _cdt_inc_refcount(type);
     }
     _tagcount++;
+    DAX_TRACE(TRACE_TAG_ADD, n, type, count, 0, 0);
+    /* Attach any pattern subscriptions that match the new tag */
+    event_tag_added(n);
     return n;
 }
 
@@ -474,7 +481,6 @@ tag_read(tag_index idx, int offset, void *data, int size)
 int
 tag_write(tag_index idx, int offset, void *data, int size)
 {
-    int n;
     /* Bounds check handle */
     if(idx < 0 || idx >= _tagcount) {
         return ERR_ARG;
@@ -485,12 +491,8 @@ tag_write(tag_index idx, int offset, void *data, int size)
     }
     /* Copy the data into the right place. */
     memcpy(&(_db[idx].data[offset]), data, size);
+    DAX_TRACE(TRACE_TAG_WRITE, idx, offset, size, 0, 0);
     event_check(idx, offset, size);
-    printf("Write %s = ", _db[idx].name);
-    for(n = 0;n < size; n++) {
-        printf("[0x%02X] ", ((u_int8_t *)data)[n]);
-    }
-    printf("\n");
     return 0;
 }
 
@@ -518,6 +520,7 @@ tag_mask_write(tag_index idx, int offset, void *data, void *mask, int size)
         db[n] = (newdata[n] & newmask[n]) | (db[n] & ~newmask[n]);
 //        printf("[0x%02X|0x%02X] ", ((u_int8_t *)data)[n],((u_int8_t *)mask)[n]);
     }
+    DAX_TRACE(TRACE_TAG_MWRITE, idx, offset, size, 0, 0);
     event_check(idx, offset, size);
 //    printf("\n");
     return 0;
@@ -694,7 +697,9 @@ cdt_create(char *str, int *error) {
 
     if(error) *error = 0;
     //--printf("create_cdt() - Created datatype %s\n", cdt.name);
-    return CDT_TO_TYPE((_datatype_index - 1));
+    type = CDT_TO_TYPE((_datatype_index - 1));
+    event_cdt_created(type, cdt.name);
+    return type;
 }
 
 
@@ -61,6 +61,9 @@
 #define STAT_DB_SIZE  64
 #define STAT_TAG_CNT 96
 
+struct dax_pattern_t;
+struct dax_compound_t;
+
 typedef struct dax_event_t {
     int id;              /* Unique identifier for this event definition */
 
@@ -73,9 +76,63 @@ typedef struct dax_event_t {
     void *data;          /* Data given by module */
     void *test;          /* Internal data, depends on event type */
     dax_module *notify;   /* List of every module to be notified of this event */
+    struct dax_pattern_t *pattern; /* Pattern subscription that created this event */
+    struct dax_compound_t *compound; /* Compound event that this event is an input to */
+    unsigned int queued; /* Used to keep from queuing the event twice in one transaction */
     struct dax_event_t *next;
 } _dax_event;
 
+/* A pattern subscription.  These are stored in a prefix trie by name and
+ * are attached to each matching tag as an ordinary event so that the
+ * event_check() function doesn't have to know anything about them. */
+typedef struct dax_pattern_t {
+    int id;              /* Unique identifier for this subscription */
+    char *name;          /* Name pattern with the trailing '*' removed */
+    int prefix;          /* True if the pattern ended with a '*' */
+    tag_type type;       /* Only match tags of this type, zero for any type */
+    int eventtype;       /* The type of event to attach to each tag */
+    dax_module *notify;  /* Module to be notified */
+    struct dax_pattern_t *next;   /* Next pattern in the trie node */
+    struct dax_pattern_t *lnext;  /* Next pattern in the list of all patterns */
+} _dax_pattern;
+
+/* Maximum number of tag references and total operations in a compound
+ * event expression */
+#ifndef COMPOUND_MAX_INPUTS
+#  define COMPOUND_MAX_INPUTS 16
+#endif
+#ifndef COMPOUND_MAX_OPS
+#  define COMPOUND_MAX_OPS 64
+#endif
+
+/* One tag reference in a compound event expression */
+typedef struct {
+    tag_index idx;       /* Tag index */
+    int byte;            /* Byte offset of the element */
+    unsigned char bit;   /* Bit offset if the tag is BOOL */
+    tag_type type;       /* Datatype of the tag */
+    int cmp;             /* Comparison operator, zero to test for non zero */
+    dax_lreal value;     /* Value to compare against */
+    int state;           /* Last result of the comparison */
+    _dax_event *event;   /* Internal event that watches this input */
+} _compound_input;
+
+/* Compound events are compiled into a list of operations in postfix
+ * order.  The operations are either OP_AND, OP_OR, OP_NOT or the index
+ * of one of the inputs.  The result of each input is cached so only the
+ * inputs that change need to be evaluated again. */
+typedef struct dax_compound_t {
+    int id;              /* Unique identifier for this compound event */
+    int result;          /* Last result of the whole expression */
+    int inputcount;
+    _compound_input inputs[COMPOUND_MAX_INPUTS];
+    int opcount;
+    int ops[COMPOUND_MAX_OPS];
+    dax_module *notify;  /* Module to be notified */
+    unsigned int queued; /* Used to keep from queuing the event twice in one transaction */
+    struct dax_compound_t *next;
+} _dax_compound;
+
 /* This is the internal structure for the tag array. */
 typedef struct {
     tag_type type;
@@ -116,9 +173,19 @@ int serialize_datatype(tag_type type, char **str);
 
 /* The event stuff is defined in events.c */
 void event_check(tag_index idx, int offset, int size);
+void event_transaction_begin(void);
+void event_transaction_end(void);
+void event_flush_fd(int fd);
 int event_add(Handle h, int event_type, void *data, dax_module *module);
 int event_del(int index, int id, dax_module *module);
 int events_cleanup(dax_module *module);
+int event_pattern_add(char *pattern, tag_type type, int event_type, dax_module *module);
+int event_pattern_del(int id, dax_module *module);
+int event_compound_add(char *expression, dax_module *module);
+int event_compound_del(int id, dax_module *module);
+void event_tag_added(tag_index idx);
+void event_tag_deleted(tag_index idx);
+void event_cdt_created(tag_type type, char *name);
 
 #define DAX_DIAG
 #ifdef DAX_DIAG
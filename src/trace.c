@@ -0,0 +1,135 @@
+/*  OpenDAX - An open source data acquisition and control system 
+ *  Copyright (c) 2007 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ 
+ * This file contains the code that writes the binary trace records.
+ */
+
+#include <common.h>
+#include <trace.h>
+
+#ifdef DAX_TRACE_ENABLE
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <time.h>
+
+unsigned int dax_trace_mask = 0;
+
+static char _trace_name[32] = "opendax";
+static char *_trace_dir = "/tmp";
+static u_int32_t _trace_threads = 0;
+
+/* Each thread gets its own ring so there is never more than one writer */
+static __thread dax_trace_hdr *_ring = NULL;
+static __thread int _ring_failed = 0;
+
+/* Reads the trace settings from the environment.  This should be
+ * called once at startup before any threads are created. */
+void
+dax_trace_init(const char *name)
+{
+    char *env;
+    
+    strncpy(_trace_name, name, sizeof(_trace_name) - 1);
+    env = getenv("DAX_TRACE");
+    if(env != NULL) {
+        if(strcasecmp(env, "all") == 0) {
+            dax_trace_mask = ~0;
+        } else {
+            dax_trace_mask = strtoul(env, NULL, 0);
+        }
+    }
+    env = getenv("DAX_TRACE_DIR");
+    if(env != NULL) {
+        _trace_dir = env;
+    }
+}
+
+/* Creates and maps the trace file for the calling thread */
+static dax_trace_hdr *
+_trace_open(void)
+{
+    char path[256];
+    dax_trace_hdr *hdr;
+    size_t size;
+    void *map;
+    int fd;
+    u_int32_t thread;
+    
+    thread = __sync_fetch_and_add(&_trace_threads, 1);
+    snprintf(path, sizeof(path), "%s/%s.%d.%u.trace", _trace_dir, _trace_name,
+             (int)getpid(), thread);
+    size = sizeof(dax_trace_hdr) + TRACE_RECORDS * sizeof(dax_trace_rec);
+    /* The directory is usually /tmp so we never follow a link or open a
+     * file that somebody else made.  One that is left over from an old
+     * process with the same pid is removed first. */
+    unlink(path);
+    fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+    if(fd < 0) {
+        return NULL;
+    }
+    if(ftruncate(fd, size)) {
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) {
+        return NULL;
+    }
+    hdr = (dax_trace_hdr *)map;
+    hdr->magic = TRACE_MAGIC;
+    hdr->version = TRACE_VERSION;
+    hdr->size = TRACE_RECORDS;
+    hdr->thread = thread;
+    hdr->head = 0;
+    strncpy(hdr->name, _trace_name, sizeof(hdr->name) - 1);
+    return hdr;
+}
+
+/* Writes one record into the calling thread's ring.  The oldest record
+ * is overwritten when the ring is full. */
+void
+dax_trace_write(u_int32_t id, u_int32_t a0, u_int32_t a1, u_int32_t a2,
+                u_int32_t a3, u_int32_t a4)
+{
+    dax_trace_rec *rec;
+    struct timespec ts;
+    
+    if(_ring == NULL) {
+        if(_ring_failed) return;
+        _ring = _trace_open();
+        if(_ring == NULL) {
+            _ring_failed = 1;
+            return;
+        }
+    }
+    rec = (dax_trace_rec *)(_ring + 1) + (_ring->head & (TRACE_RECORDS - 1));
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    rec->time = (u_int64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    rec->id = id;
+    rec->arg[0] = a0;
+    rec->arg[1] = a1;
+    rec->arg[2] = a2;
+    rec->arg[3] = a3;
+    rec->arg[4] = a4;
+    /* The record has to be complete before a reader can see it */
+    __sync_synchronize();
+    _ring->head++;
+}
+
+#endif /* DAX_TRACE_ENABLE */
@@ -0,0 +1,93 @@
+/*  OpenDAX - An open source data acquisition and control system 
+ *  Copyright (c) 2007 Phil Birkelbach
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ 
+ * This header contains the definitions for the binary trace facility.  Each
+ * thread writes fixed size records into its own ring buffer that is mapped
+ * from a file, so writing a record is a few stores and no locks or system
+ * calls.  The daxtrace program reads the files.  Tracing is only compiled
+ * in if configure is given --enable-trace and at run time the trace points
+ * are selected with the DAX_TRACE environment variable, which is a bit mask
+ * of the trace points below or "all".  The files are written to /tmp unless
+ * DAX_TRACE_DIR is set.
+ */
+
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <sys/types.h>
+
+#define TRACE_MAGIC   0x54584144  /* "DAXT" */
+#define TRACE_VERSION 1
+
+/* Number of records in each ring.  Must be a power of two */
+#ifndef TRACE_RECORDS
+#  define TRACE_RECORDS 4096
+#endif
+
+/* Trace points */
+#define TRACE_TAG_ADD      0  /* index, type, count */
+#define TRACE_TAG_WRITE    1  /* index, offset, size */
+#define TRACE_TAG_MWRITE   2  /* index, offset, size */
+#define TRACE_EVENT_HIT    3  /* index, event id, offset, size, fired */
+#define TRACE_EVENT_MISS   4  /* index, event id, offset, size */
+#define TRACE_MB_READ_REG  5  /* register type, index, count */
+#define TRACE_MB_WRITE_REG 6  /* register type, index, count */
+#define TRACE_COUNT        7
+
+#define TRACE_BIT(ID) (0x01 << (ID))
+
+typedef struct {
+    u_int64_t time;       /* Nanoseconds from CLOCK_MONOTONIC */
+    u_int32_t id;         /* Trace point */
+    u_int32_t arg[5];
+} dax_trace_rec;
+
+/* This is at the beginning of each trace file and is followed by the
+ * records.  'head' is the total number of records that have been written
+ * so the newest record is at (head - 1) % size */
+typedef struct {
+    u_int32_t magic;
+    u_int32_t version;
+    u_int32_t size;       /* Number of records */
+    u_int32_t thread;     /* Thread number within the process */
+    u_int64_t head;
+    char name[32];        /* Name of the program */
+} dax_trace_hdr;
+
+#ifdef DAX_TRACE_ENABLE
+
+extern unsigned int dax_trace_mask;
+
+void dax_trace_init(const char *name);
+void dax_trace_write(u_int32_t id, u_int32_t a0, u_int32_t a1, u_int32_t a2,
+                     u_int32_t a3, u_int32_t a4);
+
+/* The arguments are only evaluated if the trace point is turned on */
+#  define DAX_TRACE(ID, A0, A1, A2, A3, A4) \
+    do { \
+        if(dax_trace_mask & TRACE_BIT(ID)) \
+            dax_trace_write((ID), (A0), (A1), (A2), (A3), (A4)); \
+    } while(0)
+
+#else
+
+#  define dax_trace_init(NAME)
+#  define DAX_TRACE(ID, A0, A1, A2, A3, A4)
+
+#endif /* DAX_TRACE_ENABLE */
+
+#endif /* !__TRACE_H */